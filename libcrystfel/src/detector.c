@@ -44,6 +44,7 @@
 #include "utils.h"
 #include "detector.h"
 #include "hdf5-file.h"
+#include "geometry.h"
 
 
 /**
@@ -516,6 +517,151 @@ void record_image(struct image *image, int do_poisson, double background,
 }
 
 
+/* A coarse grid over the data block, listing the panels which overlap each
+ * cell, so that find_panel_number() only has to check a few panels */
+struct panel_lookup
+{
+	int min_fs;   /* Data block coordinates of the corner of cell 0,0 */
+	int min_ss;
+	int cell_w;   /* Size of each cell, in pixels */
+	int cell_h;
+	int n_fs;     /* Number of cells in each direction */
+	int n_ss;
+	int *start;   /* Panels for cell i are list[start[i]...start[i+1]-1] */
+	int *list;
+};
+
+
+/* Finds the range of cells overlapped by panel "p".  A panel covers fractional
+ * coordinates up to max_fs+1, so the range includes the cell containing
+ * max_fs+1 itself, in case of rounding in find_panel_number(). */
+static void panel_cell_range(struct panel_lookup *l, struct panel *p,
+                             int *fs1, int *fs2, int *ss1, int *ss2)
+{
+	*fs1 = (p->min_fs - l->min_fs) / l->cell_w;
+	*ss1 = (p->min_ss - l->min_ss) / l->cell_h;
+	*fs2 = (p->max_fs + 1 - l->min_fs) / l->cell_w;
+	*ss2 = (p->max_ss + 1 - l->min_ss) / l->cell_h;
+	if ( *fs2 >= l->n_fs ) *fs2 = l->n_fs - 1;
+	if ( *ss2 >= l->n_ss ) *ss2 = l->n_ss - 1;
+}
+
+
+static void free_panel_lookup(struct panel_lookup *l)
+{
+	if ( l == NULL ) return;
+	free(l->start);
+	free(l->list);
+	free(l);
+}
+
+
+/* Returns NULL if there are no panels, or if anything went wrong, in which
+ * case find_panel_number() will simply check all the panels. */
+static struct panel_lookup *make_panel_lookup(struct detector *det)
+{
+	struct panel_lookup *l;
+	int i, n_cells, n_list;
+	int max_fs, max_ss;
+	int *pos;
+
+	if ( det->n_panels == 0 ) return NULL;
+
+	l = malloc(sizeof(struct panel_lookup));
+	if ( l == NULL ) return NULL;
+
+	/* Grid covers all panels, with cells the size of the smallest one */
+	l->min_fs = det->panels[0].min_fs;
+	l->min_ss = det->panels[0].min_ss;
+	max_fs = det->panels[0].max_fs + 1;
+	max_ss = det->panels[0].max_ss + 1;
+	l->cell_w = det->panels[0].max_fs - det->panels[0].min_fs + 1;
+	l->cell_h = det->panels[0].max_ss - det->panels[0].min_ss + 1;
+	for ( i=1; i<det->n_panels; i++ ) {
+		struct panel *p = &det->panels[i];
+		if ( p->min_fs < l->min_fs ) l->min_fs = p->min_fs;
+		if ( p->min_ss < l->min_ss ) l->min_ss = p->min_ss;
+		if ( p->max_fs+1 > max_fs ) max_fs = p->max_fs+1;
+		if ( p->max_ss+1 > max_ss ) max_ss = p->max_ss+1;
+		if ( p->max_fs-p->min_fs+1 < l->cell_w ) {
+			l->cell_w = p->max_fs-p->min_fs+1;
+		}
+		if ( p->max_ss-p->min_ss+1 < l->cell_h ) {
+			l->cell_h = p->max_ss-p->min_ss+1;
+		}
+	}
+	if ( l->cell_w < 1 ) l->cell_w = 1;
+	if ( l->cell_h < 1 ) l->cell_h = 1;
+
+	/* Don't let a very small panel make the grid huge */
+	do {
+		l->n_fs = (max_fs - l->min_fs) / l->cell_w + 1;
+		l->n_ss = (max_ss - l->min_ss) / l->cell_h + 1;
+		if ( (double)l->n_fs*l->n_ss <= 16.0*det->n_panels + 1024 ) {
+			break;
+		}
+		if ( l->n_fs > l->n_ss ) {
+			l->cell_w *= 2;
+		} else {
+			l->cell_h *= 2;
+		}
+	} while ( 1 );
+	n_cells = l->n_fs * l->n_ss;
+
+	l->start = calloc(n_cells+1, sizeof(int));
+	pos = calloc(n_cells, sizeof(int));
+	if ( (l->start == NULL) || (pos == NULL) ) {
+		free(pos);
+		l->list = NULL;
+		free_panel_lookup(l);
+		return NULL;
+	}
+
+	/* Count the panels in each cell, then list them in order */
+	for ( i=0; i<det->n_panels; i++ ) {
+		int fs1, fs2, ss1, ss2, cfs, css;
+		panel_cell_range(l, &det->panels[i], &fs1, &fs2, &ss1, &ss2);
+		for ( css=ss1; css<=ss2; css++ ) {
+		for ( cfs=fs1; cfs<=fs2; cfs++ ) {
+			l->start[cfs + l->n_fs*css + 1]++;
+		}
+		}
+	}
+	for ( i=0; i<n_cells; i++ ) {
+		l->start[i+1] += l->start[i];
+	}
+	n_list = l->start[n_cells];
+
+	l->list = malloc((n_list > 0 ? n_list : 1)*sizeof(int));
+	if ( l->list == NULL ) {
+		free(pos);
+		free_panel_lookup(l);
+		return NULL;
+	}
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		int fs1, fs2, ss1, ss2, cfs, css;
+		panel_cell_range(l, &det->panels[i], &fs1, &fs2, &ss1, &ss2);
+		for ( css=ss1; css<=ss2; css++ ) {
+		for ( cfs=fs1; cfs<=fs2; cfs++ ) {
+			int c = cfs + l->n_fs*css;
+			l->list[l->start[c] + pos[c]++] = i;
+		}
+		}
+	}
+
+	free(pos);
+	return l;
+}
+
+
+static int panel_contains(struct panel *p, double fs, double ss)
+{
+	return (fs >= p->min_fs) && (fs < p->max_fs+1)
+	    && (ss >= p->min_ss) && (ss < p->max_ss+1);
+}
+
+
 signed int find_panel_number(struct detector *det, double fs, double ss)
 {
 	int p;
@@ -523,11 +669,31 @@ signed int find_panel_number(struct detector *det, double fs, double ss)
 	/* Fractional pixel coordinates are allowed to be a little further along
 	 * than "== max_{f,s}s" for an integer. */
 
+	if ( det->lookup != NULL ) {
+
+		struct panel_lookup *l = det->lookup;
+		double cfs, css;
+		int c, i;
+
+		/* Outside the grid (or NaN) means outside all the panels */
+		if ( !(fs >= l->min_fs) || !(ss >= l->min_ss) ) return -1;
+		cfs = floor((fs - l->min_fs) / l->cell_w);
+		css = floor((ss - l->min_ss) / l->cell_h);
+		if ( (cfs >= l->n_fs) || (css >= l->n_ss) ) return -1;
+
+		/* The panels are listed in order, so the first match is the
+		 * same one as the search below would find */
+		c = (int)cfs + l->n_fs*(int)css;
+		for ( i=l->start[c]; i<l->start[c+1]; i++ ) {
+			p = l->list[i];
+			if ( panel_contains(&det->panels[p], fs, ss) ) return p;
+		}
+		return -1;
+
+	}
+
 	for ( p=0; p<det->n_panels; p++ ) {
-		if ( (fs >= det->panels[p].min_fs)
-		  && (fs < det->panels[p].max_fs+1)
-		  && (ss >= det->panels[p].min_ss)
-		  && (ss < det->panels[p].max_ss+1) ) return p;
+		if ( panel_contains(&det->panels[p], fs, ss) ) return p;
 	}
 
 	return -1;
@@ -1542,6 +1708,8 @@ struct detector *get_detector_geometry(const char *filename,
 
 	}
 
+	det->lookup = make_panel_lookup(det);
+
 	for ( i=0; i<det->n_bad; i++ ) {
 		if ( det->bad[i].is_fsss == 99 ) {
 			ERROR("Please specify the coordinate ranges for"
@@ -1699,6 +1867,8 @@ void free_detector_geometry(struct detector *det)
 		free_dim_structure(det->panels[i].dim_structure);
 	}
 
+	free_panel_lookup(det->lookup);
+	free_ray_lookup(det->rays);
 	free(det->panels);
 	free(det->bad);
 	free(det);
@@ -1724,6 +1894,9 @@ struct detector *copy_geom(const struct detector *in)
 	out->n_rg_collections = 0;
 	out->rigid_group_collections = NULL;
 
+	out->lookup = make_panel_lookup(out);
+	out->rays = NULL;
+
 	for ( i=0; i<out->n_panels; i++ ) {
 
 		struct panel *p;
@@ -1859,6 +2032,8 @@ struct detector *simple_geometry(const struct image *image)
 	geom->panels[0].mask = NULL;
 	geom->panels[0].data = NULL;
 
+	geom->lookup = make_panel_lookup(geom);
+
 	find_min_max_d(geom);
 
 	return geom;
@@ -46,6 +46,8 @@ struct detector;
 struct beam_params;
 struct hdfile;
 struct event;
+struct panel_lookup;
+struct ray_lookup;
 
 #include "hdf5-file.h"
 #include "image.h"
@@ -184,6 +186,16 @@ struct detector
 	int                dim_dim;
 
 	struct panel       defaults;
+
+	/* Speeds up find_panel().  Made by get_detector_geometry(), copy_geom()
+	 * and simple_geometry(), and NULL if the detector was set up any other
+	 * way.  The panel positions in the data block (min_fs etc) must not be
+	 * changed afterwards. */
+	struct panel_lookup *lookup;
+
+	/* Speeds up the calculation of spot positions.  Made when needed, and
+	 * again whenever the panels have moved. */
+	struct ray_lookup *rays;
 };
 
 
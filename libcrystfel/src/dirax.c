@@ -508,15 +508,20 @@ static void write_drx(struct image *image)
 {
 	FILE *fh;
 	int i;
-	char filename[1024];
+	char name[64];
+	char *filename;
 
-	snprintf(filename, 1023, "xfel-%i.drx", image->id);
+	snprintf(name, 63, "xfel-%i.drx", image->id);
+	filename = image_tmp_filename(image, name);
+	if ( filename == NULL ) return;
 
 	fh = fopen(filename, "w");
 	if ( !fh ) {
 		ERROR("Couldn't open temporary file '%s'\n", filename);
+		free(filename);
 		return;
 	}
+	free(filename);
 	fprintf(fh, "%f\n", 0.5);  /* Lie about the wavelength.  */
 
 	for ( i=0; i<image_feature_count(image->features); i++ ) {
@@ -564,6 +569,12 @@ int run_dirax(struct image *image, IndexingPrivate *ipriv)
 		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
 		tcsetattr(STDIN_FILENO, TCSANOW, &t);
 
+		if ( (image->tmpdir != NULL) && chdir(image->tmpdir) ) {
+			ERROR("Failed to chdir to temporary folder: %s\n",
+			      strerror(errno));
+			_exit(0);
+		}
+
 		execlp("dirax", "", (char *)NULL);
 		ERROR("Failed to invoke DirAx.\n");
 		_exit(0);
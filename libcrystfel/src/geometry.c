@@ -32,8 +32,10 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <fenv.h>
+#include <pthread.h>
 #include <gsl/gsl_sf_erf.h>
 
 #include "utils.h"
@@ -47,46 +49,428 @@
 #include "geometry.h"
 
 
+/* An index of the panels according to the direction of the diffracted ray,
+ * (x/(k+z), y/(k+z)), so that locate_peak() only has to check a few panels.
+ * Unlike the lookup of panels by position in the data block, this depends on
+ * the camera length, which can change from frame to frame.  The detector
+ * keeps the latest one, which is made again when the panels have moved. */
+struct ray_lookup
+{
+	double min_tx;  /* Corner of cell 0,0 */
+	double min_ty;
+	double max_tx;  /* Opposite corner of the last cell */
+	double max_ty;
+	double cell_w;  /* Size of each cell */
+	double cell_h;
+	int n_x;        /* Number of cells in each direction */
+	int n_y;
+	int *start;     /* Panels for cell i are list[start[i]...start[i+1]-1] */
+	int *list;
+	int n_panels;   /* Number of panels, and their geometry when made */
+	double *key;
+	int refs;       /* The detector's reference plus one for each user */
+};
+
+
+/* Number of values in the key for each panel */
+#define RAY_KEY_SIZE (12)
+
+
+void free_ray_lookup(struct ray_lookup *rl)
+{
+	if ( rl == NULL ) return;
+	free(rl->start);
+	free(rl->list);
+	free(rl->key);
+	free(rl);
+}
+
+
+/* Everything about panel "p" which affects panel_ray_extent() or
+ * panel_hit() */
+static void ray_key(struct panel *p, double *key)
+{
+	key[0] = p->min_fs;
+	key[1] = p->max_fs;
+	key[2] = p->min_ss;
+	key[3] = p->max_ss;
+	key[4] = p->clen;
+	key[5] = p->res;
+	key[6] = p->cnx;
+	key[7] = p->cny;
+	key[8] = p->xfs;
+	key[9] = p->yfs;
+	key[10] = p->xss;
+	key[11] = p->yss;
+}
+
+
+static int ray_lookup_current(struct ray_lookup *rl, struct detector *det)
+{
+	double key[RAY_KEY_SIZE];
+	int i;
+
+	if ( rl->n_panels != det->n_panels ) return 0;
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		ray_key(&det->panels[i], key);
+		if ( memcmp(key, &rl->key[RAY_KEY_SIZE*i], sizeof(key)) ) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static int ray_cell(double t, double min, double size, int n)
+{
+	int c = floor((t - min) / size);
+	if ( c < 0 ) return 0;
+	if ( c >= n ) return n-1;
+	return c;
+}
+
+
+/* Works out the range of ray directions which could hit panel "p", with a
+ * margin for rounding errors.  Returns non-zero if the panel can't be hit at
+ * all, or -1 if the range can't be worked out. */
+static int panel_ray_extent(struct panel *p, double *bb)
+{
+	double scale, d, margin;
+	int i;
+
+	if ( (p->max_fs < p->min_fs) || (p->max_ss < p->min_ss) ) return 1;
+
+	scale = p->clen * p->res;
+	d = p->xfs*p->yss - p->yfs*p->xss;
+	if ( !isfinite(scale) || (scale <= 0.0) ) return -1;
+	if ( !isfinite(d) || (d == 0.0) ) return -1;
+
+	/* Map the corners of the panel back from fs/ss to x/y */
+	for ( i=0; i<4; i++ ) {
+
+		double fs, ss, tx, ty;
+
+		fs = (i & 1) ? p->max_fs - p->min_fs : 0.0;
+		ss = (i & 2) ? p->max_ss - p->min_ss : 0.0;
+
+		tx = (( p->yss*fs - p->yfs*ss)/d + p->cnx) / scale;
+		ty = ((-p->xss*fs + p->xfs*ss)/d + p->cny) / scale;
+
+		if ( (i == 0) || (tx < bb[0]) ) bb[0] = tx;
+		if ( (i == 0) || (tx > bb[1]) ) bb[1] = tx;
+		if ( (i == 0) || (ty < bb[2]) ) bb[2] = ty;
+		if ( (i == 0) || (ty > bb[3]) ) bb[3] = ty;
+
+	}
+
+	margin = 1e-6*(bb[1]-bb[0] + bb[3]-bb[2])
+	       + 1e-9*(fabs(bb[0]) + fabs(bb[1]) + fabs(bb[2]) + fabs(bb[3]));
+	if ( !isfinite(margin) ) return -1;
+	if ( margin == 0.0 ) margin = 1e-12;
+	bb[0] -= margin;
+	bb[1] += margin;
+	bb[2] -= margin;
+	bb[3] += margin;
+
+	return 0;
+}
+
+
+/* Returns NULL if the lookup can't be made, in which case locate_peak() will
+ * simply check all the panels */
+static struct ray_lookup *make_ray_lookup(struct detector *det)
+{
+	struct ray_lookup *rl;
+	double *bb;
+	int *hit;
+	int *pos;
+	int i, n_cells, n_list;
+	int first = 1;
+
+	if ( det->n_panels == 0 ) return NULL;
+
+	bb = malloc(4*det->n_panels*sizeof(double));
+	hit = malloc(det->n_panels*sizeof(int));
+	rl = malloc(sizeof(struct ray_lookup));
+	if ( (bb == NULL) || (hit == NULL) || (rl == NULL) ) {
+		free(bb);
+		free(hit);
+		free(rl);
+		return NULL;
+	}
+	rl->start = NULL;
+	rl->list = NULL;
+	rl->n_panels = det->n_panels;
+	rl->refs = 1;
+	rl->key = malloc(RAY_KEY_SIZE*det->n_panels*sizeof(double));
+	if ( rl->key == NULL ) goto fail;
+	for ( i=0; i<det->n_panels; i++ ) {
+		ray_key(&det->panels[i], &rl->key[RAY_KEY_SIZE*i]);
+	}
+
+	/* Grid covers all panels, with cells the size of the smallest one */
+	for ( i=0; i<det->n_panels; i++ ) {
+
+		double *b = &bb[4*i];
+		int r;
+
+		r = panel_ray_extent(&det->panels[i], b);
+		if ( r == -1 ) goto fail;
+		hit[i] = (r == 0);
+		if ( !hit[i] ) continue;
+
+		if ( first || (b[0] < rl->min_tx) ) rl->min_tx = b[0];
+		if ( first || (b[1] > rl->max_tx) ) rl->max_tx = b[1];
+		if ( first || (b[2] < rl->min_ty) ) rl->min_ty = b[2];
+		if ( first || (b[3] > rl->max_ty) ) rl->max_ty = b[3];
+		if ( first || (b[1]-b[0] < rl->cell_w) ) rl->cell_w = b[1]-b[0];
+		if ( first || (b[3]-b[2] < rl->cell_h) ) rl->cell_h = b[3]-b[2];
+		first = 0;
+
+	}
+	if ( first ) goto fail;
+
+	/* Don't let a very small panel make the grid huge */
+	do {
+		double nx = floor((rl->max_tx - rl->min_tx) / rl->cell_w) + 1;
+		double ny = floor((rl->max_ty - rl->min_ty) / rl->cell_h) + 1;
+		if ( nx*ny <= 16.0*det->n_panels + 1024 ) {
+			rl->n_x = nx;
+			rl->n_y = ny;
+			break;
+		}
+		if ( nx > ny ) {
+			rl->cell_w *= 2.0;
+		} else {
+			rl->cell_h *= 2.0;
+		}
+	} while ( 1 );
+	n_cells = rl->n_x * rl->n_y;
+
+	rl->start = calloc(n_cells+1, sizeof(int));
+	pos = calloc(n_cells, sizeof(int));
+	if ( (rl->start == NULL) || (pos == NULL) ) {
+		free(pos);
+		goto fail;
+	}
+
+	/* Count the panels in each cell, then list them in order */
+	for ( i=0; i<det->n_panels; i++ ) {
+		int x1, x2, y1, y2, x, y;
+		if ( !hit[i] ) continue;
+		x1 = ray_cell(bb[4*i+0], rl->min_tx, rl->cell_w, rl->n_x);
+		x2 = ray_cell(bb[4*i+1], rl->min_tx, rl->cell_w, rl->n_x);
+		y1 = ray_cell(bb[4*i+2], rl->min_ty, rl->cell_h, rl->n_y);
+		y2 = ray_cell(bb[4*i+3], rl->min_ty, rl->cell_h, rl->n_y);
+		for ( y=y1; y<=y2; y++ ) {
+		for ( x=x1; x<=x2; x++ ) {
+			rl->start[x + rl->n_x*y + 1]++;
+		}
+		}
+	}
+	for ( i=0; i<n_cells; i++ ) {
+		rl->start[i+1] += rl->start[i];
+	}
+	n_list = rl->start[n_cells];
+
+	rl->list = malloc((n_list > 0 ? n_list : 1)*sizeof(int));
+	if ( rl->list == NULL ) {
+		free(pos);
+		goto fail;
+	}
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		int x1, x2, y1, y2, x, y;
+		if ( !hit[i] ) continue;
+		x1 = ray_cell(bb[4*i+0], rl->min_tx, rl->cell_w, rl->n_x);
+		x2 = ray_cell(bb[4*i+1], rl->min_tx, rl->cell_w, rl->n_x);
+		y1 = ray_cell(bb[4*i+2], rl->min_ty, rl->cell_h, rl->n_y);
+		y2 = ray_cell(bb[4*i+3], rl->min_ty, rl->cell_h, rl->n_y);
+		for ( y=y1; y<=y2; y++ ) {
+		for ( x=x1; x<=x2; x++ ) {
+			int c = x + rl->n_x*y;
+			rl->list[rl->start[c] + pos[c]++] = i;
+		}
+		}
+	}
+
+	free(pos);
+	free(bb);
+	free(hit);
+	return rl;
+
+fail:
+	free(bb);
+	free(hit);
+	free_ray_lookup(rl);
+	return NULL;
+}
+
+
+/* Locks for the ray lookups of the detectors, shared between detectors
+ * according to their addresses */
+#define N_RAY_LOCKS (64)
+static pthread_mutex_t ray_locks[N_RAY_LOCKS];
+static pthread_once_t ray_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_ray_locks(void)
+{
+	int i;
+	for ( i=0; i<N_RAY_LOCKS; i++ ) {
+		pthread_mutex_init(&ray_locks[i], NULL);
+	}
+}
+
+
+static pthread_mutex_t *ray_lock(struct detector *det)
+{
+	unsigned long i = (unsigned long)det / sizeof(struct detector);
+
+	pthread_once(&ray_locks_once, init_ray_locks);
+	return &ray_locks[i % N_RAY_LOCKS];
+}
+
+
+static void unref_ray_lookup(struct ray_lookup *rl)
+{
+	if ( rl == NULL ) return;
+	if ( --rl->refs == 0 ) free_ray_lookup(rl);
+}
+
+
+/* Returns the ray lookup for the detector, making it again if the panels have
+ * moved since it was made, or NULL if it can't be made.  It stays valid, even
+ * if another thread replaces it, until put_ray_lookup() is called. */
+static struct ray_lookup *get_ray_lookup(struct detector *det)
+{
+	pthread_mutex_t *lock;
+	struct ray_lookup *rl;
+
+	if ( det == NULL ) return NULL;
+
+	lock = ray_lock(det);
+	pthread_mutex_lock(lock);
+
+	if ( (det->rays == NULL) || !ray_lookup_current(det->rays, det) ) {
+		unref_ray_lookup(det->rays);
+		det->rays = make_ray_lookup(det);
+	}
+
+	rl = det->rays;
+	if ( rl != NULL ) rl->refs++;
+
+	pthread_mutex_unlock(lock);
+
+	return rl;
+}
+
+
+static void put_ray_lookup(struct detector *det, struct ray_lookup *rl)
+{
+	pthread_mutex_t *lock;
+
+	if ( rl == NULL ) return;
+
+	lock = ray_lock(det);
+	pthread_mutex_lock(lock);
+	unref_ray_lookup(rl);
+	pthread_mutex_unlock(lock);
+}
+
+
+/* Returns non-zero if the ray hits panel "p", and puts the location in
+ * *pfs and *pss */
+static int panel_hit(struct panel *p, double x, double y, double den,
+                     double *pfs, double *pss)
+{
+	double xd, yd;
+	double fs, ss, plx, ply;
+
+	/* Coordinates of peak relative to central beam, in m */
+	xd = p->clen * x / den;
+	yd = p->clen * y / den;
+
+	/* Convert to pixels */
+	xd *= p->res;
+	yd *= p->res;
+
+	/* Convert to relative to the panel corner */
+	plx = xd - p->cnx;
+	ply = yd - p->cny;
+
+	fs = p->xfs*plx + p->yfs*ply;
+	ss = p->xss*plx + p->yss*ply;
+
+	fs += p->min_fs;
+	ss += p->min_ss;
+
+	/* Now, is this on this panel? */
+	if ( fs < p->min_fs ) return 0;
+	if ( fs > p->max_fs ) return 0;
+	if ( ss < p->min_ss ) return 0;
+	if ( ss > p->max_ss ) return 0;
+
+	*pfs = fs;
+	*pss = ss;
+	return 1;
+}
+
+
 static signed int locate_peak(double x, double y, double z, double k,
-                              struct detector *det, double *xdap, double *ydap)
+                              struct detector *det, struct ray_lookup *rl,
+                              double *xdap, double *ydap)
 {
 	int i;
 	signed int found = -1;
 	const double den = k + z;
+	double tx, ty;
 
 	*xdap = -1;  *ydap = -1;
 
-	for ( i=0; i<det->n_panels; i++ ) {
+	tx = x / den;
+	ty = y / den;
+
+	if ( (rl != NULL) && isfinite(tx) && isfinite(ty) ) {
+
+		int c, j;
 
-		double xd, yd;
-		double fs, ss, plx, ply;
-		struct panel *p;
+		/* Can't hit any panel from outside the grid */
+		if ( (tx < rl->min_tx) || (tx > rl->max_tx) ) return -1;
+		if ( (ty < rl->min_ty) || (ty > rl->max_ty) ) return -1;
 
-		p = &det->panels[i];
+		/* The panels are listed in order, so this finds the same panel
+		 * as the search below */
+		c = ray_cell(tx, rl->min_tx, rl->cell_w, rl->n_x)
+		  + rl->n_x*ray_cell(ty, rl->min_ty, rl->cell_h, rl->n_y);
+		for ( j=rl->start[c]; j<rl->start[c+1]; j++ ) {
 
-		/* Coordinates of peak relative to central beam, in m */
-		xd = p->clen * x / den;
-		yd = p->clen * y / den;
+			double fs, ss;
 
-		/* Convert to pixels */
-		xd *= p->res;
-		yd *= p->res;
+			i = rl->list[j];
+			if ( !panel_hit(&det->panels[i], x, y, den, &fs, &ss) ) {
+				continue;
+			}
+
+			/* If peak appears on multiple panels, reject it */
+			if ( found != -1 ) return -1;
+
+			found = i;
+			*xdap = fs;
+			*ydap = ss;
+
+		}
+
+		return found;
 
-		/* Convert to relative to the panel corner */
-		plx = xd - p->cnx;
-		ply = yd - p->cny;
+	}
 
-		fs = p->xfs*plx + p->yfs*ply;
-		ss = p->xss*plx + p->yss*ply;
+	for ( i=0; i<det->n_panels; i++ ) {
 
-		fs += p->min_fs;
-		ss += p->min_ss;
+		double fs, ss;
 
-		/* Now, is this on this panel? */
-		if ( fs < p->min_fs ) continue;
-		if ( fs > p->max_fs ) continue;
-		if ( ss < p->min_ss ) continue;
-		if ( ss > p->max_ss ) continue;
+		if ( !panel_hit(&det->panels[i], x, y, den, &fs, &ss) ) continue;
 
 		/* If peak appears on multiple panels, reject it */
 		if ( found != -1 ) return -1;
@@ -179,23 +563,26 @@ static double partiality(PartialityModel pmodel,
 }
 
 
-static Reflection *check_reflection(struct image *image, Crystal *cryst,
-                                    PartialityModel pmodel,
-                                    signed int h, signed int k, signed int l,
-                                    double xl, double yl, double zl)
+/* Fills in "refl" and returns non-zero if reflection h,k,l is excited and
+ * (if there is detector information) measured.  "refl" is just somewhere to put
+ * the values, so its indices don't matter. */
+static int check_reflection(struct image *image, Crystal *cryst,
+                            PartialityModel pmodel,
+                            signed int h, signed int k, signed int l,
+                            double xl, double yl, double zl,
+                            struct ray_lookup *rl, Reflection *refl)
 {
 	const int output = 0;
 	double tl;
 	double rlow, rhigh;     /* "Excitation error" */
 	double part;            /* Partiality */
 	double klow, khigh;    /* Wavenumber */
-	Reflection *refl;
 	double cet, cez;  /* Centre of Ewald sphere */
 	double pr;
 	double del;
 
 	/* Don't predict 000 */
-	if ( abs(h)+abs(k)+abs(l) == 0 ) return NULL;
+	if ( abs(h)+abs(k)+abs(l) == 0 ) return 0;
 
 	pr = crystal_get_profile_radius(cryst);
 	del = image->div + crystal_get_mosaicity(cryst);
@@ -207,7 +594,7 @@ static Reflection *check_reflection(struct image *image, Crystal *cryst,
 	khigh = 1.0/(image->lambda + image->lambda*image->bw/2.0);
 
 	/* If the point is looking "backscattery", reject it straight away */
-	if ( zl < -khigh/2.0 ) return NULL;
+	if ( zl < -khigh/2.0 ) return 0;
 
 	tl = sqrt(xl*xl + yl*yl);
 
@@ -222,26 +609,21 @@ static Reflection *check_reflection(struct image *image, Crystal *cryst,
 	/* Condition for reflection to be excited at all */
 	if ( (signbit(rlow) == signbit(rhigh))
 	     && (fabs(rlow) > pr)
-	     && (fabs(rhigh) > pr) ) return NULL;
+	     && (fabs(rhigh) > pr) ) return 0;
 
 	/* Calculate partiality */
 	part = partiality(pmodel, rlow, rhigh, pr);
 
-	/* Add peak to list */
-	refl = reflection_new(h, k, l);
-
 	/* If we have detector information, check the spot is measured.
 	 * Otherwise, we make do with calculating the partialiaty etc. */
 	if ( image->det != NULL ) {
 		double xda, yda;        /* Position on detector */
 		signed int p;           /* Panel number */
-		p = locate_peak(xl, yl, zl, 1.0/image->lambda, image->det,
+		p = locate_peak(xl, yl, zl, 1.0/image->lambda, image->det, rl,
 		                &xda, &yda);
-		if ( p == -1 ) {
-			reflection_free(refl);
-			return NULL;
-		}
+		if ( p == -1 ) return 0;
 		set_detector_pos(refl, 0.0, xda, yda);
+		set_panel(refl, &image->det->panels[p]);
 	}
 
 	if ( unlikely(rlow < rhigh) ) {
@@ -249,8 +631,7 @@ static Reflection *check_reflection(struct image *image, Crystal *cryst,
 		ERROR("%3i %3i %3i  rlow = %e, rhigh = %e\n",
 		      h, k, l, rlow, rhigh);
 		ERROR("div + m = %e, R = %e, bw = %e\n", del, pr, image->bw);
-		reflection_free(refl);
-		return NULL;
+		return 0;
 	}
 
 	set_partial(refl, rlow, rhigh, part);
@@ -262,7 +643,193 @@ static Reflection *check_reflection(struct image *image, Crystal *cryst,
 		printf("%3i %3i %3i %6f %5.2f\n", h, k, l, 0.0, part);
 	}
 
-	return refl;
+	return 1;
+}
+
+
+/* Everything needed to check reflections for find_intersections_to_res() */
+struct prediction
+{
+	struct image *image;
+	Crystal *cryst;
+	PartialityModel pmodel;
+	UnitCell *cell;
+	double max_res;
+	int hmax;
+	int kmax;
+	int lmax;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+	struct ray_lookup *rays;
+	RefList *reflections;
+	Reflection *vals;
+};
+
+
+/* Check reflections h,k,lmin to h,k,lmax, and add the ones which are excited to
+ * the list */
+static void check_line(struct prediction *pr, signed int h, signed int k,
+                       signed int lmin, signed int lmax)
+{
+	signed int l;
+
+	for ( l=lmin; l<=lmax; l++ ) {
+
+		Reflection *refl;
+		double xl, yl, zl;
+
+		if ( forbidden_reflection(pr->cell, h, k, l) ) continue;
+		if ( 2.0*resolution(pr->cell, h, k, l) > pr->max_res ) continue;
+
+		/* Get the coordinates of the reciprocal lattice point */
+		xl = h*pr->asx + k*pr->bsx + l*pr->csx;
+		yl = h*pr->asy + k*pr->bsy + l*pr->csy;
+		zl = h*pr->asz + k*pr->bsz + l*pr->csz;
+
+		if ( check_reflection(pr->image, pr->cryst, pr->pmodel,
+		                      h, k, l, xl, yl, zl, pr->rays, pr->vals) )
+		{
+			refl = add_refl(pr->reflections, h, k, l);
+			copy_data(refl, pr->vals);
+		}
+
+	}
+}
+
+
+/* Check every reflection in the cube of indices */
+static void predict_cube(struct prediction *pr)
+{
+	signed int h, k;
+
+	for ( h=-pr->hmax; h<=pr->hmax; h++ ) {
+	for ( k=-pr->kmax; k<=pr->kmax; k++ ) {
+		check_line(pr, h, k, -pr->lmax, pr->lmax);
+	}
+	}
+}
+
+
+/* Works out a spherical shell, centred on (0, 0, -*kc), which contains every
+ * point which check_reflection() could possibly accept.  Each Ewald sphere
+ * there is within distance e of the centre of the shell, so a point within
+ * pr of the surface of either sphere (or between them) is within pr+e of the
+ * surface of a sphere of the same radius centred on the shell.  Returns
+ * non-zero if there is no such shell, e.g. because of NaNs. */
+static int excitation_shell(struct image *image, Crystal *cryst, double *kc,
+                            double *rmin, double *rmax)
+{
+	double klow, khigh;
+	double elow, ehigh;
+	double pr, del, eps;
+
+	pr = crystal_get_profile_radius(cryst);
+	del = image->div + crystal_get_mosaicity(cryst);
+	klow = 1.0/(image->lambda - image->lambda*image->bw/2.0);
+	khigh = 1.0/(image->lambda + image->lambda*image->bw/2.0);
+
+	if ( !isfinite(pr) || !isfinite(del) || !isfinite(klow)
+	  || !isfinite(khigh) ) return 1;
+
+	/* With pr < 0, reflections are still excited when they are between
+	 * the two spheres */
+	if ( pr < 0.0 ) pr = 0.0;
+
+	*kc = (klow + khigh)/2.0;
+	ehigh = distance(sin(del/2.0)*khigh, -cos(del/2.0)*khigh, 0.0, -*kc);
+	elow = distance(sin(del/2.0)*klow, -cos(del/2.0)*klow, 0.0, -*kc);
+
+	/* Generous allowance for rounding errors */
+	eps = 1e-6 * (fabs(klow) + fabs(khigh));
+
+	*rmax = fmax(khigh + pr + ehigh, klow + pr + elow) + eps;
+	*rmin = fmin(khigh - pr - ehigh, klow - pr - elow) - eps;
+
+	return !isfinite(*rmin) || !isfinite(*rmax);
+}
+
+
+static signed int clamp_index(double l, int lmax)
+{
+	if ( l < -lmax ) return -lmax;
+	if ( l > lmax ) return lmax;
+	return l;
+}
+
+
+/* Check only the reflections near the Ewald sphere.  For each h,k, the
+ * reciprocal lattice points lie along a line, which passes through the
+ * excitation shell at most twice.  Solving for where the line is inside the
+ * outer and inner surfaces of the shell gives the range of l to check.  The
+ * reflections are checked and added in the same order as predict_cube(), so
+ * the results are exactly the same. */
+static int predict_shell(struct prediction *pr)
+{
+	double kc, rmin, rmax;
+	double a;
+	signed int h, k;
+
+	if ( excitation_shell(pr->image, pr->cryst, &kc, &rmin, &rmax) ) {
+		return 1;
+	}
+
+	a = pr->csx*pr->csx + pr->csy*pr->csy + pr->csz*pr->csz;
+
+	for ( h=-pr->hmax; h<=pr->hmax; h++ ) {
+	for ( k=-pr->kmax; k<=pr->kmax; k++ ) {
+
+		double ux, uy, uz, b, c, disc, sq;
+		double lo, hi;
+		signed int l1, l2;
+
+		/* |u + l*c*|^2 = rmax^2, where u is relative to the centre */
+		ux = h*pr->asx + k*pr->bsx;
+		uy = h*pr->asy + k*pr->bsy;
+		uz = h*pr->asz + k*pr->bsz + kc;
+		b = 2.0*(ux*pr->csx + uy*pr->csy + uz*pr->csz);
+		c = ux*ux + uy*uy + uz*uz;
+
+		disc = b*b - 4.0*a*(c - rmax*rmax);
+		if ( disc < 0.0 ) continue;
+		sq = sqrt(disc);
+		lo = floor((-b - sq)/(2.0*a)) - 1.0;
+		hi = ceil((-b + sq)/(2.0*a)) + 1.0;
+		if ( (hi < -pr->lmax) || (lo > pr->lmax) ) continue;
+
+		/* Leave out the part which is inside the inner surface */
+		disc = b*b - 4.0*a*(c - rmin*rmin);
+		if ( (rmin > 0.0) && (disc > 0.0) ) {
+
+			double in_lo, in_hi;
+
+			sq = sqrt(disc);
+			in_lo = ceil((-b - sq)/(2.0*a)) + 1.0;
+			in_hi = floor((-b + sq)/(2.0*a)) - 1.0;
+
+			if ( in_lo <= in_hi ) {
+				l1 = clamp_index(lo, pr->lmax);
+				l2 = clamp_index(in_lo-1.0, pr->lmax);
+				if ( (in_lo-1.0 >= -pr->lmax) && (l1 <= l2) ) {
+					check_line(pr, h, k, l1, l2);
+				}
+				l1 = clamp_index(in_hi+1.0, pr->lmax);
+				l2 = clamp_index(hi, pr->lmax);
+				if ( (in_hi+1.0 <= pr->lmax) && (l1 <= l2) ) {
+					check_line(pr, h, k, l1, l2);
+				}
+				continue;
+			}
+
+		}
+
+		check_line(pr, h, k, clamp_index(lo, pr->lmax),
+		           clamp_index(hi, pr->lmax));
+
+	}
+	}
+
+	return 0;
 }
 
 
@@ -273,32 +840,27 @@ RefList *find_intersections(struct image *image, Crystal *cryst,
 }
 
 
-RefList *find_intersections_to_res(struct image *image, Crystal *cryst,
-                                   PartialityModel pmodel, double max_res)
+/* Sets up "pr" for predicting reflections up to "max_res".  Returns non-zero
+ * if the crystal has no usable unit cell. */
+static int init_prediction(struct prediction *pr, struct image *image,
+                           Crystal *cryst, PartialityModel pmodel,
+                           double max_res)
 {
 	double ax, ay, az;
 	double bx, by, bz;
 	double cx, cy, cz;
-	double asx, asy, asz;
-	double bsx, bsy, bsz;
-	double csx, csy, csz;
-	RefList *reflections;
-	int hmax, kmax, lmax;
 	double mres;
-	signed int h, k, l;
 	UnitCell *cell;
 
 	cell = crystal_get_cell(cryst);
-	if ( cell == NULL ) return NULL;
-
-	reflections = reflist_new();
+	if ( cell == NULL ) return 1;
 
 	/* Cell angle check from Foadi and Evans (2011) */
 	if ( !cell_is_sensible(cell) ) {
 		ERROR("Invalid unit cell parameters given to"
 		      " find_intersections()\n");
 		cell_print(cell);
-		return NULL;
+		return 1;
 	}
 
 	cell_get_cartesian(cell, &ax, &ay, &az, &bx, &by, &bz, &cx, &cy, &cz);
@@ -306,50 +868,87 @@ RefList *find_intersections_to_res(struct image *image, Crystal *cryst,
 	mres = largest_q(image);
 	if ( mres > max_res ) mres = max_res;
 
-	hmax = mres * modulus(ax, ay, az);
-	kmax = mres * modulus(bx, by, bz);
-	lmax = mres * modulus(cx, cy, cz);
+	pr->hmax = mres * modulus(ax, ay, az);
+	pr->kmax = mres * modulus(bx, by, bz);
+	pr->lmax = mres * modulus(cx, cy, cz);
 
-	if ( (hmax >= 512) || (kmax >= 512) || (lmax >= 512) ) {
+	if ( (pr->hmax >= 512) || (pr->kmax >= 512) || (pr->lmax >= 512) ) {
 		ERROR("Unit cell is too large - will only integrate reflections"
 		      " up to 511th order.\n");
 		cell_print(cell);
-		if ( hmax >= 512 ) hmax = 511;
-		if ( kmax >= 512 ) kmax = 511;
-		if ( lmax >= 512 ) lmax = 511;
+		if ( pr->hmax >= 512 ) pr->hmax = 511;
+		if ( pr->kmax >= 512 ) pr->kmax = 511;
+		if ( pr->lmax >= 512 ) pr->lmax = 511;
 	}
 
-	cell_get_reciprocal(cell, &asx, &asy, &asz,
-	                          &bsx, &bsy, &bsz,
-	                          &csx, &csy, &csz);
+	cell_get_reciprocal(cell, &pr->asx, &pr->asy, &pr->asz,
+	                          &pr->bsx, &pr->bsy, &pr->bsz,
+	                          &pr->csx, &pr->csy, &pr->csz);
 
-	for ( h=-hmax; h<=hmax; h++ ) {
-	for ( k=-kmax; k<=kmax; k++ ) {
-	for ( l=-lmax; l<=lmax; l++ ) {
+	pr->image = image;
+	pr->cryst = cryst;
+	pr->pmodel = pmodel;
+	pr->cell = cell;
+	pr->max_res = max_res;
+	pr->rays = get_ray_lookup(image->det);
+	pr->reflections = reflist_new();
 
-		Reflection *refl;
-		double xl, yl, zl;
+	/* The new reflections are copied from here into the list, so that they
+	 * are allocated by the list itself */
+	pr->vals = reflection_new(0, 0, 0);
 
-		if ( forbidden_reflection(cell, h, k, l) ) continue;
-		if ( 2.0*resolution(cell, h, k, l) > max_res ) continue;
+	return 0;
+}
 
-		/* Get the coordinates of the reciprocal lattice point */
-		xl = h*asx + k*bsx + l*csx;
-		yl = h*asy + k*bsy + l*csy;
-		zl = h*asz + k*bsz + l*csz;
 
-		refl = check_reflection(image, cryst, pmodel,
-		                        h, k, l, xl, yl, zl);
+RefList *find_intersections_to_res(struct image *image, Crystal *cryst,
+                                   PartialityModel pmodel, double max_res)
+{
+	struct prediction pr;
 
-		if ( refl != NULL ) {
-			add_refl_to_list(refl, reflections);
-		}
+	if ( init_prediction(&pr, image, cryst, pmodel, max_res) ) return NULL;
 
-	}
-	}
+	if ( predict_shell(&pr) ) predict_cube(&pr);
+
+	reflection_free(pr.vals);
+	put_ray_lookup(image->det, pr.rays);
+
+	return pr.reflections;
+}
+
+
+/* Like find_intersections_to_res(), but only considers the reflections with
+ * the same indices as the ones in "indices".  The reflections which are
+ * predicted have exactly the same values as they would have in the list from
+ * find_intersections_to_res(). */
+RefList *find_listed_intersections(struct image *image, Crystal *cryst,
+                                   PartialityModel pmodel, double max_res,
+                                   RefList *indices)
+{
+	struct prediction pr;
+	Reflection *refl;
+	RefListIterator *iter;
+
+	if ( init_prediction(&pr, image, cryst, pmodel, max_res) ) return NULL;
+
+	for ( refl = first_refl(indices, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+
+		get_indices(refl, &h, &k, &l);
+		if ( (abs(h) > pr.hmax) || (abs(k) > pr.kmax)
+		  || (abs(l) > pr.lmax) ) continue;
+		if ( find_refl(pr.reflections, h, k, l) != NULL ) continue;
+
+		check_line(&pr, h, k, l, l);
 	}
 
-	return reflections;
+	reflection_free(pr.vals);
+	put_ray_lookup(image->det, pr.rays);
+
+	return pr.reflections;
 }
 
 
@@ -441,12 +1040,17 @@ void update_partialities_2(Crystal *cryst, PartialityModel pmodel,
 	struct image *image = crystal_get_image(cryst);
 	double total_p_change = 0.0;
 	int n = 0;
+	Reflection *vals;
+	struct ray_lookup *rays;
 
 	if ( pmodel == PMODEL_UNITY ) {
 		set_unity_partialities(cryst);
 		return;
 	}
 
+	vals = reflection_new(0, 0, 0);
+	rays = get_ray_lookup(image->det);
+
 	cell_get_reciprocal(crystal_get_cell(cryst), &asx, &asy, &asz,
 	                    &bsx, &bsy, &bsz, &csx, &csy, &csz);
 
@@ -454,7 +1058,6 @@ void update_partialities_2(Crystal *cryst, PartialityModel pmodel,
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		Reflection *vals;
 		double r1, r2, L, p, x, y;
 		double xl, yl, zl;
 		signed int h, k, l;
@@ -468,10 +1071,9 @@ void update_partialities_2(Crystal *cryst, PartialityModel pmodel,
 		yl = h*asy + k*bsy + l*csy;
 		zl = h*asz + k*bsz + l*csz;
 
-		vals = check_reflection(image, cryst, pmodel,
-		                        h, k, l, xl, yl, zl);
-
-		if ( vals == NULL ) {
+		if ( !check_reflection(image, cryst, pmodel,
+		                       h, k, l, xl, yl, zl, rays, vals) )
+		{
 
 			if ( get_redundancy(refl) != 0 ) {
 				(*n_lost)++;
@@ -495,8 +1097,7 @@ void update_partialities_2(Crystal *cryst, PartialityModel pmodel,
 			/* Transfer detector location */
 			get_detector_pos(vals, &x, &y);
 			set_detector_pos(refl, 0.0, x, y);
-
-			reflection_free(vals);
+			set_panel(refl, get_panel(vals));
 
 			total_p_change += fabs(p - old_p);
 			n++;
@@ -505,6 +1106,9 @@ void update_partialities_2(Crystal *cryst, PartialityModel pmodel,
 
 	}
 
+	reflection_free(vals);
+	put_ray_lookup(image->det, rays);
+
 	*mean_p_change = total_p_change / n;
 }
 
@@ -66,6 +66,9 @@ extern RefList *find_intersections(struct image *image, Crystal *cryst,
 extern RefList *find_intersections_to_res(struct image *image, Crystal *cryst,
                                           PartialityModel pmodel,
 					  double max_res);
+extern RefList *find_listed_intersections(struct image *image, Crystal *cryst,
+                                          PartialityModel pmodel,
+                                          double max_res, RefList *indices);
 
 /* Deprecated: select reflections using Kirian-style pixel proximity */
 extern RefList *select_intersections(struct image *image, Crystal *cryst);
@@ -80,6 +83,10 @@ extern void polarisation_correction(RefList *list, UnitCell *cell,
 extern double sphere_fraction(double rlow, double rhigh, double pr);
 extern double gaussian_fraction(double rlow, double rhigh, double pr);
 
+/* For free_detector_geometry() */
+struct ray_lookup;
+extern void free_ray_lookup(struct ray_lookup *rl);
+
 #ifdef __cplusplus
 }
 #endif
@@ -261,16 +261,21 @@ static void write_gve(struct image *image, struct grainspotter_private *gp)
 {
 	FILE *fh;
 	int i;
-	char filename[1024];
+	char name[64];
+	char *filename;
 	double a, b, c, al, be, ga;
 
-	snprintf(filename, 1023, "xfel-%i.gve", image->id);
+	snprintf(name, 63, "xfel-%i.gve", image->id);
+	filename = image_tmp_filename(image, name);
+	if ( filename == NULL ) return;
 
 	fh = fopen(filename, "w");
 	if ( !fh ) {
 		ERROR("Couldn't open temporary file '%s'\n", filename);
+		free(filename);
 		return;
 	}
+	free(filename);
 
 	cell_get_parameters(gp->cell, &a, &b, &c, &al, &be, &ga);
 	fprintf(fh, "%.6f %.6f %.6f %.6f %.6f %.6f P\n", a*1e10, b*1e10, c*1e10,
@@ -297,23 +302,33 @@ static void write_gve(struct image *image, struct grainspotter_private *gp)
 }
 
 
+/* Returns the name of the file relative to the temporary folder */
 static char *write_ini(struct image *image)
 {
 	FILE *fh;
+	char *name;
 	char *filename;
 	double tt;
 
-	filename = malloc(1024);
-	if ( filename == NULL ) return NULL;
+	name = malloc(1024);
+	if ( name == NULL ) return NULL;
+
+	snprintf(name, 1023, "xfel-%i.ini", image->id);
 
-	snprintf(filename, 1023, "xfel-%i.ini", image->id);
+	filename = image_tmp_filename(image, name);
+	if ( filename == NULL ) {
+		free(name);
+		return NULL;
+	}
 
 	fh = fopen(filename, "w");
 	if ( !fh ) {
 		ERROR("Couldn't open temporary file '%s'\n", filename);
 		free(filename);
+		free(name);
 		return NULL;
 	}
+	free(filename);
 
 	get_q_for_panel(image->det->furthest_out_panel,
 	                image->det->furthest_out_fs,
@@ -341,7 +356,7 @@ static char *write_ini(struct image *image)
 
 	fclose(fh);
 
-	return filename;
+	return name;
 }
 
 
@@ -353,7 +368,8 @@ int grainspotter_index(struct image *image, IndexingPrivate *ipriv)
 	struct grainspotter_data *grainspotter;
 	struct grainspotter_private *gp = (struct grainspotter_private *)ipriv;
 	char *ini_filename;
-	char gff_filename[1024];
+	char gff_name[64];
+	char *gff_filename;
 
 	write_gve(image, gp);
 	ini_filename = write_ini(image);
@@ -371,12 +387,19 @@ int grainspotter_index(struct image *image, IndexingPrivate *ipriv)
 
 	grainspotter->gp = gp;
 
-	snprintf(gff_filename, 1023, "xfel-%i.gff", image->id);
+	snprintf(gff_name, 63, "xfel-%i.gff", image->id);
+	gff_filename = image_tmp_filename(image, gff_name);
+	if ( gff_filename == NULL ) {
+		free(ini_filename);
+		free(grainspotter);
+		return 0;
+	}
 	remove(gff_filename);
 
 	grainspotter->pid = forkpty(&grainspotter->pty, NULL, NULL, NULL);
 	if ( grainspotter->pid == -1 ) {
 		ERROR("Failed to fork for GrainSpotter: %s\n", strerror(errno));
+		free(gff_filename);
 		return 0;
 	}
 	if ( grainspotter->pid == 0 ) {
@@ -389,6 +412,12 @@ int grainspotter_index(struct image *image, IndexingPrivate *ipriv)
 		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
 		tcsetattr(STDIN_FILENO, TCSANOW, &t);
 
+		if ( (image->tmpdir != NULL) && chdir(image->tmpdir) ) {
+			ERROR("Failed to chdir to temporary folder: %s\n",
+			      strerror(errno));
+			_exit(0);
+		}
+
 		STATUS("Running GrainSpotter.0.93 '%s'\n", ini_filename);
 		execlp("GrainSpotter.0.93", "", ini_filename, (char *)NULL);
 		ERROR("Failed to invoke GrainSpotter.\n");
@@ -451,16 +480,19 @@ int grainspotter_index(struct image *image, IndexingPrivate *ipriv)
 
 	if ( status != 0 ) {
 		ERROR("GrainSpotter doesn't seem to be working properly.\n");
+		free(gff_filename);
 		free(grainspotter);
 		return 0;
 	}
 
 	if ( read_matrix(gp, image, gff_filename) != 0 ) {
+		free(gff_filename);
 		free(grainspotter);
 		return 0;
 	}
 
 	/* Success! */
+	free(gff_filename);
 	free(grainspotter);
 	return 1;
 }
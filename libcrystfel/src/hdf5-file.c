@@ -124,6 +124,15 @@ struct hdfile *hdfile_open(const char *filename)
 }
 
 
+static void close_dataset(struct hdfile *f)
+{
+	if ( f->data_open ) {
+		H5Dclose(f->dh);
+		f->data_open = 0;
+	}
+}
+
+
 int hdfile_set_image(struct hdfile *f, const char *path,
                      struct panel *p)
 {
@@ -133,6 +142,8 @@ int hdfile_set_image(struct hdfile *f, const char *path,
 	int sh_dim;
 	int di;
 
+	close_dataset(f);
+
 	f->dh = H5Dopen2(f->fh, path, H5P_DEFAULT);
 	if ( f->dh < 0 ) {
 		ERROR("Couldn't open dataset\n");
@@ -146,6 +157,7 @@ int hdfile_set_image(struct hdfile *f, const char *path,
 
 		if ( sh_dim != 2 ) {
 			ERROR("Dataset is not two-dimensional\n");
+			H5Sclose(sh);
 			return -1;
 		}
 
@@ -154,6 +166,7 @@ int hdfile_set_image(struct hdfile *f, const char *path,
 		if ( sh_dim != p->dim_structure->num_dims ) {
 			ERROR("Dataset dimensionality does not match "
 			      "geometry file\n");
+			H5Sclose(sh);
 			return -1;
 		}
 
@@ -576,9 +589,7 @@ static void cleanup(hid_t fh)
 void hdfile_close(struct hdfile *f)
 {
 
-	if ( f->data_open ) {
-		H5Dclose(f->dh);
-	}
+	close_dataset(f);
 
 	cleanup(f->fh);
 
@@ -1083,12 +1094,14 @@ static void debodge_saturation(struct hdfile *f, struct image *image)
 }
 
 
-static int unpack_panels(struct image *image, struct detector *det)
+static int alloc_panels(struct image *image, struct detector *det)
 {
 	int pi;
 
-	image->dp = malloc(det->n_panels * sizeof(float *));
-	image->bad = malloc(det->n_panels * sizeof(int *));
+	/* Zeroed, so that hdf5_free_image_buffers() can clean up if only some
+	 * of the panels could be allocated */
+	image->dp = calloc(det->n_panels, sizeof(float *));
+	image->bad = calloc(det->n_panels, sizeof(int *));
 	if ( (image->dp == NULL) || (image->bad == NULL) ) {
 		ERROR("Failed to allocate panels.\n");
 		return 1;
@@ -1097,7 +1110,6 @@ static int unpack_panels(struct image *image, struct detector *det)
 	for ( pi=0; pi<det->n_panels; pi++ ) {
 
 		struct panel *p;
-		int fs, ss;
 
 		p = &det->panels[pi];
 		image->dp[pi] = malloc(p->w*p->h*sizeof(float));
@@ -1107,6 +1119,23 @@ static int unpack_panels(struct image *image, struct detector *det)
 			return 1;
 		}
 
+	}
+
+	return 0;
+}
+
+
+static int unpack_panels(struct image *image, struct detector *det)
+{
+	int pi;
+
+	for ( pi=0; pi<det->n_panels; pi++ ) {
+
+		struct panel *p;
+		int fs, ss;
+
+		p = &det->panels[pi];
+
 		for ( ss=0; ss<p->h; ss++ ) {
 		for ( fs=0; fs<p->w; fs++ ) {
 
@@ -1388,6 +1417,7 @@ int hdf5_read(struct hdfile *f, struct image *image, const char *element,
 
 	if ( fail ) {
 		ERROR("Couldn't select path\n");
+		close_dataset(f);
 		return 1;
 	}
 
@@ -1401,6 +1431,7 @@ int hdf5_read(struct hdfile *f, struct image *image, const char *element,
 	if ( r < 0 ) {
 		ERROR("Couldn't read data\n");
 		free(buf);
+		close_dataset(f);
 		return 1;
 	}
 	image->data = buf;
@@ -1412,6 +1443,7 @@ int hdf5_read(struct hdfile *f, struct image *image, const char *element,
 
 	if ( satcorr ) debodge_saturation(f, image);
 
+	if ( alloc_panels(image, image->det) ) return 1;
 	unpack_panels(image, image->det);
 
 	if ( image->beam != NULL ) {
@@ -1432,7 +1464,7 @@ int hdf5_read(struct hdfile *f, struct image *image, const char *element,
 }
 
 
-static void load_mask(struct hdfile *f, struct event *ev, char *mask,
+static int load_mask(struct hdfile *f, struct event *ev, char *mask,
                       const char *pname, struct image *image,
                       size_t p_w, size_t sum_p_h,
                       hsize_t *f_offset, hsize_t *f_count,
@@ -1489,58 +1521,155 @@ static void load_mask(struct hdfile *f, struct event *ev, char *mask,
 	H5Dclose(mask_dh);
 	if ( ev != NULL ) free(mask);
 
-	return;
+	return 0;
 
 err:
 	if ( ev != NULL ) free(mask);
-	free(image->flags);
-	image->flags = NULL;
-	return;
+	return 1;
 }
 
 
-int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
-               int satcorr)
+static int image_size_from_geom(struct detector *det, int *pp_w,
+                                int *psum_p_h)
 {
-	herr_t r;
-	float *buf;
 	int sum_p_h;
 	int p_w;
 	int pi;
 
-	if ( image->det == NULL ) {
-		ERROR("Geometry not available\n");
-		return 1;
-	}
+	*pp_w = 0;
+	*psum_p_h = 0;
 
-	p_w = image->det->panels[0].w;
+	p_w = det->panels[0].w;
 	sum_p_h = 0;
 
-	for ( pi=0; pi<image->det->n_panels; pi++ ) {
+	for ( pi=0; pi<det->n_panels; pi++ ) {
 
-		if ( image->det->panels[pi].w != p_w ) {
+		if ( det->panels[pi].w != p_w ) {
 			ERROR("Panels must have the same width.");
 			return 1;
 		}
 
-		sum_p_h += image->det->panels[pi].h;
+		sum_p_h += det->panels[pi].h;
 
 	}
 
-	buf = malloc(sizeof(float)*p_w*sum_p_h);
-	if ( buf == NULL ) {
-		ERROR("Failed to allocate memory for image\n");
+	*pp_w = p_w;
+	*psum_p_h = sum_p_h;
+	return 0;
+}
+
+
+/* Allocates image->data, image->flags, image->dp and image->bad at the right
+ * sizes for the geometry in image->det.  The buffers can then be filled for
+ * each frame using hdf5_read_into_buffers(), instead of allocating new ones
+ * each time with hdf5_read2(). */
+int hdf5_alloc_image_buffers(struct image *image)
+{
+	int sum_p_h;
+	int p_w;
+
+	image->data = NULL;
+	image->flags = NULL;
+	image->dp = NULL;
+	image->bad = NULL;
+
+	if ( image->det == NULL ) {
+		ERROR("Geometry not available\n");
 		return 1;
 	}
+
+	if ( image_size_from_geom(image->det, &p_w, &sum_p_h) ) return 1;
+
 	image->width = p_w;
 	image->height = sum_p_h;
 
-	image->flags = calloc(p_w*sum_p_h,sizeof(uint16_t));
+	image->data = malloc(sizeof(float)*p_w*sum_p_h);
+	if ( image->data == NULL ) {
+		ERROR("Failed to allocate memory for image\n");
+		return 1;
+	}
+
+	image->flags = calloc(p_w*sum_p_h, sizeof(uint16_t));
 	if ( image->flags == NULL ) {
 		ERROR("Failed to allocate memory for flags\n");
+		free(image->data);
+		image->data = NULL;
+		return 1;
+	}
+
+	if ( alloc_panels(image, image->det) ) {
+		hdf5_free_image_buffers(image);
 		return 1;
 	}
 
+	return 0;
+}
+
+
+/* Frees the buffers allocated by hdf5_alloc_image_buffers() */
+void hdf5_free_image_buffers(struct image *image)
+{
+	int pi;
+
+	if ( image->dp != NULL ) {
+		for ( pi=0; pi<image->det->n_panels; pi++ ) {
+			free(image->dp[pi]);
+		}
+	}
+	if ( image->bad != NULL ) {
+		for ( pi=0; pi<image->det->n_panels; pi++ ) {
+			free(image->bad[pi]);
+		}
+	}
+	free(image->dp);
+	free(image->bad);
+	free(image->data);
+	free(image->flags);
+
+	image->data = NULL;
+	image->flags = NULL;
+	image->dp = NULL;
+	image->bad = NULL;
+}
+
+
+static void clear_flags(struct image *image, int p_w, hsize_t *m_offset,
+                        hsize_t *m_count)
+{
+	hsize_t ss;
+
+	for ( ss=m_offset[0]; ss<m_offset[0]+m_count[0]; ss++ ) {
+		memset(&image->flags[ss*p_w + m_offset[1]], 0,
+		       m_count[1]*sizeof(uint16_t));
+	}
+}
+
+
+static int read_frame(struct hdfile *f, struct image *image,
+                      struct event *ev, int satcorr)
+{
+	herr_t r;
+	float *buf;
+	int sum_p_h;
+	int p_w;
+	int pi;
+
+	if ( image->det == NULL ) {
+		ERROR("Geometry not available\n");
+		return 1;
+	}
+
+	if ( image_size_from_geom(image->det, &p_w, &sum_p_h) ) return 1;
+
+	if ( (image->width != p_w) || (image->height != sum_p_h) ) {
+		ERROR("Image buffers don't match the geometry.\n");
+		return 1;
+	}
+
+	buf = image->data;
+	if ( image->flags != NULL ) {
+		memset(image->flags, 0, p_w*sum_p_h*sizeof(uint16_t));
+	}
 
 	for ( pi=0; pi<image->det->n_panels; pi++ ) {
 
@@ -1644,7 +1773,9 @@ int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
 		if ( check < 0 ) {
 			ERROR("Error selecting file dataspace for panel %s\n",
 			      p->name);
-			free(buf);
+			free(f_offset);
+			free(f_count);
+			H5Sclose(dataspace);
 			return 1;
 		}
 
@@ -1660,9 +1791,10 @@ int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
 		if ( check < 0 ) {
 			ERROR("Error selecting memory dataspace for panel %s\n",
 			      p->name);
-			free(buf);
 			free(f_offset);
 			free(f_count);
+			H5Sclose(dataspace);
+			H5Sclose(memspace);
 			return 1;
 		}
 
@@ -1671,19 +1803,24 @@ int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
 		if ( r < 0 ) {
 			ERROR("Couldn't read data for panel %s\n",
 			      p->name);
-			free(buf);
 			free(f_offset);
 			free(f_count);
+			H5Sclose(dataspace);
+			H5Sclose(memspace);
 			return 1;
 		}
-		H5Dclose(f->dh);
-		f->data_open = 0;
+		close_dataset(f);
 		H5Sclose(dataspace);
 		H5Sclose(memspace);
 
-		if ( p->mask != NULL ) {
-			load_mask(f, ev, p->mask, p->name, image, p_w, sum_p_h,
-			          f_offset, f_count, m_offset, m_count);
+		if ( (p->mask != NULL) && (image->flags != NULL) ) {
+			if ( load_mask(f, ev, p->mask, p->name, image,
+			               p_w, sum_p_h, f_offset, f_count,
+			               m_offset, m_count) )
+			{
+				/* Don't leave the flags from the last frame */
+				clear_flags(image, p_w, m_offset, m_count);
+			}
 		}
 
 		free(f_offset);
@@ -1691,8 +1828,6 @@ int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
 
 	}
 
-	image->data = buf;
-
 	if ( satcorr ) debodge_saturation(f, image);
 
 	fill_in_values(image->det, f, ev);
@@ -1717,6 +1852,37 @@ int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
 }
 
 
+/* Reads a frame into the buffers already allocated by
+ * hdf5_alloc_image_buffers().  If the flags for a panel cannot be read, they
+ * will be left as zero. */
+int hdf5_read_into_buffers(struct hdfile *f, struct image *image,
+                           struct event *ev, int satcorr)
+{
+	if ( read_frame(f, image, ev, satcorr) ) {
+		/* The file might be kept open and used again for the next
+		 * frame, so don't leave the dataset open */
+		close_dataset(f);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int hdf5_read2(struct hdfile *f, struct image *image, struct event *ev,
+               int satcorr)
+{
+	if ( hdf5_alloc_image_buffers(image) ) return 1;
+
+	if ( hdf5_read_into_buffers(f, image, ev, satcorr) ) {
+		hdf5_free_image_buffers(image);
+		return 1;
+	}
+
+	return 0;
+}
+
+
 static int looks_like_image(hid_t h)
 {
 	hid_t sh;
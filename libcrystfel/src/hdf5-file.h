@@ -64,6 +64,11 @@ extern int hdf5_read(struct hdfile *f, struct image *image,
 extern int hdf5_read2(struct hdfile *f, struct image *image,
 			   struct event *ev, int satcorr);
 
+extern int hdf5_alloc_image_buffers(struct image *image);
+extern void hdf5_free_image_buffers(struct image *image);
+extern int hdf5_read_into_buffers(struct hdfile *f, struct image *image,
+                                  struct event *ev, int satcorr);
+
 extern int check_path_existence(hid_t fh, const char *path);
 
 extern struct hdfile *hdfile_open(const char *filename);
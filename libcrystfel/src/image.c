@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "image.h"
 #include "utils.h"
@@ -255,3 +256,37 @@ void free_all_crystals(struct image *image)
 	free(image->crystals);
 	image->n_crystals = 0;
 }
+
+
+/**
+ * image_tmp_filename:
+ * @image: An image structure
+ * @name: The name of a temporary file
+ *
+ * External indexing programs are run with their working directory set to
+ * <structfield>tmpdir</structfield>, if it is not %NULL, so that several can
+ * run at the same time without their files getting mixed up.  This function
+ * gives the name by which the calling process can find the same file.
+ *
+ * Returns: a newly allocated string containing the path to the temporary
+ * file called @name for @image.
+ */
+char *image_tmp_filename(const struct image *image, const char *name)
+{
+	char *filename;
+	size_t len;
+
+	if ( image->tmpdir == NULL ) {
+		filename = malloc(strlen(name)+1);
+		if ( filename == NULL ) return NULL;
+		strcpy(filename, name);
+		return filename;
+	}
+
+	len = strlen(image->tmpdir) + strlen(name) + 2;
+	filename = malloc(len);
+	if ( filename == NULL ) return NULL;
+	snprintf(filename, len, "%s/%s", image->tmpdir, name);
+
+	return filename;
+}
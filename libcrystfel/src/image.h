@@ -127,6 +127,7 @@ struct beam_params
  *    const struct copy_hdf5_field *copyme;
  *
  *    int                     id;
+ *    const char              *tmpdir;
  *
  *    double                  lambda;
  *    double                  div;
@@ -158,6 +159,10 @@ struct beam_params
  *
  * <structfield>copyme</structfield> represents a list of HDF5 fields to copy
  * to the output stream.
+ *
+ * <structfield>tmpdir</structfield> is the folder in which temporary files for
+ * external indexing programs should be placed, or %NULL for the current
+ * working directory.  See image_tmp_filename().
  **/
 struct image;
 
@@ -184,6 +189,7 @@ struct image {
 
 	int                     id;   /* ID number of the thread
 	                               * handling this image */
+	const char              *tmpdir;  /* Folder for temporary files */
 	int                     serial;  /* Monotonically ascending serial
 	                                  * number for this image */
 
@@ -236,6 +242,8 @@ extern struct imagefeature *image_get_feature(ImageFeatureList *flist, int idx);
 extern void image_add_crystal(struct image *image, Crystal *cryst);
 extern void free_all_crystals(struct image *image);
 
+extern char *image_tmp_filename(const struct image *image, const char *name);
+
 #ifdef __cplusplus
 }
 #endif
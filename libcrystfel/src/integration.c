@@ -54,6 +54,11 @@
 #include "integration.h"
 
 
+/* Largest condition number of the rescaled background normal equations which
+ * will be solved using the inverse.  Must match check_eigen() in utils.c */
+#define BG_MAX_CONDITION (1e6)
+
+
 enum boxmask_val
 {
 	BM_IG,  /* "Soft" ignore */
@@ -63,6 +68,25 @@ enum boxmask_val
 };
 
 
+/* Sums over the pixels of a box, which depend only on its mask.  Boxes whose
+ * mask is the same as the context's ring mask share one copy of these. */
+struct mask_sums
+{
+	/* Peak region sums */
+	double pks_p2;
+	double pks_q2;
+	double pks_pq;
+	double pks_p;
+	double pks_q;
+	int m;
+
+	/* Normal equations for the background plane fit, and their inverse */
+	double bgm[3][3];
+	double bginv[3][3];
+	int bg_singular;  /* Non-zero if bginv isn't usable */
+};
+
+
 struct intcontext
 {
 	IntegrationMethod meth;
@@ -70,6 +94,7 @@ struct intcontext
 	int halfw;
 	int w;
 	enum boxmask_val *bm;  /* Box mask */
+	struct mask_sums sums; /* Sums for bm */
 	struct image *image;
 	int **masks;  /* Peak location mask from make_BgMask() */
 
@@ -114,15 +139,7 @@ struct peak_box
 	double b;
 	double c;
 
-	/* Peak region sums */
-	double pks_p2;
-	double pks_q2;
-	double pks_pq;
-	double pks_p;
-	double pks_q;
-	int m;
-
-	gsl_matrix *bgm;  /* Background estimation matrix */
+	struct mask_sums s;  /* Sums over the box mask */
 
 	/* Measured intensity (tentative, profile fitted or otherwise) */
 	double intensity;
@@ -142,20 +159,6 @@ struct peak_box
 };
 
 
-static void addm(gsl_matrix *m, int i, int j, double val)
-{
-	double v = gsl_matrix_get(m, i, j);
-	gsl_matrix_set(m, i, j, v+val);
-}
-
-
-static void addv(gsl_vector *v, int i, double val)
-{
-	double k = gsl_vector_get(v, i);
-	gsl_vector_set(v, i, k+val);
-}
-
-
 static float boxi(struct intcontext *ic, struct peak_box *bx, int p, int q)
 {
 	int fs, ss;
@@ -331,41 +334,71 @@ static void show_peak_box(struct intcontext *ic, struct peak_box *bx,
 }
 
 
+/* Returns the first pixel of row q of the box, for the loops which go along
+ * the rows without calling boxi() for each pixel.  The box must already have
+ * been checked by check_box(), which makes sure that it's all on the panel. */
+static const float *box_row(struct intcontext *ic, struct peak_box *bx, int q)
+{
+	assert(q >= 0);
+	assert(q < ic->w);
+	assert(bx->cfs >= 0);
+	assert(bx->cfs + ic->w <= bx->p->w);
+	assert(bx->css + q >= 0);
+	assert(bx->css + q < bx->p->h);
+
+	return ic->image->dp[bx->pn] + bx->cfs + bx->p->w*(bx->css+q);
+}
+
+
 static void fit_bg(struct intcontext *ic, struct peak_box *bx)
 {
 	int p, q;
-	gsl_vector *v;
-	gsl_vector *ans;
-
-	v = gsl_vector_calloc(3);
+	double v[3] = {0.0, 0.0, 0.0};
 
-	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
 
-		double bi;
+		const float *row = box_row(ic, bx, q);
+		const enum boxmask_val *bm = bx->bm + ic->w*q;
+		double rs = 0.0;
+		double rsp = 0.0;
 
-		if ( bx->bm[p + ic->w*q] == BM_BG ) {
+		for ( p=0; p<ic->w; p++ ) {
+			double bi = (bm[p] == BM_BG) ? row[p] : 0.0;
+			rs += bi;
+			rsp += bi*p;
+		}
 
-			bi = boxi(ic, bx, p, q);
+		v[0] += rsp;
+		v[1] += rs*q;
+		v[2] += rs;
 
-			addv(v, 0, bi*p);
-			addv(v, 1, bi*q);
-			addv(v, 2, bi);
+	}
 
-		}
+	if ( bx->s.bg_singular ) {
 
-	}
-	}
+		gsl_matrix_view Mv;
+		gsl_vector_view vv;
+		gsl_vector *ans;
 
-	/* FIXME: SVD is massive overkill here */
-	ans = solve_svd(v, bx->bgm, NULL, 0);
-	gsl_vector_free(v);
+		Mv = gsl_matrix_view_array(&bx->s.bgm[0][0], 3, 3);
+		vv = gsl_vector_view_array(v, 3);
+		ans = solve_svd(&vv.vector, &Mv.matrix, NULL, 0);
 
-	bx->a = gsl_vector_get(ans, 0);
-	bx->b = gsl_vector_get(ans, 1);
-	bx->c = gsl_vector_get(ans, 2);
+		bx->a = gsl_vector_get(ans, 0);
+		bx->b = gsl_vector_get(ans, 1);
+		bx->c = gsl_vector_get(ans, 2);
 
-	gsl_vector_free(ans);
+		gsl_vector_free(ans);
+		return;
+
+	}
+
+	bx->a = bx->s.bginv[0][0]*v[0] + bx->s.bginv[0][1]*v[1]
+	      + bx->s.bginv[0][2]*v[2];
+	bx->b = bx->s.bginv[1][0]*v[0] + bx->s.bginv[1][1]*v[1]
+	      + bx->s.bginv[1][2]*v[2];
+	bx->c = bx->s.bginv[2][0]*v[0] + bx->s.bginv[2][1]*v[1]
+	      + bx->s.bginv[2][2]*v[2];
 }
 
 
@@ -449,7 +482,6 @@ static void free_intcontext(struct intcontext *ic)
 
 	for ( i=0; i<ic->n_boxes; i++ ) {
 		free(ic->boxes[i].bm);
-		gsl_matrix_free(ic->boxes[i].bgm);
 	}
 	free(ic->boxes);
 
@@ -464,6 +496,134 @@ static void free_intcontext(struct intcontext *ic)
 }
 
 
+/* Invert the normal matrix of the background plane fit.  The matrix is
+ * rescaled to have a unit diagonal first, as in solve_svd(), so that the test
+ * for singularity doesn't depend on the box size. */
+static void invert_bgm(struct mask_sums *s)
+{
+	double S[3];
+	double A[3][3];
+	double C[3][3];
+	double det;
+	double lmax = 0.0;
+	int i, j;
+
+	s->bg_singular = 1;
+
+	for ( i=0; i<3; i++ ) {
+		if ( !(s->bgm[i][i] > 0.0) ) return;
+		S[i] = pow(s->bgm[i][i], -0.5);
+	}
+
+	/* Rescale, and find an upper bound on the largest eigenvalue
+	 * (Gershgorin) */
+	for ( i=0; i<3; i++ ) {
+		double row = 0.0;
+		for ( j=0; j<3; j++ ) {
+			A[i][j] = S[i]*s->bgm[i][j]*S[j];
+			row += fabs(A[i][j]);
+		}
+		if ( row > lmax ) lmax = row;
+	}
+
+	/* Cofactors (the matrix is symmetric, so no need to transpose) */
+	C[0][0] = A[1][1]*A[2][2] - A[1][2]*A[2][1];
+	C[0][1] = A[1][2]*A[2][0] - A[1][0]*A[2][2];
+	C[0][2] = A[1][0]*A[2][1] - A[1][1]*A[2][0];
+	C[1][1] = A[0][0]*A[2][2] - A[0][2]*A[2][0];
+	C[1][2] = A[0][1]*A[2][0] - A[0][0]*A[2][1];
+	C[2][2] = A[0][0]*A[1][1] - A[0][1]*A[1][0];
+	C[1][0] = C[0][1];
+	C[2][0] = C[0][2];
+	C[2][1] = C[1][2];
+
+	det = A[0][0]*C[0][0] + A[0][1]*C[0][1] + A[0][2]*C[0][2];
+
+	/* The matrix must be positive definite (the leading minors are 1,
+	 * C[2][2] and det), and the smallest eigenvalue is at least
+	 * 1/trace(A^-1).  If that isn't enough to be sure that solve_svd()
+	 * would not filter any eigenvalues, the background pixels are (nearly)
+	 * in a straight line.  Leave it to solve_svd() to find the least
+	 * squares solution. */
+	if ( !(det > 0.0) || !(C[2][2] > 0.0) ) return;
+	if ( det/(C[0][0]+C[1][1]+C[2][2]) < lmax/BG_MAX_CONDITION ) return;
+
+	for ( i=0; i<3; i++ ) {
+	for ( j=0; j<3; j++ ) {
+		s->bginv[i][j] = S[i]*C[i][j]*S[j]/det;
+	}
+	}
+
+	s->bg_singular = 0;
+}
+
+
+static void calc_mask_sums(struct intcontext *ic, const enum boxmask_val *bm,
+                           struct mask_sums *s)
+{
+	int p, q;
+	double bg_n = 0.0;
+	double bg_p = 0.0;
+	double bg_q = 0.0;
+	double bg_p2 = 0.0;
+	double bg_q2 = 0.0;
+	double bg_pq = 0.0;
+
+	s->pks_p2 = 0.0;
+	s->pks_q2 = 0.0;
+	s->pks_pq = 0.0;
+	s->pks_p = 0.0;
+	s->pks_q = 0.0;
+	s->m = 0;
+
+	/* Sums along each row first, without branches, then over the rows */
+	for ( q=0; q<ic->w; q++ ) {
+
+		const enum boxmask_val *row = bm + ic->w*q;
+		int rbn = 0, rbp = 0, rbp2 = 0;
+		int rpn = 0, rpp = 0, rpp2 = 0;
+
+		for ( p=0; p<ic->w; p++ ) {
+			int isbg = (row[p] == BM_BG);
+			int ispk = (row[p] == BM_PK);
+			rbn += isbg;
+			rbp += isbg*p;
+			rbp2 += isbg*p*p;
+			rpn += ispk;
+			rpp += ispk*p;
+			rpp2 += ispk*p*p;
+		}
+
+		bg_n += rbn;
+		bg_p += rbp;
+		bg_q += rbn*q;
+		bg_p2 += rbp2;
+		bg_q2 += rbn*q*q;
+		bg_pq += rbp*q;
+
+		s->pks_p2 += rpp2;
+		s->pks_q2 += rpn*q*q;
+		s->pks_pq += rpp*q;
+		s->pks_p += rpp;
+		s->pks_q += rpn*q;
+		s->m += rpn;
+
+	}
+
+	s->bgm[0][0] = bg_p2;
+	s->bgm[0][1] = bg_pq;
+	s->bgm[0][2] = bg_p;
+	s->bgm[1][0] = bg_pq;
+	s->bgm[1][1] = bg_q2;
+	s->bgm[1][2] = bg_q;
+	s->bgm[2][0] = bg_p;
+	s->bgm[2][1] = bg_q;
+	s->bgm[2][2] = bg_n;
+
+	invert_bgm(s);
+}
+
+
 static void setup_ring_masks(struct intcontext *ic,
                              double ir_inn, double ir_mid, double ir_out)
 {
@@ -502,6 +662,7 @@ static void setup_ring_masks(struct intcontext *ic,
 	}
 	}
 
+	calc_mask_sums(ic, ic->bm, &ic->sums);
 }
 
 
@@ -531,12 +692,6 @@ static struct peak_box *add_box(struct intcontext *ic)
 	ic->boxes[idx].rp = -1;
 	ic->boxes[idx].refl = NULL;
 
-	ic->boxes[idx].bgm = gsl_matrix_calloc(3, 3);
-	if ( ic->boxes[idx].bgm == NULL ) {
-		ERROR("Failed to initialise matrix.\n");
-		return NULL;
-	}
-
 	return &ic->boxes[idx];
 }
 
@@ -559,7 +714,6 @@ static void delete_box(struct intcontext *ic, struct peak_box *bx)
 	}
 
 	free(bx->bm);
-	gsl_matrix_free(bx->bgm);
 
 	memmove(&ic->boxes[i], &ic->boxes[i+1],
 	        (ic->n_boxes-i-1)*sizeof(struct peak_box));
@@ -581,9 +735,9 @@ static double tentative_intensity(struct intcontext *ic, struct peak_box *bx)
 	}
 	}
 
-	intensity -= bx->a * bx->pks_p;
-	intensity -= bx->b * bx->pks_q;
-	intensity -= bx->c * bx->m;
+	intensity -= bx->a * bx->s.pks_p;
+	intensity -= bx->b * bx->s.pks_q;
+	intensity -= bx->c * bx->s.m;
 
 	return intensity;
 }
@@ -611,9 +765,9 @@ static void UNUSED observed_position(struct intcontext *ic, struct peak_box *bx,
 	}
 	}
 
-	num_p += -bx->a*bx->pks_p2 - bx->b*bx->pks_pq - bx->c*bx->pks_p;
-	num_q += -bx->a*bx->pks_q2 - bx->b*bx->pks_pq - bx->c*bx->pks_q;
-	den += -bx->a*bx->pks_p - bx->b*bx->pks_q - bx->c;
+	num_p += -bx->a*bx->s.pks_p2 - bx->b*bx->s.pks_pq - bx->c*bx->s.pks_p;
+	num_q += -bx->a*bx->s.pks_q2 - bx->b*bx->s.pks_pq - bx->c*bx->s.pks_q;
+	den += -bx->a*bx->s.pks_p - bx->b*bx->s.pks_q - bx->c;
 
 	*pos_p = num_p / den;
 	*pos_q = num_q / den;
@@ -687,69 +841,12 @@ static void calculate_reference_profiles(struct intcontext *ic)
 }
 
 
-static void setup_peak_integrals(struct intcontext *ic, struct peak_box *bx)
-{
-	int p, q;
-
-	bx->pks_p2 = 0.0;
-	bx->pks_q2 = 0.0;
-	bx->pks_pq = 0.0;
-	bx->pks_p = 0.0;
-	bx->pks_q = 0.0;
-	bx->m = 0;
-
-	gsl_matrix_set(bx->bgm, 0, 0, 0.0);
-	gsl_matrix_set(bx->bgm, 0, 1, 0.0);
-	gsl_matrix_set(bx->bgm, 0, 2, 0.0);
-	gsl_matrix_set(bx->bgm, 1, 0, 0.0);
-	gsl_matrix_set(bx->bgm, 1, 1, 0.0);
-	gsl_matrix_set(bx->bgm, 1, 2, 0.0);
-	gsl_matrix_set(bx->bgm, 2, 0, 0.0);
-	gsl_matrix_set(bx->bgm, 2, 1, 0.0);
-	gsl_matrix_set(bx->bgm, 2, 2, 0.0);
-
-	for ( p=0; p<ic->w; p++ ) {
-	for ( q=0; q<ic->w; q++ ) {
-
-		switch ( bx->bm[p + ic->w*q] ) {
-
-			case BM_IG :
-			case BM_BH :
-			break;
-
-			case BM_BG :
-			addm(bx->bgm, 0, 0, p*p);
-			addm(bx->bgm, 0, 1, p*q);
-			addm(bx->bgm, 0, 2, p);
-			addm(bx->bgm, 1, 0, p*q);
-			addm(bx->bgm, 1, 1, q*q);
-			addm(bx->bgm, 1, 2, q);
-			addm(bx->bgm, 2, 0, p);
-			addm(bx->bgm, 2, 1, q);
-			addm(bx->bgm, 2, 2, 1);
-			break;
-
-			case BM_PK :
-			bx->pks_p2 += p*p;
-			bx->pks_q2 += q*q;
-			bx->pks_pq += p*q;
-			bx->pks_p += p;
-			bx->pks_q += q;
-			bx->m++;
-			break;
-
-		}
-
-	}
-	}
-}
-
-
 static int check_box(struct intcontext *ic, struct peak_box *bx, int *sat)
 {
 	int p, q;
 	int n_pk = 0;
 	int n_bg = 0;
+	int changed = 0;
 	double adx, ady, adz;
 	double bdx, bdy, bdz;
 	double cdx, cdy, cdz;
@@ -844,11 +941,16 @@ static int check_box(struct intcontext *ic, struct peak_box *bx, int *sat)
 
 		if ( bx->bm[p+ic->w*q] == BM_PK ) n_pk++;
 		if ( bx->bm[p+ic->w*q] == BM_BG ) n_bg++;
+		if ( bx->bm[p+ic->w*q] != ic->bm[p+ic->w*q] ) changed = 1;
 
 	}
 	}
 
-	setup_peak_integrals(ic, bx);
+	if ( changed ) {
+		calc_mask_sums(ic, bx->bm, &bx->s);
+	} else {
+		bx->s = ic->sums;
+	}
 
 	if ( n_pk < 4 ) return 1;
 	if ( n_bg < 4 ) return 1;
@@ -990,46 +1092,43 @@ static double calc_sigma(struct intcontext *ic, struct peak_box *bx)
 	double mb = 0.0;
 	int nb = 0;
 	double sigb2 = 0.0;
+	const double *prof = ic->reference_profiles[bx->rp];
 
-	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
 
-		double bi;
-
-		bi = boxi(ic, bx, p, q);
+		const float *row = box_row(ic, bx, q);
+		const enum boxmask_val *bm = bx->bm + ic->w*q;
+		const double *prow = prof + ic->w*q;
 
-		if ( bx->bm[p + ic->w*q] == BM_PK ) {
-
-			double p1, p2;
-
-			p1 = bx->J * ic->reference_profiles[bx->rp][p+ic->w*q];
-
-			p2 = bi - bx->a*p - bx->b*q - bx->c;
-			sum += pow(p1-p2, 2.0);
+		for ( p=0; p<ic->w; p++ ) {
 
-		} else if ( bx->bm[p + ic->w*q] == BM_BG ) {
+			double bi = row[p];
+			int ispk = (bm[p] == BM_PK);
+			int isbg = (bm[p] == BM_BG);
+			double d;
 
-			mb += bi;
-			nb++;
+			d = bx->J*prow[p] - (bi - bx->a*p - bx->b*q - bx->c);
+			sum += ispk ? d*d : 0.0;
+			mb += isbg ? bi : 0.0;
+			nb += isbg;
 
 		}
 
 	}
-	}
 
 	mb /= nb;
 
-	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
 
-		double bi;
+		const float *row = box_row(ic, bx, q);
+		const enum boxmask_val *bm = bx->bm + ic->w*q;
 
-		if ( bx->bm[p + ic->w*q] != BM_BG ) continue;
-		bi = boxi(ic, bx, p, q);
-		sigb2 += pow(bi - mb, 2.0);
+		for ( p=0; p<ic->w; p++ ) {
+			double d = row[p] - mb;
+			sigb2 += (bm[p] == BM_BG) ? d*d : 0.0;
+		}
 
 	}
-	}
 
 	return sqrt(sum + sigb2);
 }
@@ -1211,6 +1310,23 @@ static void integrate_prof2d_once(struct intcontext *ic, struct peak_box *bx,
 }
 
 
+/* The number of the panel which "refl" is on, using the panel found when it
+ * was predicted if possible */
+static signed int refl_panel_number(struct detector *det, Reflection *refl,
+                                    int fs, int ss)
+{
+	struct panel *p = get_panel(refl);
+
+	/* Only if the panel belongs to this copy of the geometry */
+	if ( p != NULL ) {
+		signed int pn = p - det->panels;
+		if ( (pn >= 0) && (pn < det->n_panels) ) return pn;
+	}
+
+	return find_panel_number(det, fs, ss);
+}
+
+
 static void setup_profile_boxes(struct intcontext *ic, RefList *list)
 {
 	Reflection *refl;
@@ -1242,7 +1358,7 @@ static void setup_profile_boxes(struct intcontext *ic, RefList *list)
 		 * belongs to pixel index 2. */
 		fid_fs = pfs;
 		fid_ss = pss;
-		pn = find_panel_number(ic->image->det, fid_fs, fid_ss);
+		pn = refl_panel_number(ic->image->det, refl, fid_fs, fid_ss);
 		p = &ic->image->det->panels[pn];
 
 		cfs = (fid_fs-p->min_fs) - ic->halfw;
@@ -1378,7 +1494,7 @@ static void integrate_rings_once(Reflection *refl, struct image *image,
 	 * belongs to pixel index 2. */
 	fid_fs = pfs;
 	fid_ss = pss;
-	pn = find_panel_number(image->det, fid_fs, fid_ss);
+	pn = refl_panel_number(image->det, refl, fid_fs, fid_ss);
 	p = &image->det->panels[pn];
 
 	cfs = (fid_fs-p->min_fs) - ic->halfw;
@@ -1434,7 +1550,7 @@ static void integrate_rings_once(Reflection *refl, struct image *image,
 		sig2_poisson = -aduph*intensity;
 	}
 
-	sigma = sqrt(sig2_poisson + bx->m*sig2_bg);
+	sigma = sqrt(sig2_poisson + bx->s.m*sig2_bg);
 
 	/* Record intensity and set redundancy to 1 */
 	bx->intensity = intensity;
@@ -1468,10 +1584,44 @@ static int compare_double(const void *av, const void *bv)
 }
 
 
+/* Finds the indices of the reciprocal lattice point nearest to peak number "i"
+ * in "flist".  Returns zero if there is no peak with that number or if it is
+ * not close enough to any lattice point. */
+static int nearest_indices(UnitCell *cell, ImageFeatureList *flist, int i,
+                           signed int *h, signed int *k, signed int *l)
+{
+	struct imagefeature *f;
+	const double min_dist = 0.25;
+	double hd, kd, ld;
+	double ax, ay, az;
+	double bx, by, bz;
+	double cx, cy, cz;
+
+	/* Assume all image "features" are genuine peaks */
+	f = image_get_feature(flist, i);
+	if ( f == NULL ) return 0;
+
+	cell_get_cartesian(cell, &ax, &ay, &az, &bx, &by, &bz, &cx, &cy, &cz);
+
+	/* Decimal and fractional Miller indices of nearest
+	 * reciprocal lattice point */
+	hd = f->rx * ax + f->ry * ay + f->rz * az;
+	kd = f->rx * bx + f->ry * by + f->rz * bz;
+	ld = f->rx * cx + f->ry * cy + f->rz * cz;
+	*h = lrint(hd);
+	*k = lrint(kd);
+	*l = lrint(ld);
+
+	/* Check distance */
+	return (fabs(*h - hd) < min_dist)
+	    && (fabs(*k - kd) < min_dist)
+	    && (fabs(*l - ld) < min_dist);
+}
+
+
 static double estimate_resolution(UnitCell *cell, ImageFeatureList *flist)
 {
 	int i;
-	const double min_dist = 0.25;
 	double max_res = 0.0;
 	double *acc;
 	int n_acc = 0;
@@ -1486,34 +1636,9 @@ static double estimate_resolution(UnitCell *cell, ImageFeatureList *flist)
 
 	for ( i=0; i<image_feature_count(flist); i++ ) {
 
-		struct imagefeature *f;
-		double h, k, l, hd, kd, ld;
-
-		/* Assume all image "features" are genuine peaks */
-		f = image_get_feature(flist, i);
-		if ( f == NULL ) continue;
-
-		double ax, ay, az;
-		double bx, by, bz;
-		double cx, cy, cz;
-
-		cell_get_cartesian(cell,
-		                   &ax, &ay, &az, &bx, &by, &bz, &cx, &cy, &cz);
-
-		/* Decimal and fractional Miller indices of nearest
-		 * reciprocal lattice point */
-		hd = f->rx * ax + f->ry * ay + f->rz * az;
-		kd = f->rx * bx + f->ry * by + f->rz * bz;
-		ld = f->rx * cx + f->ry * cy + f->rz * cz;
-		h = lrint(hd);
-		k = lrint(kd);
-		l = lrint(ld);
+		signed int h, k, l;
 
-		/* Check distance */
-		if ( (fabs(h - hd) < min_dist)
-		  && (fabs(k - kd) < min_dist)
-		  && (fabs(l - ld) < min_dist) )
-		{
+		if ( nearest_indices(cell, flist, i, &h, &k, &l) ) {
 			double res = 2.0*resolution(cell, h, k, l); /* 1/d */
 			acc[n_acc++] = res;
 			if ( n_acc == max_acc ) {
@@ -1605,7 +1730,7 @@ void integrate_all_4(struct image *image, IntegrationMethod meth,
                      int results_pipe)
 {
 	int i;
-	int *masks[image->det->n_panels];
+	int **masks;
 
 	if ( !(meth & INTEGRATION_RESCUT) ) push_res = +INFINITY;
 
@@ -1625,8 +1750,10 @@ void integrate_all_4(struct image *image, IntegrationMethod meth,
 
 	}
 
-	for ( i=0; i<image->det->n_panels; i++ ) {
-		masks[i] = make_BgMask(image, &image->det->panels[i], ir_inn);
+	masks = make_BgMasks(image, ir_inn);
+	if ( masks == NULL ) {
+		ERROR("Failed to allocate background masks.\n");
+		return;
 	}
 
 	for ( i=0; i<image->n_crystals; i++ ) {
@@ -1663,6 +1790,68 @@ void integrate_all_4(struct image *image, IntegrationMethod meth,
 	for ( i=0; i<image->det->n_panels; i++ ) {
 		free(masks[i]);
 	}
+	free(masks);
+}
+
+
+/* The indices of the lattice points nearest to the peaks in "flist" */
+static RefList *peak_indices(UnitCell *cell, ImageFeatureList *flist)
+{
+	RefList *list;
+	int i;
+
+	list = reflist_new();
+	if ( list == NULL ) return NULL;
+
+	for ( i=0; i<image_feature_count(flist); i++ ) {
+
+		signed int h, k, l;
+
+		if ( !nearest_indices(cell, flist, i, &h, &k, &l) ) continue;
+		if ( find_refl(list, h, k, l) != NULL ) continue;
+		add_refl(list, h, k, l);
+
+	}
+
+	return list;
+}
+
+
+/* Predicts only the reflections nearest to the peaks in image->features, for
+ * example to refine the profile radius before calling integrate_all_4().  The
+ * resolution limit is the same as in integrate_all_4(), and the predicted
+ * reflections are the same as the corresponding ones which it would predict.
+ * No integration is done. */
+void predict_near_peaks(struct image *image, IntegrationMethod meth,
+                        PartialityModel pmodel, double push_res)
+{
+	int i;
+
+	if ( !(meth & INTEGRATION_RESCUT) ) push_res = +INFINITY;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+
+		RefList *list;
+		RefList *peaks;
+		UnitCell *cell;
+		double res;
+
+		cell = crystal_get_cell(image->crystals[i]);
+		res = estimate_resolution(cell, image->features);
+		crystal_set_resolution_limit(image->crystals[i], res);
+
+		peaks = peak_indices(cell, image->features);
+		if ( peaks == NULL ) {
+			crystal_set_reflections(image->crystals[i], NULL);
+			continue;
+		}
+
+		list = find_listed_intersections(image, image->crystals[i],
+		                                 pmodel, res+push_res, peaks);
+		crystal_set_reflections(image->crystals[i], list);
+		reflist_free(peaks);
+
+	}
 }
 
 
@@ -129,6 +129,9 @@ extern void integrate_all_4(struct image *image, IntegrationMethod meth,
                             signed int idh, signed int idk, signed int idl,
                             int results_pipe);
 
+extern void predict_near_peaks(struct image *image, IntegrationMethod meth,
+                               PartialityModel pmodel, double push_res);
+
 
 #ifdef __cplusplus
 }
@@ -720,6 +720,8 @@ int run_mosflm(struct image *image, IndexingPrivate *ipriv)
 	unsigned int opts;
 	int status;
 	int rval;
+	char *filename;
+	char *newmat;
 
 	mosflm = malloc(sizeof(struct mosflm_data));
 	if ( mosflm == NULL ) {
@@ -727,19 +729,31 @@ int run_mosflm(struct image *image, IndexingPrivate *ipriv)
 		return 0;
 	}
 
+	/* These names are relative to the temporary folder, which is where
+	 * MOSFLM will be running */
 	snprintf(mosflm->imagefile, 127, "xfel-%i_001.img", image->id);
-	write_img(image, mosflm->imagefile); /* Dummy image */
+	filename = image_tmp_filename(image, mosflm->imagefile);
+	if ( filename != NULL ) write_img(image, filename); /* Dummy image */
+	free(filename);
 
 	snprintf(mosflm->sptfile, 127, "xfel-%i_001.spt", image->id);
-	write_spt(image, mosflm->sptfile);
+	filename = image_tmp_filename(image, mosflm->sptfile);
+	if ( filename != NULL ) write_spt(image, filename);
+	free(filename);
 
 	snprintf(mosflm->newmatfile, 127, "xfel-%i.newmat", image->id);
-	remove(mosflm->newmatfile);
+	newmat = image_tmp_filename(image, mosflm->newmatfile);
+	if ( newmat == NULL ) {
+		free(mosflm);
+		return 0;
+	}
+	remove(newmat);
 
 	mosflm->pid = forkpty(&mosflm->pty, NULL, NULL, NULL);
 
 	if ( mosflm->pid == -1 ) {
 		ERROR("Failed to fork for MOSFLM: %s\n", strerror(errno));
+		free(newmat);
 		free(mosflm);
 		return 0;
 	}
@@ -753,6 +767,12 @@ int run_mosflm(struct image *image, IndexingPrivate *ipriv)
 		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
 		tcsetattr(STDIN_FILENO, TCSANOW, &t);
 
+		if ( (image->tmpdir != NULL) && chdir(image->tmpdir) ) {
+			ERROR("Failed to chdir to temporary folder: %s\n",
+			      strerror(errno));
+			_exit(0);
+		}
+
 		execlp("ipmosflm", "", (char *)NULL);
 		ERROR("Invocation: Failed to invoke MOSFLM: %s\n",
 		      strerror(errno));
@@ -822,10 +842,11 @@ int run_mosflm(struct image *image, IndexingPrivate *ipriv)
 		ERROR("MOSFLM doesn't seem to be working properly.\n");
 	} else {
 		/* Read the mosflm NEWMAT file and get cell if found */
-		read_newmat(mosflm, mosflm->newmatfile, image);
+		read_newmat(mosflm, newmat, image);
 	}
 
 	rval = mosflm->success;
+	free(newmat);
 	free(mosflm);
 	return rval;
 }
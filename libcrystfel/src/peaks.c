@@ -147,6 +147,56 @@ static int cull_peaks(struct image *image)
 }
 
 
+/* The panel which "refl" is on, preferably without searching for it.  The
+ * panel pointer is only used if it belongs to "det", because the reflection
+ * might have been predicted using a different copy of the geometry. */
+static struct panel *refl_panel(struct detector *det, Reflection *refl,
+                                double fs, double ss)
+{
+	struct panel *p = get_panel(refl);
+
+	if ( p != NULL ) {
+		signed int pn = p - det->panels;
+		if ( (pn >= 0) && (pn < det->n_panels) ) return p;
+	}
+
+	return find_panel(det, fs, ss);
+}
+
+
+static void add_refl_to_mask(struct panel *p, double ir_inn, int w, int h,
+                             int *mask, double pk2_fs, double pk2_ss)
+{
+	signed int dfs, dss;
+	double pk2_cfs, pk2_css;
+
+	pk2_cfs = pk2_fs - p->min_fs;
+	pk2_css = pk2_ss - p->min_ss;
+
+	for ( dfs=-ir_inn; dfs<=ir_inn; dfs++ ) {
+	for ( dss=-ir_inn; dss<=ir_inn; dss++ ) {
+
+		signed int fs, ss;
+
+		/* In peak region for this peak? */
+		if ( dfs*dfs + dss*dss > ir_inn*ir_inn ) continue;
+
+		fs = pk2_cfs + dfs;
+		ss = pk2_css + dss;
+
+		/* On panel? */
+		if ( fs >= w ) continue;
+		if ( ss >= h ) continue;
+		if ( fs < 0 ) continue;
+		if ( ss < 0 ) continue;
+
+		mask[fs + ss*w]++;
+
+	}
+	}
+}
+
+
 static void add_crystal_to_mask(struct image *image, struct panel *p,
                                 double ir_inn, int w, int h,
                                 int *mask, Crystal *cr)
@@ -159,41 +209,14 @@ static void add_crystal_to_mask(struct image *image, struct panel *p,
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		struct panel *p2;
 		double pk2_fs, pk2_ss;
-		signed int dfs, dss;
-		double pk2_cfs, pk2_css;
 
 		get_detector_pos(refl, &pk2_fs, &pk2_ss);
 
 		/* Determine if reflection is in the same panel */
-		p2 = find_panel(image->det, pk2_fs, pk2_ss);
-		if ( p2 != p ) continue;
-
-		pk2_cfs = pk2_fs - p->min_fs;
-		pk2_css = pk2_ss - p->min_ss;
-
-		for ( dfs=-ir_inn; dfs<=ir_inn; dfs++ ) {
-		for ( dss=-ir_inn; dss<=ir_inn; dss++ ) {
-
-			signed int fs, ss;
-
-			/* In peak region for this peak? */
-			if ( dfs*dfs + dss*dss > ir_inn*ir_inn ) continue;
-
-			fs = pk2_cfs + dfs;
-			ss = pk2_css + dss;
+		if ( refl_panel(image->det, refl, pk2_fs, pk2_ss) != p ) continue;
 
-			/* On panel? */
-			if ( fs >= w ) continue;
-			if ( ss >= h ) continue;
-			if ( fs < 0 ) continue;
-			if ( ss < 0 ) continue;
-
-			mask[fs + ss*w]++;
-
-		}
-		}
+		add_refl_to_mask(p, ir_inn, w, h, mask, pk2_fs, pk2_ss);
 
 	}
 }
@@ -222,6 +245,67 @@ int *make_BgMask(struct image *image, struct panel *p, double ir_inn)
 }
 
 
+/* Like make_BgMask(), but makes the masks for all the panels at once, going
+ * through the reflections only once.  Returns an array of one mask per panel,
+ * which should be freed along with each of the masks. */
+int **make_BgMasks(struct image *image, double ir_inn)
+{
+	int **masks;
+	int i;
+
+	masks = malloc(image->det->n_panels*sizeof(int *));
+	if ( masks == NULL ) return NULL;
+
+	for ( i=0; i<image->det->n_panels; i++ ) {
+
+		struct panel *p = &image->det->panels[i];
+		int w, h;
+
+		w = p->max_fs - p->min_fs + 1;
+		h = p->max_ss - p->min_ss + 1;
+		masks[i] = calloc(w*h, sizeof(int));
+		if ( masks[i] == NULL ) {
+			int j;
+			for ( j=0; j<i; j++ ) free(masks[j]);
+			free(masks);
+			return NULL;
+		}
+
+	}
+
+	if ( image->crystals == NULL ) return masks;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+
+		Reflection *refl;
+		RefListIterator *iter;
+		RefList *list = crystal_get_reflections(image->crystals[i]);
+
+		for ( refl = first_refl(list, &iter);
+		      refl != NULL;
+		      refl = next_refl(refl, iter) )
+		{
+			double fs, ss;
+			struct panel *p;
+			int pn;
+
+			get_detector_pos(refl, &fs, &ss);
+			p = refl_panel(image->det, refl, fs, ss);
+			if ( p == NULL ) continue;
+
+			pn = p - image->det->panels;
+			add_refl_to_mask(p, ir_inn,
+			                 p->max_fs - p->min_fs + 1,
+			                 p->max_ss - p->min_ss + 1,
+			                 masks[pn], fs, ss);
+		}
+
+	}
+
+	return masks;
+}
+
+
 /* Returns non-zero if peak has been vetoed.
  * i.e. don't use result if return value is not zero. */
 static int integrate_peak(struct image *image, int cfs, int css,
@@ -43,6 +43,7 @@ extern "C" {
 #endif
 
 extern int *make_BgMask(struct image *image, struct panel *p, double ir_inn);
+extern int **make_BgMasks(struct image *image, double ir_inn);
 
 extern void search_peaks(struct image *image, float threshold,
                          float min_gradient, float min_snr,
@@ -451,6 +451,7 @@ RefList *asymmetric_indices(RefList *in, const SymOpList *sym)
 
 	new = reflist_new();
 	if ( new == NULL ) return NULL;
+	reflist_reserve(new, num_reflections(in));
 
 	for ( refl = first_refl(in, &iter);
 	      refl != NULL;
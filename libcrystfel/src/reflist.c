@@ -28,6 +28,7 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <stdio.h>
 #include <pthread.h>
 
@@ -48,6 +49,16 @@
  * length of time which scales logarithmically with the number of reflections in
  * the list.
  *
+ * Alternatively, a list created with reflist_new_2() and %REFLIST_HASH keeps
+ * its reflections in a hash table, where any reflection can be found in
+ * constant time but iteration happens in order of insertion rather than of
+ * indices.  A list of either type which is about to be searched many times
+ * without being changed can be "frozen" with reflist_freeze(), after which
+ * searches use a compact sorted array.
+ *
+ * The reflections in a list are allocated in blocks belonging to the list,
+ * and all freed together by reflist_free().
+ *
  * A RefList can contain any number of reflections, and can store more than
  * one reflection with a given set of indices, for example when two distinct
  * reflections are to be stored according to their asymmetric indices.
@@ -75,6 +86,7 @@ struct _refldata {
 	/* Location in image */
 	double fs;
 	double ss;
+	struct panel *panel;  /* Panel containing the location, or NULL */
 
 	/* The distance from the exact Bragg position to the coordinates
 	 * given above. */
@@ -122,35 +134,164 @@ struct _reflection {
 	struct _reflection *next;     /* Next and previous in doubly linked */
 	struct _reflection *prev;     /*  list of duplicate reflections */
 	enum _nodecol col;            /* Colour (red or black) */
+	int in_block;                 /* Non-zero if allocated by the list */
 
 	/* Payload */
-	pthread_mutex_t lock;         /* Protects the contents of "data" */
 	struct _refldata data;
 };
 
 
+/* Locks for the contents of reflections, shared between reflections according
+ * to their addresses.  This saves having one in every reflection. */
+#define N_REFL_LOCKS (1024)
+static pthread_mutex_t refl_locks[N_REFL_LOCKS];
+static pthread_once_t refl_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_refl_locks(void)
+{
+	int i;
+	for ( i=0; i<N_REFL_LOCKS; i++ ) {
+		pthread_mutex_init(&refl_locks[i], NULL);
+	}
+}
+
+
+static pthread_mutex_t *refl_lock(Reflection *refl)
+{
+	unsigned long i = (unsigned long)refl / sizeof(struct _reflection);
+
+	pthread_once(&refl_locks_once, init_refl_locks);
+	return &refl_locks[i % N_REFL_LOCKS];
+}
+
+
+/* A block of reflections, allocated all at once */
+struct _reflblock {
+
+	struct _reflblock *next;
+	int n_used;
+	int n_alloc;
+	struct _reflection refls[];
+
+};
+
+
+/* Sizes of the blocks, which double each time up to the maximum.  The maximum
+ * is kept small so that not too much is wasted at the end of the last block,
+ * since there are often very many lists of a few thousand reflections. */
+#define REFL_BLOCK_MIN (16)
+#define REFL_BLOCK_MAX (64)
+
+
 struct _reflist {
 
+	RefListType type;
+	int n_reflections;
+
+	/* Most recently allocated block first */
+	struct _reflblock *blocks;
+
+	/* Number of reflections which were created separately with
+	 * reflection_new() and added with add_refl_to_list() */
+	int n_foreign;
+
+	/* For REFLIST_TREE */
 	struct _reflection *head;
 	struct _reflection *tail;
 
+	/* For REFLIST_HASH.  The table contains the first reflection with each
+	 * set of indices, and "heads" contains the same in order of insertion.
+	 * The table is never more than half full. */
+	struct _reflection **table;
+	int table_bits;
+	struct _reflection **heads;
+	int n_heads;
+
+	/* After reflist_freeze(), the first reflection with each set of
+	 * indices in order of serial number, and the serial numbers */
+	struct _reflection **frozen;
+	unsigned int *frozen_serials;
+	int n_frozen;
+
 };
 
 
-/**************************** Creation / deletion *****************************/
+#define HASH_INITIAL_BITS (10)
 
-static Reflection *new_node(unsigned int serial)
+static inline unsigned int hash_serial(unsigned int serial, int bits)
 {
-	Reflection *new;
+	return (serial * 2654435761U) >> (32 - bits);
+}
 
-	new = calloc(1, sizeof(struct _reflection));
+
+/**************************** Creation / deletion *****************************/
+
+static void init_node(Reflection *new, unsigned int serial)
+{
 	new->serial = serial;
 	new->next = NULL;
 	new->prev = NULL;
 	new->child[0] = NULL;
 	new->child[1] = NULL;
 	new->col = RED;
-	pthread_mutex_init(&new->lock, NULL);
+}
+
+
+static Reflection *new_node(unsigned int serial)
+{
+	Reflection *new;
+
+	new = calloc(1, sizeof(struct _reflection));
+	if ( new == NULL ) return NULL;
+	init_node(new, serial);
+	new->in_block = 0;
+
+	return new;
+}
+
+
+static struct _reflblock *new_block(RefList *list, int n)
+{
+	struct _reflblock *b;
+
+	b = malloc(sizeof(struct _reflblock) + n*sizeof(struct _reflection));
+	if ( b == NULL ) return NULL;
+
+	b->next = list->blocks;
+	b->n_used = 0;
+	b->n_alloc = n;
+	list->blocks = b;
+
+	return b;
+}
+
+
+/* Like new_node(), but takes the reflection from the list's own blocks */
+static Reflection *new_node_in_list(RefList *list, unsigned int serial)
+{
+	Reflection *new;
+	struct _reflblock *b = list->blocks;
+
+	if ( (b == NULL) || (b->n_used == b->n_alloc) ) {
+
+		int n;
+
+		if ( b == NULL ) {
+			n = REFL_BLOCK_MIN;
+		} else {
+			n = 2*b->n_alloc;
+			if ( n > REFL_BLOCK_MAX ) n = REFL_BLOCK_MAX;
+		}
+
+		b = new_block(list, n);
+		if ( b == NULL ) return NULL;
+
+	}
+
+	new = &b->refls[b->n_used++];
+	memset(new, 0, sizeof(struct _reflection));
+	init_node(new, serial);
+	new->in_block = 1;
 
 	return new;
 }
@@ -159,23 +300,86 @@ static Reflection *new_node(unsigned int serial)
 /**
  * reflist_new:
  *
- * Creates a new reflection list.
+ * Creates a new reflection list, represented internally as an RB-tree.
  *
  * Returns: the new reflection list, or NULL on error.
  */
 RefList *reflist_new()
+{
+	return reflist_new_2(REFLIST_TREE);
+}
+
+
+/**
+ * reflist_new_2:
+ * @type: A %RefListType
+ *
+ * Creates a new reflection list with the given internal representation.  The
+ * public interface is the same whichever type is used, but a %REFLIST_HASH
+ * list has faster insertion and searching at the cost of more memory, and is
+ * not iterated in order of indices.
+ *
+ * Returns: the new reflection list, or NULL on error.
+ */
+RefList *reflist_new_2(RefListType type)
 {
 	RefList *new;
 
 	new = malloc(sizeof(struct _reflist));
 	if ( new == NULL ) return NULL;
 
+	new->type = type;
+	new->n_reflections = 0;
+	new->blocks = NULL;
+	new->n_foreign = 0;
 	new->head = NULL;
+	new->tail = NULL;
+	new->table = NULL;
+	new->table_bits = 0;
+	new->heads = NULL;
+	new->n_heads = 0;
+	new->frozen = NULL;
+	new->frozen_serials = NULL;
+	new->n_frozen = 0;
+
+	if ( type == REFLIST_HASH ) {
+		new->table_bits = HASH_INITIAL_BITS;
+		new->table = calloc(1<<new->table_bits, sizeof(Reflection *));
+		new->heads = malloc((1<<(new->table_bits-1))
+		                    * sizeof(Reflection *));
+		if ( (new->table == NULL) || (new->heads == NULL) ) {
+			free(new->table);
+			free(new->heads);
+			free(new);
+			return NULL;
+		}
+	}
 
 	return new;
 }
 
 
+/**
+ * reflist_reserve:
+ * @list: A %RefList
+ * @n: The number of reflections which are about to be added
+ *
+ * Allocates space for @n more reflections in @list, all in one block.  Calling
+ * this function is never necessary, but it saves time and memory if the number
+ * of reflections is known in advance, for example when reading a stream.
+ */
+void reflist_reserve(RefList *list, int n)
+{
+	struct _reflblock *b = list->blocks;
+
+	if ( (b != NULL) && (b->n_alloc - b->n_used >= n) ) return;
+	if ( n <= 0 ) return;
+
+	/* Any space left in the current block will not be used */
+	new_block(list, n);
+}
+
+
 /**
  * reflection_new:
  * @h: The h index of the new reflection
@@ -195,28 +399,46 @@ Reflection *reflection_new(signed int h, signed int k, signed int l)
  * reflection_free:
  * @refl: The reflection to free.
  *
- * Destroys an individual reflection.
+ * Destroys an individual reflection.  This must not be used for reflections
+ * which were created by add_refl(), which will be freed along with their list.
  */
 void reflection_free(Reflection *refl)
 {
-	pthread_mutex_destroy(&refl->lock);
+	assert(!refl->in_block);
 	free(refl);
 }
 
 
-static void recursive_free(Reflection *refl)
+/* Frees the reflections which don't belong to the list's blocks */
+static void free_duplicates(Reflection *refl)
 {
-	if ( refl->child[0] != NULL ) recursive_free(refl->child[0]);
-	if ( refl->child[1] != NULL ) recursive_free(refl->child[1]);
-
 	while ( refl != NULL ) {
 		Reflection *next = refl->next;
-		reflection_free(refl);
+		if ( !refl->in_block ) reflection_free(refl);
 		refl = next;
 	}
 }
 
 
+static void recursive_free(Reflection *refl)
+{
+	if ( refl->child[0] != NULL ) recursive_free(refl->child[0]);
+	if ( refl->child[1] != NULL ) recursive_free(refl->child[1]);
+
+	free_duplicates(refl);
+}
+
+
+static void unfreeze(RefList *list)
+{
+	free(list->frozen);
+	free(list->frozen_serials);
+	list->frozen = NULL;
+	list->frozen_serials = NULL;
+	list->n_frozen = 0;
+}
+
+
 /**
  * reflist_free:
  * @list: The reflection list to free.
@@ -225,10 +447,32 @@ static void recursive_free(Reflection *refl)
  */
 void reflist_free(RefList *list)
 {
+	int i;
+	struct _reflblock *b;
+
 	if ( list == NULL ) return;
-	if ( list->head != NULL ) {
-		recursive_free(list->head);
-	} /* else empty list */
+
+	/* Only need to visit every reflection if some of them were allocated
+	 * separately */
+	if ( list->n_foreign > 0 ) {
+		if ( list->head != NULL ) {
+			recursive_free(list->head);
+		} /* else empty list */
+		for ( i=0; i<list->n_heads; i++ ) {
+			free_duplicates(list->heads[i]);
+		}
+	}
+
+	b = list->blocks;
+	while ( b != NULL ) {
+		struct _reflblock *next = b->next;
+		free(b);
+		b = next;
+	}
+
+	unfreeze(list);
+	free(list->table);
+	free(list->heads);
 	free(list);
 }
 
@@ -250,14 +494,50 @@ void reflist_free(RefList *list)
  * Returns: The found reflection, or NULL if no reflection with the given
  * indices could be found.
  **/
+static Reflection *find_frozen(const RefList *list, unsigned int search)
+{
+	int lo = 0;
+	int hi = list->n_frozen;
+
+	while ( lo < hi ) {
+		int mid = (lo+hi)/2;
+		if ( list->frozen_serials[mid] < search ) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if ( (lo < list->n_frozen) && (list->frozen_serials[lo] == search) ) {
+		return list->frozen[lo];
+	}
+	return NULL;
+}
+
+
+/* Returns the table slot for "search", which is either empty or contains a
+ * reflection with the same serial number */
+static Reflection **hash_slot(const RefList *list, unsigned int search)
+{
+	unsigned int mask = (1U << list->table_bits) - 1;
+	unsigned int pos = hash_serial(search, list->table_bits);
+
+	while ( (list->table[pos] != NULL)
+	     && (list->table[pos]->serial != search) )
+	{
+		pos = (pos+1) & mask;
+	}
+
+	return &list->table[pos];
+}
+
+
 Reflection *find_refl(const RefList *list,
                       signed int h, signed int k, signed int l)
 {
 	unsigned int search = SERIAL(h, k, l);
 	Reflection *refl;
 
-	if ( list->head == NULL ) return NULL;
-
 	/* Indices greater than or equal to 512 are filtered out when
 	 * reflections are added, so don't even bother looking.
 	 * (also, looking for such reflections causes trouble because the search
@@ -266,6 +546,11 @@ Reflection *find_refl(const RefList *list,
 	if ( abs(k) >= 512 ) return NULL;
 	if ( abs(l) >= 512 ) return NULL;
 
+	if ( list->frozen != NULL ) return find_frozen(list, search);
+	if ( list->type == REFLIST_HASH ) return *hash_slot(list, search);
+
+	if ( list->head == NULL ) return NULL;
+
 	refl = list->head;
 
 	while ( refl != NULL ) {
@@ -342,6 +627,20 @@ void get_detector_pos(const Reflection *refl, double *fs, double *ss)
 }
 
 
+/**
+ * get_panel:
+ * @refl: A %Reflection
+ *
+ * Returns: the panel which the reflection appears on, as given to set_panel(),
+ * or NULL if this is not known.
+ *
+ **/
+struct panel *get_panel(const Reflection *refl)
+{
+	return refl->data.panel;
+}
+
+
 /**
  * get_indices:
  * @refl: A %Reflection
@@ -583,6 +882,23 @@ void set_detector_pos(Reflection *refl, double exerr, double fs, double ss)
 }
 
 
+/**
+ * set_panel:
+ * @refl: A %Reflection
+ * @p: Pointer to the panel structure on which the reflection appears
+ *
+ * Note that the pointer will be stored, not the contents of the structure, so
+ * the panel must stay valid for as long as the reflection uses it.  The panel
+ * is not changed by set_detector_pos(), so it must be set again if the
+ * reflection moves to a different panel.
+ *
+ **/
+void set_panel(Reflection *refl, struct panel *p)
+{
+	refl->data.panel = p;
+}
+
+
 /**
  * set_partial:
  * @refl: A %Reflection
@@ -831,12 +1147,69 @@ static Reflection *insert_node(Reflection *refl, Reflection *new)
 }
 
 
+static int grow_table(RefList *list)
+{
+	Reflection **old_table = list->table;
+	Reflection **new_heads;
+	int i;
+
+	new_heads = realloc(list->heads,
+	                    (1<<list->table_bits)*sizeof(Reflection *));
+	if ( new_heads == NULL ) return 1;
+	list->heads = new_heads;
+
+	list->table = calloc(1<<(list->table_bits+1), sizeof(Reflection *));
+	if ( list->table == NULL ) {
+		list->table = old_table;
+		return 1;
+	}
+	list->table_bits++;
+
+	for ( i=0; i<list->n_heads; i++ ) {
+		*hash_slot(list, list->heads[i]->serial) = list->heads[i];
+	}
+
+	free(old_table);
+	return 0;
+}
+
+
 static void add_to_list(RefList *list, Reflection *new,
                         signed int h, signed int k, signed int l)
 {
 	Reflection *f;
 
-	f = find_refl(list, h, k, l);
+	if ( list->frozen != NULL ) unfreeze(list);
+	list->n_reflections++;
+
+	if ( list->type == REFLIST_HASH ) {
+
+		Reflection **slot;
+
+		slot = hash_slot(list, new->serial);
+		if ( *slot == NULL ) {
+
+			/* Keep the table no more than half full */
+			if ( 2*(list->n_heads+1) > (1<<list->table_bits) ) {
+				if ( grow_table(list) ) {
+					ERROR("Failed to grow reflection"
+					      " list.\n");
+					abort();
+				}
+				slot = hash_slot(list, new->serial);
+			}
+
+			*slot = new;
+			list->heads[list->n_heads++] = new;
+			return;
+
+		}
+		f = *slot;
+
+	} else {
+		f = find_refl(list, h, k, l);
+	}
+
 	if ( f == NULL ) {
 
 		list->head = insert_node(list->head, new);
@@ -876,7 +1249,7 @@ Reflection *add_refl(RefList *list, signed int h, signed int k, signed int l)
 	assert(abs(k)<512);
 	assert(abs(l)<512);
 
-	new = new_node(SERIAL(h, k, l));
+	new = new_node_in_list(list, SERIAL(h, k, l));
 	if ( new == NULL ) return NULL;
 
 	add_to_list(list, new, h, k, l);
@@ -890,7 +1263,8 @@ Reflection *add_refl(RefList *list, signed int h, signed int k, signed int l)
  * @refl: A %Reflection
  * @list: A %RefList
  *
- * Adds a @refl to @list.
+ * Adds a @refl, created with reflection_new(), to @list.  The reflection will
+ * then be freed along with the list.
  *
  **/
 void add_refl_to_list(Reflection *refl, RefList *list)
@@ -899,6 +1273,7 @@ void add_refl_to_list(Reflection *refl, RefList *list)
 
 	get_indices(refl, &h, &k, &l);
 
+	if ( !refl->in_block ) list->n_foreign++;
 	add_to_list(list, refl, h, k, l);
 }
 
@@ -911,6 +1286,11 @@ struct _reflistiterator {
 	int stack_ptr;
 	Reflection **stack;
 
+	/* For hash and frozen lists, the array being iterated over */
+	Reflection **array;
+	int n_array;
+	int pos;
+
 };
 
 
@@ -935,10 +1315,27 @@ Reflection *first_refl(RefList *list, RefListIterator **piter)
 	iter->stack_size = 32;
 	iter->stack = malloc(iter->stack_size*sizeof(Reflection *));
 	iter->stack_ptr = 0;
+	iter->array = NULL;
 	*piter = iter;
 
 	if ( list == NULL ) return NULL;
 
+	if ( list->frozen != NULL ) {
+		iter->array = list->frozen;
+		iter->n_array = list->n_frozen;
+	} else if ( list->type == REFLIST_HASH ) {
+		iter->array = list->heads;
+		iter->n_array = list->n_heads;
+	}
+
+	if ( iter->array != NULL ) {
+		iter->pos = 0;
+		if ( iter->n_array > 0 ) return iter->array[0];
+		free(iter->stack);
+		free(iter);
+		return NULL;
+	}
+
 	refl = list->head;
 
 	do {
@@ -993,6 +1390,15 @@ Reflection *next_refl(Reflection *refl, RefListIterator *iter)
 
 	}
 
+	if ( iter->array != NULL ) {
+		if ( ++iter->pos < iter->n_array ) {
+			return iter->array[iter->pos];
+		}
+		free(iter->stack);
+		free(iter);
+		return NULL;
+	}
+
 	refl = refl->child[1];
 	do {
 
@@ -1035,27 +1441,6 @@ static int recursive_depth(Reflection *refl)
 }
 
 
-static int recursive_count(Reflection *refl)
-{
-	int count_left, count_right;
-	Reflection *probe;
-	int n_this = 1;
-
-	if ( refl == NULL ) return 0;
-
-	probe = refl;
-	while ( probe->next != NULL ) {
-		probe = probe->next;
-		n_this++;
-	}
-
-	count_left = recursive_count(refl->child[0]);
-	count_right = recursive_count(refl->child[1]);
-
-	return n_this + count_left + count_right;
-}
-
-
 /**
  * num_reflections:
  * @list: A %RefList
@@ -1065,7 +1450,7 @@ static int recursive_count(Reflection *refl)
  **/
 int num_reflections(RefList *list)
 {
-	return recursive_count(list->head);
+	return list->n_reflections;
 }
 
 
@@ -1076,7 +1461,8 @@ int num_reflections(RefList *list)
  * If the depth of the tree is more than about 20, access to the list will be
  * slow.  This should never happen.
  *
- * Returns: the depth of the RB-tree used internally to represent @list.
+ * Returns: the depth of the RB-tree used internally to represent @list, or
+ * zero if @list is not of type %REFLIST_TREE.
  *
  **/
 int tree_depth(RefList *list)
@@ -1085,15 +1471,86 @@ int tree_depth(RefList *list)
 }
 
 
+static void recursive_collect(Reflection *refl, RefList *list)
+{
+	if ( refl == NULL ) return;
+
+	recursive_collect(refl->child[0], list);
+	list->frozen[list->n_frozen++] = refl;
+	recursive_collect(refl->child[1], list);
+}
+
+
+static int cmp_serial(const void *av, const void *bv)
+{
+	const Reflection *a = *(Reflection **)av;
+	const Reflection *b = *(Reflection **)bv;
+
+	if ( a->serial < b->serial ) return -1;
+	if ( a->serial > b->serial ) return +1;
+	return 0;
+}
+
+
+/**
+ * reflist_freeze:
+ * @list: A %RefList
+ *
+ * Prepares @list for a large number of searches, without any further
+ * insertions, by building a compact array of its reflections sorted by
+ * indices.  Afterwards, find_refl() uses a binary search on the array, and
+ * iteration happens in order of indices whatever the type of the list.
+ *
+ * Adding another reflection to the list undoes the effect of this function,
+ * so there is no need to do anything special before changing the list, but
+ * the list should not be changed while iterating over it.
+ *
+ **/
+void reflist_freeze(RefList *list)
+{
+	int n, i;
+
+	unfreeze(list);
+
+	if ( list->type == REFLIST_HASH ) {
+		n = list->n_heads;
+	} else {
+		/* Upper bound, because of duplicates */
+		n = list->n_reflections;
+	}
+
+	list->frozen = malloc(n*sizeof(Reflection *));
+	list->frozen_serials = malloc(n*sizeof(unsigned int));
+	if ( (list->frozen == NULL) || (list->frozen_serials == NULL) ) {
+		/* Not fatal - searches will just be slower */
+		unfreeze(list);
+		return;
+	}
+
+	if ( list->type == REFLIST_HASH ) {
+		memcpy(list->frozen, list->heads, n*sizeof(Reflection *));
+		qsort(list->frozen, n, sizeof(Reflection *), cmp_serial);
+		list->n_frozen = n;
+	} else {
+		recursive_collect(list->head, list);
+	}
+
+	for ( i=0; i<list->n_frozen; i++ ) {
+		list->frozen_serials[i] = list->frozen[i]->serial;
+	}
+}
+
+
 /**
  * lock_reflection:
  * @refl: A %Reflection
  *
- * Acquires a lock on the reflection.
+ * Acquires a lock on the reflection.  The locks are shared between
+ * reflections, so you must not try to hold locks on two reflections at once.
  */
 void lock_reflection(Reflection *refl)
 {
-	pthread_mutex_lock(&refl->lock);
+	pthread_mutex_lock(refl_lock(refl));
 }
 
 
@@ -1105,5 +1562,5 @@ void lock_reflection(Reflection *refl)
  */
 void unlock_reflection(Reflection *refl)
 {
-	pthread_mutex_unlock(&refl->lock);
+	pthread_mutex_unlock(refl_lock(refl));
 }
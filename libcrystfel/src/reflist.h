@@ -69,12 +69,29 @@ typedef struct _reflection Reflection;
  **/
 typedef struct _reflistiterator RefListIterator;
 
+/**
+ * RefListType:
+ * @REFLIST_TREE: Red-black tree, iterated in order of indices (the default)
+ * @REFLIST_HASH: Open-addressing hash table, iterated in order of insertion
+ *
+ * The internal representation of a %RefList.  See reflist_new_2().
+ **/
+typedef enum
+{
+	REFLIST_TREE,
+	REFLIST_HASH
+} RefListType;
+
+struct panel;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* Creation/deletion */
 extern RefList *reflist_new(void);
+extern RefList *reflist_new_2(RefListType type);
+extern void reflist_reserve(RefList *list, int n);
 extern void reflist_free(RefList *list);
 extern Reflection *reflection_new(signed int h, signed int k, signed int l);
 extern void reflection_free(Reflection *refl);
@@ -86,6 +103,7 @@ extern Reflection *next_found_refl(Reflection *refl);
 /* Get */
 extern double get_excitation_error(const Reflection *refl);
 extern void get_detector_pos(const Reflection *refl, double *fs, double *ss);
+extern struct panel *get_panel(const Reflection *refl);
 extern double get_partiality(const Reflection *refl);
 extern double get_lorentz(const Reflection *refl);
 extern void get_indices(const Reflection *refl,
@@ -108,6 +126,7 @@ extern double get_mean_bg(const Reflection *refl);
 extern void copy_data(Reflection *to, const Reflection *from);
 extern void set_detector_pos(Reflection *refl, double exerr,
                              double fs, double ss);
+extern void set_panel(Reflection *refl, struct panel *p);
 extern void set_partial(Reflection *refl, double rlow, double rhigh, double p);
 extern void set_partiality(Reflection *refl, double p);
 extern void set_lorentz(Reflection *refl, double L);
@@ -134,6 +153,7 @@ extern Reflection *next_refl(Reflection *refl, RefListIterator *iter);
 /* Misc */
 extern int num_reflections(RefList *list);
 extern int tree_depth(RefList *list);
+extern void reflist_freeze(RefList *list);
 extern void lock_reflection(Reflection *refl);
 extern void unlock_reflection(Reflection *refl);
 
@@ -31,6 +31,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -39,10 +43,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "version.h"
 #include "cell.h"
@@ -52,6 +64,7 @@
 #include "stream.h"
 #include "reflist.h"
 #include "reflist-utils.h"
+#include "thread-pool.h"
 
 #define LATEST_MAJOR_VERSION (2)
 #define LATEST_MINOR_VERSION (3)
@@ -59,15 +72,374 @@
 #define AT_LEAST_VERSION(st, a, b) ((st->major_version>=(a)) \
                                     && (st->minor_version>=(b)))
 
+#define LATEST_BINARY_MAJOR_VERSION (1)
+#define LATEST_BINARY_MINOR_VERSION (0)
+
+/* Sizes of the fixed-width records in the binary format */
+#define BINARY_PEAK_SIZE (14)
+#define BINARY_REFLECTION_SIZE (40)
+
+/* Marks a peak or reflection list which is not present at all, as opposed to
+ * being present but empty */
+#define BINARY_NO_LIST (0xffffffff)
+
+/* Marks a peak or reflection whose coordinates are not relative to any panel
+ * (i.e. the stream was written without a detector geometry) */
+#define BINARY_NO_PANEL (0xffff)
+
+/* Maximum number of chunks given to one thread at a time by
+ * read_stream_parallel() */
+#define PARALLEL_READ_BATCH (64)
+
+/* Maximum number of batches, per thread, which read_stream_parallel() will
+ * hold waiting to be delivered in order */
+#define PARALLEL_READ_PENDING (4)
+
+#define INDEX_HEADER "CrystFEL stream index 1.0"
+#define INDEX_END_MARKER "End of index"
+
+#define TRUNCATED_CHUNK_WARNING \
+	"WARNING: The last chunk of the stream is incomplete, and was skipped.\n"
+
+struct chunk_index_entry
+{
+	off_t offset;
+	int n_crystals;
+	char *filename;
+	char *event;
+};
+
 struct _stream
 {
 	FILE *fh;
+	StreamFormat format;
 
 	int major_version;
 	int minor_version;
+
+	/* Set if the last read_chunk_2() failed only because there were no
+	 * more chunks, rather than because of an error */
+	int eof;
+
+	/* Binary format only: start of the first record, and a buffer for
+	 * assembling or decoding a record */
+	off_t data_start;
+	unsigned char *buf;
+	size_t buf_size;
+
+	/* Chunk index.  'filename' is NULL unless the stream is a file which
+	 * can be indexed.  When writing, the index is written to 'index_fh' as
+	 * we go, and 'written' is where the last chunk ended. */
+	char *filename;
+	struct chunk_index_entry *chunks;
+	int n_chunks;
+	int max_chunks;
+	int have_index;
+	FILE *index_fh;
+	off_t written;
+
+	/* Reading only: the whole stream, if it is a regular file which could
+	 * be memory-mapped, and the current position within it.  'map_shared'
+	 * means that the mapping belongs to another Stream. */
+	const char *map;
+	size_t map_size;
+	size_t map_pos;
+	int map_shared;
+
+	/* Line buffer for reading when the stream isn't memory-mapped */
+	char line[1024];
+
+	/* Writing to memory only: the buffer managed by open_memstream().  The
+	 * chunk index is kept in 'chunks', relative to the start of 'mem'. */
+	int in_memory;
+	char *mem;
+	size_t mem_size;
 };
 
-static int read_peaks(FILE *fh, struct image *image)
+
+/* ---------------------- Reading from FILE* or mmap ------------------------ */
+
+/* Memory-maps the stream, if possible.  If not, everything carries on using
+ * the FILE*. */
+static void map_stream(Stream *st)
+{
+#ifdef HAVE_MMAP
+	struct stat statbuf;
+	void *map;
+
+	if ( fstat(fileno(st->fh), &statbuf) ) return;
+	if ( !S_ISREG(statbuf.st_mode) ) return;
+	if ( statbuf.st_size == 0 ) return;
+	if ( (uintmax_t)statbuf.st_size > SIZE_MAX ) return;
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
+	           fileno(st->fh), 0);
+	if ( map == MAP_FAILED ) return;
+
+	/* Streams are mostly read from start to finish, so let the kernel
+	 * read ahead aggressively and drop pages behind us */
+	madvise(map, statbuf.st_size, MADV_SEQUENTIAL);
+
+	st->map = map;
+	st->map_size = statbuf.st_size;
+	st->map_pos = ftello(st->fh);
+#endif
+}
+
+
+static void unmap_stream(Stream *st)
+{
+#ifdef HAVE_MMAP
+	if ( (st->map != NULL) && !st->map_shared ) {
+		munmap((void *)st->map, st->map_size);
+	}
+#endif
+	st->map = NULL;
+}
+
+
+/* Same as fgets(), but works on memory-mapped streams as well */
+static char *stream_fgets(char *line, int size, Stream *st)
+{
+	const char *start;
+	const char *nl;
+	size_t len;
+
+	if ( st->map == NULL ) return fgets(line, size, st->fh);
+
+	if ( st->map_pos >= st->map_size ) return NULL;
+
+	start = st->map + st->map_pos;
+	len = st->map_size - st->map_pos;
+	nl = memchr(start, '\n', len);
+	if ( nl != NULL ) len = nl - start + 1;
+	if ( len > (size_t)size-1 ) len = size-1;
+
+	memcpy(line, start, len);
+	line[len] = '\0';
+	st->map_pos += len;
+
+	return line;
+}
+
+
+/* Returns the next line of the stream, without the line ending, and puts its
+ * length in 'len'.  If the stream is memory-mapped, the line is not copied and
+ * is not NUL-terminated.  Returns NULL at the end of the stream. */
+static const char *stream_next_line(Stream *st, size_t *len)
+{
+	const char *start;
+	const char *nl;
+	size_t n;
+
+	if ( st->map == NULL ) {
+		if ( fgets(st->line, 1023, st->fh) == NULL ) return NULL;
+		chomp(st->line);
+		*len = strlen(st->line);
+		return st->line;
+	}
+
+	if ( st->map_pos >= st->map_size ) return NULL;
+
+	start = st->map + st->map_pos;
+	n = st->map_size - st->map_pos;
+	nl = memchr(start, '\n', n);
+	if ( nl != NULL ) {
+		n = nl - start;
+		st->map_pos += n + 1;
+	} else {
+		st->map_pos += n;
+	}
+	if ( (n > 0) && (start[n-1] == '\r') ) n--;
+
+	*len = n;
+	return start;
+}
+
+
+static int line_is(const char *line, size_t len, const char *marker)
+{
+	size_t mlen = strlen(marker);
+	if ( len != mlen ) return 0;
+	return memcmp(line, marker, len) == 0;
+}
+
+
+static off_t stream_tell(Stream *st)
+{
+	if ( st->map != NULL ) return st->map_pos;
+	return ftello(st->fh);
+}
+
+
+static int stream_seek(Stream *st, off_t pos)
+{
+	if ( st->map != NULL ) {
+		if ( (pos < 0) || ((size_t)pos > st->map_size) ) return 1;
+		st->map_pos = pos;
+		return 0;
+	}
+	return fseeko(st->fh, pos, SEEK_SET);
+}
+
+
+static int stream_at_eof(Stream *st)
+{
+	if ( st->map != NULL ) return st->map_pos >= st->map_size;
+	return feof(st->fh);
+}
+
+
+/* Hand-written number parsing for the reflection and peak lists, which make up
+ * most of a stream.  These work on lines which are not NUL-terminated, and are
+ * much faster than sscanf().  Each one skips leading spaces, and moves *pp to
+ * just after the number. */
+
+static const char *skip_space(const char *p, const char *end)
+{
+	while ( (p < end) && ((*p == ' ') || (*p == '\t')) ) p++;
+	return p;
+}
+
+
+static int parse_int(const char **pp, const char *end, signed int *v)
+{
+	const char *p = skip_space(*pp, end);
+	int neg = 0;
+	long int n = 0;
+	const char *digits;
+
+	if ( (p < end) && ((*p == '-') || (*p == '+')) ) {
+		neg = (*p == '-');
+		p++;
+	}
+
+	digits = p;
+	while ( (p < end) && (*p >= '0') && (*p <= '9') && (p-digits < 10) ) {
+		n = 10*n + (*p - '0');
+		p++;
+	}
+	if ( p == digits ) return 1;
+	if ( (p < end) && (*p != ' ') && (*p != '\t') ) return 1;
+
+	*v = neg ? -n : n;
+	*pp = p;
+	return 0;
+}
+
+
+static int parse_double(const char **pp, const char *end, double *v)
+{
+	/* Exactly representable powers of ten */
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+	                                1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+	                                1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+	                                1e20, 1e21, 1e22 };
+	const char *p = skip_space(*pp, end);
+	const char *start = p;
+	int neg = 0;
+	uint64_t mant = 0;
+	int n_digits = 0;
+	int n_sig = 0;
+	int exp10 = 0;
+	double val;
+
+	if ( (p < end) && ((*p == '-') || (*p == '+')) ) {
+		neg = (*p == '-');
+		p++;
+	}
+
+	while ( (p < end) && (*p >= '0') && (*p <= '9') ) {
+		if ( n_sig < 19 ) {
+			mant = 10*mant + (*p - '0');
+			if ( mant > 0 ) n_sig++;
+		} else {
+			exp10++;
+		}
+		n_digits++;
+		p++;
+	}
+	if ( (p < end) && (*p == '.') ) {
+		p++;
+		while ( (p < end) && (*p >= '0') && (*p <= '9') ) {
+			if ( n_sig < 19 ) {
+				mant = 10*mant + (*p - '0');
+				if ( mant > 0 ) n_sig++;
+				exp10--;
+			}
+			n_digits++;
+			p++;
+		}
+	}
+	if ( (p < end) && (n_digits > 0) && ((*p == 'e') || (*p == 'E')) ) {
+		signed int e;
+		const char *q = p+1;
+		if ( (q < end) && (*q != ' ') && !parse_int(&q, end, &e) ) {
+			exp10 += e;
+			p = q;
+		}
+	}
+
+	if ( (n_digits == 0) || (n_sig > 15) || (exp10 < -22) || (exp10 > 22)
+	  || ((p < end) && (*p != ' ') && (*p != '\t')) )
+	{
+		/* Anything unusual (too many digits, "nan", "inf" etc) goes
+		 * the slow way */
+		char tmp[64];
+		char *rval;
+		const char *tok_end = start;
+
+		while ( (tok_end < end) && (*tok_end != ' ')
+		     && (*tok_end != '\t') ) tok_end++;
+		if ( (tok_end == start) || (tok_end - start > 63) ) return 1;
+		memcpy(tmp, start, tok_end - start);
+		tmp[tok_end - start] = '\0';
+		val = strtod(tmp, &rval);
+		if ( *rval != '\0' ) return 1;
+		*v = val;
+		*pp = tok_end;
+		return 0;
+	}
+
+	/* With at most 15 significant digits and an exactly representable
+	 * power of ten, this is correctly rounded */
+	val = mant;
+	if ( exp10 < 0 ) {
+		val /= pow10[-exp10];
+	} else {
+		val *= pow10[exp10];
+	}
+
+	*v = neg ? -val : val;
+	*pp = p;
+	return 0;
+}
+
+
+static int parse_float(const char **pp, const char *end, float *v)
+{
+	double d;
+	if ( parse_double(pp, end, &d) ) return 1;
+	*v = d;
+	return 0;
+}
+
+
+static int parse_word(const char **pp, const char *end, char *word, size_t size)
+{
+	const char *p = skip_space(*pp, end);
+	const char *start = p;
+
+	while ( (p < end) && (*p != ' ') && (*p != '\t') ) p++;
+	if ( (p == start) || ((size_t)(p - start) >= size) ) return 1;
+
+	memcpy(word, start, p - start);
+	word[p - start] = '\0';
+	*pp = p;
+	return 0;
+}
+
+static int read_peaks(Stream *st, struct image *image)
 {
 	char *rval = NULL;
 	int first = 1;
@@ -82,7 +454,7 @@ static int read_peaks(FILE *fh, struct image *image)
 		struct panel *p = NULL;
 		float add_x, add_y;
 
-		rval = fgets(line, 1023, fh);
+		rval = stream_fgets(line, 1023, st);
 		if ( rval == NULL ) continue;
 		chomp(line);
 
@@ -126,54 +498,54 @@ static int read_peaks(FILE *fh, struct image *image)
 }
 
 
-static int read_peaks_2_3(FILE *fh, struct image *image)
+static int read_peaks_2_3(Stream *st, struct image *image)
 {
-	char *rval = NULL;
+	const char *line;
+	size_t len;
 	int first = 1;
 
 	image->features = image_feature_list_new();
 
-	do {
+	while ( (line = stream_next_line(st, &len)) != NULL ) {
 
-		char line[1024];
+		const char *p = line;
+		const char *end = line + len;
 		char pn[32];
 		float x, y, d, intensity;
-		int r;
-		struct panel *p = NULL;
+		struct panel *pan = NULL;
 		float add_x, add_y;
 
-		rval = fgets(line, 1023, fh);
-		if ( rval == NULL ) continue;
-		chomp(line);
-
-		if ( strcmp(line, PEAK_LIST_END_MARKER) == 0 ) return 0;
+		if ( line_is(line, len, PEAK_LIST_END_MARKER) ) return 0;
 
-		r = sscanf(line, "%f %f %f %f %s", &x, &y, &d, &intensity, pn);
-		if ( (r != 5) && (!first) ) {
+		if ( parse_float(&p, end, &x) || parse_float(&p, end, &y)
+		  || parse_float(&p, end, &d) || parse_float(&p, end, &intensity)
+		  || parse_word(&p, end, pn, 32) )
+		{
+			/* The first line is the column headings */
+			if ( first ) {
+				first = 0;
+				continue;
+			}
 			ERROR("Failed to parse peak list line.\n");
-			ERROR("The failed line was: '%s'\n", line);
+			ERROR("The failed line was: '%.*s'\n", (int)len, line);
 			return 1;
 		}
 
 		first = 0;
 
-		if ( r == 5 ) {
-
-			p = find_panel_by_name(image->det, pn);
-			if ( p == NULL ) {
-				ERROR("Panel not found: %s\n", pn);
-				return 1;
-			}
-
-			add_x = x-p->orig_min_fs+p->min_fs;
-			add_y = y-p->orig_min_ss+p->min_ss;
+		pan = find_panel_by_name(image->det, pn);
+		if ( pan == NULL ) {
+			ERROR("Panel not found: %s\n", pn);
+			return 1;
+		}
 
-			image_add_feature(image->features, add_x, add_y,
-			                  image, intensity, NULL);
+		add_x = x-pan->orig_min_fs+pan->min_fs;
+		add_y = y-pan->orig_min_ss+pan->min_ss;
 
-		}
+		image_add_feature(image->features, add_x, add_y,
+		                  image, intensity, NULL);
 
-	} while ( rval != NULL );
+	}
 
 	/* Got read error of some kind before finding PEAK_LIST_END_MARKER */
 	return 1;
@@ -274,67 +646,71 @@ static int write_peaks_2_3(struct image *image, FILE *ofh)
 }
 
 
-static RefList *read_stream_reflections_2_3(FILE *fh, struct detector *det)
+static RefList *read_stream_reflections_2_3(Stream *st, struct detector *det,
+                                            int n_refls)
 {
-	char *rval = NULL;
+	const char *line;
+	size_t len;
 	int first = 1;
 	RefList *out;
 
 	out = reflist_new();
+	reflist_reserve(out, n_refls);
 
-	do {
+	while ( (line = stream_next_line(st, &len)) != NULL ) {
 
-		char line[1024];
+		const char *p = line;
+		const char *end = line + len;
 		signed int h, k, l;
 		float intensity, sigma, fs, ss, pk, bg;
 		char pn[32];
-		int r;
 		Reflection *refl;
 
-		rval = fgets(line, 1023, fh);
-		if ( rval == NULL ) continue;
-		chomp(line);
-
-		if ( strcmp(line, REFLECTION_END_MARKER) == 0 ) return out;
-
-		r = sscanf(line, "%i %i %i %f %f %f %f %f %f %s",
-		           &h, &k, &l, &intensity, &sigma, &pk, &bg,
-			   &fs, &ss, pn);
+		if ( line_is(line, len, REFLECTION_END_MARKER) ) return out;
 
-		if ( (r != 10) && (!first) ) {
+		if ( parse_int(&p, end, &h) || parse_int(&p, end, &k)
+		  || parse_int(&p, end, &l)
+		  || parse_float(&p, end, &intensity)
+		  || parse_float(&p, end, &sigma) || parse_float(&p, end, &pk)
+		  || parse_float(&p, end, &bg) || parse_float(&p, end, &fs)
+		  || parse_float(&p, end, &ss) || parse_word(&p, end, pn, 32) )
+		{
+			/* The first line is the column headings */
+			if ( first ) {
+				first = 0;
+				continue;
+			}
 			reflist_free(out);
 			return NULL;
 		}
 
 		first = 0;
 
-		if ( r == 10 ) {
-
-			struct panel *p;
-
-			refl = add_refl(out, h, k, l);
-			set_intensity(refl, intensity);
-			if ( det != NULL ) {
-				double write_fs, write_ss;
-				p = find_panel_by_name(det,pn);
-				write_fs = fs - p->orig_min_fs + p->min_fs;
-				write_ss = ss - p->orig_min_ss + p->min_ss;
-				set_detector_pos(refl, 0.0, write_fs, write_ss);
-			}
-			set_esd_intensity(refl, sigma);
-			set_peak(refl, pk);
-			set_mean_bg(refl, bg);
-			set_redundancy(refl, 1);
+		refl = add_refl(out, h, k, l);
+		set_intensity(refl, intensity);
+		if ( det != NULL ) {
+			struct panel *pan;
+			double write_fs, write_ss;
+			pan = find_panel_by_name(det, pn);
+			write_fs = fs - pan->orig_min_fs + pan->min_fs;
+			write_ss = ss - pan->orig_min_ss + pan->min_ss;
+			set_detector_pos(refl, 0.0, write_fs, write_ss);
+			set_panel(refl, pan);
 		}
+		set_esd_intensity(refl, sigma);
+		set_peak(refl, pk);
+		set_mean_bg(refl, bg);
+		set_redundancy(refl, 1);
 
-	} while ( rval != NULL );
+	}
 
 	/* Got read error of some kind before finding PEAK_LIST_END_MARKER */
+	reflist_free(out);
 	return NULL;
 }
 
 
-static RefList *read_stream_reflections_2_1(FILE *fh, struct detector *det)
+static RefList *read_stream_reflections_2_1(Stream *st, struct detector *det)
 {
 	char *rval = NULL;
 	int first = 1;
@@ -352,7 +728,7 @@ static RefList *read_stream_reflections_2_1(FILE *fh, struct detector *det)
 		int r;
 		Reflection *refl;
 
-		rval = fgets(line, 1023, fh);
+		rval = stream_fgets(line, 1023, st);
 		if ( rval == NULL ) continue;
 		chomp(line);
 
@@ -405,7 +781,7 @@ static RefList *read_stream_reflections_2_1(FILE *fh, struct detector *det)
 }
 
 
-static RefList *read_stream_reflections_2_2(FILE *fh, struct detector *det)
+static RefList *read_stream_reflections_2_2(Stream *st, struct detector *det)
 {
 	char *rval = NULL;
 	int first = 1;
@@ -421,7 +797,7 @@ static RefList *read_stream_reflections_2_2(FILE *fh, struct detector *det)
 		int r;
 		Reflection *refl;
 
-		rval = fgets(line, 1023, fh);
+		rval = stream_fgets(line, 1023, st);
 		if ( rval == NULL ) continue;
 		chomp(line);
 
@@ -768,33 +1144,23 @@ static int write_crystal(Stream *st, Crystal *cr, int include_reflections)
 }
 
 
-int write_chunk(Stream *st, struct image *i, struct hdfile *hdfile,
-                int include_peaks, int include_reflections, struct event* ev)
+/* Writes the "key = value" lines which are common to both stream formats.  In
+ * a binary stream, they're carried verbatim as a block of text. */
+static void write_header_fields(FILE *fh, struct image *i,
+                                struct hdfile *hdfile, struct event *ev)
 {
-	int j;
-	char *indexer;
-	int ret = 0;
-
-	fprintf(st->fh, CHUNK_START_MARKER"\n");
-
-	fprintf(st->fh, "Image filename: %s\n", i->filename);
-	if ( i->event != NULL ) {
-		fprintf(st->fh, "Event: %s\n", get_event_string(i->event));
-	}
-
-	fprintf(st->fh, "Image serial number: %i\n", i->serial);
-
-	indexer = indexer_str(i->indexed_by);
-	fprintf(st->fh, "indexed_by = %s\n", indexer);
-	free(indexer);
+	if ( hdfile != NULL ) {
+		copy_hdf5_fields(hdfile, i->copyme, fh, ev);
+	} else if ( i->stuff_from_stream != NULL ) {
 
-	fprintf(st->fh, "photon_energy_eV = %f\n",
-	        J_to_eV(ph_lambda_to_en(i->lambda)));
+		int j;
 
-	fprintf(st->fh, "beam_divergence = %.2e rad\n", i->div);
-	fprintf(st->fh, "beam_bandwidth = %.2e (fraction)\n", i->bw);
+		/* Re-writing values which were read from another stream */
+		for ( j=0; j<i->stuff_from_stream->n_fields; j++ ) {
+			fprintf(fh, "%s\n", i->stuff_from_stream->fields[j]);
+		}
 
-	copy_hdf5_fields(hdfile, i->copyme, st->fh, ev);
+	}
 
 	if ( i->det != NULL ) {
 
@@ -804,7 +1170,7 @@ int write_chunk(Stream *st, struct image *i, struct hdfile *hdfile,
 		for ( j=0; j<i->det->n_panels; j++ ) {
 			tclen += i->det->panels[j].clen;
 		}
-		fprintf(st->fh, "average_camera_length = %f m\n",
+		fprintf(fh, "average_camera_length = %f m\n",
 		        tclen / i->det->n_panels);
 
 		for ( j=0; j<i->det->n_rigid_groups; j++ ) {
@@ -813,626 +1179,2650 @@ int write_chunk(Stream *st, struct image *i, struct hdfile *hdfile,
 
 			if ( !rg->have_deltas ) continue;
 
-			fprintf(st->fh, "rg_delta_%s_fsx = %f\n",
+			fprintf(fh, "rg_delta_%s_fsx = %f\n",
 			        rg->name, rg->d_fsx);
-			fprintf(st->fh, "rg_delta_%s_ssx = %f\n",
+			fprintf(fh, "rg_delta_%s_ssx = %f\n",
 			        rg->name, rg->d_ssx);
-			fprintf(st->fh, "rg_delta_%s_cnx = %f\n",
+			fprintf(fh, "rg_delta_%s_cnx = %f\n",
 			        rg->name, rg->d_cnx);
 
-			fprintf(st->fh, "rg_delta_%s_fsy = %f\n",
+			fprintf(fh, "rg_delta_%s_fsy = %f\n",
 			        rg->name, rg->d_fsy);
-			fprintf(st->fh, "rg_delta_%s_ssy = %f\n",
+			fprintf(fh, "rg_delta_%s_ssy = %f\n",
 			        rg->name, rg->d_ssy);
-			fprintf(st->fh, "rg_delta_%s_cny = %f\n",
+			fprintf(fh, "rg_delta_%s_cny = %f\n",
 			        rg->name, rg->d_cny);
 
 		}
 
 	}
+}
 
-	fprintf(st->fh, "num_peaks = %lli\n", i->num_peaks);
-	fprintf(st->fh, "num_saturated_peaks = %lli\n", i->num_saturated_peaks);
-	if ( include_peaks ) {
-		if ( AT_LEAST_VERSION(st, 2, 3) ) {
-			ret = write_peaks_2_3(i, st->fh);
-		} else {
-			ret = write_peaks(i, st->fh);
-		}
-	}
 
-	for ( j=0; j<i->n_crystals; j++ ) {
-		ret = write_crystal(st, i->crystals[j], include_reflections);
-	}
+/* Little-endian encoding for the binary stream format.  These are done
+ * byte-by-byte so that the format doesn't depend on the host. */
+static void encode_u16(unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
 
-	fprintf(st->fh, CHUNK_END_MARKER"\n");
 
-	fflush(st->fh);
+static void encode_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
 
-	return ret;
+
+static void encode_u64(unsigned char *p, uint64_t v)
+{
+	encode_u32(p, v & 0xffffffff);
+	encode_u32(p+4, v >> 32);
 }
 
 
-static int find_start_of_chunk(FILE *fh)
+static uint16_t decode_u16(const unsigned char *p)
 {
-	char *rval = NULL;
-	char line[1024];
+	return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
 
-	do {
 
-		rval = fgets(line, 1023, fh);
+static uint32_t decode_u32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+	     | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-		/* Trouble? */
-		if ( rval == NULL ) return 1;
 
-		chomp(line);
+static uint64_t decode_u64(const unsigned char *p)
+{
+	return (uint64_t)decode_u32(p) | ((uint64_t)decode_u32(p+4) << 32);
+}
 
-	} while ( strcmp(line, CHUNK_START_MARKER) != 0 );
 
-	return 0;
+/**
+ * stream_record_length:
+ * @hdr: The first %STREAM_RECORD_HEADER_SIZE bytes of a binary stream record
+ *
+ * This is for programs which need to pass records from a binary stream
+ * through without decoding them, for example to multiplex several substreams
+ * into one.
+ *
+ * Returns: the number of bytes in the record which follow the header.
+ */
+size_t stream_record_length(const unsigned char *hdr)
+{
+	return decode_u32(hdr+4);
 }
 
 
-static void read_crystal(Stream *st, struct image *image, StreamReadFlags srf)
+struct binary_writer
 {
-	char line[1024];
-	char *rval = NULL;
-	struct rvec as, bs, cs;
-	int have_as = 0;
-	int have_bs = 0;
-	int have_cs = 0;
-	int have_latt = 0;
-	int have_cen = 0;
-	int have_ua = 0;
-	char centering = 'P';
-	char unique_axis = '*';
-	LatticeType lattice_type = L_TRICLINIC;
-	Crystal *cr;
-	int n;
-	Crystal **crystals_new;
+	Stream *st;
+	size_t len;
+	int err;
+};
 
-	as.u = 0.0;  as.v = 0.0;  as.w = 0.0;
-	bs.u = 0.0;  bs.v = 0.0;  bs.w = 0.0;
-	cs.u = 0.0;  cs.v = 0.0;  cs.w = 0.0;
 
-	cr = crystal_new();
-	if ( cr == NULL ) {
-		ERROR("Failed to allocate crystal!\n");
-		return;
-	}
+static unsigned char *bw_reserve(struct binary_writer *bw, size_t n)
+{
+	Stream *st = bw->st;
+	unsigned char *p;
 
-	do {
+	if ( bw->len + n > st->buf_size ) {
 
-		float u, v, w, lim, rad;
-		char c;
+		size_t new_size;
+		unsigned char *buf_new;
 
-		rval = fgets(line, 1023, st->fh);
-
-		/* Trouble? */
-		if ( rval == NULL ) break;
+		new_size = 2*st->buf_size;
+		if ( new_size < bw->len + n ) new_size = bw->len + n + 4096;
 
-		chomp(line);
-		if ( (srf & STREAM_READ_UNITCELL)
-		  && (sscanf(line, "astar = %f %f %f", &u, &v, &w) == 3) )
-		{
-			as.u = u*1e9;  as.v = v*1e9;  as.w = w*1e9;
-			have_as = 1;
+		buf_new = realloc(st->buf, new_size);
+		if ( buf_new == NULL ) {
+			ERROR("Failed to allocate stream buffer.\n");
+			bw->err = 1;
+			return NULL;
 		}
+		st->buf = buf_new;
+		st->buf_size = new_size;
 
-		if ( (srf & STREAM_READ_UNITCELL)
-		  && (sscanf(line, "bstar = %f %f %f", &u, &v, &w) == 3) )
-		{
-			bs.u = u*1e9;  bs.v = v*1e9;  bs.w = w*1e9;
-			have_bs = 1;
-		}
+	}
 
-		if ( (srf & STREAM_READ_UNITCELL)
-		  && (sscanf(line, "cstar = %f %f %f", &u, &v, &w) == 3) )
-		{
-			cs.u = u*1e9;  cs.v = v*1e9;  cs.w = w*1e9;
-			have_cs = 1;
-		}
+	p = st->buf + bw->len;
+	bw->len += n;
+	return p;
+}
 
-		if ( (srf & STREAM_READ_UNITCELL)
-		  && (sscanf(line, "centering = %c", &c) == 1) )
-		{
-			if ( !have_cen ) {
-				centering = c;
-				have_cen = 1;
-			} else {
-				ERROR("Duplicate centering ignored.\n");
-			}
-		}
 
-		if ( (srf & STREAM_READ_UNITCELL)
-		  && (sscanf(line, "unique_axis = %c", &c) == 1) )
-		{
-			if ( !have_ua ) {
-				unique_axis = c;
-				have_ua = 1;
-			} else {
-				ERROR("Duplicate unique axis ignored.\n");
+static void put_u8(struct binary_writer *bw, uint8_t v)
+{
+	unsigned char *p = bw_reserve(bw, 1);
+	if ( p != NULL ) p[0] = v;
+}
+
+
+static void put_u16(struct binary_writer *bw, uint16_t v)
+{
+	unsigned char *p = bw_reserve(bw, 2);
+	if ( p != NULL ) encode_u16(p, v);
+}
+
+
+static void put_u32(struct binary_writer *bw, uint32_t v)
+{
+	unsigned char *p = bw_reserve(bw, 4);
+	if ( p != NULL ) encode_u32(p, v);
+}
+
+
+static void put_u64(struct binary_writer *bw, uint64_t v)
+{
+	unsigned char *p = bw_reserve(bw, 8);
+	if ( p != NULL ) encode_u64(p, v);
+}
+
+
+static void put_f32(struct binary_writer *bw, float v)
+{
+	uint32_t u;
+	memcpy(&u, &v, 4);
+	put_u32(bw, u);
+}
+
+
+static void put_f64(struct binary_writer *bw, double v)
+{
+	uint64_t u;
+	memcpy(&u, &v, 8);
+	put_u64(bw, u);
+}
+
+
+static void put_string(struct binary_writer *bw, const char *str)
+{
+	size_t len;
+	unsigned char *p;
+
+	len = (str != NULL) ? strlen(str) : 0;
+	put_u32(bw, len);
+	p = bw_reserve(bw, len);
+	if ( (p != NULL) && (len > 0) ) memcpy(p, str, len);
+}
+
+
+static int write_binary_record(Stream *st, uint32_t type,
+                               const unsigned char *data, size_t len)
+{
+	unsigned char hdr[STREAM_RECORD_HEADER_SIZE];
+
+	encode_u32(hdr, type);
+	encode_u32(hdr+4, len);
+
+	if ( fwrite(hdr, 1, STREAM_RECORD_HEADER_SIZE, st->fh)
+	     != STREAM_RECORD_HEADER_SIZE ) return 1;
+	if ( fwrite(data, 1, len, st->fh) != len ) return 1;
+
+	return 0;
+}
+
+
+static int panel_number(struct detector *det, struct panel *p)
+{
+	return p - det->panels;
+}
+
+
+static int write_peaks_binary(struct binary_writer *bw, struct image *image)
+{
+	int i;
+	size_t count_pos;
+	uint32_t n = 0;
+	int ret = 0;
+
+	count_pos = bw->len;
+	put_u32(bw, 0);  /* Filled in below */
+
+	for ( i=0; i<image_feature_count(image->features); i++ ) {
+
+		struct imagefeature *f;
+		double write_fs, write_ss;
+		uint16_t pn;
+
+		f = image_get_feature(image->features, i);
+		if ( f == NULL ) continue;
+
+		if ( image->det != NULL ) {
+
+			struct panel *p;
+
+			p = find_panel(image->det, f->fs, f->ss);
+			if ( p == NULL ) {
+				ERROR("Panel not found\n");
+				ret = 1;
+				continue;
 			}
+
+			/* Convert coordinates to match arrangement of panels in
+			 * HDF5 file */
+			write_fs = f->fs - p->min_fs + p->orig_min_fs;
+			write_ss = f->ss - p->min_ss + p->orig_min_ss;
+			pn = panel_number(image->det, p);
+
+		} else {
+
+			write_fs = f->fs;
+			write_ss = f->ss;
+			pn = BINARY_NO_PANEL;
+
 		}
 
-		if ( (srf & STREAM_READ_UNITCELL)
-		  && (strncmp(line, "lattice_type = ", 15) == 0) )
-		{
-			if ( !have_latt ) {
-				lattice_type = lattice_from_str(line+15);
-				have_latt = 1;
-			} else {
-				ERROR("Duplicate lattice type ignored.\n");
+		put_f32(bw, write_fs);
+		put_f32(bw, write_ss);
+		put_f32(bw, f->intensity);
+		put_u16(bw, pn);
+		n++;
+
+	}
+
+	if ( !bw->err ) encode_u32(bw->st->buf + count_pos, n);
+	return ret;
+}
+
+
+static int write_reflections_binary(struct binary_writer *bw, RefList *list,
+                                    struct image *image)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	size_t count_pos;
+	uint32_t n = 0;
+	int ret = 0;
+
+	count_pos = bw->len;
+	put_u32(bw, 0);  /* Filled in below */
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		double fs, ss;
+		double write_fs, write_ss;
+		uint16_t pn;
+
+		/* Reflections with redundancy = 0 are not written */
+		if ( get_redundancy(refl) == 0 ) continue;
+
+		get_indices(refl, &h, &k, &l);
+		get_detector_pos(refl, &fs, &ss);
+
+		if ( image->det != NULL ) {
+
+			struct panel *p;
+
+			p = find_panel(image->det, fs, ss);
+			if ( p == NULL ) {
+				ERROR("Panel not found\n");
+				ret = 1;
+				continue;
 			}
-		}
 
-		if ( strncmp(line, "num_saturated_reflections = ", 28) == 0 ) {
-			int n = atoi(line+28);
-			crystal_set_num_saturated_reflections(cr, n);
-		}
+			write_fs = fs - p->min_fs + p->orig_min_fs;
+			write_ss = ss - p->min_ss + p->orig_min_ss;
+			pn = panel_number(image->det, p);
 
-		if ( sscanf(line, "diffraction_resolution_limit = %f nm^-1",
-		            &lim) == 1 ) {
-			crystal_set_resolution_limit(cr, lim*1e9);
-		}
+		} else {
+
+			write_fs = fs;
+			write_ss = ss;
+			pn = BINARY_NO_PANEL;
 
-		if ( sscanf(line, "profile_radius = %e nm^-1", &rad) == 1 ) {
-			crystal_set_profile_radius(cr, rad*1e9);
 		}
 
-		if ( (strcmp(line, REFLECTION_START_MARKER) == 0)
-		  && (srf & STREAM_READ_REFLECTIONS) )
-		{
+		put_u16(bw, h);
+		put_u16(bw, k);
+		put_u16(bw, l);
+		put_f64(bw, get_intensity(refl));
+		put_f64(bw, get_esd_intensity(refl));
+		put_f32(bw, get_peak(refl));
+		put_f32(bw, get_mean_bg(refl));
+		put_f32(bw, write_fs);
+		put_f32(bw, write_ss);
+		put_u16(bw, pn);
+		n++;
+	}
 
-			RefList *reflist;
+	if ( !bw->err ) encode_u32(bw->st->buf + count_pos, n);
+	return ret;
+}
 
-			/* The reflection list format in the stream diverges
-			 * after 2.2 */
-			if ( AT_LEAST_VERSION(st, 2, 3) ) {
-				reflist = read_stream_reflections_2_3(st->fh,
-                                                      image->det);
-			} else if ( AT_LEAST_VERSION(st, 2, 2) ) {
-				reflist = read_stream_reflections_2_2(st->fh,
-				          image->det);
-			} else {
-				reflist = read_stream_reflections_2_1(st->fh,
-				          image->det);
-			}
-			if ( reflist == NULL ) {
-				ERROR("Failed while reading reflections\n");
-				break;
-			}
 
-			crystal_set_reflections(cr, reflist);
+static int write_crystal_binary(struct binary_writer *bw, Crystal *cr,
+                                int include_reflections)
+{
+	UnitCell *cell;
+	RefList *reflist;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+
+	cell = crystal_get_cell(cr);
+	assert(cell != NULL);
+
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+	put_f64(bw, asx);  put_f64(bw, asy);  put_f64(bw, asz);
+	put_f64(bw, bsx);  put_f64(bw, bsy);  put_f64(bw, bsz);
+	put_f64(bw, csx);  put_f64(bw, csy);  put_f64(bw, csz);
+	put_u8(bw, cell_get_lattice_type(cell));
+	put_u8(bw, cell_get_centering(cell));
+	put_u8(bw, cell_get_unique_axis(cell));
+
+	put_f64(bw, crystal_get_profile_radius(cr));
+	put_f64(bw, crystal_get_resolution_limit(cr));
+	put_u64(bw, crystal_get_num_saturated_reflections(cr));
+	put_u64(bw, crystal_get_num_implausible_reflections(cr));
+	put_string(bw, crystal_get_notes(cr));
+
+	reflist = crystal_get_reflections(cr);
+	if ( include_reflections && (reflist != NULL) ) {
+		return write_reflections_binary(bw, reflist,
+		                                crystal_get_image(cr));
+	}
+
+	put_u32(bw, BINARY_NO_LIST);
+	return 0;
+}
+
+
+static int write_chunk_binary(Stream *st, struct image *i,
+                              struct hdfile *hdfile, int include_peaks,
+                              int include_reflections, struct event *ev)
+{
+	struct binary_writer bw;
+	char *fields;
+	size_t fields_len;
+	FILE *fh;
+	int j;
+	int ret = 0;
+
+	bw.st = st;
+	bw.len = 0;
+	bw.err = 0;
+
+	put_string(&bw, i->filename);
+	if ( i->event != NULL ) {
+		char *evstr = get_event_string(i->event);
+		put_string(&bw, evstr);
+		free(evstr);
+	} else {
+		put_string(&bw, NULL);
+	}
+	put_u32(&bw, i->serial);
+	put_u32(&bw, i->indexed_by);
+	put_f64(&bw, i->lambda);
+	put_f64(&bw, i->div);
+	put_f64(&bw, i->bw);
+	put_u64(&bw, i->num_peaks);
+	put_u64(&bw, i->num_saturated_peaks);
+
+	fh = open_memstream(&fields, &fields_len);
+	if ( fh == NULL ) {
+		ERROR("Failed to open memory stream.\n");
+		return 1;
+	}
+	write_header_fields(fh, i, hdfile, ev);
+	fclose(fh);
+	put_string(&bw, fields);
+	free(fields);
+
+	if ( include_peaks ) {
+		ret = write_peaks_binary(&bw, i);
+	} else {
+		put_u32(&bw, BINARY_NO_LIST);
+	}
 
+	put_u32(&bw, i->n_crystals);
+	for ( j=0; j<i->n_crystals; j++ ) {
+		ret = write_crystal_binary(&bw, i->crystals[j],
+		                           include_reflections);
+	}
+
+	if ( bw.err ) return 1;
+
+	if ( write_binary_record(st, STREAM_RECORD_CHUNK, st->buf, bw.len) ) {
+		ERROR("Failed to write chunk.\n");
+		return 1;
+	}
+
+	fflush(st->fh);
+
+	return ret;
+}
+
+
+static int write_chunk_text(Stream *st, struct image *i,
+                            struct hdfile *hdfile, int include_peaks,
+                            int include_reflections, struct event *ev)
+{
+	int j;
+	char *indexer;
+	int ret = 0;
+
+	fprintf(st->fh, CHUNK_START_MARKER"\n");
+
+	fprintf(st->fh, "Image filename: %s\n", i->filename);
+	if ( i->event != NULL ) {
+		fprintf(st->fh, "Event: %s\n", get_event_string(i->event));
+	}
+
+	fprintf(st->fh, "Image serial number: %i\n", i->serial);
+
+	indexer = indexer_str(i->indexed_by);
+	fprintf(st->fh, "indexed_by = %s\n", indexer);
+	free(indexer);
+
+	fprintf(st->fh, "photon_energy_eV = %f\n",
+	        J_to_eV(ph_lambda_to_en(i->lambda)));
+
+	fprintf(st->fh, "beam_divergence = %.2e rad\n", i->div);
+	fprintf(st->fh, "beam_bandwidth = %.2e (fraction)\n", i->bw);
+
+	write_header_fields(st->fh, i, hdfile, ev);
+
+	fprintf(st->fh, "num_peaks = %lli\n", i->num_peaks);
+	fprintf(st->fh, "num_saturated_peaks = %lli\n", i->num_saturated_peaks);
+	if ( include_peaks ) {
+		if ( AT_LEAST_VERSION(st, 2, 3) ) {
+			ret = write_peaks_2_3(i, st->fh);
+		} else {
+			ret = write_peaks(i, st->fh);
+		}
+	}
+
+	for ( j=0; j<i->n_crystals; j++ ) {
+		ret = write_crystal(st, i->crystals[j], include_reflections);
+	}
+
+	fprintf(st->fh, CHUNK_END_MARKER"\n");
+
+	fflush(st->fh);
+
+	return ret;
+}
+
+
+static void free_index(Stream *st)
+{
+	int i;
+
+	for ( i=0; i<st->n_chunks; i++ ) {
+		free(st->chunks[i].filename);
+		free(st->chunks[i].event);
+	}
+	free(st->chunks);
+	st->chunks = NULL;
+	st->n_chunks = 0;
+	st->max_chunks = 0;
+	st->have_index = 0;
+}
+
+
+static int add_index_entry(Stream *st, off_t offset, int n_crystals,
+                           const char *filename, const char *event)
+{
+	struct chunk_index_entry *e;
+
+	if ( st->n_chunks == st->max_chunks ) {
+
+		struct chunk_index_entry *chunks_new;
+		int max_new = (st->max_chunks == 0) ? 1024 : 2*st->max_chunks;
+
+		chunks_new = realloc(st->chunks,
+		                     max_new*sizeof(struct chunk_index_entry));
+		if ( chunks_new == NULL ) {
+			ERROR("Failed to allocate chunk index.\n");
+			return 1;
+		}
+		st->chunks = chunks_new;
+		st->max_chunks = max_new;
+
+	}
+
+	e = &st->chunks[st->n_chunks++];
+	e->offset = offset;
+	e->n_crystals = n_crystals;
+	e->filename = strdup(filename);
+	if ( (event != NULL) && (event[0] != '\0') ) {
+		e->event = strdup(event);
+	} else {
+		e->event = NULL;
+	}
+
+	return 0;
+}
+
+
+int write_chunk(Stream *st, struct image *i, struct hdfile *hdfile,
+                int include_peaks, int include_reflections, struct event* ev)
+{
+	off_t offset = 0;
+	int ret;
+	char *evstr = NULL;
+
+	if ( (st->index_fh != NULL) || st->in_memory ) offset = ftello(st->fh);
+
+	if ( st->format == STREAM_FORMAT_BINARY ) {
+		ret = write_chunk_binary(st, i, hdfile, include_peaks,
+		                         include_reflections, ev);
+	} else {
+		ret = write_chunk_text(st, i, hdfile, include_peaks,
+		                       include_reflections, ev);
+	}
+
+	if ( i->event != NULL ) evstr = get_event_string(i->event);
+
+	if ( st->index_fh != NULL ) {
+		fprintf(st->index_fh, "%lld %i %s %s\n", (long long)offset,
+		        i->n_crystals, (evstr != NULL) ? evstr : "-",
+		        i->filename);
+		st->written = ftello(st->fh);
+	}
+
+	/* Passed on to the real stream's index by write_stream_buffer() */
+	if ( st->in_memory ) {
+		if ( add_index_entry(st, offset, i->n_crystals, i->filename,
+		                     evstr) ) ret = 1;
+	}
+
+	free(evstr);
+
+	return ret;
+}
+
+
+static int find_start_of_chunk(Stream *st)
+{
+	const char *line;
+	size_t len;
+
+	do {
+
+		line = stream_next_line(st, &len);
+
+		/* Trouble? */
+		if ( line == NULL ) return 1;
+
+	} while ( !line_is(line, len, CHUNK_START_MARKER) );
+
+	return 0;
+}
+
+
+/* Add crystal to the list for this image */
+static void add_crystal_to_image(struct image *image, Crystal *cr)
+{
+	int n;
+	Crystal **crystals_new;
+
+	n = image->n_crystals+1;
+	crystals_new = realloc(image->crystals, n*sizeof(Crystal *));
+
+	if ( crystals_new == NULL ) {
+		ERROR("Failed to expand crystal list!\n");
+	} else {
+		image->crystals = crystals_new;
+		image->crystals[image->n_crystals++] = cr;
+	}
+}
+
+
+static void read_crystal(Stream *st, struct image *image, StreamReadFlags srf)
+{
+	char line[1024];
+	char *rval = NULL;
+	struct rvec as, bs, cs;
+	int have_as = 0;
+	int have_bs = 0;
+	int have_cs = 0;
+	int have_latt = 0;
+	int have_cen = 0;
+	int have_ua = 0;
+	char centering = 'P';
+	char unique_axis = '*';
+	LatticeType lattice_type = L_TRICLINIC;
+	Crystal *cr;
+	int n_refls = 0;
+
+	as.u = 0.0;  as.v = 0.0;  as.w = 0.0;
+	bs.u = 0.0;  bs.v = 0.0;  bs.w = 0.0;
+	cs.u = 0.0;  cs.v = 0.0;  cs.w = 0.0;
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		ERROR("Failed to allocate crystal!\n");
+		return;
+	}
+
+	do {
+
+		float u, v, w, lim, rad;
+		char c;
+
+		rval = stream_fgets(line, 1023, st);
+
+		/* Trouble? */
+		if ( rval == NULL ) break;
+
+		chomp(line);
+		if ( (srf & STREAM_READ_UNITCELL)
+		  && (sscanf(line, "astar = %f %f %f", &u, &v, &w) == 3) )
+		{
+			as.u = u*1e9;  as.v = v*1e9;  as.w = w*1e9;
+			have_as = 1;
+		}
+
+		if ( (srf & STREAM_READ_UNITCELL)
+		  && (sscanf(line, "bstar = %f %f %f", &u, &v, &w) == 3) )
+		{
+			bs.u = u*1e9;  bs.v = v*1e9;  bs.w = w*1e9;
+			have_bs = 1;
+		}
+
+		if ( (srf & STREAM_READ_UNITCELL)
+		  && (sscanf(line, "cstar = %f %f %f", &u, &v, &w) == 3) )
+		{
+			cs.u = u*1e9;  cs.v = v*1e9;  cs.w = w*1e9;
+			have_cs = 1;
+		}
+
+		if ( (srf & STREAM_READ_UNITCELL)
+		  && (sscanf(line, "centering = %c", &c) == 1) )
+		{
+			if ( !have_cen ) {
+				centering = c;
+				have_cen = 1;
+			} else {
+				ERROR("Duplicate centering ignored.\n");
+			}
+		}
+
+		if ( (srf & STREAM_READ_UNITCELL)
+		  && (sscanf(line, "unique_axis = %c", &c) == 1) )
+		{
+			if ( !have_ua ) {
+				unique_axis = c;
+				have_ua = 1;
+			} else {
+				ERROR("Duplicate unique axis ignored.\n");
+			}
+		}
+
+		if ( (srf & STREAM_READ_UNITCELL)
+		  && (strncmp(line, "lattice_type = ", 15) == 0) )
+		{
+			if ( !have_latt ) {
+				lattice_type = lattice_from_str(line+15);
+				have_latt = 1;
+			} else {
+				ERROR("Duplicate lattice type ignored.\n");
+			}
+		}
+
+		if ( strncmp(line, "num_reflections = ", 18) == 0 ) {
+			n_refls = atoi(line+18);
+		}
+
+		if ( strncmp(line, "num_saturated_reflections = ", 28) == 0 ) {
+			int n = atoi(line+28);
+			crystal_set_num_saturated_reflections(cr, n);
+		}
+
+		if ( sscanf(line, "diffraction_resolution_limit = %f nm^-1",
+		            &lim) == 1 ) {
+			crystal_set_resolution_limit(cr, lim*1e9);
+		}
+
+		if ( sscanf(line, "profile_radius = %e nm^-1", &rad) == 1 ) {
+			crystal_set_profile_radius(cr, rad*1e9);
+		}
+
+		if ( (strcmp(line, REFLECTION_START_MARKER) == 0)
+		  && (srf & STREAM_READ_REFLECTIONS) )
+		{
+
+			RefList *reflist;
+
+			/* The reflection list format in the stream diverges
+			 * after 2.2 */
+			if ( AT_LEAST_VERSION(st, 2, 3) ) {
+				reflist = read_stream_reflections_2_3(st,
+				          image->det, n_refls);
+			} else if ( AT_LEAST_VERSION(st, 2, 2) ) {
+				reflist = read_stream_reflections_2_2(st,
+				          image->det);
+			} else {
+				reflist = read_stream_reflections_2_1(st,
+				          image->det);
+			}
+			if ( reflist == NULL ) {
+				ERROR("Failed while reading reflections\n");
+				break;
+			}
+
+			crystal_set_reflections(cr, reflist);
+
+		}
+
+		if ( strcmp(line, CRYSTAL_END_MARKER) == 0 ) break;
+
+	} while ( 1 );
+
+	if ( have_as && have_bs && have_cs ) {
+
+		UnitCell *cell;
+
+		cell = crystal_get_cell(cr);
+
+		if ( cell != NULL ) {
+			ERROR("Duplicate cell found in stream!\n");
+			ERROR("I'll use the most recent one.\n");
+			cell_free(cell);
+		}
+
+		cell = cell_new_from_reciprocal_axes(as, bs, cs);
+
+		if ( have_cen && have_ua && have_latt ) {
+			cell_set_centering(cell, centering);
+			cell_set_unique_axis(cell, unique_axis);
+			cell_set_lattice_type(cell, lattice_type);
+		} /* else keep default triclinic P */
+
+		crystal_set_cell(cr, cell);
+
+		have_as = 0;  have_bs = 0;  have_cs = 0;
+		have_latt = 0;  have_ua = 0;  have_cen = 0;
+
+	}
+
+	/* Unused at the moment */
+	crystal_set_mosaicity(cr, 0.0);
+
+	add_crystal_to_image(image, cr);
+}
+
+
+static int read_and_store_hdf5_field(struct image *image, const char *line)
+{
+
+	char **new_fields;
+
+	if ( image->stuff_from_stream == NULL ) {
+		image->stuff_from_stream =
+		       malloc(sizeof(struct stuff_from_stream));
+		if ( image->stuff_from_stream == NULL) {
+			ERROR("Failed reading hdf5 entries from "
+			      "stream\n");
+			return 1;
+		}
+		image->stuff_from_stream->fields = NULL;
+		image->stuff_from_stream->n_fields = 0;
+	}
+
+	new_fields = realloc(image->stuff_from_stream->fields,
+			     (1+image->stuff_from_stream->n_fields)*
+			     sizeof(char *));
+	if ( new_fields == NULL ) {
+		ERROR("Failed reading hdf5 entries from stream\n");
+		return 1;
+	}
+	image->stuff_from_stream->fields = new_fields;
+	image->stuff_from_stream->fields[image->stuff_from_stream->n_fields]
+							     = strdup(line);
+	image->stuff_from_stream->n_fields++;
+
+	return 0;
+}
+
+
+/* Handles the "key = value" lines which are common to both stream formats */
+static int read_header_field(struct image *image, const char *line)
+{
+	if ( strncmp(line, "camera_length_", 14) == 0 ) {
+		if ( image->det != NULL ) {
+
+			int k;
+			char name[1024];
+			struct panel *p;
+
+			for ( k=0; k<strlen(line)-14; k++ ) {
+				char ch = line[k+14];
+				name[k] = ch;
+				if ( (ch == ' ') || (ch == '=') ) {
+					name[k] = '\0';
+					break;
+				}
+			}
+
+			p = find_panel_by_name(image->det, name);
+			if ( p == NULL ) {
+				ERROR("No panel '%s'\n", name);
+			} else {
+				p->clen = atof(line+14+k+3);
+			}
+
+		}
+	}
+
+	if ( strncmp(line, "hdf5", 3) == 0 ) {
+
+		int fail;
+
+		fail = read_and_store_hdf5_field(image, line);
+		if ( fail ) {
+			ERROR("Failed to read hd5 fields from stream.\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+struct binary_reader
+{
+	const unsigned char *pos;
+	const unsigned char *end;
+	int err;
+};
+
+
+static const unsigned char *br_take(struct binary_reader *br, size_t n)
+{
+	const unsigned char *p = br->pos;
+
+	if ( (size_t)(br->end - br->pos) < n ) {
+		br->err = 1;
+		br->pos = br->end;
+		return NULL;
+	}
+
+	br->pos += n;
+	return p;
+}
+
+
+static uint8_t get_u8(struct binary_reader *br)
+{
+	const unsigned char *p = br_take(br, 1);
+	return (p != NULL) ? p[0] : 0;
+}
+
+
+static uint16_t get_u16(struct binary_reader *br)
+{
+	const unsigned char *p = br_take(br, 2);
+	return (p != NULL) ? decode_u16(p) : 0;
+}
+
+
+static signed int get_i16(struct binary_reader *br)
+{
+	uint16_t v = get_u16(br);
+	return (v & 0x8000) ? (signed int)v - 0x10000 : (signed int)v;
+}
+
+
+static uint32_t get_u32(struct binary_reader *br)
+{
+	const unsigned char *p = br_take(br, 4);
+	return (p != NULL) ? decode_u32(p) : 0;
+}
+
+
+static uint64_t get_u64(struct binary_reader *br)
+{
+	const unsigned char *p = br_take(br, 8);
+	return (p != NULL) ? decode_u64(p) : 0;
+}
+
+
+static float get_f32(struct binary_reader *br)
+{
+	uint32_t u = get_u32(br);
+	float v;
+	memcpy(&v, &u, 4);
+	return v;
+}
+
+
+static double get_f64(struct binary_reader *br)
+{
+	uint64_t u = get_u64(br);
+	double v;
+	memcpy(&v, &u, 8);
+	return v;
+}
+
+
+/* Always returns a newly allocated string, possibly empty */
+static char *get_string(struct binary_reader *br)
+{
+	uint32_t len;
+	const unsigned char *p;
+
+	len = get_u32(br);
+	p = br_take(br, len);
+	if ( p == NULL ) return strdup("");
+	return strndup((const char *)p, len);
+}
+
+
+/* Reads the next record from 'fh' into 'buf', enlarging it if necessary.
+ * Returns non-zero at the end of the stream or on error. */
+static int read_binary_record(FILE *fh, unsigned char **buf, size_t *buf_size,
+                              uint32_t *type, size_t *len)
+{
+	unsigned char hdr[STREAM_RECORD_HEADER_SIZE];
+
+	if ( fread(hdr, 1, STREAM_RECORD_HEADER_SIZE, fh)
+	     != STREAM_RECORD_HEADER_SIZE )
+	{
+		if ( !feof(fh) ) ERROR("Error reading stream.\n");
+		return 1;
+	}
+
+	*type = decode_u32(hdr);
+	*len = stream_record_length(hdr);
+
+	if ( *len > *buf_size ) {
+		unsigned char *buf_new = realloc(*buf, *len);
+		if ( buf_new == NULL ) {
+			ERROR("Failed to allocate stream buffer.\n");
+			return 1;
+		}
+		*buf = buf_new;
+		*buf_size = *len;
+	}
+
+	if ( fread(*buf, 1, *len, fh) != *len ) {
+		ERROR("Incomplete record found in input file.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Gets the next record from a binary stream.  If the stream is memory-mapped,
+ * the record is used in place. */
+static int next_binary_record(Stream *st, const unsigned char **data,
+                              uint32_t *type, size_t *len)
+{
+	const unsigned char *hdr;
+
+	if ( st->map == NULL ) {
+
+		int c;
+
+		/* Check for the end of the stream at a record boundary, which
+		 * isn't an error */
+		c = getc(st->fh);
+		if ( c == EOF ) {
+			if ( ferror(st->fh) ) {
+				ERROR("Error reading stream.\n");
+			} else {
+				st->eof = 1;
+			}
+			return 1;
+		}
+		ungetc(c, st->fh);
+
+		if ( read_binary_record(st->fh, &st->buf, &st->buf_size,
+		                        type, len) ) return 1;
+		*data = st->buf;
+		return 0;
+	}
+
+	if ( st->map_pos == st->map_size ) {
+		st->eof = 1;
+		return 1;
+	}
+
+	if ( st->map_size - st->map_pos < STREAM_RECORD_HEADER_SIZE ) {
+		ERROR("Error reading stream.\n");
+		st->map_pos = st->map_size;
+		return 1;
+	}
+
+	hdr = (const unsigned char *)st->map + st->map_pos;
+	*type = decode_u32(hdr);
+	*len = stream_record_length(hdr);
+
+	if ( st->map_size - st->map_pos - STREAM_RECORD_HEADER_SIZE < *len ) {
+		ERROR("Incomplete record found in input file.\n");
+		st->map_pos = st->map_size;
+		return 1;
+	}
+
+	*data = hdr + STREAM_RECORD_HEADER_SIZE;
+	st->map_pos += STREAM_RECORD_HEADER_SIZE + *len;
+
+	return 0;
+}
+
+
+static int read_peaks_binary(struct binary_reader *br, struct image *image,
+                             uint32_t n)
+{
+	uint32_t i;
+
+	image->features = image_feature_list_new();
+
+	for ( i=0; i<n; i++ ) {
+
+		float x, y, intensity;
+		uint16_t pn;
+
+		x = get_f32(br);
+		y = get_f32(br);
+		intensity = get_f32(br);
+		pn = get_u16(br);
+
+		if ( (image->det != NULL) && (pn != BINARY_NO_PANEL) ) {
+
+			struct panel *p;
+
+			if ( pn >= image->det->n_panels ) {
+				ERROR("Panel not found: %i\n", pn);
+				return 1;
+			}
+			p = &image->det->panels[pn];
+
+			x = x - p->orig_min_fs + p->min_fs;
+			y = y - p->orig_min_ss + p->min_ss;
+
+		}
+
+		image_add_feature(image->features, x, y, image, intensity,
+		                  NULL);
+
+	}
+
+	return br->err;
+}
+
+
+static RefList *read_reflections_binary(struct binary_reader *br,
+                                        struct detector *det, uint32_t n)
+{
+	RefList *out;
+	uint32_t i;
+
+	out = reflist_new();
+	reflist_reserve(out, n);
+
+	for ( i=0; i<n; i++ ) {
+
+		signed int h, k, l;
+		double intensity, sigma;
+		float pk, bg, fs, ss;
+		uint16_t pn;
+		struct panel *p = NULL;
+		Reflection *refl;
+
+		h = get_i16(br);
+		k = get_i16(br);
+		l = get_i16(br);
+		intensity = get_f64(br);
+		sigma = get_f64(br);
+		pk = get_f32(br);
+		bg = get_f32(br);
+		fs = get_f32(br);
+		ss = get_f32(br);
+		pn = get_u16(br);
+
+		if ( (det != NULL) && (pn != BINARY_NO_PANEL) ) {
+
+			if ( pn >= det->n_panels ) {
+				ERROR("Panel not found: %i\n", pn);
+				reflist_free(out);
+				return NULL;
+			}
+			p = &det->panels[pn];
+
+			fs = fs - p->orig_min_fs + p->min_fs;
+			ss = ss - p->orig_min_ss + p->min_ss;
+
+		}
+
+		refl = add_refl(out, h, k, l);
+		set_intensity(refl, intensity);
+		set_detector_pos(refl, 0.0, fs, ss);
+		if ( p != NULL ) set_panel(refl, p);
+		set_esd_intensity(refl, sigma);
+		set_peak(refl, pk);
+		set_mean_bg(refl, bg);
+		set_redundancy(refl, 1);
+
+	}
+
+	if ( br->err ) {
+		reflist_free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+
+static int read_crystal_binary(struct binary_reader *br, struct image *image,
+                               StreamReadFlags srf)
+{
+	Crystal *cr;
+	struct rvec as, bs, cs;
+	LatticeType lattice_type;
+	char centering, unique_axis;
+	char *notes;
+	uint32_t n_refl;
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		ERROR("Failed to allocate crystal!\n");
+		return 1;
+	}
+
+	as.u = get_f64(br);  as.v = get_f64(br);  as.w = get_f64(br);
+	bs.u = get_f64(br);  bs.v = get_f64(br);  bs.w = get_f64(br);
+	cs.u = get_f64(br);  cs.v = get_f64(br);  cs.w = get_f64(br);
+	lattice_type = get_u8(br);
+	centering = get_u8(br);
+	unique_axis = get_u8(br);
+
+	crystal_set_profile_radius(cr, get_f64(br));
+	crystal_set_resolution_limit(cr, get_f64(br));
+	crystal_set_num_saturated_reflections(cr, get_u64(br));
+	crystal_set_num_implausible_reflections(cr, get_u64(br));
+
+	notes = get_string(br);
+	if ( notes[0] != '\0' ) crystal_set_notes(cr, notes);
+	free(notes);
+
+	if ( srf & STREAM_READ_UNITCELL ) {
+
+		UnitCell *cell;
+
+		cell = cell_new_from_reciprocal_axes(as, bs, cs);
+		cell_set_centering(cell, centering);
+		cell_set_unique_axis(cell, unique_axis);
+		cell_set_lattice_type(cell, lattice_type);
+		crystal_set_cell(cr, cell);
+
+	}
+
+	n_refl = get_u32(br);
+	if ( n_refl != BINARY_NO_LIST ) {
+
+		if ( srf & STREAM_READ_REFLECTIONS ) {
+
+			RefList *reflist;
+
+			reflist = read_reflections_binary(br, image->det,
+			                                  n_refl);
+			if ( reflist == NULL ) {
+				ERROR("Failed while reading reflections\n");
+				crystal_free(cr);
+				return 1;
+			}
+			crystal_set_reflections(cr, reflist);
+
+		} else {
+			br_take(br, (size_t)n_refl*BINARY_REFLECTION_SIZE);
+		}
+
+	}
+
+	/* Unused at the moment */
+	crystal_set_mosaicity(cr, 0.0);
+
+	add_crystal_to_image(image, cr);
+
+	return br->err;
+}
+
+
+static int read_chunk_binary(Stream *st, struct image *image,
+                             StreamReadFlags srf)
+{
+	struct binary_reader br;
+	const unsigned char *data;
+	uint32_t type;
+	size_t len;
+	char *ev;
+	char *fields;
+	char *line;
+	char *saveptr;
+	uint32_t n_peaks, n_crystals, i;
+
+	/* Skip over anything which isn't a chunk (e.g. the command line) */
+	do {
+		if ( next_binary_record(st, &data, &type, &len) ) return 1;
+	} while ( type != STREAM_RECORD_CHUNK );
+
+	br.pos = data;
+	br.end = data + len;
+	br.err = 0;
+
+	image->features = NULL;
+	image->crystals = NULL;
+	image->n_crystals = 0;
+	image->event = NULL;
+	image->stuff_from_stream = NULL;
+
+	if ( (srf & STREAM_READ_REFLECTIONS) || (srf & STREAM_READ_UNITCELL) ) {
+		srf |= STREAM_READ_CRYSTALS;
+	}
+
+	image->filename = get_string(&br);
+	ev = get_string(&br);
+	if ( ev[0] != '\0' ) {
+		image->event = get_event_from_event_string(ev);
+	}
+	free(ev);
+
+	image->serial = get_u32(&br);
+	image->indexed_by = get_u32(&br);
+	image->lambda = get_f64(&br);
+	image->div = get_f64(&br);
+	image->bw = get_f64(&br);
+	image->num_peaks = get_u64(&br);
+	image->num_saturated_peaks = get_u64(&br);
+
+	fields = get_string(&br);
+	for ( line = strtok_r(fields, "\n", &saveptr);
+	      line != NULL;
+	      line = strtok_r(NULL, "\n", &saveptr) )
+	{
+		if ( read_header_field(image, line) ) {
+			free(fields);
+			return 1;
+		}
+	}
+	free(fields);
+
+	n_peaks = get_u32(&br);
+	if ( n_peaks != BINARY_NO_LIST ) {
+		if ( srf & STREAM_READ_PEAKS ) {
+			if ( read_peaks_binary(&br, image, n_peaks) ) {
+				ERROR("Failed while reading peaks\n");
+				return 1;
+			}
+		} else {
+			br_take(&br, (size_t)n_peaks*BINARY_PEAK_SIZE);
+		}
+	}
+
+	/* The crystals come last, so there's nothing more to do if they
+	 * aren't wanted */
+	if ( !(srf & STREAM_READ_CRYSTALS) ) return br.err;
+
+	n_crystals = get_u32(&br);
+	for ( i=0; i<n_crystals; i++ ) {
+		if ( read_crystal_binary(&br, image, srf) ) break;
+	}
+
+	if ( br.err ) {
+		ERROR("Incomplete chunk found in input file.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Read the next chunk from a stream and fill in 'image' */
+int read_chunk_2(Stream *st, struct image *image,  StreamReadFlags srf)
+{
+	char line[1024];
+	char *rval = NULL;
+	int have_filename = 0;
+	int have_ev = 0;
+
+	st->eof = 0;
+
+	if ( st->format == STREAM_FORMAT_BINARY ) {
+		return read_chunk_binary(st, image, srf);
+	}
+
+	if ( find_start_of_chunk(st) ) {
+		st->eof = stream_at_eof(st);
+		return 1;
+	}
+
+	image->lambda = -1.0;
+	image->features = NULL;
+	image->crystals = NULL;
+	image->n_crystals = 0;
+	image->event = NULL;
+	image->stuff_from_stream = NULL;
+
+	if ( (srf & STREAM_READ_REFLECTIONS) || (srf & STREAM_READ_UNITCELL) ) {
+		srf |= STREAM_READ_CRYSTALS;
+	}
+
+	do {
+		long long num_peaks;
+		int ser;
+		float div, bw;
+
+		rval = stream_fgets(line, 1023, st);
+
+		/* Trouble? */
+		if ( rval == NULL ) break;
+
+		chomp(line);
+
+		if ( strncmp(line, "Image filename: ", 16) == 0 ) {
+			image->filename = strdup(line+16);
+			have_filename = 1;
+		}
+
+		if ( strncmp(line, "Event: ", 7) == 0 ) {
+			image->event = get_event_from_event_string(line+7);
+		}
+
+		if ( strncmp(line, "indexed_by = ", 13) == 0 ) {
+			IndexingMethod *list;
+			list = build_indexer_list(line+13);
+			image->indexed_by = list[0];
+			free(list);
+			have_filename = 1;
+		}
+
+		if ( strncmp(line, "photon_energy_eV = ", 19) == 0 ) {
+			image->lambda = ph_en_to_lambda(eV_to_J(atof(line+19)));
+			have_ev = 1;
+		}
+
+		if ( sscanf(line, "beam_divergence = %e rad", &div) == 1 ) {
+			image->div = div;
+		}
+
+		if ( sscanf(line, "beam_bandwidth = %f", &bw) == 1 ) {
+			/* Older streams gave the bandwidth as a percentage */
+			if ( strchr(line, '%') != NULL ) bw /= 100.0;
+			image->bw = bw;
+		}
+
+		if ( sscanf(line, "num_peaks = %lld %%", &num_peaks) == 1 ) {
+			image->num_peaks = num_peaks;
+		}
+
+		if ( sscanf(line, "num_saturated_peaks = %lld",
+		            &num_peaks) == 1 ) {
+			image->num_saturated_peaks = num_peaks;
+		}
+
+		if ( sscanf(line, "Image serial number: %i", &ser) == 1 ) {
+			image->serial = ser;
+		}
+
+		if ( read_header_field(image, line) ) return 1;
+
+		if ( (srf & STREAM_READ_PEAKS)
+		    && strcmp(line, PEAK_LIST_START_MARKER) == 0 ) {
+
+			int fail;
+
+			if ( AT_LEAST_VERSION(st, 2, 3) ) {
+				fail = read_peaks_2_3(st, image);
+			} else {
+				fail = read_peaks(st, image);
+			}
+			if ( fail ) {
+				ERROR("Failed while reading peaks\n");
+				return 1;
+			}
+		}
+
+		if ( (srf & STREAM_READ_CRYSTALS)
+		  && (strcmp(line, CRYSTAL_START_MARKER) == 0) ) {
+			read_crystal(st, image, srf);
+		}
+
+		/* A chunk must have at least a filename and a wavelength,
+		 * otherwise it's incomplete */
+		if ( strcmp(line, CHUNK_END_MARKER) == 0 ) {
+			if ( have_filename && have_ev ) return 0;
+			ERROR("Incomplete chunk found in input file.\n");
+			return 1;
+		}
+
+	} while ( 1 );
+
+	if ( !stream_at_eof(st) ) {
+		ERROR("Error reading stream.\n");
+	}
+
+	return 1;  /* Either error or EOF, don't care because we will complain
+	            * on the terminal if it was an error. */
+}
+
+
+int read_chunk(Stream *st, struct image *image)
+{
+	return read_chunk_2(st, image, STREAM_READ_UNITCELL
+	                               | STREAM_READ_REFLECTIONS
+	                               | STREAM_READ_PEAKS);
+}
+
+
+void write_stream_header(FILE *ofh, int argc, char *argv[])
+{
+	int i;
+
+	fprintf(ofh, "Command line:");
+	for ( i=0; i<argc; i++ ) {
+		fprintf(ofh, " %s", argv[i]);
+	}
+	fprintf(ofh, "\n");
+	fflush(ofh);
+}
+
+
+static void init_stream(Stream *st, StreamFormat format)
+{
+	st->format = format;
+	st->eof = 0;
+	st->data_start = 0;
+	st->buf = NULL;
+	st->buf_size = 0;
+	st->filename = NULL;
+	st->chunks = NULL;
+	st->n_chunks = 0;
+	st->max_chunks = 0;
+	st->have_index = 0;
+	st->index_fh = NULL;
+	st->written = 0;
+	st->map = NULL;
+	st->map_size = 0;
+	st->map_pos = 0;
+	st->map_shared = 0;
+	st->in_memory = 0;
+	st->mem = NULL;
+	st->mem_size = 0;
+}
+
+
+static char *index_filename(const char *filename)
+{
+	char *idx;
+
+	idx = malloc(strlen(filename)+5);
+	if ( idx == NULL ) return NULL;
+	strcpy(idx, filename);
+	strcat(idx, ".idx");
+	return idx;
+}
+
+
+Stream *open_stream_for_read(const char *filename)
+{
+	Stream *st;
+
+	st = malloc(sizeof(struct _stream));
+	if ( st == NULL ) return NULL;
+
+	init_stream(st, STREAM_FORMAT_TEXT);
+
+	if ( strcmp(filename, "-") == 0 ) {
+		st->fh = stdin;
+	} else {
+		st->fh = fopen(filename, "r");
+		st->filename = strdup(filename);
+	}
+
+	if ( st->fh == NULL ) {
+		free(st->filename);
+		free(st);
+		return NULL;
+	}
+
+	/* Regular files are read via a memory mapping, pipes via the FILE* */
+	map_stream(st);
+
+	char line[1024];
+	char *rval;
+
+	rval = stream_fgets(line, 1023, st);
+	if ( rval == NULL ) {
+		ERROR("Failed to read stream version.\n");
+		close_stream(st);
+		return NULL;
+	}
+
+	if ( strncmp(line, "CrystFEL stream format 2.0", 26) == 0 ) {
+		st->major_version = 2;
+		st->minor_version = 0;
+	} else if ( strncmp(line, "CrystFEL stream format 2.1", 26) == 0 ) {
+		st->major_version = 2;
+		st->minor_version = 1;
+	} else if ( strncmp(line, "CrystFEL stream format 2.2", 26) == 0 ) {
+		st->major_version = 2;
+		st->minor_version = 2;
+	} else if ( strncmp(line, "CrystFEL stream format 2.3", 26) == 0 ) {
+		st->major_version = 2;
+		st->minor_version = 3;
+	} else if ( strncmp(line, BINARY_STREAM_MAGIC" 1.0", 33) == 0 ) {
+		st->format = STREAM_FORMAT_BINARY;
+		st->major_version = 1;
+		st->minor_version = 0;
+		st->data_start = stream_tell(st);
+	} else {
+		ERROR("Invalid stream, or stream format is too new.\n");
+		close_stream(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+
+/**
+ * open_stream_fd_for_write_2
+ * @fd: File descriptor (e.g. from open()) to use for stream data.
+ * @format: A %StreamFormat
+ *
+ * Creates a new %Stream from @fd, so that stream data can be written to @fd
+ * using write_chunk().
+ *
+ * In contrast to open_stream_for_write_3(), this function does not write any
+ * of the usual headers.  This function is mostly for use when multiple
+ * substreams need to be multiplexed into a single master stream.  The master
+ * would be opened using open_stream_for_write_3(), and the substreams using
+ * this function with the same @format.
+ *
+ * Returns: a %Stream, or NULL on failure.
+ */
+Stream *open_stream_fd_for_write_2(int fd, StreamFormat format)
+{
+	Stream *st;
+
+	st = malloc(sizeof(struct _stream));
+	if ( st == NULL ) return NULL;
+
+	st->fh = fdopen(fd, "w");
+	if ( st->fh == NULL ) {
+		free(st);
+		return NULL;
+	}
+
+	init_stream(st, format);
+
+	if ( format == STREAM_FORMAT_BINARY ) {
+		st->major_version = LATEST_BINARY_MAJOR_VERSION;
+		st->minor_version = LATEST_BINARY_MINOR_VERSION;
+	} else {
+		st->major_version = LATEST_MAJOR_VERSION;
+		st->minor_version = LATEST_MINOR_VERSION;
+	}
+
+	return st;
+}
+
+
+/**
+ * open_stream_fd_for_write
+ * @fd: File descriptor (e.g. from open()) to use for stream data.
+ *
+ * As open_stream_fd_for_write_2(), for a text stream.
+ *
+ * Returns: a %Stream, or NULL on failure.
+ */
+Stream *open_stream_fd_for_write(int fd)
+{
+	return open_stream_fd_for_write_2(fd, STREAM_FORMAT_TEXT);
+}
+
+
+/**
+ * open_stream_for_write_buffer
+ * @format: A %StreamFormat
+ *
+ * Creates a new %Stream which keeps the stream data in memory.  As with
+ * open_stream_fd_for_write_2(), no headers are written.  This is for
+ * preparing chunks in one thread to be written to the master stream by
+ * another.  Use write_stream_buffer() to add the chunks to the master stream,
+ * or close_stream_buffer() to get the data.
+ *
+ * Returns: a %Stream, or NULL on failure.
+ */
+Stream *open_stream_for_write_buffer(StreamFormat format)
+{
+	Stream *st;
+
+	st = malloc(sizeof(struct _stream));
+	if ( st == NULL ) return NULL;
+
+	init_stream(st, format);
+
+	st->fh = open_memstream(&st->mem, &st->mem_size);
+	if ( st->fh == NULL ) {
+		free(st);
+		return NULL;
+	}
+	st->in_memory = 1;
+
+	if ( format == STREAM_FORMAT_BINARY ) {
+		st->major_version = LATEST_BINARY_MAJOR_VERSION;
+		st->minor_version = LATEST_BINARY_MINOR_VERSION;
+	} else {
+		st->major_version = LATEST_MAJOR_VERSION;
+		st->minor_version = LATEST_MINOR_VERSION;
+	}
+
+	return st;
+}
+
+
+/**
+ * close_stream_buffer
+ * @st: A %Stream created with open_stream_for_write_buffer()
+ * @len: Place to store the length of the data
+ *
+ * Closes @st, which must have been created by open_stream_for_write_buffer(),
+ * and returns the data which was written to it.
+ *
+ * Returns: the stream data, which the caller must free(), or NULL on failure.
+ */
+char *close_stream_buffer(Stream *st, size_t *len)
+{
+	char *mem;
+
+	if ( fclose(st->fh) ) {
+		free(st->mem);
+		mem = NULL;
+		*len = 0;
+	} else {
+		mem = st->mem;
+		*len = st->mem_size;
+	}
+
+	free_index(st);
+	free(st->buf);
+	free(st);
+
+	return mem;
+}
+
+
+/**
+ * write_stream_buffer
+ * @st: A %Stream
+ * @buf: A %Stream created with open_stream_for_write_buffer()
+ *
+ * Closes @buf, and writes the chunks which were written to it onto the end of
+ * @st, adding them to the chunk index of @st.  @buf must have been created
+ * with the same %StreamFormat as @st.
+ *
+ * Returns: non-zero on failure.
+ */
+int write_stream_buffer(Stream *st, Stream *buf)
+{
+	struct chunk_index_entry *chunks;
+	int n_chunks;
+	char *data;
+	size_t len;
+	off_t start;
+	int i;
+	int r = 0;
+
+	/* Take the index before close_stream_buffer() frees it */
+	chunks = buf->chunks;
+	n_chunks = buf->n_chunks;
+	buf->chunks = NULL;
+	buf->n_chunks = 0;
+
+	data = close_stream_buffer(buf, &len);
+	if ( data == NULL ) {
+		ERROR("Failed to close stream buffer.\n");
+		r = 1;
+		goto out;
+	}
+
+	start = ftello(st->fh);
+	if ( fwrite(data, 1, len, st->fh) != len ) {
+		ERROR("Failed to write chunk: %s\n", strerror(errno));
+		r = 1;
+		goto out;
+	}
+	fflush(st->fh);
+
+	if ( st->index_fh != NULL ) {
+		for ( i=0; i<n_chunks; i++ ) {
+			struct chunk_index_entry *e = &chunks[i];
+			fprintf(st->index_fh, "%lld %i %s %s\n",
+			        (long long)(start+e->offset), e->n_crystals,
+			        (e->event != NULL) ? e->event : "-",
+			        e->filename);
+		}
+		st->written = ftello(st->fh);
+	}
+
+out:
+	for ( i=0; i<n_chunks; i++ ) {
+		free(chunks[i].filename);
+		free(chunks[i].event);
+	}
+	free(chunks);
+	free(data);
+	return r;
+}
+
+
+/**
+ * open_stream_for_write_3
+ * @filename: Filename of new stream
+ * @geom_filename: The geometry filename to copy
+ * @argc: The number of arguments to the program
+ * @argv: The arguments to the program
+ * @format: A %StreamFormat
+ *
+ * Creates a new stream with name @filename, and adds the stream format
+ * and version header, plus a verbatim copy of the geometry file.  The rest of
+ * the stream will be written in @format.
+ *
+ * Returns: a %Stream, or NULL on failure.
+ */
+Stream *open_stream_for_write_3(const char *filename,
+                                const char *geom_filename, int argc,
+                                char *argv[], StreamFormat format)
+
+{
+	Stream *st;
+	char *idx_filename;
+
+	st = malloc(sizeof(struct _stream));
+	if ( st == NULL ) return NULL;
+
+	st->fh = fopen(filename, "w");
+	if ( st->fh == NULL ) {
+		ERROR("Failed to open stream.\n");
+		free(st);
+		return NULL;
+	}
+
+	init_stream(st, format);
+
+	if ( format == STREAM_FORMAT_BINARY ) {
+
+		st->major_version = LATEST_BINARY_MAJOR_VERSION;
+		st->minor_version = LATEST_BINARY_MINOR_VERSION;
+
+		/* The rest of the binary stream is made of records, which
+		 * start straight after this line */
+		fprintf(st->fh, BINARY_STREAM_MAGIC" %i.%i\n",
+		        st->major_version, st->minor_version);
+		st->data_start = ftello(st->fh);
+
+	} else {
+
+		st->major_version = LATEST_MAJOR_VERSION;
+		st->minor_version = LATEST_MINOR_VERSION;
+
+		fprintf(st->fh, "CrystFEL stream format %i.%i\n",
+		        st->major_version, st->minor_version);
+		fprintf(st->fh, "Generated by CrystFEL "
+		                CRYSTFEL_VERSIONSTRING"\n");
+
+	}
+	fflush(st->fh);
+	st->written = ftello(st->fh);
+
+	/* Start the chunk index.  Not being able to write it is not an error,
+	 * because it can be re-created later if needed. */
+	st->filename = strdup(filename);
+	idx_filename = index_filename(filename);
+	if ( idx_filename != NULL ) {
+		st->index_fh = fopen(idx_filename, "w");
+		if ( st->index_fh != NULL ) {
+			fprintf(st->index_fh, INDEX_HEADER"\n");
 		}
+		free(idx_filename);
+	}
 
-		if ( strcmp(line, CRYSTAL_END_MARKER) == 0 ) break;
+	if ( (argc > 0) && (argv != NULL) ) {
+		write_command(st, argc, argv);
+	}
+	if ( geom_filename != NULL ) {
+		write_geometry_file(st, geom_filename);
+	}
 
-	} while ( 1 );
+	return st;
+}
 
-	if ( have_as && have_bs && have_cs ) {
 
-		UnitCell *cell;
+/**
+ * open_stream_for_write_2
+ * @filename: Filename of new stream
+ * @geom_filename: The geometry filename to copy
+ * @argc: The number of arguments to the program
+ * @argv: The arguments to the program
+ *
+ * Creates a new text stream with name @filename, and adds the stream format
+ * and version header, plus a verbatim copy of the geometry file
+ *
+ * You may want to follow this with a call to write_command() to record the
+ * command line.
+ *
+ * Returns: a %Stream, or NULL on failure.
+ */
+Stream *open_stream_for_write_2(const char *filename,
+                                const char *geom_filename, int argc,
+                                char *argv[])
+{
+	return open_stream_for_write_3(filename, geom_filename, argc, argv,
+	                               STREAM_FORMAT_TEXT);
+}
 
-		cell = crystal_get_cell(cr);
 
-		if ( cell != NULL ) {
-			ERROR("Duplicate cell found in stream!\n");
-			ERROR("I'll use the most recent one.\n");
-			cell_free(cell);
-		}
+/**
+ * open_stream_for_write
+ * @filename: Filename of new stream
+ *
+ * Creates a new stream with name @filename, and adds the stream format
+ * and version headers.
+ *
+ * You may want to follow this with a call to write_command() to record the
+ * command line.
+ *
+ * Returns: a %Stream, or NULL on failure.
+ */
+Stream *open_stream_for_write(const char *filename)
+{
+	return open_stream_for_write_2(filename, NULL, 0, NULL);
+}
 
-		cell = cell_new_from_reciprocal_axes(as, bs, cs);
 
-		if ( have_cen && have_ua && have_latt ) {
-			cell_set_centering(cell, centering);
-			cell_set_unique_axis(cell, unique_axis);
-			cell_set_lattice_type(cell, lattice_type);
-		} /* else keep default triclinic P */
+/**
+ * get_stream_fd
+ * @st: A %Stream
+ *
+ * This function gets the integer file descriptor for @st, a bit like fileno().
+ *
+ * This is useful in conjunction with open_stream_fd_for_write(), to get the
+ * underlying file descriptor to which the multiplexed stream data should be
+ * written.  In this case, the only other operations you should ever do (or have
+ * done) on @st are open_stream_for_write() and close_stream().
+ *
+ * Returns: an integer file descriptor
+ */
+int get_stream_fd(Stream *st)
+{
+	return fileno(st->fh);
+}
 
-		crystal_set_cell(cr, cell);
 
-		have_as = 0;  have_bs = 0;  have_cs = 0;
-		have_latt = 0;  have_ua = 0;  have_cen = 0;
+/**
+ * get_stream_format
+ * @st: A %Stream
+ *
+ * Returns: the %StreamFormat of @st.
+ */
+StreamFormat get_stream_format(Stream *st)
+{
+	return st->format;
+}
 
-	}
 
-	/* Unused at the moment */
-	crystal_set_mosaicity(cr, 0.0);
+/* Reads the index from the sidecar file, if it exists and matches the size of
+ * the stream. */
+static int read_index_file(Stream *st, off_t stream_size)
+{
+	char *idx_filename;
+	FILE *fh;
+	char line[4096];
+	int done = 0;
 
-	/* Add crystal to the list for this image */
-	n = image->n_crystals+1;
-	crystals_new = realloc(image->crystals, n*sizeof(Crystal *));
+	idx_filename = index_filename(st->filename);
+	if ( idx_filename == NULL ) return 1;
+	fh = fopen(idx_filename, "r");
+	free(idx_filename);
+	if ( fh == NULL ) return 1;
 
-	if ( crystals_new == NULL ) {
-		ERROR("Failed to expand crystal list!\n");
-	} else {
-		image->crystals = crystals_new;
-		image->crystals[image->n_crystals++] = cr;
+	if ( (fgets(line, 4095, fh) == NULL)
+	  || (strncmp(line, INDEX_HEADER, strlen(INDEX_HEADER)) != 0) )
+	{
+		fclose(fh);
+		return 1;
 	}
 
-}
+	while ( fgets(line, 4095, fh) != NULL ) {
 
+		long long int offset;
+		int n_crystals;
+		char event[1024];
+		int n;
 
-static int read_and_store_hdf5_field(struct image *image, const char *line)
-{
+		chomp(line);
 
-	char **new_fields;
+		if ( strncmp(line, INDEX_END_MARKER,
+		             strlen(INDEX_END_MARKER)) == 0 )
+		{
+			long long int size;
+			if ( (sscanf(line+strlen(INDEX_END_MARKER), "%lld",
+			             &size) == 1) && (size == stream_size) )
+			{
+				done = 1;
+			}
+			break;
+		}
 
-	if ( image->stuff_from_stream == NULL ) {
-		image->stuff_from_stream =
-		       malloc(sizeof(struct stuff_from_stream));
-		if ( image->stuff_from_stream == NULL) {
-			ERROR("Failed reading hdf5 entries from "
-			      "stream\n");
-			return 1;
+		if ( sscanf(line, "%lld %i %1023s %n", &offset, &n_crystals,
+		            event, &n) < 3 ) break;
+
+		if ( add_index_entry(st, offset, n_crystals, line+n,
+		                     (strcmp(event, "-") == 0) ? NULL : event) )
+		{
+			break;
 		}
-		image->stuff_from_stream->fields = NULL;
-		image->stuff_from_stream->n_fields = 0;
+
 	}
 
-	new_fields = realloc(image->stuff_from_stream->fields,
-			     (1+image->stuff_from_stream->n_fields)*
-			     sizeof(char *));
-	if ( new_fields == NULL ) {
-		ERROR("Failed reading hdf5 entries from stream\n");
+	fclose(fh);
+
+	if ( !done ) {
+		free_index(st);
 		return 1;
 	}
-	image->stuff_from_stream->fields = new_fields;
-	image->stuff_from_stream->fields[image->stuff_from_stream->n_fields]
-							     = strdup(line);
-	image->stuff_from_stream->n_fields++;
 
 	return 0;
 }
 
 
-/* Read the next chunk from a stream and fill in 'image' */
-int read_chunk_2(Stream *st, struct image *image,  StreamReadFlags srf)
+static int build_index_text(Stream *st, FILE *fh)
 {
 	char line[1024];
-	char *rval = NULL;
-	int have_filename = 0;
-	int have_ev = 0;
+	off_t pos = 0;
+	off_t chunk_start = 0;
+	int in_chunk = 0;
+	int n_crystals = 0;
+	char *filename = NULL;
+	char *event = NULL;
 
-	if ( find_start_of_chunk(st->fh) ) return 1;
+	while ( fgets(line, 1023, fh) != NULL ) {
 
-	image->lambda = -1.0;
-	image->features = NULL;
-	image->crystals = NULL;
-	image->n_crystals = 0;
-	image->event = NULL;
-	image->stuff_from_stream = NULL;
+		off_t line_start = pos;
+
+		pos += strlen(line);
+		chomp(line);
+
+		if ( strcmp(line, CHUNK_START_MARKER) == 0 ) {
+			chunk_start = line_start;
+			in_chunk = 1;
+			n_crystals = 0;
+			free(filename);
+			free(event);
+			filename = NULL;
+			event = NULL;
+			continue;
+		}
+
+		if ( !in_chunk ) continue;
+
+		if ( strncmp(line, "Image filename: ", 16) == 0 ) {
+			free(filename);
+			filename = strdup(line+16);
+		} else if ( strncmp(line, "Event: ", 7) == 0 ) {
+			free(event);
+			event = strdup(line+7);
+		} else if ( strcmp(line, CRYSTAL_START_MARKER) == 0 ) {
+			n_crystals++;
+		} else if ( strcmp(line, CHUNK_END_MARKER) == 0 ) {
+			in_chunk = 0;
+			if ( add_index_entry(st, chunk_start, n_crystals,
+			                     (filename != NULL) ? filename : "",
+			                     event) ) break;
+		}
 
-	if ( (srf & STREAM_READ_REFLECTIONS) || (srf & STREAM_READ_UNITCELL) ) {
-		srf |= STREAM_READ_CRYSTALS;
 	}
 
-	do {
-		long long num_peaks;
-		int ser;
-		float div, bw;
+	/* A chunk cut off by the end of the stream is left out of the index */
+	if ( in_chunk ) ERROR(TRUNCATED_CHUNK_WARNING);
 
-		rval = fgets(line, 1023, st->fh);
+	free(filename);
+	free(event);
 
-		/* Trouble? */
-		if ( rval == NULL ) break;
+	return ferror(fh);
+}
 
-		chomp(line);
 
-		if ( strncmp(line, "Image filename: ", 16) == 0 ) {
-			image->filename = strdup(line+16);
-			have_filename = 1;
-		}
+static int build_index_binary(Stream *st, FILE *fh)
+{
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	int r = 0;
 
-		if ( strncmp(line, "Event: ", 7) == 0 ) {
-			image->event = get_event_from_event_string(line+7);
-		}
+	if ( fseeko(fh, st->data_start, SEEK_SET) ) return 1;
 
-		if ( strncmp(line, "indexed_by = ", 13) == 0 ) {
-			IndexingMethod *list;
-			list = build_indexer_list(line+13);
-			image->indexed_by = list[0];
-			free(list);
-			have_filename = 1;
-		}
+	do {
 
-		if ( strncmp(line, "photon_energy_eV = ", 19) == 0 ) {
-			image->lambda = ph_en_to_lambda(eV_to_J(atof(line+19)));
-			have_ev = 1;
+		off_t offset = ftello(fh);
+		struct binary_reader br;
+		uint32_t type;
+		size_t len;
+		char *filename;
+		char *event;
+		uint32_t n_peaks, n_crystals;
+
+		if ( read_binary_record(fh, &buf, &buf_size, &type, &len) ) {
+			r = ferror(fh);
+			if ( !r && (ftello(fh) != offset) ) {
+				ERROR(TRUNCATED_CHUNK_WARNING);
+			}
+			break;
 		}
-
-		if ( sscanf(line, "beam_divergence = %e rad", &div) == 1 ) {
-			image->div = div;
+		if ( type != STREAM_RECORD_CHUNK ) continue;
+
+		br.pos = buf;
+		br.end = buf + len;
+		br.err = 0;
+
+		filename = get_string(&br);
+		event = get_string(&br);
+
+		/* Serial, indexing method, wavelength, divergence, bandwidth
+		 * and the two peak counts */
+		br_take(&br, 4+4+8+8+8+8+8);
+		free(get_string(&br));
+		n_peaks = get_u32(&br);
+		if ( n_peaks != BINARY_NO_LIST ) {
+			br_take(&br, (size_t)n_peaks*BINARY_PEAK_SIZE);
 		}
+		n_crystals = get_u32(&br);
 
-		if ( sscanf(line, "beam_bandwidth = %f %%", &bw) == 1 ) {
-			image->bw = bw/100.0;
+		if ( br.err ) {
+			ERROR("Incomplete chunk found in input file.\n");
+			r = 1;
+		} else {
+			r = add_index_entry(st, offset, n_crystals, filename,
+			                    event);
 		}
 
-		if ( sscanf(line, "num_peaks = %lld %%", &num_peaks) == 1 ) {
-			image->num_peaks = num_peaks;
-		}
+		free(filename);
+		free(event);
 
-		if ( sscanf(line, "Image serial number: %i", &ser) == 1 ) {
-			image->serial = ser;
-		}
+	} while ( !r );
 
-		if ( strncmp(line, "camera_length_", 14) == 0 ) {
-			if ( image->det != NULL ) {
+	free(buf);
+	return r;
+}
 
-				int k;
-				char name[1024];
-				struct panel *p;
 
-				for ( k=0; k<strlen(line)-14; k++ ) {
-					char ch = line[k+14];
-					name[k] = ch;
-					if ( (ch == ' ') || (ch == '=') ) {
-						name[k] = '\0';
-						break;
-					}
-				}
+static void write_index_file(Stream *st, off_t stream_size)
+{
+	char *idx_filename;
+	FILE *fh;
+	int i;
 
-				p = find_panel_by_name(image->det, name);
-				if ( p == NULL ) {
-					ERROR("No panel '%s'\n", name);
-				} else {
-					p->clen = atof(line+14+k+3);
-				}
+	idx_filename = index_filename(st->filename);
+	if ( idx_filename == NULL ) return;
+	fh = fopen(idx_filename, "w");
+	free(idx_filename);
+	if ( fh == NULL ) return;
+
+	fprintf(fh, INDEX_HEADER"\n");
+	for ( i=0; i<st->n_chunks; i++ ) {
+		struct chunk_index_entry *e = &st->chunks[i];
+		fprintf(fh, "%lld %i %s %s\n", (long long)e->offset,
+		        e->n_crystals, (e->event != NULL) ? e->event : "-",
+		        e->filename);
+	}
+	fprintf(fh, INDEX_END_MARKER" %lld\n", (long long)stream_size);
+	fclose(fh);
+}
 
-			}
-		}
 
-		if ( strncmp(line, "hdf5", 3) == 0 ) {
+/* Finishes off the index which was written alongside the stream.  If anything
+ * other than write_chunk() wrote to the stream (e.g. indexamajig, which
+ * multiplexes the output of its worker processes directly into the file
+ * descriptor), the index is incomplete, so the stream is scanned to make a new
+ * one. */
+static void finish_written_index(Stream *st)
+{
+	struct stat statbuf;
+	FILE *fh;
+	int r;
 
-			int fail;
+	fflush(st->fh);
 
-			fail = read_and_store_hdf5_field(image, line);
-			if ( fail ) {
-				ERROR("Failed to read hd5 fields from stream.\n");
-				return 1;
-			}
-		}
+	if ( fstat(fileno(st->fh), &statbuf) ) {
+		fclose(st->index_fh);
+		return;
+	}
 
-		if ( (srf & STREAM_READ_PEAKS)
-		    && strcmp(line, PEAK_LIST_START_MARKER) == 0 ) {
+	if ( statbuf.st_size == st->written ) {
+		fprintf(st->index_fh, INDEX_END_MARKER" %lld\n",
+		        (long long)st->written);
+		fclose(st->index_fh);
+		return;
+	}
 
-			int fail;
+	/* Start again from the beginning.  The old index is left without an
+	 * end marker (and so will be ignored) if this fails. */
+	fclose(st->index_fh);
+	fh = fopen(st->filename, "r");
+	if ( fh == NULL ) return;
+	if ( st->format == STREAM_FORMAT_BINARY ) {
+		r = build_index_binary(st, fh);
+	} else {
+		r = build_index_text(st, fh);
+	}
+	fclose(fh);
 
-			if ( AT_LEAST_VERSION(st, 2, 3) ) {
-				fail = read_peaks_2_3(st->fh, image);
-			} else {
-				fail = read_peaks(st->fh, image);
-			}
-			if ( fail ) {
-				ERROR("Failed while reading peaks\n");
-				return 1;
-			}
-		}
+	if ( !r ) write_index_file(st, statbuf.st_size);
+}
 
-		if ( (srf & STREAM_READ_CRYSTALS)
-		  && (strcmp(line, CRYSTAL_START_MARKER) == 0) ) {
-			read_crystal(st, image, srf);
-		}
 
-		/* A chunk must have at least a filename and a wavelength,
-		 * otherwise it's incomplete */
-		if ( strcmp(line, CHUNK_END_MARKER) == 0 ) {
-			if ( have_filename && have_ev ) return 0;
-			ERROR("Incomplete chunk found in input file.\n");
-			return 1;
-		}
+void close_stream(Stream *st)
+{
+	if ( st->index_fh != NULL ) finish_written_index(st);
+	unmap_stream(st);
+	fclose(st->fh);
+	free_index(st);
+	free(st->filename);
+	free(st->buf);
+	free(st);
+}
+
+
+static int load_index(Stream *st)
+{
+	struct stat statbuf;
+	FILE *fh;
+	int r;
+
+	if ( st->have_index ) return 0;
+
+	/* Only possible for streams which were opened for reading from a
+	 * real file */
+	if ( (st->filename == NULL) || (st->index_fh != NULL) ) return 1;
+	if ( stat(st->filename, &statbuf) ) return 1;
+	if ( !S_ISREG(statbuf.st_mode) ) return 1;
+
+	if ( read_index_file(st, statbuf.st_size) == 0 ) {
+		st->have_index = 1;
+		return 0;
+	}
 
-	} while ( 1 );
+	/* Scan the stream using a separate file handle, so that the position
+	 * of the caller's handle is not disturbed. */
+	fh = fopen(st->filename, "r");
+	if ( fh == NULL ) return 1;
+	if ( st->format == STREAM_FORMAT_BINARY ) {
+		r = build_index_binary(st, fh);
+	} else {
+		r = build_index_text(st, fh);
+	}
+	fclose(fh);
 
-	if ( !feof(st->fh) ) {
-		ERROR("Error reading stream.\n");
+	if ( r ) {
+		ERROR("Failed to index stream '%s'\n", st->filename);
+		free_index(st);
+		return 1;
 	}
 
-	return 1;  /* Either error or EOF, don't care because we will complain
-	            * on the terminal if it was an error. */
+	st->have_index = 1;
+	return 0;
 }
 
 
-int read_chunk(Stream *st, struct image *image)
+/**
+ * stream_num_chunks:
+ * @st: A %Stream
+ *
+ * Finds the number of chunks in @st, which must have been opened using
+ * open_stream_for_read() with a real filename (i.e. not "-").
+ *
+ * The chunk index is read from the sidecar file "<stream>.idx" written
+ * alongside the stream by open_stream_for_write_3() and close_stream().  If the
+ * sidecar file is missing or does not match the stream, the stream will be
+ * scanned once to build the index in memory.  The sidecar file is only ever
+ * written by the program which writes the stream.
+ *
+ * Returns: the number of chunks, or -1 if the stream could not be indexed.
+ */
+int stream_num_chunks(Stream *st)
 {
-	return read_chunk_2(st, image, STREAM_READ_UNITCELL
-	                               | STREAM_READ_REFLECTIONS
-	                               | STREAM_READ_PEAKS);
+	if ( load_index(st) ) return -1;
+	return st->n_chunks;
 }
 
 
-void write_stream_header(FILE *ofh, int argc, char *argv[])
+/**
+ * stream_seek_chunk:
+ * @st: A %Stream
+ * @n: Index of the chunk, counting from zero
+ *
+ * Sets the file pointer for @st so that the next call to read_chunk() or
+ * read_chunk_2() will read chunk number @n.  See stream_num_chunks() for
+ * restrictions and details of the index.
+ *
+ * Returns: non-zero on failure.
+ */
+int stream_seek_chunk(Stream *st, int n)
+{
+	if ( load_index(st) ) return 1;
+	if ( (n < 0) || (n >= st->n_chunks) ) return 1;
+	return stream_seek(st, st->chunks[n].offset);
+}
+
+
+/**
+ * stream_chunk_info:
+ * @st: A %Stream
+ * @n: Index of the chunk, counting from zero
+ * @filename: Location at which to store a pointer to the image filename
+ * @event: Location at which to store a pointer to the event ID
+ * @n_crystals: Location at which to store the number of crystals
+ *
+ * Looks up chunk number @n of @st in the chunk index, without reading the
+ * chunk itself.  Any of @filename, @event and @n_crystals may be NULL if the
+ * corresponding value is not wanted.  The strings remain owned by @st, and
+ * @event will be set to NULL if the chunk has no event ID.
+ *
+ * Returns: non-zero on failure.
+ */
+int stream_chunk_info(Stream *st, int n, const char **filename,
+                      const char **event, int *n_crystals)
+{
+	if ( load_index(st) ) return 1;
+	if ( (n < 0) || (n >= st->n_chunks) ) return 1;
+	if ( filename != NULL ) *filename = st->chunks[n].filename;
+	if ( event != NULL ) *event = st->chunks[n].event;
+	if ( n_crystals != NULL ) *n_crystals = st->chunks[n].n_crystals;
+	return 0;
+}
+
+
+/* Frees everything which read_chunk_2() allocated for an image */
+static void free_chunk_contents(struct image *image)
 {
 	int i;
 
-	fprintf(ofh, "Command line:");
-	for ( i=0; i<argc; i++ ) {
-		fprintf(ofh, " %s", argv[i]);
+	for ( i=0; i<image->n_crystals; i++ ) {
+		Crystal *cr = image->crystals[i];
+		reflist_free(crystal_get_reflections(cr));
+		cell_free(crystal_get_cell(cr));
+		crystal_free(cr);
 	}
-	fprintf(ofh, "\n");
-	fflush(ofh);
+	free(image->crystals);
+
+	if ( image->stuff_from_stream != NULL ) {
+		for ( i=0; i<image->stuff_from_stream->n_fields; i++ ) {
+			free(image->stuff_from_stream->fields[i]);
+		}
+		free(image->stuff_from_stream->fields);
+		free(image->stuff_from_stream);
+	}
+
+	image_feature_list_free(image->features);
+	if ( image->event != NULL ) free_event(image->event);
+	free(image->filename);
 }
 
 
-Stream *open_stream_for_read(const char *filename)
+static void init_chunk_image(struct image *image, struct detector *det)
 {
-	Stream *st;
+	image->det = det;
+	image->copyme = NULL;
+	image->filename = NULL;
+	image->serial = 0;
+	image->indexed_by = INDEXING_NONE;
+	image->num_peaks = 0;
+	image->num_saturated_peaks = 0;
+
+	/* Left as NaN if the chunk doesn't say */
+	image->div = NAN;
+	image->bw = NAN;
+}
 
-	st = malloc(sizeof(struct _stream));
-	if ( st == NULL ) return NULL;
 
-	if ( strcmp(filename, "-") == 0 ) {
-		st->fh = stdin;
-	} else {
-		st->fh = fopen(filename, "r");
-	}
+/* Opens another handle on the same stream, for a reader thread */
+static Stream *reopen_stream_for_read(Stream *st)
+{
+	Stream *n;
 
-	if ( st->fh == NULL ) {
-		free(st);
-		return NULL;
-	}
+	n = malloc(sizeof(struct _stream));
+	if ( n == NULL ) return NULL;
 
-	char line[1024];
-	char *rval;
+	init_stream(n, st->format);
+	n->major_version = st->major_version;
+	n->minor_version = st->minor_version;
+	n->data_start = st->data_start;
 
-	rval = fgets(line, 1023, st->fh);
-	if ( rval == NULL ) {
-		ERROR("Failed to read stream version.\n");
-		close_stream(st);
+	n->fh = fopen(st->filename, "r");
+	if ( n->fh == NULL ) {
+		free(n);
 		return NULL;
 	}
 
-	if ( strncmp(line, "CrystFEL stream format 2.0", 26) == 0 ) {
-		st->major_version = 2;
-		st->minor_version = 0;
-	} else if ( strncmp(line, "CrystFEL stream format 2.1", 26) == 0 ) {
-		st->major_version = 2;
-		st->minor_version = 1;
-	} else if ( strncmp(line, "CrystFEL stream format 2.2", 26) == 0 ) {
-		st->major_version = 2;
-		st->minor_version = 2;
-	} else if ( strncmp(line, "CrystFEL stream format 2.3", 26) == 0 ) {
-		st->major_version = 2;
-		st->minor_version = 3;
-	} else {
-		ERROR("Invalid stream, or stream format is too new.\n");
-		close_stream(st);
-		return NULL;
+	if ( st->map != NULL ) {
+		n->map = st->map;
+		n->map_size = st->map_size;
+		n->map_shared = 1;
 	}
 
-	return st;
+	return n;
 }
 
 
-/**
- * open_stream_fd_for_write
- * @fd: File descriptor (e.g. from open()) to use for stream data.
- *
- * Creates a new %Stream from @fd, so that stream data can be written to @fd
- * using write_chunk().
- *
- * In contrast to open_stream_for_write(), this function does not write any of
- * the usual headers.  This function is mostly for use when multiple substreams
- * need to be multiplexed into a single master stream.  The master would be
- * opened using open_stream_for_write(), and the substreams using this function.
- *
- * Returns: a %Stream, or NULL on failure.
- */
-Stream *open_stream_fd_for_write(int fd)
+struct parallel_read_args;
+
+struct parallel_read_task
+{
+	struct parallel_read_args *pargs;
+	int batch;
+	int first;
+	int n;
+	struct image *images;
+	int n_read;
+};
+
+
+struct parallel_read_args
 {
 	Stream *st;
+	Stream **substreams;
+	StreamReadFlags srf;
+	struct detector *det;
+	StreamChunkFunc func;
+	void *vp;
+	int ordered;
+
+	int batch_size;
+	int next_chunk;
+	int next_batch;
+
+	/* Batches which have been read but not yet delivered, indexed by
+	 * batch number modulo max_pending (ordered mode only).  A thread which
+	 * gets too far ahead of the delivery waits on 'delivered' before
+	 * reading its batch. */
+	struct parallel_read_task **done;
+	int max_pending;
+	int next_deliver;
+	pthread_mutex_t deliver_lock;
+	pthread_cond_t delivered;
+
+	int stop;
+	int err;
+};
 
-	st = malloc(sizeof(struct _stream));
-	if ( st == NULL ) return NULL;
 
-	st->fh = fdopen(fd, "w");
-	if ( st->fh == NULL ) {
-		free(st);
-		return NULL;
+static void *get_read_task(void *vp)
+{
+	struct parallel_read_args *pargs = vp;
+	struct parallel_read_task *task;
+
+	if ( pargs->stop ) return NULL;
+	if ( pargs->next_chunk >= pargs->st->n_chunks ) return NULL;
+
+	task = malloc(sizeof(struct parallel_read_task));
+	if ( task == NULL ) return NULL;
+
+	task->pargs = pargs;
+	task->batch = pargs->next_batch++;
+	task->first = pargs->next_chunk;
+	task->n = pargs->batch_size;
+	if ( task->first + task->n > pargs->st->n_chunks ) {
+		task->n = pargs->st->n_chunks - task->first;
 	}
+	pargs->next_chunk += task->n;
 
-	st->major_version = LATEST_MAJOR_VERSION;
-	st->minor_version = LATEST_MINOR_VERSION;
+	task->images = malloc(task->n * sizeof(struct image));
+	task->n_read = 0;
 
-	return st;
+	return task;
 }
 
 
-/**
- * open_stream_for_write_2
- * @filename: Filename of new stream
- * @geom_filename: The geometry filename to copy
- * @argc: The number of arguments to the program
- * @argv: The arguments to the program
- *
- * Creates a new stream with name @filename, and adds the stream format
- * and version header, plus a verbatim copy of the geometry file
- *
- * You may want to follow this with a call to write_command() to record the
- * command line.
- *
- * Returns: a %Stream, or NULL on failure.
- */
-Stream *open_stream_for_write_2(const char *filename,
-                                const char *geom_filename, int argc,
-                                char *argv[])
-
+static void read_batch(void *tv, int cookie)
 {
-	Stream *st;
+	struct parallel_read_task *task = tv;
+	struct parallel_read_args *pargs = task->pargs;
+	Stream *st = pargs->substreams[cookie];
+	int i;
 
-	st = malloc(sizeof(struct _stream));
-	if ( st == NULL ) return NULL;
+	if ( pargs->ordered ) {
+		pthread_mutex_lock(&pargs->deliver_lock);
+		while ( task->batch >= pargs->next_deliver+pargs->max_pending ) {
+			pthread_cond_wait(&pargs->delivered,
+			                  &pargs->deliver_lock);
+		}
+		pthread_mutex_unlock(&pargs->deliver_lock);
+	}
 
-	st->fh = fopen(filename, "w");
-	if ( st->fh == NULL ) {
-		ERROR("Failed to open stream.\n");
-		free(st);
-		return NULL;
+	if ( (st == NULL) || (task->images == NULL) ) return;
+
+	/* The chunks in the batch are consecutive, so only one seek is
+	 * needed */
+	if ( stream_seek(st, pargs->st->chunks[task->first].offset) ) return;
+
+	for ( i=0; i<task->n; i++ ) {
+		struct image *image = &task->images[i];
+		init_chunk_image(image, pargs->det);
+		if ( read_chunk_2(st, image, pargs->srf) ) break;
+		task->n_read++;
 	}
+}
 
-	st->major_version = LATEST_MAJOR_VERSION;
-	st->minor_version = LATEST_MINOR_VERSION;
 
-	fprintf(st->fh, "CrystFEL stream format %i.%i\n",
-	        st->major_version, st->minor_version);
-	fprintf(st->fh, "Generated by CrystFEL "CRYSTFEL_VERSIONSTRING"\n");
-	fflush(st->fh);
+static void deliver_batch(struct parallel_read_args *pargs,
+                          struct parallel_read_task *task)
+{
+	int i;
+
+	if ( task->n_read < task->n ) pargs->err = 1;
+
+	for ( i=0; i<task->n_read; i++ ) {
+
+		/* After an error or a request to stop, the remaining chunks
+		 * are just thrown away */
+		if ( !pargs->stop && !pargs->err ) {
+			if ( pargs->func(&task->images[i], pargs->vp) ) {
+				pargs->stop = 1;
+			}
+		} else {
+			free_chunk_contents(&task->images[i]);
+		}
 
-	if ( (argc > 0) && (argv != NULL) ) {
-		write_command(st, argc, argv);
 	}
-	if ( geom_filename != NULL ) {
-		write_geometry_file(st, geom_filename);
+
+	free(task->images);
+	free(task);
+}
+
+
+static void finalise_read_task(void *vp, void *tv)
+{
+	struct parallel_read_args *pargs = vp;
+	struct parallel_read_task *task = tv;
+
+	if ( !pargs->ordered ) {
+		deliver_batch(pargs, task);
+		return;
 	}
 
-	return st;
+	pargs->done[task->batch % pargs->max_pending] = task;
+	while ( pargs->next_deliver < pargs->next_batch ) {
+
+		int slot = pargs->next_deliver % pargs->max_pending;
+
+		if ( pargs->done[slot] == NULL ) break;
+		deliver_batch(pargs, pargs->done[slot]);
+		pargs->done[slot] = NULL;
+
+		pthread_mutex_lock(&pargs->deliver_lock);
+		pargs->next_deliver++;
+		pthread_cond_broadcast(&pargs->delivered);
+		pthread_mutex_unlock(&pargs->deliver_lock);
+
+	}
 }
 
 
-/**
- * open_stream_for_write
- * @filename: Filename of new stream
- *
- * Creates a new stream with name @filename, and adds the stream format
- * and version headers.
- *
- * You may want to follow this with a call to write_command() to record the
- * command line.
- *
- * Returns: a %Stream, or NULL on failure.
- */
-Stream *open_stream_for_write(const char *filename)
+static int read_stream_serial(Stream *st, StreamReadFlags srf,
+                              struct detector *det, StreamChunkFunc func,
+                              void *vp)
 {
-	return open_stream_for_write_2(filename, NULL, 0, NULL);
+	do {
+
+		struct image image;
+
+		init_chunk_image(&image, det);
+		if ( read_chunk_2(st, &image, srf) ) {
+			/* Running out of chunks is the normal way to finish */
+			if ( st->eof ) return 0;
+			/* The stream may have been cut off part way through a
+			 * chunk.  Keep everything before it, like the chunk
+			 * index does when reading in parallel. */
+			if ( stream_at_eof(st) ) {
+				ERROR(TRUNCATED_CHUNK_WARNING);
+				return 0;
+			}
+			return 1;
+		}
+		if ( func(&image, vp) ) break;
+
+	} while ( 1 );
+
+	return 0;
 }
 
 
 /**
- * get_stream_fd
+ * read_stream_parallel:
  * @st: A %Stream
+ * @n_threads: The number of threads to use for parsing the stream
+ * @srf: A %StreamReadFlags, as for read_chunk_2()
+ * @ordered: Non-zero to receive the chunks in the order of the stream
+ * @det: The detector structure to put in each image, or NULL
+ * @func: Function to call for each chunk
+ * @vp: Pointer to pass to @func
  *
- * This function gets the integer file descriptor for @st, a bit like fileno().
+ * Reads all the remaining chunks from @st, parsing them using @n_threads
+ * threads, and calls @func for each one.  This is equivalent to calling
+ * read_chunk_2() in a loop, but much faster for large streams.
  *
- * This is useful in conjunction with open_stream_fd_for_write(), to get the
- * underlying file descriptor to which the multiplexed stream data should be
- * written.  In this case, the only other operations you should ever do (or have
- * done) on @st are open_stream_for_write() and close_stream().
+ * The stream is split into batches of chunks using the chunk index (see
+ * stream_num_chunks()).  If the stream cannot be indexed (for example, if it
+ * is being read from standard input), or if @n_threads is 1, the stream will be
+ * read serially instead.  If @ordered is zero, the chunks will be passed to
+ * @func in whatever order the threads finish parsing them.  Otherwise, threads
+ * which get too far ahead of the chunk waiting to be delivered will wait for
+ * it, so that only a limited number of parsed chunks are held in memory.
  *
- * Returns: an integer file descriptor
+ * @func is never called by more than one thread at a time.  The image passed
+ * to it is only valid for the duration of the call, but everything inside it
+ * (filename, crystals, reflection lists and so on) belongs to @func afterwards.
+ * The beam divergence and bandwidth will be NaN if the chunk did not contain
+ * them.  If @func returns non-zero, no more chunks will be delivered.
+ *
+ * If the last chunk of the stream is incomplete, for example because the
+ * program writing it was stopped, it will be skipped with a warning.
+ *
+ * After this function returns, the position of @st is undefined.  Use
+ * rewind_stream() to read the stream again.
+ *
+ * Returns: non-zero if an error occurred while reading the stream.
  */
-int get_stream_fd(Stream *st)
+int read_stream_parallel(Stream *st, int n_threads, StreamReadFlags srf,
+                         int ordered, struct detector *det,
+                         StreamChunkFunc func, void *vp)
 {
-	return fileno(st->fh);
-}
+	struct parallel_read_args pargs;
+	off_t pos;
+	int i;
 
+	if ( (n_threads < 2) || load_index(st) ) {
+		return read_stream_serial(st, srf, det, func, vp);
+	}
 
-void close_stream(Stream *st)
-{
-	fclose(st->fh);
-	free(st);
+	pargs.st = st;
+	pargs.srf = srf;
+	pargs.det = det;
+	pargs.func = func;
+	pargs.vp = vp;
+	pargs.ordered = ordered;
+	pargs.next_batch = 0;
+	pargs.next_deliver = 0;
+	pargs.stop = 0;
+	pargs.err = 0;
+
+	/* Continue from wherever the stream's own handle has got to */
+	pos = stream_tell(st);
+	pargs.next_chunk = 0;
+	while ( (pargs.next_chunk < st->n_chunks)
+	     && (st->chunks[pargs.next_chunk].offset < pos) )
+	{
+		pargs.next_chunk++;
+	}
+
+	/* Small enough that all the threads get some work, but large enough
+	 * to keep the locking overhead small */
+	pargs.batch_size = (st->n_chunks - pargs.next_chunk) / (4*n_threads);
+	if ( pargs.batch_size > PARALLEL_READ_BATCH ) {
+		pargs.batch_size = PARALLEL_READ_BATCH;
+	}
+	if ( pargs.batch_size < 1 ) pargs.batch_size = 1;
+
+	pargs.max_pending = PARALLEL_READ_PENDING*n_threads;
+	pargs.done = calloc(pargs.max_pending,
+	                    sizeof(struct parallel_read_task *));
+	pargs.substreams = malloc(n_threads * sizeof(Stream *));
+	if ( (pargs.done == NULL) || (pargs.substreams == NULL) ) {
+		ERROR("Failed to allocate stream readers.\n");
+		free(pargs.done);
+		free(pargs.substreams);
+		return 1;
+	}
+
+	for ( i=0; i<n_threads; i++ ) {
+		pargs.substreams[i] = reopen_stream_for_read(st);
+		if ( pargs.substreams[i] == NULL ) {
+			ERROR("Failed to open stream for thread %i\n", i);
+			pargs.err = 1;
+		}
+	}
+
+	if ( !pargs.err ) {
+		pthread_mutex_init(&pargs.deliver_lock, NULL);
+		pthread_cond_init(&pargs.delivered, NULL);
+		run_threads(n_threads, read_batch, get_read_task,
+		            finalise_read_task, &pargs, 0, 0, 0, 0);
+		pthread_cond_destroy(&pargs.delivered);
+		pthread_mutex_destroy(&pargs.deliver_lock);
+	}
+
+	for ( i=0; i<n_threads; i++ ) {
+		if ( pargs.substreams[i] != NULL ) {
+			close_stream(pargs.substreams[i]);
+		}
+	}
+	free(pargs.substreams);
+	free(pargs.done);
+
+	if ( st->map != NULL ) {
+		st->map_pos = st->map_size;
+	} else {
+		fseeko(st->fh, 0, SEEK_END);
+	}
+
+	return pargs.err;
 }
 
 
@@ -1452,6 +3842,8 @@ int is_stream(const char *filename)
 	if ( strncmp(line, "CrystFEL stream format 2.0", 26) == 0 ) return 1;
 	if ( strncmp(line, "CrystFEL stream format 2.1", 26) == 0 ) return 1;
 	if ( strncmp(line, "CrystFEL stream format 2.2", 26) == 0 ) return 1;
+	if ( strncmp(line, "CrystFEL stream format 2.3", 26) == 0 ) return 1;
+	if ( strncmp(line, BINARY_STREAM_MAGIC" 1.0", 33) == 0 ) return 1;
 
 	return 0;
 }
@@ -1473,12 +3865,39 @@ void write_command(Stream *st, int argc, char *argv[])
 
 	if ( argc == 0 ) return;
 
+	if ( st->format == STREAM_FORMAT_BINARY ) {
+
+		struct binary_writer bw;
+
+		bw.st = st;
+		bw.len = 0;
+		bw.err = 0;
+
+		for ( i=0; i<argc; i++ ) {
+
+			size_t len = strlen(argv[i]);
+			unsigned char *p;
+
+			if ( i > 0 ) put_u8(&bw, ' ');
+			p = bw_reserve(&bw, len);
+			if ( p != NULL ) memcpy(p, argv[i], len);
+
+		}
+		if ( bw.err ) return;
+		write_binary_record(st, STREAM_RECORD_COMMAND, st->buf, bw.len);
+		fflush(st->fh);
+		st->written = ftello(st->fh);
+		return;
+
+	}
+
 	for ( i=0; i<argc; i++ ) {
 		if ( i > 0 ) fprintf(st->fh, " ");
 		fprintf(st->fh, "%s", argv[i]);
 	}
 	fprintf(st->fh, "\n");
 	fflush(st->fh);
+	st->written = ftello(st->fh);
 }
 
 
@@ -1504,6 +3923,34 @@ void write_geometry_file(Stream *st, const char *geom_filename) {
 		      "'%s'\n", geom_filename);
 		return;
 	}
+	if ( st->format == STREAM_FORMAT_BINARY ) {
+
+		struct binary_writer bw;
+
+		bw.st = st;
+		bw.len = 0;
+		bw.err = 0;
+
+		do {
+			rval = fgets(line, 1023, geom_fh);
+			if ( rval != NULL ) {
+				size_t len = strlen(line);
+				unsigned char *p = bw_reserve(&bw, len);
+				if ( p != NULL ) memcpy(p, line, len);
+			}
+		} while ( rval != NULL );
+
+		fclose(geom_fh);
+
+		if ( bw.err ) return;
+		write_binary_record(st, STREAM_RECORD_GEOMETRY, st->buf,
+		                    bw.len);
+		fflush(st->fh);
+		st->written = ftello(st->fh);
+		return;
+
+	}
+
 	fprintf(st->fh, GEOM_START_MARKER"\n");
 
 	do {
@@ -1515,6 +3962,7 @@ void write_geometry_file(Stream *st, const char *geom_filename) {
 
 	fprintf(st->fh, GEOM_END_MARKER"\n");
 	fflush(st->fh);
+	st->written = ftello(st->fh);
 }
 
 
@@ -1532,6 +3980,6 @@ void write_geometry_file(Stream *st, const char *geom_filename) {
  */
 int rewind_stream(Stream *st)
 {
-	return fseek(st->fh, 0, SEEK_SET);
+	return stream_seek(st, st->data_start);
 }
 
@@ -35,9 +35,11 @@
 #include <config.h>
 #endif
 
+#include <stddef.h>
 
 struct image;
 struct hdfile;
+struct detector;
 struct event;
 
 #define GEOM_START_MARKER "----- Begin geometry file -----"
@@ -52,8 +54,35 @@ struct event;
 /* REFLECTION_END_MARKER is over in reflist-utils.h because it is also
  * used to terminate a standalone list of reflections */
 
+#define BINARY_STREAM_MAGIC "CrystFEL binary stream format"
+
+/* Record types and header size for the binary stream format.  See
+ * doc/stream-format.txt for the layout of the records */
+#define STREAM_RECORD_COMMAND (1)
+#define STREAM_RECORD_GEOMETRY (2)
+#define STREAM_RECORD_CHUNK (3)
+#define STREAM_RECORD_HEADER_SIZE (8)
+
 typedef struct _stream Stream;
 
+/**
+ * StreamFormat:
+ * @STREAM_FORMAT_TEXT: The usual line-based text format
+ * @STREAM_FORMAT_BINARY: Fixed-width little-endian binary records
+ *
+ * The on-disk format of a stream.  Both formats hold exactly the same chunk,
+ * crystal, peak and reflection information, and open_stream_for_read() will
+ * detect which one it has been given.  The binary format is much faster to
+ * read back, but you can't look at it with a text editor.  Use convert_stream
+ * to get from one to the other.
+ **/
+typedef enum {
+
+	STREAM_FORMAT_TEXT,
+	STREAM_FORMAT_BINARY,
+
+} StreamFormat;
+
 /**
  * StreamReadFlags:
  * @STREAM_READ_UNITCELL: Read the unit cell
@@ -77,6 +106,17 @@ typedef enum {
 
 } StreamReadFlags;
 
+/**
+ * StreamChunkFunc:
+ * @image: A %struct image containing the contents of a chunk
+ * @vp: The pointer which was given to read_stream_parallel()
+ *
+ * The type of function which read_stream_parallel() calls for each chunk.
+ *
+ * Returns: non-zero to stop reading the stream.
+ **/
+typedef int (*StreamChunkFunc)(struct image *image, void *vp);
+
 struct stuff_from_stream
 {
 	char **fields;
@@ -92,8 +132,17 @@ extern Stream *open_stream_for_write(const char *filename);
 extern Stream *open_stream_for_write_2(const char *filename,
                                 const char* geom_filename, int argc,
                                 char *argv[]);
+extern Stream *open_stream_for_write_3(const char *filename,
+                                       const char* geom_filename, int argc,
+                                       char *argv[], StreamFormat format);
 extern Stream *open_stream_fd_for_write(int fd);
+extern Stream *open_stream_fd_for_write_2(int fd, StreamFormat format);
+extern Stream *open_stream_for_write_buffer(StreamFormat format);
+extern char *close_stream_buffer(Stream *st, size_t *len);
+extern int write_stream_buffer(Stream *st, Stream *buf);
 extern int get_stream_fd(Stream *st);
+extern StreamFormat get_stream_format(Stream *st);
+extern size_t stream_record_length(const unsigned char *hdr);
 extern void close_stream(Stream *st);
 
 extern int read_chunk(Stream *st, struct image *image);
@@ -107,6 +156,14 @@ extern int write_chunk(Stream *st, struct image *image, struct hdfile *hdfile,
 extern void write_command(Stream *st, int argc, char *argv[]);
 extern void write_geometry_file(Stream *st, const char *geom_filename);
 extern int rewind_stream(Stream *st);
+extern int stream_num_chunks(Stream *st);
+extern int stream_seek_chunk(Stream *st, int n);
+extern int stream_chunk_info(Stream *st, int n, const char **filename,
+                             const char **event, int *n_crystals);
+extern int read_stream_parallel(Stream *st, int n_threads,
+                                StreamReadFlags srf, int ordered,
+                                struct detector *det, StreamChunkFunc func,
+                                void *vp);
 extern int is_stream(const char *filename);
 
 #ifdef __cplusplus
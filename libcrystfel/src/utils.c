@@ -31,6 +31,8 @@
 #endif
 
 #include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
@@ -286,6 +288,49 @@ void chomp(char *s)
 }
 
 
+/**
+ * grow_array:
+ * @array: An array allocated with malloc(), or NULL
+ * @max_n: Pointer to the number of elements which @array has room for
+ * @n: The number of elements needed
+ * @size: The size of each element
+ *
+ * Makes sure that @array has room for at least @n elements.  If it doesn't,
+ * the array is reallocated with room for at least twice as many elements as
+ * before (or exactly @n, if that is more), so that adding elements one at a
+ * time only costs a constant amount of copying per element on average.  The
+ * new size is stored at @max_n.
+ *
+ * To start a new array, pass NULL for @array and a pointer to zero for @max_n.
+ * If the final size is known or can be estimated, calling this function once
+ * with that size avoids any further reallocation.
+ *
+ * Returns: the new location of the array, or NULL on failure.  In that case,
+ * @array and @max_n are unchanged, and @array must still be freed.
+ **/
+void *grow_array(void *array, int *max_n, int n, size_t size)
+{
+	void *new_array;
+	int new_max;
+
+	if ( (array != NULL) && (n <= *max_n) ) return array;
+
+	if ( *max_n > INT_MAX/2 ) {
+		new_max = INT_MAX;
+	} else {
+		new_max = 2 * *max_n;
+	}
+	if ( new_max < 16 ) new_max = 16;
+	if ( new_max < n ) new_max = n;
+
+	new_array = realloc(array, (size_t)new_max*size);
+	if ( new_array == NULL ) return NULL;
+
+	*max_n = new_max;
+	return new_array;
+}
+
+
 void progress_bar(int val, int total, const char *text)
 {
 	double frac;
@@ -107,6 +107,7 @@ extern gsl_vector *solve_svd(gsl_vector *v, gsl_matrix *M, int *n_filt,
                             int verbose);
 extern size_t notrail(char *s);
 extern void chomp(char *s);
+extern void *grow_array(void *array, int *max_n, int n, size_t size);
 
 /**
  * AssplodeFlag:
@@ -243,8 +243,12 @@ static int read_cell(struct image *image, struct xds_private *xp)
 	char *rval, line[1024];
 	int r;
 	UnitCell *cell;
+	char *filename;
 
-	fh = fopen("IDXREF.LP", "r");
+	filename = image_tmp_filename(image, "IDXREF.LP");
+	if ( filename == NULL ) return 0;
+	fh = fopen(filename, "r");
+	free(filename);
 	if ( fh == NULL ) {
 		ERROR("Couldn't open 'IDXREF.LP'\n");
 		return 0;
@@ -315,8 +319,12 @@ static void write_spot(struct image *image)
 	FILE *fh;
 	int i;
 	int n;
+	char *filename;
 
-	fh = fopen("SPOT.XDS", "w");
+	filename = image_tmp_filename(image, "SPOT.XDS");
+	if ( filename == NULL ) return;
+	fh = fopen(filename, "w");
+	free(filename);
 	if ( !fh ) {
 		ERROR("Couldn't open temporary file '%s'\n", "SPOT.XDS");
 		return;
@@ -437,8 +445,12 @@ static const char *spacegroup_for_lattice(UnitCell *cell)
 static int write_inp(struct image *image, struct xds_private *xp)
 {
 	FILE *fh;
+	char *filename;
 
-	fh = fopen("XDS.INP", "w");
+	filename = image_tmp_filename(image, "XDS.INP");
+	if ( filename == NULL ) return 1;
+	fh = fopen(filename, "w");
+	free(filename);
 	if ( !fh ) {
 		ERROR("Couldn't open XDS.INP\n");
 		return 1;
@@ -508,6 +520,7 @@ int run_xds(struct image *image, IndexingPrivate *priv)
 	int n;
 	struct xds_data *xds;
 	struct xds_private *xp = (struct xds_private *)priv;
+	char *filename;
 
 	xds = malloc(sizeof(struct xds_data));
 	if ( xds == NULL ) {
@@ -528,7 +541,9 @@ int run_xds(struct image *image, IndexingPrivate *priv)
 	write_spot(image);
 
 	/* Delete any old indexing result which may exist */
-	remove("IDXREF.LP");
+	filename = image_tmp_filename(image, "IDXREF.LP");
+	if ( filename != NULL ) remove(filename);
+	free(filename);
 
 	xds->pid = forkpty(&xds->pty, NULL, NULL, NULL);
 
@@ -547,6 +562,12 @@ int run_xds(struct image *image, IndexingPrivate *priv)
 		t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL);
 		tcsetattr(STDIN_FILENO, TCSANOW, &t);
 
+		if ( (image->tmpdir != NULL) && chdir(image->tmpdir) ) {
+			ERROR("Failed to chdir to temporary folder: %s\n",
+			      strerror(errno));
+			_exit(0);
+		}
+
 		execlp("xds", "", (char *)NULL);
 		ERROR("Failed to invoke XDS.\n");
 		_exit(0);
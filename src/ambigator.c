@@ -1061,6 +1061,15 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* write_reindexed_stream() edits the text of the stream directly */
+	if ( (outfile != NULL)
+	  && (get_stream_format(st) == STREAM_FORMAT_BINARY) )
+	{
+		ERROR("Can't write a re-indexed copy of a binary stream.\n");
+		ERROR("Use convert_stream to convert it to text first.\n");
+		return 1;
+	}
+
 	if ( s_sym_str == NULL ) {
 		ERROR("You must specify the input symmetry (with -y)\n");
 		return 1;
@@ -0,0 +1,677 @@
+/*
+ * checkpoint.c
+ *
+ * Save and restore the state of partialator between cycles
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "crystal.h"
+#include "reflist.h"
+#include "cell.h"
+#include "events.h"
+#include "utils.h"
+#include "refl-arrays.h"
+#include "refl-cache.h"
+#include "checkpoint.h"
+
+
+/* A checkpoint file holds everything which partialator needs to carry on from
+ * where it was, in the byte order of the machine which wrote it:
+ *
+ *   struct checkpoint_header
+ *   for each image: struct checkpoint_image, filename, event
+ *   for each crystal: struct checkpoint_crystal, reflections
+ *   for each merged reflection: struct checkpoint_merged
+ *
+ * The reflections of each crystal are in the same format as in the reflection
+ * cache (see refl-cache.c), and include the partialities. */
+
+#define CHECKPOINT_MAGIC "PARTIALATOR-CKPT"
+#define CHECKPOINT_VERSION (1)
+
+struct checkpoint_header
+{
+	char magic[16];
+	int32_t version;
+	int32_t cycle;
+	int32_t pmodel;
+	int32_t rank;
+	int32_t n_ranks;
+	int32_t n_images;
+	int32_t n_crystals;
+	int32_t n_full;
+	int32_t n_iter;
+	int32_t min_measurements;
+	double max_adu;
+	char sym[32];
+};
+
+
+struct checkpoint_image
+{
+	double lambda;
+	double div;
+	double bw;
+	int32_t n_crystals;
+	int32_t filename_len;    /* -1 for NULL */
+	int32_t event_len;       /* -1 for NULL */
+	int32_t pad;
+};
+
+
+struct checkpoint_crystal
+{
+	double cell[9];          /* Reciprocal axes */
+	double profile_radius;
+	double mosaicity;
+	double osf;
+	double Bfac;
+	int32_t image;
+	int32_t user_flag;
+	int32_t n_refl;
+	int32_t lattice_type;
+	char centering;
+	char unique_axis;
+	char pad[6];
+};
+
+
+struct checkpoint_merged
+{
+	double intensity;
+	double esd;
+	int32_t h;
+	int32_t k;
+	int32_t l;
+	int32_t redundancy;
+};
+
+
+static int write_data(FILE *fh, const void *data, size_t size)
+{
+	if ( size == 0 ) return 0;
+	return fwrite(data, size, 1, fh) != 1;
+}
+
+
+static int read_data(FILE *fh, void *data, size_t size)
+{
+	if ( size == 0 ) return 0;
+	return fread(data, size, 1, fh) != 1;
+}
+
+
+static int reserve_buffer(unsigned char **buf, size_t *buf_size, size_t size)
+{
+	unsigned char *buf_new;
+
+	if ( size <= *buf_size ) return 0;
+
+	buf_new = realloc(*buf, size);
+	if ( buf_new == NULL ) return 1;
+	*buf = buf_new;
+	*buf_size = size;
+	return 0;
+}
+
+
+static int write_string(FILE *fh, const char *str)
+{
+	if ( str == NULL ) return 0;
+	return write_data(fh, str, strlen(str));
+}
+
+
+static char *read_string(FILE *fh, int len, int *err)
+{
+	char *str;
+
+	if ( len < 0 ) return NULL;
+
+	str = malloc(len+1);
+	if ( (str == NULL) || read_data(fh, str, len) ) {
+		free(str);
+		*err = 1;
+		return NULL;
+	}
+	str[len] = '\0';
+	return str;
+}
+
+
+static int write_images(FILE *fh, struct image *images, int n_images)
+{
+	int i;
+
+	for ( i=0; i<n_images; i++ ) {
+
+		struct checkpoint_image ci;
+		char *ev = NULL;
+		int r;
+
+		if ( images[i].event != NULL ) {
+			ev = get_event_string(images[i].event);
+		}
+
+		ci.lambda = images[i].lambda;
+		ci.div = images[i].div;
+		ci.bw = images[i].bw;
+		ci.n_crystals = images[i].n_crystals;
+		if ( images[i].filename != NULL ) {
+			ci.filename_len = strlen(images[i].filename);
+		} else {
+			ci.filename_len = -1;
+		}
+		ci.event_len = (ev != NULL) ? strlen(ev) : -1;
+		ci.pad = 0;
+
+		r = write_data(fh, &ci, sizeof(ci))
+		 || write_string(fh, images[i].filename)
+		 || write_string(fh, ev);
+		free(ev);
+		if ( r ) return 1;
+
+	}
+
+	return 0;
+}
+
+
+/* Write the crystals in "ra", with their reflections */
+static int write_crystals(FILE *fh, struct refl_arrays *ra,
+                          struct image *images, unsigned char **buf,
+                          size_t *buf_size)
+{
+	int i;
+
+	for ( i=0; i<ra->n_crystals; i++ ) {
+
+		struct crystal_arrays *ca = &ra->crystals[i];
+		Crystal *cr = ca->crystal;
+		UnitCell *cell = crystal_get_cell(cr);
+		RefList *list = crystal_get_reflections(cr);
+		struct checkpoint_crystal cc;
+		double *c = cc.cell;
+		size_t size;
+
+		memset(&cc, 0, sizeof(cc));
+		cell_get_reciprocal(cell, &c[0], &c[1], &c[2], &c[3], &c[4],
+		                    &c[5], &c[6], &c[7], &c[8]);
+		cc.profile_radius = crystal_get_profile_radius(cr);
+		cc.mosaicity = crystal_get_mosaicity(cr);
+		cc.osf = crystal_get_osf(cr);
+		cc.Bfac = crystal_get_Bfac(cr);
+		cc.image = crystal_get_image(cr) - images;
+		cc.user_flag = crystal_get_user_flag(cr);
+		cc.n_refl = num_reflections(list);
+		cc.lattice_type = cell_get_lattice_type(cell);
+		cc.centering = cell_get_centering(cell);
+		cc.unique_axis = cell_get_unique_axis(cell);
+
+		size = refl_cache_segment_size(cc.n_refl);
+		if ( reserve_buffer(buf, buf_size, size) ) {
+			ERROR("Failed to allocate checkpoint buffer.\n");
+			return 1;
+		}
+		refl_cache_encode(*buf, list, cc.n_refl);
+
+		if ( write_data(fh, &cc, sizeof(cc))
+		  || write_data(fh, *buf, size) ) return 1;
+
+	}
+
+	return 0;
+}
+
+
+/* With the reflection cache, the crystals have to be written one block at a
+ * time */
+static int write_blocks(FILE *fh, Crystal **crystals, struct refl_cache *cache,
+                        struct image *images, unsigned char **buf,
+                        size_t *buf_size)
+{
+	int b;
+
+	for ( b=0; b<refl_cache_num_blocks(cache); b++ ) {
+
+		struct refl_arrays *ra;
+		int first, n;
+		int r;
+
+		if ( refl_cache_load_block(cache, crystals, b, &first, &n) ) {
+			return 1;
+		}
+
+		ra = refl_arrays_new(&crystals[first], n);
+		if ( ra == NULL ) {
+			refl_cache_release_block(cache, crystals, b, 0);
+			return 1;
+		}
+
+		r = write_crystals(fh, ra, images, buf, buf_size);
+
+		refl_arrays_free(ra);
+		if ( refl_cache_release_block(cache, crystals, b, 0) || r ) {
+			return 1;
+		}
+
+	}
+
+	return 0;
+}
+
+
+static int write_merged(FILE *fh, RefList *full)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(full, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		struct checkpoint_merged cm;
+		signed int h, k, l;
+
+		get_indices(refl, &h, &k, &l);
+		cm.h = h;
+		cm.k = k;
+		cm.l = l;
+		cm.intensity = get_intensity(refl);
+		cm.esd = get_esd_intensity(refl);
+		cm.redundancy = get_redundancy(refl);
+
+		if ( write_data(fh, &cm, sizeof(cm)) ) return 1;
+	}
+
+	return 0;
+}
+
+
+/* Write everything needed to carry on from the end of cycle "info->cycle".
+ * "ra" must be NULL if "cache" is used.  The checkpoint is written under a
+ * temporary name and then moved into place, so that "filename" always holds a
+ * complete checkpoint even if the program is stopped part-way through. */
+int write_checkpoint(const char *filename, const struct checkpoint_info *info,
+                     struct image *images, int n_images,
+                     Crystal **crystals, int n_crystals,
+                     struct refl_arrays *ra, struct refl_cache *cache,
+                     RefList *full)
+{
+	struct checkpoint_header hdr;
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	char *tmp;
+	FILE *fh;
+	int r;
+
+	tmp = malloc(strlen(filename)+5);
+	if ( tmp == NULL ) return 1;
+	sprintf(tmp, "%s.tmp", filename);
+
+	fh = fopen(tmp, "wb");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s': %s\n", tmp, strerror(errno));
+		free(tmp);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, 16);
+	hdr.version = CHECKPOINT_VERSION;
+	hdr.cycle = info->cycle;
+	hdr.pmodel = info->pmodel;
+	hdr.rank = info->rank;
+	hdr.n_ranks = info->n_ranks;
+	hdr.n_images = n_images;
+	hdr.n_crystals = n_crystals;
+	hdr.n_full = num_reflections(full);
+	hdr.n_iter = info->n_iter;
+	hdr.min_measurements = info->min_measurements;
+	hdr.max_adu = info->max_adu;
+	memcpy(hdr.sym, info->sym, 32);
+
+	r = write_data(fh, &hdr, sizeof(hdr))
+	 || write_images(fh, images, n_images);
+	if ( !r ) {
+		if ( cache == NULL ) {
+			r = write_crystals(fh, ra, images, &buf, &buf_size);
+		} else {
+			r = write_blocks(fh, crystals, cache, images, &buf,
+			                 &buf_size);
+		}
+	}
+	r = r || write_merged(fh, full);
+	free(buf);
+
+	/* Make sure it's really on disk before replacing the old one */
+	r = r || (fflush(fh) != 0) || (fsync(fileno(fh)) != 0);
+	r = (fclose(fh) != 0) || r;
+
+	if ( !r && (rename(tmp, filename) != 0) ) r = 1;
+	if ( r ) {
+		ERROR("Failed to write checkpoint '%s': %s\n", filename,
+		      strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	return r;
+}
+
+
+/* Reads the images, and puts the number of crystals allocated for each one in
+ * "max_crystals" */
+static int read_images(FILE *fh, struct image *images, int n_images,
+                       int *max_crystals)
+{
+	int i;
+
+	for ( i=0; i<n_images; i++ ) {
+
+		struct checkpoint_image ci;
+		struct image *image = &images[i];
+		char *ev;
+		int err = 0;
+
+		if ( read_data(fh, &ci, sizeof(ci)) ) return 1;
+
+		image->lambda = ci.lambda;
+		image->div = ci.div;
+		image->bw = ci.bw;
+		image->filename = read_string(fh, ci.filename_len, &err);
+		ev = read_string(fh, ci.event_len, &err);
+		if ( ev != NULL ) {
+			image->event = get_event_from_event_string(ev);
+			free(ev);
+		}
+		if ( err ) return 1;
+		if ( ci.n_crystals < 0 ) return 1;
+
+		image->crystals = malloc(ci.n_crystals*sizeof(Crystal *));
+		if ( (image->crystals == NULL) && (ci.n_crystals > 0) ) {
+			return 1;
+		}
+		image->n_crystals = 0;  /* Counted again by read_crystal() */
+		max_crystals[i] = ci.n_crystals;
+
+	}
+
+	return 0;
+}
+
+
+static Crystal *read_crystal(FILE *fh, struct image *images, int n_images,
+                             const int *max_crystals, unsigned char **buf,
+                             size_t *buf_size)
+{
+	struct checkpoint_crystal cc;
+	struct rvec as, bs, cs;
+	struct image *image;
+	UnitCell *cell;
+	RefList *list;
+	Crystal *cr;
+	size_t size;
+
+	if ( read_data(fh, &cc, sizeof(cc)) ) return NULL;
+	if ( (cc.image < 0) || (cc.image >= n_images) || (cc.n_refl < 0) ) {
+		return NULL;
+	}
+	image = &images[cc.image];
+
+	/* More crystals than the image said it had */
+	if ( image->n_crystals >= max_crystals[cc.image] ) return NULL;
+
+	size = refl_cache_segment_size(cc.n_refl);
+	if ( reserve_buffer(buf, buf_size, size) ) return NULL;
+	if ( read_data(fh, *buf, size) ) return NULL;
+
+	list = refl_cache_decode(*buf, cc.n_refl);
+	if ( list == NULL ) return NULL;
+
+	as.u = cc.cell[0];  as.v = cc.cell[1];  as.w = cc.cell[2];
+	bs.u = cc.cell[3];  bs.v = cc.cell[4];  bs.w = cc.cell[5];
+	cs.u = cc.cell[6];  cs.v = cc.cell[7];  cs.w = cc.cell[8];
+	cell = cell_new_from_reciprocal_axes(as, bs, cs);
+	cr = crystal_new();
+	if ( (cell == NULL) || (cr == NULL) ) {
+		reflist_free(list);
+		cell_free(cell);
+		crystal_free(cr);
+		return NULL;
+	}
+	cell_set_lattice_type(cell, cc.lattice_type);
+	cell_set_centering(cell, cc.centering);
+	cell_set_unique_axis(cell, cc.unique_axis);
+
+	crystal_set_cell(cr, cell);
+	crystal_set_reflections(cr, list);
+	crystal_set_image(cr, image);
+	crystal_set_profile_radius(cr, cc.profile_radius);
+	crystal_set_mosaicity(cr, cc.mosaicity);
+	crystal_set_osf(cr, cc.osf);
+	crystal_set_Bfac(cr, cc.Bfac);
+	crystal_set_user_flag(cr, cc.user_flag);
+	image->crystals[image->n_crystals++] = cr;
+
+	return cr;
+}
+
+
+static RefList *read_merged(FILE *fh, int n_full)
+{
+	RefList *full;
+	int i;
+
+	full = reflist_new();
+	if ( full == NULL ) return NULL;
+
+	for ( i=0; i<n_full; i++ ) {
+
+		struct checkpoint_merged cm;
+		Reflection *refl;
+
+		if ( read_data(fh, &cm, sizeof(cm)) ) {
+			reflist_free(full);
+			return NULL;
+		}
+
+		refl = add_refl(full, cm.h, cm.k, cm.l);
+		if ( refl == NULL ) {
+			reflist_free(full);
+			return NULL;
+		}
+		set_intensity(refl, cm.intensity);
+		set_esd_intensity(refl, cm.esd);
+		set_redundancy(refl, cm.redundancy);
+
+	}
+
+	return full;
+}
+
+
+/* Frees what read_checkpoint() had read so far, if it fails part-way */
+static void free_checkpoint_data(struct image *images, int n_images,
+                                 Crystal **crystals, int n_crystals)
+{
+	int i;
+
+	for ( i=0; i<n_crystals; i++ ) {
+		reflist_free(crystal_get_reflections(crystals[i]));
+		cell_free(crystal_get_cell(crystals[i]));
+		crystal_free(crystals[i]);
+	}
+	free(crystals);
+
+	if ( images == NULL ) return;
+	for ( i=0; i<n_images; i++ ) {
+		free(images[i].filename);
+		if ( images[i].event != NULL ) free_event(images[i].event);
+		free(images[i].crystals);
+	}
+	free(images);
+}
+
+
+/* Restore the state written by write_checkpoint(), including the
+ * partialities, so the crystals don't have to be predicted again.  If "cache"
+ * isn't NULL, the reflections are put into it and "*pra" is set to NULL.
+ * Otherwise, the reflection arrays are set up in "*pra". */
+int read_checkpoint(const char *filename, struct checkpoint_info *info,
+                    struct image **pimages, int *pn_images,
+                    Crystal ***pcrystals, int *pn_crystals,
+                    struct refl_arrays **pra, struct refl_cache *cache,
+                    RefList **pfull)
+{
+	struct checkpoint_header hdr;
+	struct image *images = NULL;
+	Crystal **crystals = NULL;
+	int *max_crystals = NULL;
+	struct refl_arrays *ra = NULL;
+	RefList *full = NULL;
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	FILE *fh;
+	int n_read = 0;
+
+	fh = fopen(filename, "rb");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s': %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	if ( read_data(fh, &hdr, sizeof(hdr))
+	  || (memcmp(hdr.magic, CHECKPOINT_MAGIC, 16) != 0) )
+	{
+		ERROR("'%s' is not a partialator checkpoint.\n", filename);
+		fclose(fh);
+		return 1;
+	}
+	if ( hdr.version != CHECKPOINT_VERSION ) {
+		ERROR("Checkpoint '%s' has unsupported version %i.\n",
+		      filename, hdr.version);
+		fclose(fh);
+		return 1;
+	}
+	if ( (hdr.n_images < 0) || (hdr.n_crystals < 0) || (hdr.n_full < 0) ) {
+		ERROR("Checkpoint '%s' is corrupt.\n", filename);
+		fclose(fh);
+		return 1;
+	}
+
+	info->cycle = hdr.cycle;
+	info->pmodel = hdr.pmodel;
+	info->rank = hdr.rank;
+	info->n_ranks = hdr.n_ranks;
+	info->n_iter = hdr.n_iter;
+	info->min_measurements = hdr.min_measurements;
+	info->max_adu = hdr.max_adu;
+	memcpy(info->sym, hdr.sym, 32);
+	info->sym[31] = '\0';
+
+	images = calloc(hdr.n_images, sizeof(struct image));
+	max_crystals = malloc(hdr.n_images*sizeof(int));
+	crystals = malloc(hdr.n_crystals*sizeof(Crystal *));
+	if ( ((images == NULL) && (hdr.n_images > 0))
+	  || ((max_crystals == NULL) && (hdr.n_images > 0))
+	  || ((crystals == NULL) && (hdr.n_crystals > 0)) )
+	{
+		ERROR("Failed to allocate memory for checkpoint.\n");
+		goto fail;
+	}
+
+	if ( read_images(fh, images, hdr.n_images, max_crystals) ) {
+		ERROR("Failed to read images from checkpoint.\n");
+		goto fail;
+	}
+
+	for ( n_read=0; n_read<hdr.n_crystals; n_read++ ) {
+
+		Crystal *cr;
+
+		cr = read_crystal(fh, images, hdr.n_images, max_crystals,
+		                  &buf, &buf_size);
+		if ( cr == NULL ) {
+			ERROR("Failed to read crystal %i from checkpoint.\n",
+			      n_read);
+			goto fail;
+		}
+		crystals[n_read] = cr;
+
+		if ( (cache != NULL) && refl_cache_store(cache, cr) ) {
+			n_read++;
+			goto fail;
+		}
+
+	}
+
+	full = read_merged(fh, hdr.n_full);
+	if ( full == NULL ) {
+		ERROR("Failed to read merged reflections from checkpoint.\n");
+		goto fail;
+	}
+
+	if ( cache == NULL ) {
+		ra = refl_arrays_new(crystals, hdr.n_crystals);
+		if ( ra == NULL ) {
+			ERROR("Failed to set up reflection arrays.\n");
+			goto fail;
+		}
+	}
+
+	fclose(fh);
+	free(buf);
+	free(max_crystals);
+
+	*pra = ra;
+	*pfull = full;
+	*pimages = images;
+	*pn_images = hdr.n_images;
+	*pcrystals = crystals;
+	*pn_crystals = hdr.n_crystals;
+
+	return 0;
+
+fail:
+	fclose(fh);
+	free(buf);
+	free(max_crystals);
+	reflist_free(full);
+	free_checkpoint_data(images, hdr.n_images, crystals, n_read);
+	return 1;
+}
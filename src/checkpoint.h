@@ -0,0 +1,74 @@
+/*
+ * checkpoint.h
+ *
+ * Save and restore the state of partialator between cycles
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include "image.h"
+#include "crystal.h"
+#include "reflist.h"
+#include "geometry.h"
+#include "refl-arrays.h"
+#include "refl-cache.h"
+
+
+/* The settings which a checkpoint was made with, which must be the same when
+ * resuming from it */
+struct checkpoint_info
+{
+	int cycle;               /* Number of the last completed cycle */
+	PartialityModel pmodel;
+	char sym[32];            /* Name of the point group */
+	int rank;
+	int n_ranks;
+	int n_iter;              /* --iterations */
+	int min_measurements;    /* --min-measurements */
+	double max_adu;          /* --max-adu */
+};
+
+
+extern int write_checkpoint(const char *filename,
+                            const struct checkpoint_info *info,
+                            struct image *images, int n_images,
+                            Crystal **crystals, int n_crystals,
+                            struct refl_arrays *ra, struct refl_cache *cache,
+                            RefList *full);
+
+extern int read_checkpoint(const char *filename, struct checkpoint_info *info,
+                           struct image **pimages, int *pn_images,
+                           Crystal ***pcrystals, int *pn_crystals,
+                           struct refl_arrays **pra, struct refl_cache *cache,
+                           RefList **pfull);
+
+#endif	/* CHECKPOINT_H */
@@ -0,0 +1,943 @@
+/*
+ * collective.c
+ *
+ * Collective operations between several partialator processes
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "reflist.h"
+#include "utils.h"
+#include "collective.h"
+
+
+/* How long to wait for all the ranks to turn up, in seconds */
+#define CONNECT_TIMEOUT (300)
+
+/* How long to wait for a new connection to say which rank it is, in seconds */
+#define HELLO_TIMEOUT (10)
+
+#define HELLO_MAGIC (0x43464c52)
+
+
+/* The ranks are connected in a star around rank zero, which does all the
+ * reductions.  Everything is sent in the native byte order, so all the ranks
+ * have to run on the same kind of machine.
+ *
+ * The crystals are divided into contiguous shards in exactly the same way as
+ * lsq_intensities() would divide them in a single process, with one shard per
+ * thread of every rank.  Each rank handles a contiguous range of the shards,
+ * and the partial merged lists are reduced by the same pairwise tree as in a
+ * single process.  Sums over crystals are passed from rank to rank, so that
+ * they are added up in the same order.  All of this means that the results
+ * are identical to a single process with the same total number of threads. */
+struct collective
+{
+	int rank;
+	int n_ranks;
+	int failed;           /* Non-zero after communication has failed */
+	int *fds;             /* Connections to the other ranks (rank 0 only) */
+	int fd;               /* Connection to rank 0 (other ranks only) */
+	int *n_threads;       /* Number of threads of each rank */
+
+	int n_crystals;       /* Total number of crystals in all ranks */
+	int first_crystal;    /* Number of this rank's first crystal */
+	int n_shards;         /* Total number of shards in all ranks */
+	int first_shard;      /* Number of this rank's first shard */
+	int last_shard;       /* One more than the number of the last shard */
+};
+
+
+/* One reflection of a partial merged list, as merge_crystal() leaves it */
+struct list_entry
+{
+	double intensity;
+	double temp1;
+	double temp2;
+	int32_t h;
+	int32_t k;
+	int32_t l;
+	int32_t redundancy;
+};
+
+
+/* There is no way to carry on if another rank has gone away, or sent
+ * something which doesn't make sense.  All the connections are closed, so
+ * that the other ranks find out instead of waiting forever, and everything
+ * after this fails straight away. */
+static int comm_failed(struct collective *c, const char *what)
+{
+	int i;
+
+	if ( c->failed ) return 1;
+
+	ERROR("Rank %i: communication with the other ranks failed (%s).\n",
+	      c->rank, what);
+	c->failed = 1;
+
+	for ( i=0; i<c->n_ranks; i++ ) {
+		if ( c->fds[i] != -1 ) close(c->fds[i]);
+		c->fds[i] = -1;
+	}
+	if ( c->fd != -1 ) close(c->fd);
+	c->fd = -1;
+
+	return 1;
+}
+
+
+static int send_all(struct collective *c, int fd, const void *vbuf,
+                    size_t len)
+{
+	const unsigned char *buf = vbuf;
+
+	if ( c->failed ) return 1;
+
+	while ( len > 0 ) {
+		ssize_t r = write(fd, buf, len);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return comm_failed(c, strerror(errno));
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+
+static int recv_all(struct collective *c, int fd, void *vbuf, size_t len)
+{
+	unsigned char *buf = vbuf;
+
+	if ( c->failed ) return 1;
+
+	while ( len > 0 ) {
+		ssize_t r = read(fd, buf, len);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return comm_failed(c, strerror(errno));
+		}
+		if ( r == 0 ) return comm_failed(c, "connection closed");
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+
+/* ------------------------------ Connecting -------------------------------- */
+
+/* Addresses containing a slash, or no colon, are Unix socket paths.
+ * Everything else is "host:port" for TCP.  If the host is left out, rank zero
+ * only listens on the loopback interface, so all the ranks have to be on the
+ * same computer. */
+static int is_unix_address(const char *address)
+{
+	return (strchr(address, '/') != NULL) || (strchr(address, ':') == NULL);
+}
+
+
+static int unix_socket(const char *address, int listening)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if ( strlen(address) >= sizeof(addr.sun_path) ) {
+		ERROR("Socket path '%s' is too long.\n", address);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, address);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( fd == -1 ) return -1;
+
+	if ( listening ) {
+		struct stat statbuf;
+		/* Remove the socket left behind by an earlier run, but don't
+		 * clobber anything else */
+		if ( !stat(address, &statbuf) && S_ISSOCK(statbuf.st_mode) ) {
+			unlink(address);
+		}
+		if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+		  || listen(fd, SOMAXCONN) )
+		{
+			close(fd);
+			return -1;
+		}
+	} else if ( connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static int tcp_socket(const char *address, int listening)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	char *host;
+	char *port;
+	int fd = -1;
+
+	host = strdup(address);
+	if ( host == NULL ) return -1;
+	port = strrchr(host, ':');
+	*port++ = '\0';
+
+	/* Without AI_PASSIVE, no host means the loopback address, even when
+	 * listening */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ( getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &res) ) {
+		free(host);
+		return -1;
+	}
+	free(host);
+
+	for ( ai=res; ai!=NULL; ai=ai->ai_next ) {
+
+		int one = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if ( fd == -1 ) continue;
+
+		if ( listening ) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+			           &one, sizeof(one));
+			if ( !bind(fd, ai->ai_addr, ai->ai_addrlen)
+			  && !listen(fd, SOMAXCONN) ) break;
+		} else if ( !connect(fd, ai->ai_addr, ai->ai_addrlen) ) {
+			/* Many of the messages are small */
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+			           &one, sizeof(one));
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+
+static int open_socket(const char *address, int listening)
+{
+	if ( is_unix_address(address) ) {
+		return unix_socket(address, listening);
+	} else {
+		return tcp_socket(address, listening);
+	}
+}
+
+
+/* Rank zero might not be listening yet, so keep trying for a while */
+static int connect_to_root(const char *address)
+{
+	int i;
+
+	for ( i=0; i<CONNECT_TIMEOUT*10; i++ ) {
+		int fd = open_socket(address, 0);
+		if ( fd != -1 ) return fd;
+		usleep(100000);
+	}
+
+	return -1;
+}
+
+
+/* This doesn't use recv_all(), because a connection which turns out not to be
+ * from another rank shouldn't stop the others from joining */
+static int recv_hello(int fd, int32_t *hello, size_t len)
+{
+	unsigned char *buf = (unsigned char *)hello;
+
+	while ( len > 0 ) {
+
+		struct pollfd pfd;
+		ssize_t r;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if ( poll(&pfd, 1, HELLO_TIMEOUT*1000) != 1 ) return 1;
+
+		r = read(fd, buf, len);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		if ( r == 0 ) return 1;
+		buf += r;
+		len -= r;
+
+	}
+
+	return 0;
+}
+
+
+static int accept_ranks(struct collective *c, const char *address,
+                        uint32_t token)
+{
+	int lfd;
+	int i;
+
+	lfd = open_socket(address, 1);
+	if ( lfd == -1 ) {
+		ERROR("Failed to listen on '%s': %s\n", address,
+		      strerror(errno));
+		return 1;
+	}
+
+	for ( i=1; i<c->n_ranks; i++ ) {
+
+		struct pollfd pfd;
+		int32_t hello[5];
+		int one = 1;
+		int fd;
+
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		if ( poll(&pfd, 1, CONNECT_TIMEOUT*1000) != 1 ) {
+			ERROR("Timed out waiting for the other ranks.\n");
+			close(lfd);
+			return 1;
+		}
+
+		fd = accept(lfd, NULL, NULL);
+		if ( fd == -1 ) {
+			ERROR("Failed to accept connection: %s\n",
+			      strerror(errno));
+			close(lfd);
+			return 1;
+		}
+		if ( !is_unix_address(address) ) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+			           &one, sizeof(one));
+		}
+
+		if ( recv_hello(fd, hello, sizeof(hello))
+		  || (hello[0] != HELLO_MAGIC)
+		  || ((uint32_t)hello[4] != token) )
+		{
+			ERROR("Ignoring a connection on '%s' which isn't from "
+			      "a rank of this run.  All the ranks must have "
+			      "the same options apart from --rank and -j.\n",
+			      address);
+			close(fd);
+			i--;
+			continue;
+		}
+		if ( (hello[2] != c->n_ranks)
+		  || (hello[1] < 1) || (hello[1] >= c->n_ranks)
+		  || (c->fds[hello[1]] != -1)
+		  || (hello[3] < 1) || (hello[3] > INT_MAX/c->n_ranks) )
+		{
+			ERROR("Unexpected connection on '%s'.  Check the "
+			      "--rank and --ranks options.\n", address);
+			close(fd);
+			close(lfd);
+			return 1;
+		}
+		c->fds[hello[1]] = fd;
+		c->n_threads[hello[1]] = hello[3];
+
+	}
+
+	close(lfd);
+	if ( is_unix_address(address) ) unlink(address);
+
+	/* Tell everyone how many threads everyone else has */
+	for ( i=1; i<c->n_ranks; i++ ) {
+		if ( send_all(c, c->fds[i], c->n_threads,
+		              c->n_ranks*sizeof(int)) ) return 1;
+	}
+
+	return 0;
+}
+
+
+/* Connects this rank to all the others, via rank zero, which listens on
+ * "address".  This blocks until all the ranks have joined.  Rank zero refuses
+ * connections which don't give the same "token", which should be different
+ * for each run.
+ */
+struct collective *collective_new(const char *address, int rank,
+                                  int n_ranks, int n_threads, uint32_t token)
+{
+	struct collective *c;
+	int i;
+
+	c = malloc(sizeof(struct collective));
+	if ( c == NULL ) return NULL;
+
+	c->rank = rank;
+	c->n_ranks = n_ranks;
+	c->failed = 0;
+	c->fd = -1;
+	c->fds = malloc(n_ranks*sizeof(int));
+	c->n_threads = malloc(n_ranks*sizeof(int));
+	if ( (c->fds == NULL) || (c->n_threads == NULL) ) {
+		free(c->fds);
+		free(c->n_threads);
+		free(c);
+		return NULL;
+	}
+	for ( i=0; i<n_ranks; i++ ) c->fds[i] = -1;
+	c->n_threads[rank] = n_threads;
+
+	c->n_crystals = 0;
+	c->first_crystal = 0;
+	c->n_shards = 1;
+	c->first_shard = 0;
+	c->last_shard = 1;
+
+	/* Get an error instead if another rank goes away */
+	signal(SIGPIPE, SIG_IGN);
+
+	if ( rank == 0 ) {
+
+		if ( accept_ranks(c, address, token) ) {
+			collective_free(c);
+			return NULL;
+		}
+
+	} else {
+
+		int32_t hello[5];
+
+		c->fd = connect_to_root(address);
+		if ( c->fd == -1 ) {
+			ERROR("Failed to connect to rank 0 at '%s'.\n",
+			      address);
+			collective_free(c);
+			return NULL;
+		}
+
+		hello[0] = HELLO_MAGIC;
+		hello[1] = rank;
+		hello[2] = n_ranks;
+		hello[3] = n_threads;
+		hello[4] = token;
+		if ( send_all(c, c->fd, hello, sizeof(hello))
+		  || recv_all(c, c->fd, c->n_threads, n_ranks*sizeof(int)) )
+		{
+			collective_free(c);
+			return NULL;
+		}
+
+		for ( i=0; i<n_ranks; i++ ) {
+			if ( (c->n_threads[i] < 1)
+			  || (c->n_threads[i] > INT_MAX/n_ranks)
+			  || ((i == rank) && (c->n_threads[i] != n_threads)) )
+			{
+				comm_failed(c, "bad numbers of threads");
+				collective_free(c);
+				return NULL;
+			}
+		}
+
+	}
+
+	return c;
+}
+
+
+void collective_free(struct collective *c)
+{
+	int i;
+
+	if ( c == NULL ) return;
+	for ( i=0; i<c->n_ranks; i++ ) {
+		if ( c->fds[i] != -1 ) close(c->fds[i]);
+	}
+	if ( c->fd != -1 ) close(c->fd);
+	free(c->fds);
+	free(c->n_threads);
+	free(c);
+}
+
+
+int collective_rank(struct collective *c)
+{
+	if ( c == NULL ) return 0;
+	return c->rank;
+}
+
+
+int collective_n_ranks(struct collective *c)
+{
+	if ( c == NULL ) return 1;
+	return c->n_ranks;
+}
+
+
+/* ------------------------------ Partitioning ------------------------------ */
+
+/* Works out which of the "n_total" crystals belong to this rank.  They are
+ * the "n" crystals starting from number "first".
+ */
+void collective_partition(struct collective *c, int n_total, int *first,
+                          int *n)
+{
+	int offset = 0;
+	int total_threads = 0;
+	int i;
+
+	if ( c == NULL ) {
+		*first = 0;
+		*n = n_total;
+		return;
+	}
+
+	for ( i=0; i<c->n_ranks; i++ ) {
+		if ( i == c->rank ) offset = total_threads;
+		total_threads += c->n_threads[i];
+	}
+
+	/* As in lsq_intensities() */
+	c->n_crystals = n_total;
+	c->n_shards = total_threads;
+	if ( c->n_shards > n_total ) c->n_shards = n_total;
+	if ( c->n_shards < 1 ) c->n_shards = 1;
+
+	c->first_shard = offset;
+	c->last_shard = offset + c->n_threads[c->rank];
+	if ( c->first_shard > c->n_shards ) c->first_shard = c->n_shards;
+	if ( c->last_shard > c->n_shards ) c->last_shard = c->n_shards;
+
+	c->first_crystal = (long)c->first_shard * n_total / c->n_shards;
+	*first = c->first_crystal;
+	*n = (long)c->last_shard * n_total / c->n_shards - *first;
+}
+
+
+/* Divides the "n" crystals of this rank into contiguous shards for merging.
+ * Returns an array of the local numbers of the first crystal of each shard,
+ * plus one more element for the end of the last shard.  The number of shards
+ * in this rank and in all ranks are put in "n_shards" and "n_total_shards", and
+ * the number of this rank's first shard is put in "first_shard".
+ */
+int *collective_shard_bounds(struct collective *c, int n, int n_threads,
+                             int *first_shard, int *n_shards,
+                             int *n_total_shards)
+{
+	int *bounds;
+	int i;
+
+	if ( c == NULL ) {
+		*first_shard = 0;
+		*n_shards = n_threads;
+		if ( *n_shards > n ) *n_shards = n;
+		if ( *n_shards < 1 ) *n_shards = 1;
+		*n_total_shards = *n_shards;
+	} else {
+		*first_shard = c->first_shard;
+		*n_shards = c->last_shard - c->first_shard;
+		*n_total_shards = c->n_shards;
+	}
+
+	bounds = malloc((*n_shards+1)*sizeof(int));
+	if ( bounds == NULL ) return NULL;
+
+	for ( i=0; i<=*n_shards; i++ ) {
+		if ( c == NULL ) {
+			bounds[i] = (long)i * n / *n_shards;
+		} else {
+			bounds[i] = (long)(c->first_shard+i) * c->n_crystals
+			            / c->n_shards - c->first_crystal;
+		}
+	}
+
+	return bounds;
+}
+
+
+/* -------------------------- Partial merged lists -------------------------- */
+
+/* The most reflections a list can have, so that its size fits in an int32_t
+ * and the buffer size doesn't overflow */
+#define MAX_LIST_ENTRIES (INT32_MAX/sizeof(struct list_entry))
+
+
+static int send_list(struct collective *c, int fd, RefList *list)
+{
+	struct list_entry *entries;
+	Reflection *refl;
+	RefListIterator *iter;
+	int32_t n;
+	int i = 0;
+	int r;
+
+	if ( num_reflections(list) > MAX_LIST_ENTRIES ) {
+		return comm_failed(c, "list too big");
+	}
+	n = num_reflections(list);
+
+	/* At least one element, so that NULL always means failure */
+	entries = malloc((n > 0 ? n : 1)*sizeof(struct list_entry));
+	if ( entries == NULL ) return comm_failed(c, "out of memory");
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		get_indices(refl, &h, &k, &l);
+		entries[i].h = h;
+		entries[i].k = k;
+		entries[i].l = l;
+		entries[i].intensity = get_intensity(refl);
+		entries[i].temp1 = get_temp1(refl);
+		entries[i].temp2 = get_temp2(refl);
+		entries[i].redundancy = get_redundancy(refl);
+		i++;
+	}
+
+	r = send_all(c, fd, &n, sizeof(n))
+	 || send_all(c, fd, entries, n*sizeof(struct list_entry));
+	free(entries);
+	return r;
+}
+
+
+static RefList *recv_list(struct collective *c, int fd)
+{
+	struct list_entry *entries;
+	RefList *list;
+	int32_t n;
+	int i;
+
+	if ( recv_all(c, fd, &n, sizeof(n)) ) return NULL;
+	if ( (n < 0) || (n > MAX_LIST_ENTRIES) ) {
+		comm_failed(c, "bad list size");
+		return NULL;
+	}
+
+	entries = malloc((n > 0 ? n : 1)*sizeof(struct list_entry));
+	list = reflist_new_2(REFLIST_HASH);
+	if ( (entries == NULL) || (list == NULL) ) {
+		comm_failed(c, "out of memory");
+		goto fail;
+	}
+	if ( recv_all(c, fd, entries, n*sizeof(struct list_entry)) ) goto fail;
+
+	reflist_reserve(list, n);
+	for ( i=0; i<n; i++ ) {
+
+		Reflection *refl;
+
+		/* The largest indices which a RefList can hold */
+		if ( (abs(entries[i].h) >= 512) || (abs(entries[i].k) >= 512)
+		  || (abs(entries[i].l) >= 512) )
+		{
+			comm_failed(c, "bad indices in list");
+			goto fail;
+		}
+
+		refl = add_refl(list, entries[i].h, entries[i].k,
+		                entries[i].l);
+		if ( refl == NULL ) {
+			comm_failed(c, "out of memory");
+			goto fail;
+		}
+
+		set_intensity(refl, entries[i].intensity);
+		set_temp1(refl, entries[i].temp1);
+		set_temp2(refl, entries[i].temp2);
+		set_redundancy(refl, entries[i].redundancy);
+
+	}
+
+	free(entries);
+	return list;
+
+fail:
+	free(entries);
+	reflist_free(list);
+	return NULL;
+}
+
+
+/* Sends the partial merged lists lists[first] to lists[first+n-1] from each
+ * rank to rank zero, where they end up at the same positions in "lists".
+ * NULL entries are skipped.  In the other ranks, the lists are freed and
+ * replaced with NULL, even if something fails.  Only the quantities used by
+ * merge_crystal() are sent.  Returns non-zero on error.
+ */
+int collective_gather_lists(struct collective *c, RefList **lists, int first,
+                            int n)
+{
+	int i;
+	int r = 0;
+
+	if ( c == NULL ) return 0;
+
+	if ( c->rank != 0 ) {
+
+		int32_t n_send = 0;
+
+		for ( i=first; i<first+n; i++ ) {
+			if ( lists[i] != NULL ) n_send++;
+		}
+		r = send_all(c, c->fd, &n_send, sizeof(n_send));
+
+		for ( i=first; i<first+n; i++ ) {
+			int32_t pos = i;
+			if ( lists[i] == NULL ) continue;
+			if ( !r ) r = send_all(c, c->fd, &pos, sizeof(pos));
+			if ( !r ) r = send_list(c, c->fd, lists[i]);
+			reflist_free(lists[i]);
+			lists[i] = NULL;
+		}
+
+		return r;
+
+	}
+
+	for ( i=1; i<c->n_ranks; i++ ) {
+
+		int32_t n_recv;
+		int j;
+
+		if ( recv_all(c, c->fds[i], &n_recv, sizeof(n_recv)) ) {
+			return 1;
+		}
+		if ( (n_recv < 0) || (n_recv > c->n_shards) ) {
+			return comm_failed(c, "bad number of lists");
+		}
+
+		for ( j=0; j<n_recv; j++ ) {
+			int32_t pos;
+			if ( recv_all(c, c->fds[i], &pos, sizeof(pos)) ) {
+				return 1;
+			}
+			if ( (pos < 0) || (pos >= c->n_shards)
+			  || (lists[pos] != NULL) )
+			{
+				return comm_failed(c, "bad list position");
+			}
+			lists[pos] = recv_list(c, c->fds[i]);
+			if ( lists[pos] == NULL ) return 1;
+		}
+
+	}
+
+	return 0;
+}
+
+
+/* Sends "*list" from rank zero to all the other ranks, where it replaces
+ * "*list".  As for collective_gather_lists(), only the quantities used for
+ * merging are sent.  Returns non-zero on error, in which case "*list" is NULL
+ * in the other ranks.
+ */
+int collective_bcast_list(struct collective *c, RefList **list)
+{
+	int i;
+
+	if ( c == NULL ) return 0;
+
+	if ( c->rank != 0 ) {
+		reflist_free(*list);
+		*list = recv_list(c, c->fd);
+		return *list == NULL;
+	}
+
+	for ( i=1; i<c->n_ranks; i++ ) {
+		if ( send_list(c, c->fds[i], *list) ) return 1;
+	}
+
+	return 0;
+}
+
+
+/* ---------------------------------- Sums ---------------------------------- */
+
+/* Replaces the "n" values in "vals" with their totals over all the ranks.
+ * Returns non-zero on error.
+ */
+int collective_sum_int(struct collective *c, int *vals, int n)
+{
+	int *tmp;
+	int i, j;
+
+	if ( c == NULL ) return 0;
+
+	if ( c->rank != 0 ) {
+		return send_all(c, c->fd, vals, n*sizeof(int))
+		    || recv_all(c, c->fd, vals, n*sizeof(int));
+	}
+
+	tmp = malloc(n*sizeof(int));
+	if ( tmp == NULL ) return comm_failed(c, "out of memory");
+	for ( i=1; i<c->n_ranks; i++ ) {
+		if ( recv_all(c, c->fds[i], tmp, n*sizeof(int)) ) {
+			free(tmp);
+			return 1;
+		}
+		for ( j=0; j<n; j++ ) vals[j] += tmp[j];
+	}
+	free(tmp);
+
+	for ( i=1; i<c->n_ranks; i++ ) {
+		if ( send_all(c, c->fds[i], vals, n*sizeof(int)) ) return 1;
+	}
+
+	return 0;
+}
+
+
+/* Floating point sums over all the crystals have to be added up in the same
+ * order as in a single process, otherwise the results would change slightly.
+ * Call this before adding this rank's contributions to the "n" values in
+ * "acc", and collective_chain_end() afterwards.  This waits for the running
+ * totals from the previous rank, which replace "acc".  In rank zero, "acc"
+ * should already contain the initial values.  Returns non-zero on error.
+ */
+int collective_chain_begin(struct collective *c, double *acc, int n)
+{
+	if ( c == NULL ) return 0;
+	if ( c->rank == 0 ) return 0;
+	return recv_all(c, c->fd, acc, n*sizeof(double));
+}
+
+
+/* Passes the running totals in "acc" to the next rank, and waits for the
+ * final totals from the last rank.  Returns non-zero on error.
+ */
+int collective_chain_end(struct collective *c, double *acc, int n)
+{
+	int i;
+
+	if ( c == NULL ) return 0;
+
+	if ( c->rank != 0 ) {
+		return send_all(c, c->fd, acc, n*sizeof(double))
+		    || recv_all(c, c->fd, acc, n*sizeof(double));
+	}
+
+	for ( i=1; i<c->n_ranks; i++ ) {
+		if ( send_all(c, c->fds[i], acc, n*sizeof(double))
+		  || recv_all(c, c->fds[i], acc, n*sizeof(double)) ) return 1;
+	}
+	for ( i=1; i<c->n_ranks; i++ ) {
+		if ( send_all(c, c->fds[i], acc, n*sizeof(double)) ) return 1;
+	}
+
+	return 0;
+}
+
+
+/* Sends "size" bytes from "local" in each rank to rank zero.  In rank zero,
+ * puts a newly allocated buffer containing the data from all the ranks in
+ * order in "all", and its size in "total_size".  In the other ranks, "all" is
+ * set to NULL.  Returns non-zero on error.
+ */
+int collective_gather(struct collective *c, const void *local, size_t size,
+                      void **all, size_t *total_size)
+{
+	unsigned char *buf;
+	size_t pos;
+	int i;
+
+	*all = NULL;
+
+	if ( (c != NULL) && (c->rank != 0) ) {
+		uint64_t len = size;
+		return send_all(c, c->fd, &len, sizeof(len))
+		    || send_all(c, c->fd, local, size);
+	}
+
+	/* At least one byte, so that NULL always means failure */
+	buf = malloc(size > 0 ? size : 1);
+	if ( buf == NULL ) return 1;
+	if ( size > 0 ) memcpy(buf, local, size);
+	pos = size;
+
+	for ( i=1; i<collective_n_ranks(c); i++ ) {
+
+		unsigned char *buf_new;
+		uint64_t len;
+
+		if ( recv_all(c, c->fds[i], &len, sizeof(len)) ) {
+			free(buf);
+			return 1;
+		}
+		if ( len > SIZE_MAX - pos ) {
+			free(buf);
+			return comm_failed(c, "bad size");
+		}
+
+		buf_new = realloc(buf, pos+len > 0 ? pos+len : 1);
+		if ( buf_new == NULL ) {
+			free(buf);
+			return comm_failed(c, "out of memory");
+		}
+		buf = buf_new;
+		if ( recv_all(c, c->fds[i], buf+pos, len) ) {
+			free(buf);
+			return 1;
+		}
+		pos += len;
+
+	}
+
+	*all = buf;
+	*total_size = pos;
+	return 0;
+}
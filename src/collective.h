@@ -0,0 +1,71 @@
+/*
+ * collective.h
+ *
+ * Collective operations between several partialator processes
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COLLECTIVE_H
+#define COLLECTIVE_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "reflist.h"
+
+
+struct collective;
+
+extern struct collective *collective_new(const char *address, int rank,
+                                         int n_ranks, int n_threads,
+                                         uint32_t token);
+extern void collective_free(struct collective *c);
+
+extern int collective_rank(struct collective *c);
+extern int collective_n_ranks(struct collective *c);
+
+extern void collective_partition(struct collective *c, int n_total,
+                                 int *first, int *n);
+extern int *collective_shard_bounds(struct collective *c, int n,
+                                    int n_threads, int *first_shard,
+                                    int *n_shards, int *n_total_shards);
+
+extern int collective_gather_lists(struct collective *c, RefList **lists,
+                                   int first, int n);
+extern int collective_bcast_list(struct collective *c, RefList **list);
+
+extern int collective_sum_int(struct collective *c, int *vals, int n);
+extern int collective_chain_begin(struct collective *c, double *acc, int n);
+extern int collective_chain_end(struct collective *c, double *acc, int n);
+
+extern int collective_gather(struct collective *c, const void *local,
+                             size_t size, void **all, size_t *total_size);
+
+#endif	/* COLLECTIVE_H */
@@ -0,0 +1,251 @@
+/*
+ * convert_stream.c
+ *
+ * Convert streams between the text and binary formats
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "version.h"
+#include "utils.h"
+#include "detector.h"
+#include "image.h"
+#include "stream.h"
+#include "reflist.h"
+#include "cell.h"
+#include "events.h"
+#include "index.h"
+
+
+static void show_help(const char *s)
+{
+	printf("Syntax: %s [options] -i input.stream -o output.stream "
+	       "-g geometry.geom\n\n", s);
+	printf(
+"Convert streams between the text and binary formats.\n"
+"\n"
+"  -h, --help                 Display this help message.\n"
+"      --version              Print CrystFEL version number and exit.\n"
+"\n"
+"  -i, --input=<file>         Input stream, in either format.\n"
+"  -o, --output=<file>        Output stream.\n"
+"  -g, --geometry=<file>      Get detector geometry from file.\n"
+"      --format=<f>           Write the output in format <f>, 'text' or\n"
+"                              'binary'.  Default: the opposite of the input.\n"
+);
+}
+
+
+static void free_chunk(struct image *image)
+{
+	int i;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+		Crystal *cr = image->crystals[i];
+		reflist_free(crystal_get_reflections(cr));
+		cell_free(crystal_get_cell(cr));
+		crystal_free(cr);
+	}
+	free(image->crystals);
+
+	if ( image->stuff_from_stream != NULL ) {
+		for ( i=0; i<image->stuff_from_stream->n_fields; i++ ) {
+			free(image->stuff_from_stream->fields[i]);
+		}
+		free(image->stuff_from_stream->fields);
+		free(image->stuff_from_stream);
+	}
+
+	image_feature_list_free(image->features);
+	if ( image->event != NULL ) free_event(image->event);
+	free(image->filename);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *input = NULL;
+	char *output = NULL;
+	char *geom = NULL;
+	char *format = NULL;
+	StreamFormat out_format;
+	struct detector *det;
+	Stream *ist;
+	Stream *ost;
+	int n_chunks = 0;
+	int n_crystals = 0;
+
+	/* Long options */
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,                2 },
+		{"input",              1, NULL,               'i'},
+		{"output",             1, NULL,               'o'},
+		{"geometry",           1, NULL,               'g'},
+		{"format",             1, NULL,                3 },
+		{0, 0, NULL, 0}
+	};
+
+	/* Short options */
+	while ((c = getopt_long(argc, argv, "hi:o:g:",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 2 :
+			printf("CrystFEL: " CRYSTFEL_VERSIONSTRING "\n");
+			printf(CRYSTFEL_BOILERPLATE"\n");
+			return 0;
+
+			case 'i' :
+			input = strdup(optarg);
+			break;
+
+			case 'o' :
+			output = strdup(optarg);
+			break;
+
+			case 'g' :
+			geom = strdup(optarg);
+			break;
+
+			case 3 :
+			format = strdup(optarg);
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( (input == NULL) || (output == NULL) || (geom == NULL) ) {
+		ERROR("You must specify at least the input, output and geometry"
+		      " filenames.\n");
+		return 1;
+	}
+
+	det = get_detector_geometry(geom, NULL);
+	if ( det == NULL ) {
+		ERROR("Failed to read '%s'\n", geom);
+		return 1;
+	}
+
+	ist = open_stream_for_read(input);
+	if ( ist == NULL ) {
+		ERROR("Failed to open input stream '%s'\n", input);
+		return 1;
+	}
+
+	if ( format == NULL ) {
+		if ( get_stream_format(ist) == STREAM_FORMAT_BINARY ) {
+			out_format = STREAM_FORMAT_TEXT;
+		} else {
+			out_format = STREAM_FORMAT_BINARY;
+		}
+	} else if ( strcmp(format, "text") == 0 ) {
+		out_format = STREAM_FORMAT_TEXT;
+	} else if ( strcmp(format, "binary") == 0 ) {
+		out_format = STREAM_FORMAT_BINARY;
+	} else {
+		ERROR("Invalid value for --format\n");
+		return 1;
+	}
+	free(format);
+
+	ost = open_stream_for_write_3(output, geom, argc, argv, out_format);
+	if ( ost == NULL ) {
+		ERROR("Failed to open output stream '%s'\n", output);
+		return 1;
+	}
+
+	do {
+
+		struct image cur;
+		int i;
+
+		cur.det = det;
+		cur.copyme = NULL;
+		cur.num_peaks = 0;
+		cur.num_saturated_peaks = 0;
+		cur.div = 0.0;
+		cur.bw = 0.0;
+		cur.serial = 0;
+		cur.indexed_by = INDEXING_NONE;
+
+		if ( read_chunk(ist, &cur) != 0 ) break;
+
+		for ( i=0; i<cur.n_crystals; i++ ) {
+			crystal_set_image(cur.crystals[i], &cur);
+		}
+
+		if ( write_chunk(ost, &cur, NULL, cur.features != NULL, 1,
+		                 cur.event) )
+		{
+			ERROR("Failed to write chunk for %s\n", cur.filename);
+		}
+
+		n_chunks++;
+		n_crystals += cur.n_crystals;
+		free_chunk(&cur);
+
+	} while ( 1 );
+
+	close_stream(ist);
+	close_stream(ost);
+	free_detector_geometry(det);
+
+	STATUS("Converted %i chunks containing %i crystals.\n",
+	       n_chunks, n_crystals);
+
+	free(input);
+	free(output);
+	free(geom);
+
+	return 0;
+}
@@ -47,6 +47,9 @@
 #include "utils.h"
 #include "reflist.h"
 #include "cell-utils.h"
+#include "refl-arrays.h"
+#include "refl-cache.h"
+#include "collective.h"
 
 
 /* Minimum partiality of a reflection for it to be used for scaling */
@@ -61,18 +64,16 @@
 
 struct scale_queue_args
 {
-	RefList *reference;
-	Crystal **crystals;
+	struct refl_arrays *ra;
 	int n_started;
 	PartialityModel pmodel;
-	UnitCell *cell;
 };
 
 
 struct scale_worker_args
 {
-	Crystal *crystal;
-	RefList *reference;
+	struct crystal_arrays *ca;
+	const struct merged_arrays *reference;
 	PartialityModel pmodel;
 	int crystal_number;
 };
@@ -84,11 +85,11 @@ static void *create_scale_job(void *vqargs)
 	struct scale_queue_args *qargs = vqargs;
 
 	wargs = malloc(sizeof(struct scale_worker_args));
-	wargs->reference = qargs->reference;
+	wargs->reference = &qargs->ra->merged;
 	wargs->pmodel = qargs->pmodel;
 
 	wargs->crystal_number = qargs->n_started;
-	wargs->crystal = qargs->crystals[qargs->n_started++];
+	wargs->ca = &qargs->ra->crystals[qargs->n_started++];
 
 	return wargs;
 }
@@ -97,74 +98,63 @@ static void *create_scale_job(void *vqargs)
 static void run_scale_job(void *vwargs, int cookie)
 {
 	struct scale_worker_args *wargs = vwargs;
-	Crystal *cr = wargs->crystal;
-	RefList *reference = wargs->reference;
-	Reflection *refl;
-	RefListIterator *iter;
+	struct crystal_arrays *ca = wargs->ca;
+	Crystal *cr = ca->crystal;
+	const struct merged_arrays *reference = wargs->reference;
+	UnitCell *cell = crystal_get_cell(cr);
 	int n = 0;
 	double *x;
 	double *y;
 	double *w;
-	int max_n = 256;
 	double c0, c1, cov00, cov01, cov11, chisq;
 	double G, B;
+	int i;
 	int r;
 
 	/* If this crystal's scaling was dodgy, it doesn't contribute to the
 	 * merged intensities */
 	if ( crystal_get_user_flag(cr) != 0 ) return;
 
-	x = malloc(max_n*sizeof(double));
-	y = malloc(max_n*sizeof(double));
-	w = malloc(max_n*sizeof(double));
+	if ( ca->n < 2 ) {
+		crystal_set_user_flag(cr, 1);
+		return;
+	}
+
+	/* There can't be more points than reflections */
+	x = malloc(ca->n*sizeof(double));
+	y = malloc(ca->n*sizeof(double));
+	w = malloc(ca->n*sizeof(double));
 	if ( (x==NULL) || (y==NULL) || (w==NULL) ) {
 		ERROR("Failed to allocate memory for scaling.\n");
 		return;
 	}
 
-	for ( refl = first_refl(crystal_get_reflections(cr), &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	for ( i=0; i<ca->n; i++ )
 	{
-		signed int h, k, l;
 		double Ih, Ihl, corr;
-		Reflection *r;
 		double res;
+		int m;
 
-		get_indices(refl, &h, &k, &l);
-		res = resolution(crystal_get_cell(cr), h, k, l);
-
-		if ( (get_partiality(refl) < MIN_PART_SCALE)
-		  || (get_intensity(refl) < 5.0*get_esd_intensity(refl)) ) {
+		if ( (ca->partiality[i] < MIN_PART_SCALE)
+		  || (ca->intensity[i] < 5.0*ca->esd[i]) ) {
 			continue;
 		}
 
 		/* Look up by asymmetric indices */
-		r = find_refl(reference, h, k, l);
-		if ( r == NULL ) {
-			continue;
-		}
+		m = ca->merged[i];
+		if ( reference->redundancy[m] == 0 ) continue;
 
-		corr = get_lorentz(refl) / get_partiality(refl);
+		corr = ca->lorentz[i] / ca->partiality[i];
 
-		Ih = get_intensity(r);
-		Ihl = get_intensity(refl) * corr;
+		Ih = reference->intensity[m];
+		Ihl = ca->intensity[i] * corr;
 
 		if ( Ihl <= 0.0 ) continue;
 		if ( Ih <= 0.0 ) continue;
 		if ( isnan(Ihl) || isinf(Ihl) ) continue;
 		if ( isnan(Ih) || isinf(Ih) ) continue;
 
-		if ( n == max_n ) {
-			max_n *= 2;
-			x = realloc(x, max_n*sizeof(double));
-			y = realloc(y, max_n*sizeof(double));
-			w = realloc(w, max_n*sizeof(double));
-			if ( (x==NULL) || (y==NULL) || (w==NULL) ) {
-				ERROR("Failed to allocate memory for scaling.\n");
-				return;
-			}
-		}
+		res = resolution(cell, ca->h[i], ca->k[i], ca->l[i]);
 
 		x[n] = res*res;
 		y[n] = log(Ihl/Ih);
@@ -175,6 +165,9 @@ static void run_scale_job(void *vwargs, int cookie)
 
 	if ( n < 2 ) {
 		crystal_set_user_flag(cr, 1);
+		free(x);
+		free(y);
+		free(w);
 		return;
 	}
 
@@ -204,28 +197,65 @@ static void finalise_scale_job(void *vqargs, void *vwargs)
 }
 
 
-static void iterate_scale(Crystal **crystals, int n, RefList *reference,
-                          int n_threads, PartialityModel pmodel)
+static void scale_arrays(struct refl_arrays *ra, RefList *reference,
+                         int n_threads, PartialityModel pmodel)
 {
 	struct scale_queue_args qargs;
 
-	assert(reference != NULL);
+	refl_arrays_set_merged(ra, reference);
 
-	qargs.reference = reference;
+	qargs.ra = ra;
 	qargs.n_started = 0;
-	qargs.crystals = crystals;
 	qargs.pmodel = pmodel;
 
 	run_threads(n_threads, run_scale_job, create_scale_job,
-	            finalise_scale_job, &qargs, n, 0, 0, 0);
+	            finalise_scale_job, &qargs, ra->n_crystals, 0, 0, 0);
+}
+
+
+static int iterate_scale(Crystal **crystals, struct refl_arrays *ra,
+                         struct refl_cache *cache, RefList *reference,
+                         int n_threads, PartialityModel pmodel)
+{
+	int b;
+
+	assert(reference != NULL);
+
+	if ( cache == NULL ) {
+		scale_arrays(ra, reference, n_threads, pmodel);
+		return 0;
+	}
+
+	for ( b=0; b<refl_cache_num_blocks(cache); b++ ) {
+
+		struct refl_arrays *block_ra;
+		int first, n;
+
+		if ( refl_cache_load_block(cache, crystals, b, &first, &n) ) {
+			return 1;
+		}
+
+		block_ra = refl_arrays_new(&crystals[first], n);
+		if ( block_ra == NULL ) {
+			refl_cache_release_block(cache, crystals, b, 0);
+			return 1;
+		}
+		scale_arrays(block_ra, reference, n_threads, pmodel);
+		refl_arrays_free(block_ra);
+
+		refl_cache_release_block(cache, crystals, b, 0);
+
+	}
+
+	return 0;
 }
 
 
 struct merge_queue_args
 {
-	RefList *full;
-	pthread_rwlock_t full_lock;
+	RefList **partials;
 	Crystal **crystals;
+	const int *bounds;    /* First crystal of each shard, and end of last */
 	int n_started;
 	PartialityModel pmodel;
 };
@@ -233,11 +263,10 @@ struct merge_queue_args
 
 struct merge_worker_args
 {
-	Crystal *crystal;
-	RefList *full;
-	pthread_rwlock_t *full_lock;
+	Crystal **crystals;
+	int n_crystals;
+	RefList *partial;
 	PartialityModel pmodel;
-	int crystal_number;
 };
 
 
@@ -245,24 +274,22 @@ static void *create_merge_job(void *vqargs)
 {
 	struct merge_worker_args *wargs;
 	struct merge_queue_args *qargs = vqargs;
+	int shard;
 
 	wargs = malloc(sizeof(struct merge_worker_args));
-	wargs->full = qargs->full;
-	wargs->full_lock = &qargs->full_lock;
 	wargs->pmodel = qargs->pmodel;
 
-	wargs->crystal_number = qargs->n_started;
-	wargs->crystal = qargs->crystals[qargs->n_started++];
+	shard = qargs->n_started++;
+	wargs->crystals = &qargs->crystals[qargs->bounds[shard]];
+	wargs->n_crystals = qargs->bounds[shard+1] - qargs->bounds[shard];
+	wargs->partial = qargs->partials[shard];
 
 	return wargs;
 }
 
 
-static void run_merge_job(void *vwargs, int cookie)
+static void merge_crystal(Crystal *cr, RefList *partial)
 {
-	struct merge_worker_args *wargs = vwargs;
-	Crystal *cr = wargs->crystal;
-	RefList *full = wargs->full;
 	Reflection *refl;
 	RefListIterator *iter;
 	double G, B;
@@ -286,39 +313,12 @@ static void run_merge_job(void *vwargs, int cookie)
 		if ( get_partiality(refl) < MIN_PART_MERGE ) continue;
 
 		get_indices(refl, &h, &k, &l);
-		pthread_rwlock_rdlock(wargs->full_lock);
-		f = find_refl(full, h, k, l);
+		f = find_refl(partial, h, k, l);
 		if ( f == NULL ) {
-
-			/* Swap read lock for write lock */
-			pthread_rwlock_unlock(wargs->full_lock);
-			pthread_rwlock_wrlock(wargs->full_lock);
-
-			/* In the gap between the unlock and the wrlock, the
-			 * reflection might have been created by another thread.
-			 * So, we must check again */
-			f = find_refl(full, h, k, l);
-			if ( f == NULL ) {
-				f = add_refl(full, h, k, l);
-				lock_reflection(f);
-				pthread_rwlock_unlock(wargs->full_lock);
-				set_intensity(f, 0.0);
-				set_temp1(f, 0.0);
-				set_temp2(f, 0.0);
-
-			} else {
-
-				/* Someone else created it */
-				lock_reflection(f);
-				pthread_rwlock_unlock(wargs->full_lock);
-
-			}
-
-		} else {
-
-			lock_reflection(f);
-			pthread_rwlock_unlock(wargs->full_lock);
-
+			f = add_refl(partial, h, k, l);
+			set_intensity(f, 0.0);
+			set_temp1(f, 0.0);
+			set_temp2(f, 0.0);
 		}
 
 		mean = get_intensity(f);
@@ -342,7 +342,17 @@ static void run_merge_job(void *vwargs, int cookie)
 		set_temp2(f, M2 + sumweight * delta * R);
 		set_temp1(f, temp);
 		set_redundancy(f, get_redundancy(f)+1);
-		unlock_reflection(f);
+	}
+}
+
+
+static void run_merge_job(void *vwargs, int cookie)
+{
+	struct merge_worker_args *wargs = vwargs;
+	int i;
+
+	for ( i=0; i<wargs->n_crystals; i++ ) {
+		merge_crystal(wargs->crystals[i], wargs->partial);
 	}
 }
 
@@ -353,40 +363,289 @@ static void finalise_merge_job(void *vqargs, void *vwargs)
 }
 
 
-RefList *lsq_intensities(Crystal **crystals, int n, int n_threads,
-                         PartialityModel pmodel)
+/* Combine the weighted means and variances in "b" into "a", using the pairwise
+ * formula of Chan, Golub and LeVeque */
+static void combine_partials(RefList *a, RefList *b)
 {
-	RefList *full;
-	struct merge_queue_args qargs;
 	Reflection *refl;
 	RefListIterator *iter;
 
-	full = reflist_new();
+	for ( refl = first_refl(b, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		Reflection *f;
+		signed int h, k, l;
+		double wa, wb, w, delta;
 
-	qargs.full = full;
-	qargs.n_started = 0;
+		get_indices(refl, &h, &k, &l);
+		f = find_refl(a, h, k, l);
+		if ( f == NULL ) {
+			f = add_refl(a, h, k, l);
+			copy_data(f, refl);
+			continue;
+		}
+
+		wa = get_temp1(f);
+		wb = get_temp1(refl);
+		w = wa + wb;
+		delta = get_intensity(refl) - get_intensity(f);
+
+		set_intensity(f, get_intensity(f) + delta*wb/w);
+		set_temp2(f, get_temp2(f) + get_temp2(refl)
+		             + delta*delta*wa*wb/w);
+		set_temp1(f, w);
+		set_redundancy(f, get_redundancy(f) + get_redundancy(refl));
+	}
+}
+
+
+struct combine_queue_args
+{
+	RefList **partials;
+	int stride;
+	int *pairs;           /* First partial of each pair at this level */
+	int n_started;
+};
+
+
+struct combine_worker_args
+{
+	RefList *a;
+	RefList *b;
+	RefList **b_pos;      /* Where "b" was, to be cleared when it's done */
+};
+
+
+static void *create_combine_job(void *vqargs)
+{
+	struct combine_worker_args *wargs;
+	struct combine_queue_args *qargs = vqargs;
+	int i;
+
+	wargs = malloc(sizeof(struct combine_worker_args));
+
+	i = qargs->pairs[qargs->n_started++];
+	wargs->a = qargs->partials[i];
+	wargs->b = qargs->partials[i+qargs->stride];
+	wargs->b_pos = &qargs->partials[i+qargs->stride];
+
+	return wargs;
+}
+
+
+static void run_combine_job(void *vwargs, int cookie)
+{
+	struct combine_worker_args *wargs = vwargs;
+	combine_partials(wargs->a, wargs->b);
+}
+
+
+static void finalise_combine_job(void *vqargs, void *vwargs)
+{
+	struct combine_worker_args *wargs = vwargs;
+	reflist_free(wargs->b);
+	*wargs->b_pos = NULL;
+	free(wargs);
+}
+
+
+/* Combine the "n" partial lists in pairs, in parallel, until only partials[0]
+ * is left.  Only the lists from "first" to "last"-1 are present in this rank,
+ * so only the pairs which cover lists in that range are combined, and the
+ * others are left for rank zero.  NULL entries have already been combined
+ * into an earlier list.  Returns non-zero on error. */
+static int reduce_partials(RefList **partials, int first, int last, int n,
+                           int n_threads)
+{
+	struct combine_queue_args qargs;
+
+	qargs.partials = partials;
+	qargs.pairs = malloc(n*sizeof(int));
+	if ( qargs.pairs == NULL ) {
+		ERROR("Failed to allocate memory for merging.\n");
+		return 1;
+	}
+
+	for ( qargs.stride=1; qargs.stride<n; qargs.stride*=2 ) {
+
+		int n_pairs = 0;
+		int i;
+
+		for ( i=0; i+qargs.stride<n; i+=2*qargs.stride ) {
+			int end = i + 2*qargs.stride;
+			if ( end > n ) end = n;
+			if ( (i < first) || (end > last) ) continue;
+			if ( (partials[i] == NULL)
+			  || (partials[i+qargs.stride] == NULL) ) continue;
+			qargs.pairs[n_pairs++] = i;
+		}
+
+		/* Zero would mean "no limit" to run_threads() */
+		if ( n_pairs == 0 ) continue;
+
+		qargs.n_started = 0;
+		run_threads(n_threads, run_combine_job, create_combine_job,
+		            finalise_combine_job, &qargs, n_pairs, 0, 0, 0);
+
+	}
+
+	free(qargs.pairs);
+	return 0;
+}
+
+
+static void merge_shards(Crystal **crystals, const int *bounds,
+                         RefList **partials, int n_shards, int n_threads,
+                         PartialityModel pmodel)
+{
+	struct merge_queue_args qargs;
+
+	if ( n_shards == 0 ) return;
+
+	qargs.partials = partials;
 	qargs.crystals = crystals;
+	qargs.bounds = bounds;
+	qargs.n_started = 0;
 	qargs.pmodel = pmodel;
-	pthread_rwlock_init(&qargs.full_lock, NULL);
 
 	run_threads(n_threads, run_merge_job, create_merge_job,
-	            finalise_merge_job, &qargs, n, 0, 0, 0);
+	            finalise_merge_job, &qargs, n_shards, 0, 0, 0);
+}
+
+
+/* Each shard keeps the crystals it would have without the cache, but only the
+ * part of it in the current block is merged each time.  Because the crystals
+ * are merged in the same order, the result doesn't depend on the blocks. */
+static int merge_blocks(Crystal **crystals, struct refl_cache *cache,
+                        const int *bounds, RefList **partials, int n_shards,
+                        int n_threads, PartialityModel pmodel)
+{
+	int *block_bounds;
+	int b;
 
-	pthread_rwlock_destroy(&qargs.full_lock);
+	if ( n_shards == 0 ) return 0;
 
-	for ( refl = first_refl(full, &iter);
+	block_bounds = malloc((n_shards+1)*sizeof(int));
+	if ( block_bounds == NULL ) return 1;
+
+	for ( b=0; b<refl_cache_num_blocks(cache); b++ ) {
+
+		int first, n;
+		int i;
+
+		if ( refl_cache_load_block(cache, crystals, b, &first, &n) ) {
+			free(block_bounds);
+			return 1;
+		}
+		for ( i=0; i<=n_shards; i++ ) {
+			int bound = bounds[i];
+			if ( bound < first ) bound = first;
+			if ( bound > first+n ) bound = first+n;
+			block_bounds[i] = bound;
+		}
+		merge_shards(crystals, block_bounds, partials, n_shards,
+		             n_threads, pmodel);
+		refl_cache_release_block(cache, crystals, b, 0);
+
+	}
+
+	free(block_bounds);
+	return 0;
+}
+
+
+/* If "cache" isn't NULL, the reflections are loaded from it one block at a
+ * time.  If "coll" isn't NULL, the crystals of all the ranks are merged, and
+ * every rank gets the result. */
+RefList *lsq_intensities(Crystal **crystals, int n, struct refl_cache *cache,
+                         struct collective *coll, int n_threads,
+                         PartialityModel pmodel)
+{
+	RefList *full;
+	RefList **partials;
+	Reflection *refl;
+	RefListIterator *iter;
+	int *bounds;
+	int first_shard, n_shards, n_total_shards;
+	int i;
+
+	/* The crystals are divided into one contiguous shard per thread.  Each
+	 * shard is merged into its own list without any locking, then the
+	 * lists are combined.  The division depends only on the number of
+	 * threads, so the result does not depend on the order in which the
+	 * threads happen to run. */
+	bounds = collective_shard_bounds(coll, n, n_threads, &first_shard,
+	                                 &n_shards, &n_total_shards);
+	partials = calloc(n_total_shards, sizeof(RefList *));
+	if ( (bounds == NULL) || (partials == NULL) ) {
+		ERROR("Failed to allocate memory for merging.\n");
+		free(bounds);
+		free(partials);
+		return NULL;
+	}
+	for ( i=first_shard; i<first_shard+n_shards; i++ ) {
+		partials[i] = reflist_new_2(REFLIST_HASH);
+		if ( partials[i] == NULL ) {
+			ERROR("Failed to allocate memory for merging.\n");
+			goto fail;
+		}
+	}
+
+	if ( cache == NULL ) {
+		merge_shards(crystals, bounds, &partials[first_shard],
+		             n_shards, n_threads, pmodel);
+	} else if ( merge_blocks(crystals, cache, bounds,
+	                         &partials[first_shard], n_shards, n_threads,
+	                         pmodel) )
+	{
+		goto fail;
+	}
+
+	/* Combine as much as possible here, then finish off in rank zero */
+	if ( reduce_partials(partials, first_shard, first_shard+n_shards,
+	                     n_total_shards, n_threads) ) goto fail;
+	if ( collective_gather_lists(coll, partials, first_shard, n_shards) ) {
+		goto fail;
+	}
+	if ( collective_rank(coll) == 0 ) {
+		if ( reduce_partials(partials, 0, n_total_shards,
+		                     n_total_shards, n_threads) ) goto fail;
+	}
+	if ( collective_bcast_list(coll, &partials[0]) ) goto fail;
+	free(bounds);
+
+	/* Copy into a tree, which keeps the reflections in order */
+	full = reflist_new();
+	reflist_reserve(full, num_reflections(partials[0]));
+	for ( refl = first_refl(partials[0], &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
+		Reflection *f;
+		signed int h, k, l;
 		double var;
 		int red;
 
-		red = get_redundancy(refl);
-		var = get_temp2(refl) / get_temp1(refl);
-		set_esd_intensity(refl, sqrt(var)/sqrt(red));
+		get_indices(refl, &h, &k, &l);
+		f = add_refl(full, h, k, l);
+		copy_data(f, refl);
+
+		red = get_redundancy(f);
+		var = get_temp2(f) / get_temp1(f);
+		set_esd_intensity(f, sqrt(var)/sqrt(red));
 	}
 
+	reflist_free(partials[0]);
+	free(partials);
+
 	return full;
+
+fail:
+	for ( i=0; i<n_total_shards; i++ ) reflist_free(partials[i]);
+	free(partials);
+	free(bounds);
+	return NULL;
 }
 
 
@@ -426,16 +685,24 @@ static void reset_scaling_flag(Crystal *crystal)
 }
 
 
+/* Returns 1 if scaling has converged, 0 if not, or -1 if communication with the
+ * other ranks failed */
 static int test_convergence(double *old_osfs, double *old_Bs, int *old_flags,
-                            int n, Crystal **crystals)
+                            int n, Crystal **crystals,
+                            struct collective *coll)
 {
 	int i;
-	double total_osf_change = 0.0;
-	double total_B_change = 0.0;
+	double totals[2] = {0.0, 0.0};
+	int counts[3];
+	double total_osf_change, total_B_change;
 	int n_change = 0;
 	int n_newreject = 0;
 	int n_reject = 0;
 
+	if ( collective_chain_begin(coll, totals, 2) ) return -1;
+	total_osf_change = totals[0];
+	total_B_change = totals[1];
+
 	for ( i=0; i<n; i++ ) {
 
 		int oldf = old_flags[i];
@@ -461,6 +728,20 @@ static int test_convergence(double *old_osfs, double *old_Bs, int *old_flags,
 		}
 	}
 
+	totals[0] = total_osf_change;
+	totals[1] = total_B_change;
+	if ( collective_chain_end(coll, totals, 2) ) return -1;
+	total_osf_change = totals[0];
+	total_B_change = totals[1];
+
+	counts[0] = n_change;
+	counts[1] = n_newreject;
+	counts[2] = n_reject;
+	if ( collective_sum_int(coll, counts, 3) ) return -1;
+	n_change = counts[0];
+	n_newreject = counts[1];
+	n_reject = counts[2];
+
 	STATUS("Mean OSF change: %10.3f  Mean B change: %10.3f A^2  "
 	       "Newly rejected: %4i   Total rejected : %4i\n",
 	       total_osf_change/n_change, 1e20*total_B_change/n_change,
@@ -470,9 +751,13 @@ static int test_convergence(double *old_osfs, double *old_Bs, int *old_flags,
 }
 
 
-/* Scale the stack of images */
-RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
-                           PartialityModel pmodel, int min_redundancy)
+/* Scale the stack of images.  If "cache" isn't NULL, "ra" isn't used and the
+ * reflections are loaded from the cache in blocks.  If "coll" isn't NULL, the
+ * crystals of all the ranks are scaled together. */
+RefList *scale_intensities(Crystal **crystals, int n, struct refl_arrays *ra,
+                           struct refl_cache *cache, struct collective *coll,
+                           int n_threads, PartialityModel pmodel,
+                           int min_redundancy)
 {
 	int i;
 	RefList *full = NULL;
@@ -488,12 +773,18 @@ RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
 	}
 
 	/* Create an initial list to refine against */
-	full = lsq_intensities(crystals, n, n_threads, pmodel);
+	full = lsq_intensities(crystals, n, cache, coll, n_threads, pmodel);
+	if ( full == NULL ) return NULL;
 
 	old_osfs = malloc(n*sizeof(double));
 	old_Bs = malloc(n*sizeof(double));
 	old_flags = malloc(n*sizeof(int));
 	if ( (old_osfs == NULL) || (old_Bs == NULL) || (old_flags == NULL) ) {
+		ERROR("Failed to allocate memory for scaling.\n");
+		free(old_osfs);
+		free(old_Bs);
+		free(old_flags);
+		reflist_free(full);
 		return NULL;
 	}
 
@@ -501,9 +792,9 @@ RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
 	i = 0;
 	do {
 
-		double total_sf = 0.0;
-		double total_B = 0.0;
-		int n_sf = 0;
+		double totals[3] = {0.0, 0.0, 0.0};
+		double total_sf, total_B;
+		int n_sf;
 		double norm_sf, norm_B;
 		int j;
 
@@ -514,10 +805,24 @@ RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
 			reset_scaling_flag(crystals[j]);
 		}
 
-		iterate_scale(crystals, n, full, n_threads, pmodel);
+		if ( iterate_scale(crystals, ra, cache, full, n_threads,
+		                   pmodel) )
+		{
+			reflist_free(full);
+			full = NULL;
+			break;
+		}
 		reject_outliers(old_osfs, n, crystals);
 
 		/* Normalise the scale factors */
+		if ( collective_chain_begin(coll, totals, 3) ) {
+			reflist_free(full);
+			full = NULL;
+			break;
+		}
+		total_sf = totals[0];
+		total_B = totals[1];
+		n_sf = totals[2];
 		for ( j=0; j<n; j++ ) {
 			if ( crystal_get_user_flag(crystals[j]) == 0 ) {
 				total_sf += crystal_get_osf(crystals[j]);
@@ -525,6 +830,17 @@ RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
 				n_sf++;
 			}
 		}
+		totals[0] = total_sf;
+		totals[1] = total_B;
+		totals[2] = n_sf;
+		if ( collective_chain_end(coll, totals, 3) ) {
+			reflist_free(full);
+			full = NULL;
+			break;
+		}
+		total_sf = totals[0];
+		total_B = totals[1];
+		n_sf = totals[2];
 		norm_sf = total_sf / n_sf;
 		norm_B = total_B / n_sf;
 		for ( j=0; j<n; j++ ) {
@@ -535,11 +851,18 @@ RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
 		}
 
 		done = test_convergence(old_osfs, old_Bs, old_flags,
-		                        n, crystals);
+		                        n, crystals, coll);
+		if ( done < 0 ) {
+			reflist_free(full);
+			full = NULL;
+			break;
+		}
 
 		/* Generate list for next iteration */
 		reflist_free(full);
-		full = lsq_intensities(crystals, n, n_threads, pmodel);
+		full = lsq_intensities(crystals, n, cache, coll, n_threads,
+		                       pmodel);
+		if ( full == NULL ) break;
 
 		i++;
 
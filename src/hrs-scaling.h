@@ -38,12 +38,20 @@
 #include "crystal.h"
 #include "reflist.h"
 #include "geometry.h"
-
-extern RefList *scale_intensities(Crystal **crystals, int n, int n_threads,
+#include "refl-arrays.h"
+#include "refl-cache.h"
+#include "collective.h"
+
+extern RefList *scale_intensities(Crystal **crystals, int n,
+                                  struct refl_arrays *ra,
+                                  struct refl_cache *cache,
+                                  struct collective *coll, int n_threads,
                                   PartialityModel pmodel, int min_redundancy);
 
 
-extern RefList *lsq_intensities(Crystal **crystals, int n, int n_threads,
+extern RefList *lsq_intensities(Crystal **crystals, int n,
+                                struct refl_cache *cache,
+                                struct collective *coll, int n_threads,
                                 PartialityModel pmodel);
 
 #endif	/* HRS_SCALING_H */
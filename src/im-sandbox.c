@@ -48,6 +48,7 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifdef HAVE_CLOCK_GETTIME
 #include <time.h>
@@ -58,6 +59,7 @@
 #include <events.h>
 #include <hdf5-file.h>
 #include <detector.h>
+#include <thread-pool.h>
 
 #include "im-sandbox.h"
 #include "process_image.h"
@@ -66,6 +68,20 @@
 /* Write statistics at APPROXIMATELY this interval */
 #define STATS_EVERY_N_SECONDS (5)
 
+/* Maximum number of consecutive events from the same file which will be given
+ * to one worker */
+#define MAX_EVENT_BLOCK (16)
+
+/* Workers ask for enough events to keep them busy for about this long, but
+ * never more than MAX_BATCH at once */
+#define BATCH_SECONDS (0.25)
+#define MAX_BATCH (64)
+
+/* Events sent to one worker which it has not yet finished with.  The worker
+ * asks for the next batch before starting on the last event of the current
+ * one, so there can be up to MAX_BATCH+1. */
+#define MAX_IN_FLIGHT (2*MAX_BATCH)
+
 
 struct sb_reader
 {
@@ -85,6 +101,27 @@ struct sb_reader
 };
 
 
+/* Events which have been taken from the input list and assigned to a worker,
+ * but not yet sent to it.  Keeping consecutive events from the same file
+ * together lets the worker re-use the file it already has open. */
+struct event_block
+{
+	struct filename_plus_event *events[MAX_EVENT_BLOCK];
+	int serials[MAX_EVENT_BLOCK];
+	int first;
+	int n;
+};
+
+
+/* Events which have been sent to a worker, oldest first */
+struct in_flight
+{
+	struct filename_plus_event *events[MAX_IN_FLIGHT];
+	int serials[MAX_IN_FLIGHT];
+	int n;
+};
+
+
 struct sandbox
 {
 	pthread_mutex_t lock;
@@ -105,11 +142,33 @@ struct sandbox
 
 	int *running;
 	FILE **result_fhs;
+	struct buffer_data *result_bufs;
 	int *filename_pipes;
 	int *stream_pipe_write;
-	struct filename_plus_event **last_filename;
+	struct in_flight *in_flight;
 	int serial;
 
+	/* Time spent by the workers waiting for events to arrive */
+	double wait_time;
+	double t_start;
+	int n_requests;
+	int n_sent;
+
+	/* Input list */
+	FILE *fh;
+	int config_basename;
+	const char *prefix;
+	struct event_block *blocks;
+	struct filename_plus_event *lookahead;
+	int lookahead_serial;
+	int input_done;
+
+	/* Events taken back from workers which died */
+	struct filename_plus_event **requeue;
+	int *requeue_serials;
+	int n_requeue;
+	int max_requeue;
+
 	char *tmpdir;
 
 	struct sb_reader *reader;
@@ -261,6 +320,46 @@ static struct filename_plus_event *get_pattern(FILE *fh, int config_basename,
 }
 
 
+#ifdef HAVE_CLOCK_GETTIME
+
+static time_t get_monotonic_seconds()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec;
+}
+
+
+static double get_monotonic_time()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+#else
+
+/* Fallback versions of the above.  The time according to gettimeofday() is not
+ * monotonic, so measuring intervals based on it will screw up if there's a
+ * timezone change (e.g. daylight savings) while the program is running. */
+static time_t get_monotonic_seconds()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec;
+}
+
+
+static double get_monotonic_time()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec*1e-6;
+}
+
+#endif
+
+
 struct buffer_data
 {
 	char *rbuffer;
@@ -273,10 +372,55 @@ struct buffer_data
 };
 
 
+/* Take the next complete line out of the buffer, if there is one */
+static int extract_line(struct buffer_data *bd)
+{
+	int i;
+	int line_length = 0;
+	int new_rbuflen;
+
+	/* See if there's a full line in the buffer yet */
+	for ( i=0; i<bd->rbufpos; i++ ) {
+		if ( bd->rbuffer[i] == '\n' ) {
+			line_length = i+1;
+			break;
+		}
+	}
+
+	if ( line_length == 0 ) {
+		if ( bd->rbufpos == bd->rbuflen ) {
+			bd->rbuffer = realloc(bd->rbuffer, bd->rbuflen + 256);
+			bd->rbuflen = bd->rbuflen + 256;
+		}
+		return 0;
+	}
+
+	if ( bd->line != NULL ) {
+		free(bd->line);
+	}
+
+	bd->line = malloc(line_length+1);
+	strncpy(bd->line, bd->rbuffer, line_length);
+	bd->line[line_length] = '\0';
+
+	/* Now the block's been parsed, it should be forgotten about */
+	memmove(bd->rbuffer, bd->rbuffer + line_length,
+	        bd->rbuflen - line_length);
+
+	/* Subtract the number of bytes removed */
+	bd->rbufpos = bd->rbufpos - line_length;
+	new_rbuflen = bd->rbuflen - line_length;
+	if ( new_rbuflen == 0 ) new_rbuflen = 256;
+	bd->rbuffer = realloc(bd->rbuffer, new_rbuflen*sizeof(char));
+	bd->rbuflen = new_rbuflen;
+
+	return 1;
+}
+
+
 static int read_fpe_data(struct buffer_data *bd)
 {
 	int rval;
-	int no_line = 0;
 
 	bd->eof = 0;
 	bd->err = 0;
@@ -294,66 +438,35 @@ static int read_fpe_data(struct buffer_data *bd)
 	bd->rbufpos += rval;
 	assert(bd->rbufpos <= bd->rbuflen);
 
-	while ( (!no_line) && (bd->rbufpos > 0) ) {
-
-		int i;
-		int line_ready = 0;
-		int line_length = 0;
-
-		/* See if there's a full line in the buffer yet */
-		for ( i=0; i<bd->rbufpos; i++ ) {
-
-			/* Is there a line in the buffer? */
-			if ( bd->rbuffer[i] == '\n' ) {
-				line_length = i+1;
-				line_ready = 1;
-				break;
-			}
-
-		}
-
-		if ( line_ready ) {
-
-			int new_rbuflen;
-
-			if ( bd->line != NULL ) {
-				free(bd->line);
-			}
-
-			bd->line = malloc(line_length+1);
-			strncpy(bd->line, bd->rbuffer, line_length);
-			bd->line[line_length] = '\0';
-
-			/* Now the block's been parsed, it should be
-			 * forgotten about */
-			memmove(bd->rbuffer,
-			        bd->rbuffer + line_length,
-			        bd->rbuflen - line_length);
-
-			/* Subtract the number of bytes removed */
-			bd->rbufpos = bd->rbufpos - line_length;
-			new_rbuflen = bd->rbuflen - line_length;
-			if ( new_rbuflen == 0 ) new_rbuflen = 256;
-			bd->rbuffer = realloc(bd->rbuffer,
-			                      new_rbuflen*sizeof(char));
-			bd->rbuflen = new_rbuflen;
+	return extract_line(bd);
+}
 
-			return 1;
 
-		} else {
+/* Ask the main process for up to "n" more events */
+static void request_events(int results_pipe, int n)
+{
+	char buf[64];
+	int c, w;
 
-			if ( bd->rbufpos == bd->rbuflen ) {
-				bd->rbuffer = realloc(bd->rbuffer,
-				                      bd->rbuflen + 256);
-				bd->rbuflen = bd->rbuflen + 256;
-			}
-			no_line = 1;
+	c = snprintf(buf, 63, "REQUEST %i\n", n);
+	w = write(results_pipe, buf, c);
+	if ( w < 0 ) {
+		ERROR("Failed to request events.\n");
+	}
+}
 
-		}
 
-	}
+/* Number of events to ask for at once, given the average time taken to
+ * process one */
+static int batch_size(double t_event)
+{
+	double n;
 
-	return 0;
+	if ( t_event <= 0.0 ) return 1;
+	n = BATCH_SECONDS / t_event;
+	if ( n < 1.0 ) return 1;
+	if ( n > MAX_BATCH ) return MAX_BATCH;
+	return n;
 }
 
 
@@ -366,6 +479,11 @@ static void run_work(const struct index_args *iargs,
 	int w;
 	unsigned int opts;
 	struct buffer_data bd;
+	struct hdfile_cache *cache;
+	struct image_arena *arena;
+	int n_pending;
+	double t_event = 0.0;
+	double t_wait = 0.0;
 
 	bd.rbuffer = malloc(256*sizeof(char));
 	bd.rbuflen = 256;
@@ -381,11 +499,24 @@ static void run_work(const struct index_args *iargs,
 		return;
 	}
 
-	w = write(results_pipe, "\n", 1);
-	if ( w < 0 ) {
-		ERROR("Failed to send request for first filename.\n");
+	cache = hdfile_cache_new(iargs->hdf5_cache_size);
+	if ( cache == NULL ) {
+		ERROR("Failed to create HDF5 file cache.\n");
+		return;
+	}
+
+	arena = image_arena_new(iargs->det);
+	if ( arena == NULL ) {
+		ERROR("Failed to allocate image buffers.\n");
+		return;
 	}
 
+	/* The main process sends exactly as many events as were asked for,
+	 * unless there are no more, in which case a blank line takes the
+	 * place of the next one. */
+	request_events(results_pipe, 1);
+	n_pending = 1;
+
 	bd.fd = fileno(fh);
 
 	/* Set non-blocking */
@@ -398,11 +529,19 @@ static void run_work(const struct index_args *iargs,
 		int  c;
 		int rval;
 		char buf[1024];
+		double t0;
 
 		pargs.filename_p_e = initialize_filename_plus_event();
 
-		rval = 0;
-		do {
+		/* The rest of the batch might already be in the buffer */
+		rval = extract_line(&bd);
+		if ( rval ) {
+			bd.eof = 0;
+			bd.err = 0;
+		}
+
+		t0 = get_monotonic_time();
+		while ( !rval ) {
 
 			fd_set fds;
 			struct timeval tv;
@@ -429,6 +568,7 @@ static void run_work(const struct index_args *iargs,
 					default:
 					ERROR("select() failed: %s\n",
 					      strerror(err));
+					bd.err = 1;
 					rval = 1;
 
 				}
@@ -443,7 +583,8 @@ static void run_work(const struct index_args *iargs,
 				 */
 			}
 
-		} while ( !rval );
+		}
+		t_wait += get_monotonic_time() - t0;
 
 		if ( bd.err ) {
 			ERROR("Event pipe read error: %s\n", strerror(errno));
@@ -466,6 +607,15 @@ static void run_work(const struct index_args *iargs,
 			struct event* ev;
 			int ser;
 
+			/* Ask for the next batch before starting on the last
+			 * event of this one, so that it arrives while we are
+			 * working */
+			n_pending--;
+			if ( n_pending == 0 ) {
+				n_pending = batch_size(t_event);
+				request_events(results_pipe, n_pending);
+			}
+
 			chomp(bd.line);
 
 			sscanf(bd.line, "%s %s %i", filename, event_str, &ser);
@@ -475,33 +625,44 @@ static void run_work(const struct index_args *iargs,
 			 * processed a second time */
 			bd.line[0] = '\0';
 
+			pargs.n_crystals = 0;
+			t0 = get_monotonic_time();
+
 			if ( strcmp(event_str, "/") != 0 ) {
 
 				ev = get_event_from_event_string(event_str);
-				if ( ev == NULL ) {
-					ERROR("Bad event string '%s'\n",
-					      event_str);
-					continue;
-				}
-
 				pargs.filename_p_e->ev = ev;
 
 			} else {
 
+				ev = NULL;
 				pargs.filename_p_e->ev = NULL;
 
 			}
 
-			pargs.n_crystals = 0;
-			process_image(iargs, &pargs, st, cookie, tmpdir,
-			              results_pipe, ser);
+			if ( (ev == NULL) && (strcmp(event_str, "/") != 0) ) {
+				ERROR("Bad event string '%s'\n", event_str);
+			} else {
+				process_image(iargs, &pargs, st, cache, arena,
+				              cookie, tmpdir, results_pipe, ser);
+			}
+
+			/* Running average of the time per event */
+			if ( t_event == 0.0 ) {
+				t_event = get_monotonic_time() - t0;
+			} else {
+				t_event = 0.8*t_event
+				          + 0.2*(get_monotonic_time() - t0);
+			}
 
-			/* Request another image */
-			c = sprintf(buf, "%i\n", pargs.n_crystals);
+			/* Report the result, and the time spent waiting for
+			 * it since the last report */
+			c = sprintf(buf, "%i %f\n", pargs.n_crystals, t_wait);
 			w = write(results_pipe, buf, c);
 			if ( w < 0 ) {
 				ERROR("write P0\n");
 			}
+			t_wait = 0.0;
 
 		}
 
@@ -511,6 +672,8 @@ static void run_work(const struct index_args *iargs,
 
 	free(bd.line);
 	free(bd.rbuffer);
+	hdfile_cache_free(cache);
+	image_arena_free(arena);
 
 	cleanup_indexing(iargs->indm, iargs->ipriv);
 	free(iargs->indm);
@@ -523,29 +686,6 @@ static void run_work(const struct index_args *iargs,
 }
 
 
-#ifdef HAVE_CLOCK_GETTIME
-
-static time_t get_monotonic_seconds()
-{
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return tp.tv_sec;
-}
-
-#else
-
-/* Fallback version of the above.  The time according to gettimeofday() is not
- * monotonic, so measuring intervals based on it will screw up if there's a
- * timezone change (e.g. daylight savings) while the program is running. */
-static time_t get_monotonic_seconds()
-{
-	struct timeval tp;
-	gettimeofday(&tp, NULL);
-	return tp.tv_sec;
-}
-
-#endif
-
 size_t vol = 0;
 
 
@@ -593,6 +733,48 @@ static int pump_chunk(FILE *fh, int ofd)
 }
 
 
+/* As pump_chunk(), for the binary stream format.  Records are passed through
+ * whole, so nothing is written if the worker dies half way through one. */
+static int pump_record(FILE *fh, int ofd)
+{
+	unsigned char hdr[STREAM_RECORD_HEADER_SIZE];
+	unsigned char *buf;
+	size_t len;
+
+	if ( fread(hdr, 1, STREAM_RECORD_HEADER_SIZE, fh)
+	     != STREAM_RECORD_HEADER_SIZE )
+	{
+		if ( !feof(fh) ) {
+			ERROR("fread() failed: %s\n", strerror(errno));
+		} /* else normal end of output */
+		return 1;
+	}
+
+	len = stream_record_length(hdr);
+	buf = malloc(STREAM_RECORD_HEADER_SIZE + len);
+	if ( buf == NULL ) {
+		ERROR("Failed to allocate memory for record.\n");
+		return 1;
+	}
+
+	memcpy(buf, hdr, STREAM_RECORD_HEADER_SIZE);
+	if ( fread(buf+STREAM_RECORD_HEADER_SIZE, 1, len, fh) != len ) {
+		ERROR("EOF during chunk!\n");
+		free(buf);
+		return 1;
+	}
+
+	if ( write(ofd, buf, STREAM_RECORD_HEADER_SIZE+len)
+	     != STREAM_RECORD_HEADER_SIZE+len )
+	{
+		ERROR("Failed to write chunk: %s\n", strerror(errno));
+	}
+
+	free(buf);
+	return 0;
+}
+
+
 /* Add an fd to the list of pipes to be read from */
 static void add_pipe(struct sb_reader *rd, int fd)
 {
@@ -654,6 +836,8 @@ static void *run_reader(void *rdv)
 {
 	struct sb_reader *rd = rdv;
 	const int ofd = get_stream_fd(rd->stream);
+	const int binary = (get_stream_format(rd->stream)
+	                    == STREAM_FORMAT_BINARY);
 
 	while ( 1 ) {
 
@@ -701,9 +885,15 @@ static void *run_reader(void *rdv)
 				continue;
 			}
 
+			if ( binary ) {
+				r = pump_record(rd->fhs[i], ofd);
+			} else {
+				r = pump_chunk(rd->fhs[i], ofd);
+			}
+
 			/* If the chunk cannot be read, assume the connection
 			 * is broken and that the process will die soon. */
-			if ( pump_chunk(rd->fhs[i], ofd) ) {
+			if ( r ) {
 				/* remove_pipe() assumes that the caller is
 				 * holding rd->lock ! */
 				remove_pipe(rd, i);
@@ -806,6 +996,9 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		free(sb->filename_pipes);
 		free(sb->result_fhs);
 		free(sb->pids);
+		free(sb->blocks);
+		free(sb->in_flight);
+		free(sb->result_bufs);
 		/* Also prefix, tempdir, */
 
 		/* Child process gets the 'read' end of the filename
@@ -813,7 +1006,8 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		close(filename_pipe[1]);
 		close(result_pipe[0]);
 
-		st = open_stream_fd_for_write(stream_pipe[1]);
+		st = open_stream_fd_for_write_2(stream_pipe[1],
+		                  get_stream_format(sb->reader->stream));
 		run_work(sb->iargs, filename_pipe[0], result_pipe[1],
 		         st, slot, tmp);
 		close_stream(st);
@@ -842,6 +1036,18 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		ERROR("fdopen() failed.\n");
 		return;
 	}
+
+	/* Results are read with read() rather than stdio, because several
+	 * lines can arrive at once */
+	free(sb->result_bufs[slot].rbuffer);
+	free(sb->result_bufs[slot].line);
+	sb->result_bufs[slot].rbuffer = malloc(256*sizeof(char));
+	sb->result_bufs[slot].rbuflen = 256;
+	sb->result_bufs[slot].rbufpos = 0;
+	sb->result_bufs[slot].line = NULL;
+	sb->result_bufs[slot].fd = result_pipe[0];
+	sb->result_bufs[slot].eof = 0;
+	sb->result_bufs[slot].err = 0;
 }
 
 
@@ -851,6 +1057,261 @@ static void signal_handler(int sig, siginfo_t *si, void *uc_v)
 }
 
 
+/* Fill up the block for worker "slot" with the next run of events from the
+ * same file */
+static void fill_event_block(struct sandbox *sb, int slot)
+{
+	struct event_block *b = &sb->blocks[slot];
+
+	b->first = 0;
+	b->n = 0;
+
+	while ( b->n < MAX_EVENT_BLOCK ) {
+
+		if ( sb->lookahead == NULL ) {
+
+			if ( sb->input_done ) break;
+
+			sb->lookahead = get_pattern(sb->fh, sb->config_basename,
+			                            sb->iargs->det, sb->prefix);
+			if ( sb->lookahead == NULL ) {
+				sb->input_done = 1;
+				break;
+			}
+			sb->lookahead_serial = sb->serial++;
+
+		}
+
+		if ( (b->n > 0) && (strcmp(sb->lookahead->filename,
+		                           b->events[0]->filename) != 0) )
+		{
+			break;
+		}
+
+		b->events[b->n] = sb->lookahead;
+		b->serials[b->n] = sb->lookahead_serial;
+		b->n++;
+		sb->lookahead = NULL;
+
+	}
+}
+
+
+/* Get the next event for worker "slot", or NULL if there are none left */
+static struct filename_plus_event *next_event(struct sandbox *sb, int slot,
+                                              int *serial)
+{
+	struct event_block *b = &sb->blocks[slot];
+	struct filename_plus_event *fne;
+	int i, victim;
+
+	if ( sb->n_requeue > 0 ) {
+		sb->n_requeue--;
+		*serial = sb->requeue_serials[sb->n_requeue];
+		return sb->requeue[sb->n_requeue];
+	}
+
+	if ( b->n == 0 ) fill_event_block(sb, slot);
+
+	if ( b->n > 0 ) {
+		fne = b->events[b->first];
+		*serial = b->serials[b->first];
+		b->first++;
+		b->n--;
+		return fne;
+	}
+
+	/* The input list has run out.  Take the last event from the worker
+	 * which has the most left to do, so that nobody sits idle while
+	 * another worker finishes off a long block on its own. */
+	victim = -1;
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( sb->blocks[i].n == 0 ) continue;
+		if ( (victim == -1) || (sb->blocks[i].n > sb->blocks[victim].n) ) {
+			victim = i;
+		}
+	}
+	if ( victim == -1 ) return NULL;
+
+	b = &sb->blocks[victim];
+	b->n--;
+	fne = b->events[b->first + b->n];
+	*serial = b->serials[b->first + b->n];
+	return fne;
+}
+
+
+static void send_events(struct sandbox *sb, int slot, int n)
+{
+	struct in_flight *f = &sb->in_flight[slot];
+	char *buf;
+	size_t len = 0;
+	size_t max_len = 1024;
+	int j;
+
+	buf = malloc(max_len);
+	if ( buf == NULL ) {
+		ERROR("Failed to allocate event buffer.\n");
+		return;
+	}
+
+	sb->n_requests++;
+
+	for ( j=0; j<n; j++ ) {
+
+		struct filename_plus_event *fne;
+		char *evstr;
+		int serial;
+		size_t l;
+
+		fne = next_event(sb, slot, &serial);
+		if ( fne == NULL ) {
+			/* No more images */
+			buf[len++] = '\n';
+			break;
+		}
+
+		if ( fne->ev != NULL ) {
+			evstr = get_event_string(fne->ev);
+		} else {
+			evstr = strdup("/");
+		}
+
+		l = strlen(fne->filename) + strlen(evstr) + 32;
+		if ( len + l + 1 > max_len ) {
+			char *buf_new;
+			max_len = 2*(len + l + 1);
+			buf_new = realloc(buf, max_len);
+			if ( buf_new == NULL ) {
+				ERROR("Failed to allocate event buffer.\n");
+				free(evstr);
+				free(buf);
+				return;
+			}
+			buf = buf_new;
+		}
+		len += snprintf(buf+len, max_len-len, "%s %s %i\n",
+		                fne->filename, evstr, serial);
+		free(evstr);
+
+		f->events[f->n] = fne;
+		f->serials[f->n] = serial;
+		f->n++;
+		sb->n_sent++;
+
+	}
+
+	/* All in one go, rather than one write() per event */
+	if ( write(sb->filename_pipes[slot], buf, len) != len ) {
+		ERROR("write pipe\n");
+	}
+
+	free(buf);
+}
+
+
+/* Deal with one line from worker "slot".  Assumes that the caller is holding
+ * the sandbox lock! */
+static void handle_result(struct sandbox *sb, int slot, char *results)
+{
+	struct in_flight *f = &sb->in_flight[slot];
+	char *eptr;
+	int nc;
+
+	chomp(results);
+
+	if ( strcmp(results, "SUSPEND") == 0 ) {
+		sb->suspend_stats++;
+		return;
+	}
+
+	if ( strcmp(results, "RELEASE") == 0 ) {
+		if ( sb->suspend_stats > 0 ) {
+			sb->suspend_stats--;
+		} else {
+			ERROR("RELEASE before SUSPEND.\n");
+		}
+		return;
+	}
+
+	if ( strncmp(results, "REQUEST ", 8) == 0 ) {
+
+		int n = atoi(results+8);
+
+		/* A worker which has died does not need any more */
+		if ( !sb->running[slot] ) return;
+
+		if ( (n < 1) || (n > MAX_BATCH)
+		  || (f->n + n > MAX_IN_FLIGHT) )
+		{
+			ERROR("Invalid request '%s'\n", results);
+			n = 1;
+		}
+
+		/* Even one more would overflow the list of events which the
+		 * worker has been sent */
+		if ( f->n + n > MAX_IN_FLIGHT ) return;
+
+		send_events(sb, slot, n);
+		return;
+
+	}
+
+	nc = strtol(results, &eptr, 10);
+	if ( eptr == results ) {
+		if ( strlen(results) > 0 ) {
+			ERROR("Invalid result '%s'\n", results);
+		}
+		return;
+	}
+
+	sb->wait_time += strtod(eptr, NULL);
+	sb->n_crystals += nc;
+	if ( nc > 0 ) {
+		sb->n_hadcrystals++;
+	}
+	sb->n_processed++;
+
+	/* Results come back in the same order as the events were sent */
+	if ( f->n > 0 ) {
+		free_filename_plus_event(f->events[0]);
+		memmove(&f->events[0], &f->events[1],
+		        (f->n-1)*sizeof(struct filename_plus_event *));
+		memmove(&f->serials[0], &f->serials[1], (f->n-1)*sizeof(int));
+		f->n--;
+	}
+}
+
+
+/* Put events back to be sent to another worker */
+static void requeue_event(struct sandbox *sb, struct filename_plus_event *fne,
+                          int serial)
+{
+	if ( sb->n_requeue == sb->max_requeue ) {
+
+		struct filename_plus_event **ev_new;
+		int *ser_new;
+
+		ev_new = realloc(sb->requeue, (sb->max_requeue+MAX_IN_FLIGHT)
+		                              * sizeof(struct filename_plus_event *));
+		ser_new = realloc(sb->requeue_serials,
+		                  (sb->max_requeue+MAX_IN_FLIGHT)*sizeof(int));
+		if ( (ev_new == NULL) || (ser_new == NULL) ) {
+			ERROR("Failed to re-queue %s\n", fne->filename);
+			return;
+		}
+		sb->requeue = ev_new;
+		sb->requeue_serials = ser_new;
+		sb->max_requeue += MAX_IN_FLIGHT;
+
+	}
+
+	sb->requeue[sb->n_requeue] = fne;
+	sb->requeue_serials[sb->n_requeue] = serial;
+	sb->n_requeue++;
+}
+
+
 static void handle_zombie(struct sandbox *sb)
 {
 	int i;
@@ -871,21 +1332,51 @@ static void handle_zombie(struct sandbox *sb)
 
 		if ( p == sb->pids[i] ) {
 
+			struct in_flight *f = &sb->in_flight[i];
+			struct buffer_data *bd = &sb->result_bufs[i];
+			int j;
+
 			sb->running[i] = 0;
 
 			if ( WIFEXITED(status) ) {
 				continue;
 			}
 
-			if ( WIFSIGNALED(status) ) {
-				STATUS("Worker %i was killed by signal %i\n",
-				       i, WTERMSIG(status));
+			if ( !WIFSIGNALED(status) ) continue;
+
+			/* Collect the results which the worker managed to
+			 * send before it died, so that the first event
+			 * still in flight is the one it died on. */
+			if ( sb->result_fhs[i] != NULL ) {
+				int r;
+				do {
+					r = read_fpe_data(bd);
+					while ( r && !bd->eof && !bd->err ) {
+						handle_result(sb, i, bd->line);
+						r = extract_line(bd);
+					}
+				} while ( !bd->eof && !bd->err );
+				fclose(sb->result_fhs[i]);
+				sb->result_fhs[i] = NULL;
+			}
+
+			STATUS("Worker %i was killed by signal %i\n",
+			       i, WTERMSIG(status));
+			if ( f->n > 0 ) {
 				STATUS("Last filename was: %s (%s)\n",
-				       sb->last_filename[i]->filename,
-				       get_event_string(sb->last_filename[i]->ev) );
-				sb->n_processed++;
-				start_worker_process(sb, i);
+				       f->events[0]->filename,
+				       get_event_string(f->events[0]->ev));
+				free_filename_plus_event(f->events[0]);
+			}
+			sb->n_processed++;
+
+			/* The rest of its batch goes to someone else */
+			for ( j=1; j<f->n; j++ ) {
+				requeue_event(sb, f->events[j], f->serials[j]);
 			}
+			f->n = 0;
+
+			start_worker_process(sb, i);
 
 		}
 
@@ -934,6 +1425,19 @@ void create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	sb->n_proc = n_proc;
 	sb->iargs = iargs;
 	sb->serial = 1;
+	sb->fh = fh;
+	sb->config_basename = config_basename;
+	sb->prefix = prefix;
+	sb->lookahead = NULL;
+	sb->input_done = 0;
+	sb->requeue = NULL;
+	sb->requeue_serials = NULL;
+	sb->n_requeue = 0;
+	sb->max_requeue = 0;
+	sb->wait_time = 0.0;
+	sb->t_start = get_monotonic_time();
+	sb->n_requests = 0;
+	sb->n_sent = 0;
 
 	sb->reader->fds = NULL;
 	sb->reader->fhs = NULL;
@@ -967,9 +1471,21 @@ void create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		return;
 	}
 
-	sb->last_filename = calloc(n_proc, sizeof(char *));
-	if ( sb->last_filename == NULL ) {
-		ERROR("Couldn't allocate memory for last filename list.\n");
+	sb->result_bufs = calloc(n_proc, sizeof(struct buffer_data));
+	if ( sb->result_bufs == NULL ) {
+		ERROR("Couldn't allocate memory for result buffers.\n");
+		return;
+	}
+
+	sb->in_flight = calloc(n_proc, sizeof(struct in_flight));
+	if ( sb->in_flight == NULL ) {
+		ERROR("Couldn't allocate memory for event lists.\n");
+		return;
+	}
+
+	sb->blocks = calloc(n_proc, sizeof(struct event_block));
+	if ( sb->blocks == NULL ) {
+		ERROR("Couldn't allocate memory for event blocks.\n");
 		return;
 	}
 	unlock_sandbox(sb);
@@ -1083,125 +1599,29 @@ void create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		lock_sandbox(sb);
 		for ( i=0; i<n_proc; i++ ) {
 
-			struct filename_plus_event *nextImage;
-			char results[1024];
-			char *rval;
+			struct buffer_data *bd;
 			int fd;
-			char *eptr;
 
 			if ( sb->result_fhs[i] == NULL ) continue;
 
 			fd = fileno(sb->result_fhs[i]);
 			if ( !FD_ISSET(fd, &fds) ) continue;
 
-			rval = fgets(results, 1024, sb->result_fhs[i]);
-			if ( rval == NULL ) {
-				if ( !feof(sb->result_fhs[i]) ) {
-					ERROR("fgets() failed: %s\n",
+			bd = &sb->result_bufs[i];
+			r = read_fpe_data(bd);
+			if ( bd->eof || bd->err ) {
+				if ( bd->err ) {
+					ERROR("read() failed: %s\n",
 					      strerror(errno));
 				}
 				sb->result_fhs[i] = NULL;
 				continue;
 			}
 
-			chomp(results);
-
-			if ( strcmp(results, "SUSPEND") == 0 ) {
-				sb->suspend_stats++;
-				continue;  /* Do not send next filename */
-			} else if ( strcmp(results, "RELEASE") == 0 ) {
-				if ( sb->suspend_stats > 0 ) {
-					sb->suspend_stats--;
-				} else {
-					ERROR("RELEASE before SUSPEND.\n");
-				}
-				continue;  /* Do not send next filename */
-			} else {
-
-				strtol(results, &eptr, 10);
-				if ( eptr == results ) {
-					if ( strlen(results) > 0 ) {
-						ERROR("Invalid result '%s'\n",
-						      results);
-					}
-				} else {
-
-					int nc = atoi(results);
-					sb->n_crystals += nc;
-					if ( nc > 0 ) {
-						sb->n_hadcrystals++;
-					}
-					sb->n_processed++;
-
-				}
-
-			}
-
-			/* Send next filename */
-			nextImage = get_pattern(fh, config_basename,
-			                        iargs->det, prefix);
-
-			if ( sb->last_filename[i] != NULL ) {
-				free_filename_plus_event(sb->last_filename[i]);
-			}
-
-			sb->last_filename[i] = nextImage;
-
-			if ( nextImage == NULL ) {
-
-				/* No more images */
-				r = write(sb->filename_pipes[i], "\n", 1);
-				if ( r < 0 ) {
-					ERROR("Write pipe\n");
-				}
-
-			} else {
-
-				char tmp[256];
-
-				r = write(sb->filename_pipes[i],
-				          nextImage->filename,
-				          strlen(nextImage->filename));
-
-				if ( r < 0 ) {
-					ERROR("write pipe\n");
-				}
-
-				r = write(sb->filename_pipes[i], " ", 1);
-				if ( r < 0 ) {
-					ERROR("write pipe\n");
-				}
-
-				if ( nextImage->ev != NULL ) {
-
-					r = write(sb->filename_pipes[i],
-					          get_event_string(nextImage->ev),
-					          strlen(get_event_string(nextImage->ev)));
-					if ( r < 0 ) {
-						ERROR("write pipe\n");
-					}
-
-				} else {
-
-					r = write(sb->filename_pipes[i], "/", 1);
-					if ( r < 0 ) {
-						ERROR("write pipe\n");
-					}
-
-				}
-
-				snprintf(tmp, 255, " %i", sb->serial++);
-				r = write(sb->filename_pipes[i],
-				          tmp, strlen(tmp));
-				if ( r < 0 ) {
-					ERROR("write pipe\n");
-				}
-
-				r = write(sb->filename_pipes[i], "\n", 1);
-				if ( r < 0 ) {
-					ERROR("write pipe\n");
-				}
-
+			/* Several lines might have arrived at once */
+			while ( r ) {
+				handle_result(sb, i, bd->line);
+				r = extract_line(bd);
 			}
 		}
 
@@ -1264,6 +1684,15 @@ void create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	free(sb->result_fhs);
 	free(sb->pids);
 	free(sb->tmpdir);
+	free(sb->blocks);
+	free(sb->in_flight);
+	free(sb->requeue);
+	free(sb->requeue_serials);
+	for ( i=0; i<n_proc; i++ ) {
+		free(sb->result_bufs[i].rbuffer);
+		free(sb->result_bufs[i].line);
+	}
+	free(sb->result_bufs);
 
 	pthread_mutex_destroy(&sb->lock);
 
@@ -1273,5 +1702,313 @@ void create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	       sb->n_processed, sb->n_hadcrystals,
 	       100.0 * sb->n_hadcrystals / sb->n_processed, sb->n_crystals);
 
+	STATUS("Workers spent %.1f%% of their time waiting for images"
+	       " (%i images sent in %i batches).\n",
+	       100.0 * sb->wait_time
+	             / (n_proc * (get_monotonic_time() - sb->t_start)),
+	       sb->n_sent, sb->n_requests);
+
 	free(sb);
 }
+
+
+/* ------------------------ Worker threads, not processes ------------------- */
+
+struct finished_chunk
+{
+	int serial;
+	Stream *buf;
+};
+
+
+struct thread_sandbox
+{
+	struct index_args *iargs;
+	FILE *fh;
+	int config_basename;
+	const char *prefix;
+	Stream *stream;
+
+	/* One of each per thread */
+	struct hdfile_cache **caches;
+	struct image_arena **arenas;
+	char **tmpdirs;
+
+	/* Serial number of the next image to start, and of the next chunk to
+	 * be written to the stream */
+	int serial;
+	int next_out;
+
+	/* Chunks which are finished but are waiting for earlier ones */
+	struct finished_chunk *pending;
+	int n_pending;
+	int max_pending;
+
+	int n_processed;
+	int n_hadcrystals;
+	int n_crystals;
+	int n_processed_last_stats;
+	time_t t_last_stats;
+};
+
+
+struct thread_task
+{
+	struct thread_sandbox *tsb;
+	struct pattern_args pargs;
+	int serial;
+	Stream *buf;
+};
+
+
+static void *get_thread_task(void *vp)
+{
+	struct thread_sandbox *tsb = vp;
+	struct thread_task *task;
+	struct filename_plus_event *fne;
+
+	/* get_pattern() might need to look inside a multi-event file */
+	pthread_mutex_lock(&hdf5_lock);
+	fne = get_pattern(tsb->fh, tsb->config_basename, tsb->iargs->det,
+	                  tsb->prefix);
+	pthread_mutex_unlock(&hdf5_lock);
+	if ( fne == NULL ) return NULL;
+
+	task = malloc(sizeof(struct thread_task));
+	if ( task == NULL ) {
+		ERROR("Failed to allocate task.\n");
+		free_filename_plus_event(fne);
+		return NULL;
+	}
+
+	task->tsb = tsb;
+	task->pargs.filename_p_e = fne;
+	task->pargs.n_crystals = 0;
+	task->serial = tsb->serial++;
+	task->buf = NULL;
+
+	return task;
+}
+
+
+static void run_thread_task(void *vp, int cookie)
+{
+	struct thread_task *task = vp;
+	struct thread_sandbox *tsb = task->tsb;
+	Stream *st;
+
+	if ( tsb->caches[cookie] == NULL ) {
+		tsb->caches[cookie] = hdfile_cache_new(tsb->iargs->hdf5_cache_size);
+	}
+
+	if ( tsb->arenas[cookie] == NULL ) {
+		tsb->arenas[cookie] = image_arena_new(tsb->iargs->det);
+		if ( tsb->arenas[cookie] == NULL ) {
+			ERROR("Failed to allocate image buffers.\n");
+			return;
+		}
+	}
+
+	/* The chunk is written to memory, and then into the real stream in
+	 * the right order by finalise_thread_task() */
+	st = open_stream_for_write_buffer(get_stream_format(tsb->stream));
+	if ( st == NULL ) {
+		ERROR("Failed to open stream buffer.\n");
+		return;
+	}
+
+	process_image(tsb->iargs, &task->pargs, st, tsb->caches[cookie],
+	              tsb->arenas[cookie], cookie, tsb->tmpdirs[cookie], 0,
+	              task->serial);
+
+	task->buf = st;
+}
+
+
+static void finalise_thread_task(void *qp, void *vp)
+{
+	struct thread_sandbox *tsb = qp;
+	struct thread_task *task = vp;
+	time_t tNow;
+	int i;
+
+	if ( tsb->n_pending == tsb->max_pending ) {
+		struct finished_chunk *pending_new;
+		pending_new = realloc(tsb->pending, (tsb->max_pending+64)
+		                                 * sizeof(struct finished_chunk));
+		if ( pending_new == NULL ) {
+			ERROR("Failed to allocate output queue.\n");
+			abort();
+		}
+		tsb->pending = pending_new;
+		tsb->max_pending += 64;
+	}
+	tsb->pending[tsb->n_pending].serial = task->serial;
+	tsb->pending[tsb->n_pending].buf = task->buf;
+	tsb->n_pending++;
+
+	/* Write out everything which is now in sequence */
+	i = 0;
+	while ( i < tsb->n_pending ) {
+
+		struct finished_chunk *c = &tsb->pending[i];
+
+		if ( c->serial != tsb->next_out ) {
+			i++;
+			continue;
+		}
+
+		if ( c->buf != NULL ) write_stream_buffer(tsb->stream, c->buf);
+		tsb->next_out++;
+		tsb->pending[i] = tsb->pending[--tsb->n_pending];
+		i = 0;
+
+	}
+
+	tsb->n_processed++;
+	tsb->n_crystals += task->pargs.n_crystals;
+	if ( task->pargs.n_crystals > 0 ) tsb->n_hadcrystals++;
+
+	tNow = get_monotonic_seconds();
+	if ( tNow >= tsb->t_last_stats+STATS_EVERY_N_SECONDS ) {
+
+		STATUS("%4i indexable out of %4i processed (%4.1f%%), "
+		       "%4i crystals so far. "
+		       "%4i images processed since the last message.\n",
+		       tsb->n_hadcrystals, tsb->n_processed,
+		       100.0 * tsb->n_hadcrystals / tsb->n_processed,
+		       tsb->n_crystals,
+		       tsb->n_processed - tsb->n_processed_last_stats);
+
+		tsb->n_processed_last_stats = tsb->n_processed;
+		tsb->t_last_stats = tNow;
+
+	}
+
+	free_filename_plus_event(task->pargs.filename_p_e);
+	free(task);
+}
+
+
+static char *make_tmpdir(const char *parent, const char *name)
+{
+	size_t ll;
+	char *tmp;
+	struct stat s;
+
+	ll = strlen(parent) + strlen(name) + 2;
+	tmp = malloc(ll);
+	if ( tmp == NULL ) {
+		ERROR("Failed to allocate temporary folder name\n");
+		return NULL;
+	}
+	snprintf(tmp, ll, "%s/%s", parent, name);
+
+	if ( stat(tmp, &s) == -1 ) {
+
+		if ( errno != ENOENT ) {
+			ERROR("Failed to stat temporary folder.\n");
+			free(tmp);
+			return NULL;
+		}
+
+		if ( mkdir(tmp, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) ) {
+			ERROR("Failed to create temporary folder: %s\n",
+			      strerror(errno));
+			free(tmp);
+			return NULL;
+		}
+
+	}
+
+	return tmp;
+}
+
+
+/* As create_sandbox(), but the work is done by threads in this process.  The
+ * read-only parts of "iargs" are shared between all of them, and there are no
+ * pipes to copy the results through.  A crash while processing one image
+ * will take the whole program down with it, though. */
+void create_thread_sandbox(struct index_args *iargs, int n_threads,
+                           char *prefix, int config_basename, FILE *fh,
+                           Stream *stream, const char *tempdir)
+{
+	struct thread_sandbox tsb;
+	char *topdir;
+	char tmp[64];
+	int i;
+
+	tsb.iargs = iargs;
+	tsb.fh = fh;
+	tsb.config_basename = config_basename;
+	tsb.prefix = prefix;
+	tsb.stream = stream;
+	tsb.serial = 1;
+	tsb.next_out = 1;
+	tsb.pending = NULL;
+	tsb.n_pending = 0;
+	tsb.max_pending = 0;
+	tsb.n_processed = 0;
+	tsb.n_hadcrystals = 0;
+	tsb.n_crystals = 0;
+	tsb.n_processed_last_stats = 0;
+	tsb.t_last_stats = get_monotonic_seconds();
+
+	tsb.caches = calloc(n_threads, sizeof(struct hdfile_cache *));
+	tsb.arenas = calloc(n_threads, sizeof(struct image_arena *));
+	tsb.tmpdirs = calloc(n_threads, sizeof(char *));
+
+	if ( tempdir == NULL ) tempdir = "";
+	snprintf(tmp, 63, "indexamajig.%i", getpid());
+	topdir = make_tmpdir(tempdir, tmp);
+	if ( topdir == NULL ) goto out;
+
+	if ( (tsb.caches == NULL) || (tsb.arenas == NULL)
+	  || (tsb.tmpdirs == NULL) )
+	{
+		ERROR("Failed to allocate per-thread data.\n");
+		goto out;
+	}
+
+	/* Each thread gets its own folder for the indexing programs */
+	for ( i=0; i<n_threads; i++ ) {
+		snprintf(tmp, 63, "worker.%i", i);
+		tsb.tmpdirs[i] = make_tmpdir(topdir, tmp);
+		if ( tsb.tmpdirs[i] == NULL ) goto out;
+	}
+
+	run_threads(n_threads, run_thread_task, get_thread_task,
+	            finalise_thread_task, &tsb, 0, 0, 0, 0);
+
+	if ( tsb.n_pending != 0 ) {
+		ERROR("%i chunks were not written.\n", tsb.n_pending);
+	}
+
+out:
+	fclose(fh);
+
+	for ( i=0; i<tsb.n_pending; i++ ) {
+		if ( tsb.pending[i].buf != NULL ) {
+			size_t len;
+			free(close_stream_buffer(tsb.pending[i].buf, &len));
+		}
+	}
+	for ( i=0; i<n_threads; i++ ) {
+		if ( tsb.caches != NULL ) hdfile_cache_free(tsb.caches[i]);
+		if ( tsb.arenas != NULL ) image_arena_free(tsb.arenas[i]);
+		if ( tsb.tmpdirs != NULL ) free(tsb.tmpdirs[i]);
+	}
+	free(tsb.caches);
+	free(tsb.arenas);
+	free(tsb.tmpdirs);
+	free(tsb.pending);
+	free(topdir);
+
+	if ( tsb.n_processed == 0 ) return;
+
+	STATUS("Final:"
+	       " %i images processed, %i had crystals (%.1f%%),"
+	       " %i crystals overall.\n",
+	       tsb.n_processed, tsb.n_hadcrystals,
+	       100.0 * tsb.n_hadcrystals / tsb.n_processed, tsb.n_crystals);
+}
@@ -39,3 +39,7 @@
 extern void create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
                            int config_basename, FILE *fh,  Stream *stream,
                            const char *tempdir);
+
+extern void create_thread_sandbox(struct index_args *iargs, int n_threads,
+                                  char *prefix, int config_basename, FILE *fh,
+                                  Stream *stream, const char *tempdir);
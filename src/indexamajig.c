@@ -136,6 +136,10 @@ static void show_help(const char *s)
 "\n"
 "\nOptions for greater performance:\n\n"
 " -j <n>                   Run <n> analyses in parallel.  Default 1.\n"
+" --hdf5-cache-size=<n>    Keep up to <n> HDF5 files open in each worker.\n"
+"                           Default 4.\n"
+" --threads                Run the <n> analyses in threads within a single\n"
+"                           process, instead of separate processes.\n"
 " --temp-dir=<path>        Put the temporary folder under <path>.\n"
 "\n"
 "\nOptions you probably won't need:\n\n"
@@ -146,6 +150,8 @@ static void show_help(const char *s)
 "                           validity.\n"
 "     --no-peaks-in-stream Do not record peak search results in the stream.\n"
 "     --no-refls-in-stream Do not record integrated reflections in the stream.\n"
+"     --stream-format=<f>  Write the stream in format <f>, 'text' (the default)\n"
+"                           or 'binary'.\n"
 "     --int-diag=<cond>    Show debugging information about reflections.\n"
 );
 }
@@ -199,6 +205,8 @@ int main(int argc, char *argv[])
 	char *geom_filename = NULL;
 	struct beam_params beam;
 	int have_push_res = 0;
+	StreamFormat stream_format = STREAM_FORMAT_TEXT;
+	int use_threads = 0;
 
 	/* Defaults */
 	iargs.cell = NULL;
@@ -242,6 +250,7 @@ int main(int argc, char *argv[])
 	iargs.fix_profile_r = -1.0;
 	iargs.fix_bandwidth = -1.0;
 	iargs.fix_divergence = -1.0;
+	iargs.hdf5_cache_size = 4;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -299,6 +308,9 @@ int main(int argc, char *argv[])
 		{"fix-profile-radius", 1, NULL,               22},
 		{"fix-bandwidth",      1, NULL,               23},
 		{"fix-divergence",     1, NULL,               24},
+		{"stream-format",      1, NULL,               25},
+		{"hdf5-cache-size",    1, NULL,               26},
+		{"threads",            0, &use_threads,        1},
 
 		{0, 0, NULL, 0}
 	};
@@ -468,6 +480,26 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+			case 25 :
+			if ( strcmp(optarg, "text") == 0 ) {
+				stream_format = STREAM_FORMAT_TEXT;
+			} else if ( strcmp(optarg, "binary") == 0 ) {
+				stream_format = STREAM_FORMAT_BINARY;
+			} else {
+				ERROR("Invalid value for --stream-format\n");
+				return 1;
+			}
+			break;
+
+			case 26 :
+			if ( (sscanf(optarg, "%i", &iargs.hdf5_cache_size) != 1)
+			  || (iargs.hdf5_cache_size < 0) )
+			{
+				ERROR("Invalid value for --hdf5-cache-size\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -699,7 +731,8 @@ int main(int argc, char *argv[])
 
 	}
 
-	st = open_stream_for_write_2(outfile, geom_filename, argc, argv);
+	st = open_stream_for_write_3(outfile, geom_filename, argc, argv,
+	                             stream_format);
 	if ( st == NULL ) {
 		ERROR("Failed to open stream '%s'\n", outfile);
 		return 1;
@@ -723,8 +756,13 @@ int main(int argc, char *argv[])
 	iargs.indm = indm;
 	iargs.ipriv = ipriv;
 
-	create_sandbox(&iargs, n_proc, prefix, config_basename, fh,
-	               st, tempdir);
+	if ( use_threads ) {
+		create_thread_sandbox(&iargs, n_proc, prefix, config_basename,
+		                      fh, st, tempdir);
+	} else {
+		create_sandbox(&iargs, n_proc, prefix, config_basename, fh,
+		               st, tempdir);
+	}
 
 	free(prefix);
 	free(tempdir);
@@ -800,6 +800,7 @@ int main(int argc, char *argv[])
 	image.bw = bandwidth;
 	image.filename = "dummy.h5";
 	image.copyme = NULL;
+	image.stuff_from_stream = NULL;
 	image.crystals = NULL;
 	image.n_crystals = 0;
 	image.indexed_by = INDEXING_SIMULATION;
@@ -56,6 +56,10 @@
 #include "hrs-scaling.h"
 #include "scaling-report.h"
 #include "rejection.h"
+#include "refl-arrays.h"
+#include "refl-cache.h"
+#include "collective.h"
+#include "checkpoint.h"
 
 
 static void show_help(const char *s)
@@ -76,14 +80,28 @@ static void show_help(const char *s)
 "      --min-measurements=<n> Minimum number of measurements to require.\n"
 "      --no-polarisation      Disable polarisation correction.\n"
 "      --max-adu=<n>          Saturation value of detector.\n"
-"  -j <n>                     Run <n> analyses in parallel.\n");
+"      --max-crystals=<n>     Use only the first <n> crystals in the stream.\n"
+"      --max-memory=<n>       Keep reflections on disk, loading at most about\n"
+"                              <n> MB of them into memory at a time.\n"
+"      --cache-dir=<dir>      Put the reflections for --max-memory in <dir>.\n"
+"                              Default: the current directory.\n"
+"  -j <n>                     Run <n> analyses in parallel.\n"
+"\n"
+"      --checkpoint=<file>    Save the state to <file> after each cycle.\n"
+"      --resume=<file>        Carry on from the state saved in <file>,\n"
+"                              instead of reading a stream.\n"
+"\n"
+"      --ranks=<n>            Share the work between <n> processes.\n"
+"      --rank=<r>             This is process number <r>, counting from 0.\n"
+"      --rendezvous=<addr>    Processes meet at socket <addr>, which is a\n"
+"                              filename or <host>:<port>.\n");
 }
 
 
 struct refine_args
 {
-	RefList *full;
-	Crystal *crystal;
+	const struct merged_arrays *full;
+	struct crystal_arrays *ca;
 	PartialityModel pmodel;
 	struct prdata prdata;
 };
@@ -93,7 +111,9 @@ struct queue_args
 {
 	int n_started;
 	int n_done;
-	Crystal **crystals;
+	int n_updated;
+	int n_crystals_skipped;
+	struct refl_arrays *ra;
 	int n_crystals;
 	struct srdata *srdata;
 	struct refine_args task_defaults;
@@ -103,9 +123,8 @@ struct queue_args
 static void refine_image(void *task, int id)
 {
 	struct refine_args *pargs = task;
-	Crystal *cr = pargs->crystal;
 
-	pargs->prdata = pr_refine(cr, pargs->full, pargs->pmodel);
+	pargs->prdata = pr_refine(pargs->ca, pargs->full, pargs->pmodel);
 }
 
 
@@ -117,7 +136,7 @@ static void *get_image(void *vqargs)
 	task = malloc(sizeof(struct refine_args));
 	memcpy(task, &qargs->task_defaults, sizeof(struct refine_args));
 
-	task->crystal = qargs->crystals[qargs->n_started];
+	task->ca = &qargs->ra->crystals[qargs->n_started];
 
 	qargs->n_started++;
 
@@ -131,6 +150,8 @@ static void done_image(void *vqargs, void *task)
 	struct refine_args *pargs = task;
 
 	qargs->n_done++;
+	qargs->n_updated += pargs->prdata.n_updated;
+	qargs->n_crystals_skipped += pargs->prdata.n_skipped;
 	if ( pargs->prdata.refined ) {
 		qargs->srdata->n_refined += pargs->prdata.refined;
 		qargs->srdata->n_filtered += pargs->prdata.n_filtered;
@@ -141,39 +162,102 @@ static void done_image(void *vqargs, void *task)
 }
 
 
-static void refine_all(Crystal **crystals, int n_crystals,
-                       RefList *full, int nthreads, PartialityModel pmodel,
-                       struct srdata *srdata)
+static void refine_arrays(struct queue_args *qargs, struct refl_arrays *ra,
+                          RefList *full, int nthreads)
+{
+	refl_arrays_set_merged(ra, full);
+
+	qargs->task_defaults.full = &ra->merged;
+	qargs->n_started = 0;
+	qargs->ra = ra;
+
+	/* Don't have threads which are doing nothing */
+	if ( ra->n_crystals < nthreads ) nthreads = ra->n_crystals;
+
+	run_threads(nthreads, refine_image, get_image, done_image,
+	            qargs, ra->n_crystals, 0, 0, 0);
+}
+
+
+/* Refine the crystals in each block of the cache in turn */
+static int refine_blocks(struct queue_args *qargs, Crystal **crystals,
+                         struct refl_cache *cache, RefList *full, int nthreads)
+{
+	int b;
+
+	for ( b=0; b<refl_cache_num_blocks(cache); b++ ) {
+
+		struct refl_arrays *ra;
+		int first, n;
+
+		if ( refl_cache_load_block(cache, crystals, b, &first, &n) ) {
+			return 1;
+		}
+
+		ra = refl_arrays_new(&crystals[first], n);
+		if ( ra == NULL ) {
+			refl_cache_release_block(cache, crystals, b, 0);
+			return 1;
+		}
+		refine_arrays(qargs, ra, full, nthreads);
+		refl_arrays_free(ra);
+
+		if ( refl_cache_release_block(cache, crystals, b, 1) ) return 1;
+
+	}
+
+	return 0;
+}
+
+
+static int refine_all(Crystal **crystals, int n_crystals,
+                      struct refl_arrays *ra, struct refl_cache *cache,
+                      struct collective *coll, RefList *full, int nthreads,
+                      PartialityModel pmodel, struct srdata *srdata)
 {
 	struct refine_args task_defaults;
 	struct queue_args qargs;
+	int counts[4];
 
 	/* If the partiality model is "p=1", this refinement is really, really
 	 * easy... */
-	if ( pmodel == PMODEL_UNITY ) return;
+	if ( pmodel == PMODEL_UNITY ) return 0;
 
-	task_defaults.full = full;
-	task_defaults.crystal = NULL;
+	task_defaults.full = NULL;
+	task_defaults.ca = NULL;
 	task_defaults.pmodel = pmodel;
 	task_defaults.prdata.refined = 0;
 	task_defaults.prdata.n_filtered = 0;
+	task_defaults.prdata.n_updated = 0;
+	task_defaults.prdata.n_skipped = 0;
 
 	qargs.task_defaults = task_defaults;
-	qargs.n_started = 0;
 	qargs.n_done = 0;
+	qargs.n_updated = 0;
+	qargs.n_crystals_skipped = 0;
 	qargs.n_crystals = n_crystals;
-	qargs.crystals = crystals;
 	qargs.srdata = srdata;
 
-	/* Don't have threads which are doing nothing */
-	if ( n_crystals < nthreads ) nthreads = n_crystals;
+	if ( cache == NULL ) {
+		refine_arrays(&qargs, ra, full, nthreads);
+	} else if ( refine_blocks(&qargs, crystals, cache, full, nthreads) ) {
+		return 1;
+	}
 
-	run_threads(nthreads, refine_image, get_image, done_image,
-	            &qargs, n_crystals, 0, 0, 0);
+	/* Totals for all ranks, just for the messages */
+	counts[0] = srdata->n_filtered;
+	counts[1] = srdata->n_refined;
+	counts[2] = qargs.n_crystals_skipped;
+	counts[3] = qargs.n_updated;
+	if ( collective_sum_int(coll, counts, 4) ) return 1;
 
 	STATUS("%5.2f eigenvalues filtered on final iteration per successfully "
-	       "refined crystal\n",
-	       (double)srdata->n_filtered/srdata->n_refined);
+	       "refined crystal\n", (double)counts[0]/counts[1]);
+	STATUS("Partialities were recalculated %i times, and not recalculated "
+	       "for %i crystals whose parameters hardly changed.\n",
+	       counts[3], counts[2]);
+
+	return 0;
 }
 
 
@@ -191,9 +275,9 @@ static void display_progress(int n_images, int n_crystals)
 }
 
 
-static const char *str_flags(Crystal *cr)
+static const char *str_flags(int flag)
 {
-	switch ( crystal_get_user_flag(cr) ) {
+	switch ( flag ) {
 
 		case 0 :
 		return "OK";
@@ -227,6 +311,7 @@ static RefList *apply_max_adu(RefList *list, double max_adu)
 
 	nlist = reflist_new();
 	if ( nlist == NULL ) return NULL;
+	reflist_reserve(nlist, num_reflections(list));
 
 	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
@@ -283,7 +368,245 @@ static int set_initial_params(Crystal *cr, FILE *fh)
 }
 
 
-static void show_duds(Crystal **crystals, int n_crystals)
+struct load_context
+{
+	struct image *images;
+	int n_images;
+	int max_images;
+	Crystal **crystals;
+	int n_crystals;
+	int max_crystals;
+	int limit;            /* Maximum number of crystals to load, or zero */
+	int skip;             /* Number of crystals to drop before loading */
+
+	const SymOpList *sym;
+	double max_adu;
+	int polarisation;
+	FILE *sparams_fh;
+	PartialityModel pmodel;
+	struct refl_cache *cache;
+	int err;
+};
+
+
+static void free_crystal(Crystal *cr)
+{
+	reflist_free(crystal_get_reflections(cr));
+	cell_free(crystal_get_cell(cr));
+	crystal_free(cr);
+}
+
+
+/* Called for each chunk, in stream order, by read_stream_parallel() */
+static int load_chunk(struct image *image, void *vp)
+{
+	struct load_context *lc = vp;
+	struct image *images_new;
+	Crystal **crystals_new;
+	struct image *cur;
+	int i;
+
+	if ( isnan(image->div) || isnan(image->bw) ) {
+		ERROR("Chunk doesn't contain beam parameters.\n");
+		lc->err = 1;
+		return 1;
+	}
+
+	images_new = grow_array(lc->images, &lc->max_images, lc->n_images+1,
+	                        sizeof(struct image));
+	if ( images_new == NULL ) {
+		ERROR("Failed to allocate memory for image list.\n");
+		lc->err = 1;
+		return 1;
+	}
+	lc->images = images_new;
+	cur = &lc->images[lc->n_images++];
+	*cur = *image;
+
+	/* Drop any crystals which belong to the previous rank */
+	if ( lc->skip > 0 ) {
+		int n_skip = lc->skip;
+		if ( n_skip > cur->n_crystals ) n_skip = cur->n_crystals;
+		for ( i=0; i<n_skip; i++ ) {
+			free_crystal(cur->crystals[i]);
+		}
+		memmove(cur->crystals, cur->crystals+n_skip,
+		        (cur->n_crystals-n_skip)*sizeof(Crystal *));
+		cur->n_crystals -= n_skip;
+		lc->skip -= n_skip;
+	}
+
+	/* Drop any crystals beyond the limit */
+	if ( (lc->limit > 0) && (lc->n_crystals+cur->n_crystals > lc->limit) ) {
+		for ( i=lc->limit-lc->n_crystals; i<cur->n_crystals; i++ ) {
+			free_crystal(cur->crystals[i]);
+		}
+		cur->n_crystals = lc->limit - lc->n_crystals;
+	}
+
+	crystals_new = grow_array(lc->crystals, &lc->max_crystals,
+	                          lc->n_crystals+cur->n_crystals,
+	                          sizeof(Crystal *));
+	if ( crystals_new == NULL ) {
+		ERROR("Failed to allocate memory for crystal list.\n");
+		lc->err = 1;
+		return 1;
+	}
+	lc->crystals = crystals_new;
+
+	for ( i=0; i<cur->n_crystals; i++ ) {
+
+		Crystal *cr;
+		RefList *cr_refl;
+		RefList *as;
+		int n_gained = 0;
+		int n_lost = 0;
+		double mean_p_change = 0.0;
+
+		cr = cur->crystals[i];
+		lc->crystals[lc->n_crystals] = cr;
+
+		/* This is the raw list of reflections */
+		cr_refl = crystal_get_reflections(cr);
+
+		cr_refl = apply_max_adu(cr_refl, lc->max_adu);
+
+		if ( lc->polarisation ) {
+			polarisation_correction(cr_refl, crystal_get_cell(cr),
+			                        cur);
+		}
+
+		as = asymmetric_indices(cr_refl, lc->sym);
+		crystal_set_reflections(cr, as);
+		crystal_set_user_flag(cr, 0);
+		reflist_free(cr_refl);
+
+		if ( set_initial_params(cr, lc->sparams_fh) ) {
+			ERROR("Failed to set initial parameters\n");
+			lc->err = 1;
+			return 1;
+		}
+
+		/* The image will move due to later reallocs, so the pointer
+		 * is only set properly after loading.  "cur" is good enough
+		 * for the following. */
+		crystal_set_image(cr, cur);
+		update_partialities_2(cr, lc->pmodel, &n_gained, &n_lost,
+		                      &mean_p_change);
+		assert(n_gained == 0);  /* That'd just be silly */
+
+		if ( (lc->cache != NULL) && refl_cache_store(lc->cache, cr) ) {
+			lc->err = 1;
+			return 1;
+		}
+		crystal_set_image(cr, NULL);
+
+		lc->n_crystals++;
+
+	}
+
+	if ( lc->n_images % 100 == 0 ) {
+		display_progress(lc->n_images, lc->n_crystals);
+	}
+
+	if ( (lc->limit > 0) && (lc->n_crystals == lc->limit) ) return 1;
+
+	return 0;
+}
+
+
+/* Allocate the image and crystal lists at their final sizes, if they can be
+ * worked out from the chunk index.  Getting the index is only worthwhile if
+ * read_stream_parallel() will need it anyway, because otherwise it might
+ * mean scanning the whole stream an extra time.  Failure doesn't matter,
+ * because load_chunk() will grow the lists as needed. */
+static void presize_lists(struct load_context *lc, Stream *st, int nthreads)
+{
+	int n_chunks;
+	int n_crystals = 0;
+	int i;
+
+	n_chunks = (nthreads > 1) ? stream_num_chunks(st) : -1;
+
+	if ( n_chunks < 0 ) {
+		if ( lc->limit > 0 ) {
+			lc->crystals = grow_array(NULL, &lc->max_crystals,
+			                          lc->limit, sizeof(Crystal *));
+		}
+		return;
+	}
+
+	for ( i=0; i<n_chunks; i++ ) {
+		int n;
+		if ( stream_chunk_info(st, i, NULL, NULL, &n) ) return;
+		n_crystals += n;
+		if ( (lc->limit > 0) && (n_crystals >= lc->limit) ) {
+			n_crystals = lc->limit;
+			n_chunks = i+1;
+			break;
+		}
+	}
+
+	lc->images = grow_array(NULL, &lc->max_images, n_chunks,
+	                        sizeof(struct image));
+	lc->crystals = grow_array(NULL, &lc->max_crystals, n_crystals,
+	                          sizeof(Crystal *));
+}
+
+
+/* Works out which crystals belong to this rank, and gets ready to read them.
+ * They are the "*n" crystals starting from number "*first".  Unlike in
+ * presize_lists(), the index is needed regardless of the number of threads. */
+static int select_partition(struct load_context *lc, Stream *st,
+                            struct collective *coll, int *first, int *n)
+{
+	int n_chunks;
+	int n_total = 0;
+	int n_before = 0;
+	int chunk;
+
+	n_chunks = stream_num_chunks(st);
+	if ( n_chunks < 0 ) {
+		ERROR("The input stream must be a file for --ranks.\n");
+		return 1;
+	}
+
+	for ( chunk=0; chunk<n_chunks; chunk++ ) {
+		int nc;
+		if ( stream_chunk_info(st, chunk, NULL, NULL, &nc) ) return 1;
+		n_total += nc;
+	}
+	if ( (lc->limit > 0) && (n_total > lc->limit) ) n_total = lc->limit;
+
+	collective_partition(coll, n_total, first, n);
+	STATUS("Rank %i of %i: crystals %i to %i of %i.\n",
+	       collective_rank(coll), collective_n_ranks(coll),
+	       *first, *first+*n-1, n_total);
+	if ( *n == 0 ) return 0;
+
+	/* Find the chunk containing the first crystal */
+	for ( chunk=0; chunk<n_chunks; chunk++ ) {
+		int nc;
+		if ( stream_chunk_info(st, chunk, NULL, NULL, &nc) ) return 1;
+		if ( n_before + nc > *first ) break;
+		n_before += nc;
+	}
+	if ( stream_seek_chunk(st, chunk) ) {
+		ERROR("Failed to find chunk %i.\n", chunk);
+		return 1;
+	}
+
+	lc->skip = *first - n_before;
+	lc->limit = *n;
+	lc->crystals = grow_array(NULL, &lc->max_crystals, *n,
+	                          sizeof(Crystal *));
+
+	return 0;
+}
+
+
+static void show_duds(Crystal **crystals, int n_crystals,
+                      struct collective *coll)
 {
 	int j;
 	int n_dud = 0;
@@ -328,6 +651,18 @@ static void show_duds(Crystal **crystals, int n_crystals)
 		}
 	}
 
+	if ( coll != NULL ) {
+		int counts[6] = {n_dud, n_noscale, n_noref, n_solve, n_lost,
+		                 n_early};
+		if ( collective_sum_int(coll, counts, 6) ) return;
+		n_dud = counts[0];
+		n_noscale = counts[1];
+		n_noref = counts[2];
+		n_solve = counts[3];
+		n_lost = counts[4];
+		n_early = counts[5];
+	}
+
 	if ( n_dud ) {
 		STATUS("%i bad crystals:\n", n_dud);
 		STATUS(" %i scaling failed.\n", n_noscale);
@@ -339,6 +674,180 @@ static void show_duds(Crystal **crystals, int n_crystals)
 }
 
 
+struct crystal_params
+{
+	double osf;
+	double Bfac;
+	double div;
+	int flag;
+};
+
+
+/* Write the parameters of all the crystals, from all ranks, to
+ * partialator.params */
+static int dump_params(Crystal **crystals, int n_crystals,
+                       struct collective *coll)
+{
+	struct crystal_params *params;
+	void *vall;
+	struct crystal_params *all;
+	size_t size;
+	FILE *fh;
+	int i;
+	int r;
+
+	/* At least one element, so that NULL always means failure */
+	params = malloc((n_crystals > 0 ? n_crystals : 1)
+	                * sizeof(struct crystal_params));
+	if ( params == NULL ) {
+		ERROR("Failed to allocate memory for parameters.\n");
+		return 1;
+	}
+	for ( i=0; i<n_crystals; i++ ) {
+		params[i].osf = crystal_get_osf(crystals[i]);
+		params[i].Bfac = crystal_get_Bfac(crystals[i]);
+		params[i].div = crystal_get_image(crystals[i])->div;
+		params[i].flag = crystal_get_user_flag(crystals[i]);
+	}
+
+	r = collective_gather(coll, params,
+	                      n_crystals*sizeof(struct crystal_params),
+	                      &vall, &size);
+	free(params);
+	if ( r ) {
+		ERROR("Failed to collect parameters.\n");
+		return 1;
+	}
+	if ( collective_rank(coll) != 0 ) return 0;
+	all = vall;
+
+	fh = fopen("partialator.params", "w");
+	if ( fh == NULL ) {
+		ERROR("Couldn't open partialator.params!\n");
+	} else {
+		fprintf(fh, "  cr        OSF       relB         div flag\n");
+		for ( i=0; i<size/sizeof(struct crystal_params); i++ ) {
+			fprintf(fh, "%4i %10.5f %10.2f %8.5e %s\n", i,
+			        all[i].osf, all[i].Bfac*1e20, all[i].div,
+			        str_flags(all[i].flag));
+		}
+		fclose(fh);
+	}
+	free(all);
+	return 0;
+}
+
+
+/* Add the rank number to "filename", and free the original */
+static char *rank_filename(char *filename, int rank)
+{
+	char *rfn;
+
+	if ( filename == NULL ) return NULL;
+
+	rfn = malloc(strlen(filename)+16);
+	if ( rfn == NULL ) return NULL;
+	sprintf(rfn, "%s.%i", filename, rank);
+	free(filename);
+	return rfn;
+}
+
+
+/* All the ranks of a run are started with the same options apart from --rank
+ * and -j, so a hash of the others tells rank zero which connections are from
+ * this run */
+static uint32_t run_token(int argc, char *argv[])
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for ( i=1; i<argc; i++ ) {
+
+		const char *p;
+
+		if ( strncmp(argv[i], "--rank=", 7) == 0 ) continue;
+		if ( (strcmp(argv[i], "--rank") == 0)
+		  || (strcmp(argv[i], "-j") == 0) )
+		{
+			i++;
+			continue;
+		}
+		if ( strncmp(argv[i], "-j", 2) == 0 ) continue;
+
+		/* Including the terminator, so that "-a b" and "-ab" differ */
+		for ( p=argv[i]; ; p++ ) {
+			h = (h ^ (unsigned char)*p) * 16777619u;
+			if ( *p == '\0' ) break;
+		}
+
+	}
+
+	return h;
+}
+
+
+/* Checks that a checkpoint ("info") was made with the same settings as the
+ * current run ("want") */
+static int check_checkpoint(const struct checkpoint_info *info,
+                            const struct checkpoint_info *want)
+{
+	if ( strcmp(info->sym, want->sym) != 0 ) {
+		ERROR("The checkpoint was made with symmetry %s, not %s.\n",
+		      info->sym, want->sym);
+		return 1;
+	}
+	if ( info->pmodel != want->pmodel ) {
+		ERROR("The checkpoint was made with a different partiality "
+		      "model.\n");
+		return 1;
+	}
+	if ( (info->rank != want->rank) || (info->n_ranks != want->n_ranks) ) {
+		ERROR("The checkpoint was made by rank %i of %i, not rank %i "
+		      "of %i.\n", info->rank, info->n_ranks, want->rank,
+		      want->n_ranks);
+		return 1;
+	}
+	if ( info->n_iter != want->n_iter ) {
+		ERROR("The checkpoint was made with --iterations=%i, not "
+		      "%i.\n", info->n_iter, want->n_iter);
+		return 1;
+	}
+	if ( info->min_measurements != want->min_measurements ) {
+		ERROR("The checkpoint was made with --min-measurements=%i, "
+		      "not %i.\n", info->min_measurements,
+		      want->min_measurements);
+		return 1;
+	}
+	if ( info->max_adu != want->max_adu ) {
+		ERROR("The checkpoint was made with --max-adu=%f, not %f.\n",
+		      info->max_adu, want->max_adu);
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Failing to save a checkpoint isn't a reason to stop */
+static void save_checkpoint(const char *filename, struct checkpoint_info *info,
+                            struct image *images, int n_images,
+                            Crystal **crystals, int n_crystals,
+                            struct refl_arrays *ra, struct refl_cache *cache,
+                            RefList *full)
+{
+	if ( filename == NULL ) return;
+
+	if ( write_checkpoint(filename, info, images, n_images, crystals,
+	                      n_crystals, ra, cache, full) )
+	{
+		ERROR("WARNING: Failed to save checkpoint after cycle %i.\n",
+		      info->cycle);
+		return;
+	}
+	STATUS("Saved checkpoint after cycle %i to '%s'.\n", info->cycle,
+	       filename);
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
@@ -365,8 +874,25 @@ int main(int argc, char *argv[])
 	struct srdata srdata;
 	int polarisation = 1;
 	double max_adu = +INFINITY;
+	int max_crystals = 0;
+	double max_memory = 0.0;
+	char *cache_dir = NULL;
+	struct refl_cache *cache = NULL;
 	char *sparams_fn = NULL;
 	FILE *sparams_fh;
+	struct load_context lc;
+	struct refl_arrays *ra;
+	int n_ranks = 1;
+	int rank = 0;
+	char *rendezvous = NULL;
+	struct collective *coll = NULL;
+	int first_crystal = 0;
+	int n_partition = 0;
+	char *checkpoint_fn = NULL;
+	char *resume_fn = NULL;
+	struct checkpoint_info ckinfo;
+	int first_cycle = 0;
+	int r;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -383,6 +909,14 @@ int main(int argc, char *argv[])
 		{"min-measurements",   1, NULL,                2},
 		{"max-adu",            1, NULL,                3},
 		{"start-params",       1, NULL,                4},
+		{"max-crystals",       1, NULL,                5},
+		{"max-memory",         1, NULL,                6},
+		{"cache-dir",          1, NULL,                7},
+		{"ranks",              1, NULL,                8},
+		{"rank",               1, NULL,                9},
+		{"rendezvous",         1, NULL,               10},
+		{"checkpoint",         1, NULL,               11},
+		{"resume",             1, NULL,               12},
 
 		{"no-scale",           0, &noscale,            1},
 		{"no-polarisation",    0, &polarisation,       0},
@@ -461,6 +995,58 @@ int main(int argc, char *argv[])
 			sparams_fn = strdup(optarg);
 			break;
 
+			case 5 :
+			errno = 0;
+			max_crystals = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (max_crystals < 0) ) {
+				ERROR("Invalid value for --max-crystals.\n");
+				return 1;
+			}
+			break;
+
+			case 6 :
+			errno = 0;
+			max_memory = strtod(optarg, &rval);
+			if ( (*rval != '\0') || !(max_memory > 0.0) ) {
+				ERROR("Invalid value for --max-memory.\n");
+				return 1;
+			}
+			break;
+
+			case 7 :
+			cache_dir = strdup(optarg);
+			break;
+
+			case 8 :
+			errno = 0;
+			n_ranks = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_ranks < 1) ) {
+				ERROR("Invalid value for --ranks.\n");
+				return 1;
+			}
+			break;
+
+			case 9 :
+			errno = 0;
+			rank = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (rank < 0) ) {
+				ERROR("Invalid value for --rank.\n");
+				return 1;
+			}
+			break;
+
+			case 10 :
+			rendezvous = strdup(optarg);
+			break;
+
+			case 11 :
+			checkpoint_fn = strdup(optarg);
+			break;
+
+			case 12 :
+			resume_fn = strdup(optarg);
+			break;
+
 			case 0 :
 			break;
 
@@ -480,14 +1066,29 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if ( infile == NULL ) {
-		infile = strdup("-");
+	if ( rank >= n_ranks ) {
+		ERROR("--rank must be less than --ranks.\n");
+		return 1;
 	}
-	st = open_stream_for_read(infile);
-	if ( st == NULL ) {
-		ERROR("Failed to open input stream '%s'\n", infile);
+	if ( (n_ranks > 1) && (rendezvous == NULL) ) {
+		ERROR("You need to give --rendezvous with --ranks.\n");
 		return 1;
 	}
+
+	if ( resume_fn != NULL ) {
+		if ( sparams_fn != NULL ) {
+			ERROR("--start-params can't be used with --resume.\n");
+			return 1;
+		}
+		if ( infile != NULL ) {
+			ERROR("WARNING: Not reading '%s', because of "
+			      "--resume.\n", infile);
+		}
+	}
+
+	if ( infile == NULL ) {
+		infile = strdup("-");
+	}
 	/* Don't free "infile", because it's needed for the scaling report */
 
 	/* Sanitise output filename */
@@ -514,11 +1115,6 @@ int main(int argc, char *argv[])
 
 	gsl_set_error_handler_off();
 
-	/* Fill in what we know about the images so far */
-	n_images = 0;
-	n_crystals = 0;
-	images = NULL;
-	crystals = NULL;
 	if ( sparams_fn != NULL ) {
 		char line[1024];
 		sparams_fh = fopen(sparams_fn, "r");
@@ -534,128 +1130,193 @@ int main(int argc, char *argv[])
 		sparams_fh = NULL;
 	}
 
-	do {
+	if ( n_ranks > 1 ) {
+		STATUS("Waiting for all %i ranks to join.\n", n_ranks);
+		coll = collective_new(rendezvous, rank, n_ranks, nthreads,
+		                      run_token(argc, argv));
+		if ( coll == NULL ) return 1;
+	}
+	free(rendezvous);
 
-		RefList *as;
-		int i;
-		struct image *images_new;
-		struct image *cur;
+	/* Each rank has its own checkpoint */
+	if ( n_ranks > 1 ) {
+		checkpoint_fn = rank_filename(checkpoint_fn, rank);
+		resume_fn = rank_filename(resume_fn, rank);
+	}
 
-		images_new = realloc(images, (n_images+1)*sizeof(struct image));
-		if ( images_new == NULL ) {
-			ERROR("Failed to allocate memory for image list.\n");
+	if ( max_memory > 0.0 ) {
+		cache = refl_cache_new(cache_dir != NULL ? cache_dir : ".",
+		                       max_memory*1024.0*1024.0);
+		if ( cache == NULL ) return 1;
+	} else if ( cache_dir != NULL ) {
+		ERROR("WARNING: --cache-dir has no effect without "
+		      "--max-memory.\n");
+	}
+	free(cache_dir);
+
+	ckinfo.pmodel = pmodel;
+	strncpy(ckinfo.sym, symmetry_name(sym), 31);
+	ckinfo.sym[31] = '\0';
+	ckinfo.rank = rank;
+	ckinfo.n_ranks = n_ranks;
+	ckinfo.n_iter = n_iter;
+	ckinfo.min_measurements = min_measurements;
+	ckinfo.max_adu = max_adu;
+
+	if ( resume_fn != NULL ) {
+
+		struct checkpoint_info resumed;
+
+		STATUS("Resuming from '%s'.\n", resume_fn);
+		if ( read_checkpoint(resume_fn, &resumed, &images, &n_images,
+		                     &crystals, &n_crystals, &ra, cache, &full) )
+		{
+			ERROR("Failed to resume from '%s'.\n", resume_fn);
 			return 1;
 		}
-		images = images_new;
-		cur = &images[n_images];
-
-		cur->div = NAN;
-		cur->bw = NAN;
-		cur->det = NULL;
-		if ( read_chunk_2(st, cur, STREAM_READ_REFLECTIONS
-		                           | STREAM_READ_UNITCELL) != 0 ) {
-			break;
+		if ( check_checkpoint(&resumed, &ckinfo) ) return 1;
+		first_cycle = resumed.cycle;
+
+		/* The ranks need to agree on the partition again */
+		if ( coll != NULL ) {
+			int n_total = n_crystals;
+			if ( collective_sum_int(coll, &n_total, 1) ) return 1;
+			collective_partition(coll, n_total, &first_crystal,
+			                     &n_partition);
+			if ( n_partition != n_crystals ) {
+				ERROR("Rank %i of %i has %i crystals in its "
+				      "checkpoint instead of %i.  The "
+				      "checkpoints of the ranks aren't from "
+				      "the same run.\n", rank, n_ranks,
+				      n_crystals, n_partition);
+				return 1;
+			}
 		}
+		STATUS("Loaded %i crystals after cycle %i.\n", n_crystals,
+		       first_cycle);
+
+	} else {
 
-		if ( isnan(cur->div) || isnan(cur->bw) ) {
-			ERROR("Chunk doesn't contain beam parameters.\n");
+		st = open_stream_for_read(infile);
+		if ( st == NULL ) {
+			ERROR("Failed to open input stream '%s'\n", infile);
 			return 1;
 		}
 
-		n_images++;
-
-		for ( i=0; i<cur->n_crystals; i++ ) {
-
-			Crystal *cr;
-			Crystal **crystals_new;
-			RefList *cr_refl;
-
-			crystals_new = realloc(crystals,
-			                      (n_crystals+1)*sizeof(Crystal *));
-			if ( crystals_new == NULL ) {
-				ERROR("Failed to allocate memory for crystal "
-				      "list.\n");
+		lc.images = NULL;
+		lc.n_images = 0;
+		lc.max_images = 0;
+		lc.crystals = NULL;
+		lc.n_crystals = 0;
+		lc.max_crystals = 0;
+		lc.limit = max_crystals;
+		lc.skip = 0;
+		lc.sym = sym;
+		lc.max_adu = max_adu;
+		lc.polarisation = polarisation;
+		lc.sparams_fh = sparams_fh;
+		lc.pmodel = pmodel;
+		lc.cache = cache;
+		lc.err = 0;
+
+		if ( coll != NULL ) {
+			if ( select_partition(&lc, st, coll, &first_crystal,
+			                      &n_partition) )
+			{
 				return 1;
 			}
-			crystals = crystals_new;
-			crystals[n_crystals] = cur->crystals[i];
-			cr = crystals[n_crystals];
-
-			/* Image pointer will change due to later reallocs */
-			crystal_set_image(cr, NULL);
-
-			/* This is the raw list of reflections */
-			cr_refl = crystal_get_reflections(cr);
-
-			cr_refl = apply_max_adu(cr_refl, max_adu);
-
-			if ( polarisation ) {
-				polarisation_correction(cr_refl,
-						        crystal_get_cell(cr),
-						        cur);
+			/* The starting parameters are listed for all
+			 * crystals */
+			for ( i=0; i<first_crystal; i++ ) {
+				if ( sparams_fh != NULL ) skip_to_end(sparams_fh);
 			}
+		} else {
+			presize_lists(&lc, st, nthreads);
+		}
+		if ( ((coll == NULL) || (n_partition > 0))
+		  && (read_stream_parallel(st, nthreads,
+		                           STREAM_READ_REFLECTIONS
+		                            | STREAM_READ_UNITCELL,
+		                           1, NULL, load_chunk, &lc)
+		      || lc.err) )
+		{
+			ERROR("Failed to load the stream.\n");
+			return 1;
+		}
+		images = lc.images;
+		n_images = lc.n_images;
+		crystals = lc.crystals;
+		n_crystals = lc.n_crystals;
+		display_progress(n_images, n_crystals);
+		fprintf(stderr, "\n");
+		if ( (coll == NULL) && (max_crystals > 0)
+		  && (n_crystals == max_crystals) )
+		{
+			STATUS("Stopped reading the stream after %i "
+			       "crystals.\n", n_crystals);
+		}
+		if ( sparams_fh != NULL ) fclose(sparams_fh);
 
-			as = asymmetric_indices(cr_refl, sym);
-			crystal_set_reflections(cr, as);
-			crystal_set_user_flag(cr, 0);
-			reflist_free(cr_refl);
+		close_stream(st);
 
-			if ( set_initial_params(cr, sparams_fh) ) {
-				ERROR("Failed to set initial parameters\n");
-				return 1;
+		/* Fill in image pointers */
+		for ( i=0; i<n_images; i++ ) {
+			int j;
+			for ( j=0; j<images[i].n_crystals; j++ ) {
+				crystal_set_image(images[i].crystals[j],
+				                  &images[i]);
 			}
-
-			n_crystals++;
-
 		}
 
-		if ( n_images % 100 == 0 ) {
-			display_progress(n_images, n_crystals);
+		/* Take the values needed for scaling and refinement into
+		 * arrays.  With the cache, that's done for each block when
+		 * it's loaded. */
+		if ( cache == NULL ) {
+			ra = refl_arrays_new(crystals, n_crystals);
+			if ( ra == NULL ) {
+				ERROR("Failed to set up reflection arrays.\n");
+				return 1;
+			}
+		} else {
+			ra = NULL;
 		}
 
-	} while ( 1 );
-	display_progress(n_images, n_crystals);
-	fprintf(stderr, "\n");
-	if ( sparams_fh != NULL ) fclose(sparams_fh);
-
-	close_stream(st);
-
-	/* Fill in image pointers */
-	for ( i=0; i<n_images; i++ ) {
-		int j;
-		for ( j=0; j<images[i].n_crystals; j++ ) {
-
-			Crystal *cryst;
-			int n_gained = 0;
-			int n_lost = 0;
-			double mean_p_change = 0.0;
-
-			cryst = images[i].crystals[j];
-			crystal_set_image(cryst, &images[i]);
-
-			/* Now it's safe to do the following */
-			update_partialities_2(cryst, pmodel, &n_gained, &n_lost,
-			                      &mean_p_change);
-			assert(n_gained == 0);  /* That'd just be silly */
+	}
 
-		}
+	if ( cache != NULL ) {
+		STATUS("Reflections are cached on disk in %i blocks.\n",
+		       refl_cache_num_blocks(cache));
 	}
 
 	/* Make a first pass at cutting out crap */
 //	STATUS("Checking patterns.\n");
 //	early_rejection(crystals, n_crystals);
 
-	/* Make initial estimates */
-	STATUS("Performing initial scaling.\n");
-	if ( noscale ) {
-		STATUS("Skipping scaling step (--no-scale).\n");
-		full = lsq_intensities(crystals, n_crystals, nthreads, pmodel);
-	} else {
-		full = scale_intensities(crystals, n_crystals, nthreads, pmodel,
-		                         min_measurements);
-	}
+	if ( resume_fn == NULL ) {
+
+		/* Make initial estimates */
+		STATUS("Performing initial scaling.\n");
+		if ( noscale ) {
+			STATUS("Skipping scaling step (--no-scale).\n");
+			full = lsq_intensities(crystals, n_crystals, cache,
+			                       coll, nthreads, pmodel);
+		} else {
+			full = scale_intensities(crystals, n_crystals, ra,
+			                         cache, coll, nthreads, pmodel,
+			                         min_measurements);
+		}
+		if ( full == NULL ) {
+			ERROR("Initial scaling failed.\n");
+			return 1;
+		}
+
+		if ( check_rejection(crystals, n_crystals, coll) ) return 1;
+
+		ckinfo.cycle = 0;
+		save_checkpoint(checkpoint_fn, &ckinfo, images, n_images,
+		                crystals, n_crystals, ra, cache, full);
 
-	check_rejection(crystals, n_crystals);
+	}
 
 	srdata.crystals = crystals;
 	srdata.n = n_crystals;
@@ -663,38 +1324,63 @@ int main(int argc, char *argv[])
 	srdata.n_filtered = 0;
 	srdata.n_refined = 0;
 
-	sr = sr_titlepage(crystals, n_crystals, "scaling-report.pdf",
-	                  infile, cmdline);
+	/* The scaling report needs all the reflections at once */
+	if ( coll != NULL ) {
+		STATUS("No scaling report with --ranks.\n");
+		sr = NULL;
+	} else if ( resume_fn != NULL ) {
+		STATUS("No scaling report when resuming.\n");
+		sr = NULL;
+	} else if ( cache == NULL ) {
+		sr = sr_titlepage(crystals, n_crystals, "scaling-report.pdf",
+		                  infile, cmdline, nthreads);
+	} else {
+		STATUS("No scaling report with --max-memory.\n");
+		sr = NULL;
+	}
 	sr_iteration(sr, 0, &srdata);
 
-	show_duds(crystals, n_crystals);
+	show_duds(crystals, n_crystals, coll);
 
 	/* Iterate */
-	for ( i=0; i<n_iter; i++ ) {
+	for ( i=first_cycle; i<n_iter; i++ ) {
 
 		STATUS("Post refinement cycle %i of %i\n", i+1, n_iter);
 
 		srdata.n_filtered = 0;
 
 		/* Refine the geometry of all patterns to get the best fit */
-		refine_all(crystals, n_crystals, full, nthreads, pmodel,
-		           &srdata);
+		if ( refine_all(crystals, n_crystals, ra, cache, coll, full,
+		                nthreads, pmodel, &srdata) )
+		{
+			ERROR("Post refinement failed.\n");
+			return 1;
+		}
 
-		show_duds(crystals, n_crystals);
-		check_rejection(crystals, n_crystals);
+		show_duds(crystals, n_crystals, coll);
+		if ( check_rejection(crystals, n_crystals, coll) ) return 1;
 
 		/* Re-estimate all the full intensities */
 		reflist_free(full);
 		if ( noscale ) {
 			STATUS("Skipping scaling step (--no-scale).\n");
-			full = lsq_intensities(crystals, n_crystals, nthreads,
-			                       pmodel);
+			full = lsq_intensities(crystals, n_crystals, cache,
+			                       coll, nthreads, pmodel);
 		} else {
-			full = scale_intensities(crystals, n_crystals, nthreads,
-			                         pmodel, min_measurements);
+			full = scale_intensities(crystals, n_crystals, ra,
+			                         cache, coll, nthreads, pmodel,
+			                         min_measurements);
 		}
+		if ( full == NULL ) {
+			ERROR("Scaling failed.\n");
+			return 1;
+		}
+
+		if ( check_rejection(crystals, n_crystals, coll) ) return 1;
 
-		check_rejection(crystals, n_crystals);
+		ckinfo.cycle = i+1;
+		save_checkpoint(checkpoint_fn, &ckinfo, images, n_images,
+		                crystals, n_crystals, ra, cache, full);
 
 		srdata.full = full;
 
@@ -705,26 +1391,15 @@ int main(int argc, char *argv[])
 	sr_finish(sr);
 
 	/* Output results */
-	write_reflist(outfile, full);
+	if ( collective_rank(coll) == 0 ) write_reflist(outfile, full);
 
 	/* Dump parameters */
-	FILE *fh;
-	fh = fopen("partialator.params", "w");
-	if ( fh == NULL ) {
-		ERROR("Couldn't open partialator.params!\n");
-	} else {
-		fprintf(fh, "  cr        OSF       relB         div flag\n");
-		for ( i=0; i<n_crystals; i++ ) {
-			fprintf(fh, "%4i %10.5f %10.2f %8.5e %s\n", i,
-			        crystal_get_osf(crystals[i]),
-				crystal_get_Bfac(crystals[i])*1e20,
-			        crystal_get_image(crystals[i])->div,
-			        str_flags(crystals[i]));
-		}
-		fclose(fh);
-	}
+	r = dump_params(crystals, n_crystals, coll);
 
 	/* Clean up */
+	refl_arrays_free(ra);
+	refl_cache_free(cache);
+	collective_free(coll);
 	for ( i=0; i<n_crystals; i++ ) {
 		reflist_free(crystal_get_reflections(crystals[i]));
 		crystal_free(crystals[i]);
@@ -738,6 +1413,8 @@ int main(int argc, char *argv[])
 	}
 	free(images);
 	free(infile);
+	free(checkpoint_fn);
+	free(resume_fn);
 
-	return 0;
+	return r;
 }
@@ -54,6 +54,15 @@
 /* Maximum number of iterations of NLSq to do for each image per macrocycle. */
 #define MAX_CYCLES (10)
 
+/* The partialities are not recalculated if the parameters have changed so
+ * little that no partiality could have changed by more than about this */
+#define PR_SKIP_TOLERANCE (0.01)
+
+/* Largest condition number of the rescaled normal equations which will be
+ * solved without filtering eigenvalues.  Must match check_eigen() in
+ * libcrystfel/src/utils.c */
+#define PR_MAX_CONDITION (1e6)
+
 
 /* Returns dp(gauss)/dr at "r" */
 static double gaussian_fraction_gradient(double r, double R)
@@ -290,6 +299,102 @@ double p_gradient(Crystal *cr, int k, Reflection *refl, PartialityModel pmodel)
 }
 
 
+/* Calculate the gradients of partiality wrt all the parameters before
+ * NUM_PARAMS, for all the reflections in "ca" in one go.  The gradient for
+ * reflection "i" wrt parameter "k" is put in gradients[k*ca->n + i].
+ *
+ * This does the same calculation as p_gradient(), but the things which don't
+ * depend on the parameter are only calculated once, and the final step for
+ * each parameter is a simple loop over the reflections. */
+int p_gradients(const struct crystal_arrays *ca, PartialityModel pmodel,
+                double *gradients)
+{
+	Crystal *cr = ca->crystal;
+	struct image *image = crystal_get_image(cr);
+	double R = crystal_get_profile_radius(cr);
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+	double klow, khigh;
+	double cetlow, cezlow, cethigh, cezhigh;
+	double *ex, *ey, *ez;
+	const int n = ca->n;
+	int i;
+
+	/* Parameter-independent terms for each reflection */
+	ex = malloc(3*n*sizeof(double));
+	if ( ex == NULL ) return 1;
+	ey = ex + n;
+	ez = ey + n;
+
+	cell_get_reciprocal(crystal_get_cell(cr), &asx, &asy, &asz,
+	                                          &bsx, &bsy, &bsz,
+	                                          &csx, &csy, &csz);
+
+	/* "low" gives the largest Ewald sphere (wavelength short => k large)
+	 * "high" gives the smallest Ewald sphere (wavelength long => k small)
+	 */
+	klow = 1.0/(image->lambda - image->lambda*image->bw/2.0);
+	khigh = 1.0/(image->lambda + image->lambda*image->bw/2.0);
+
+	cetlow = -sin(image->div/2.0) * klow;
+	cezlow = -cos(image->div/2.0) * klow;
+	cethigh = -sin(image->div/2.0) * khigh;
+	cezhigh = -cos(image->div/2.0) * khigh;
+
+	for ( i=0; i<n; i++ ) {
+
+		double rlow = ca->rlow[i];
+		double rhigh = ca->rhigh[i];
+		double glow, ghigh, dg;
+		double xl, yl, zl, tl;
+		double philow, phihigh, phi, azi;
+
+		/* Gradient of partiality wrt excitation error */
+		glow = partiality_gradient(rlow, R, pmodel, rlow, rhigh);
+		ghigh = partiality_gradient(rhigh, R, pmodel, rlow, rhigh);
+		dg = glow - ghigh;
+
+		xl = ca->hs[i]*asx + ca->ks[i]*bsx + ca->ls[i]*csx;
+		yl = ca->hs[i]*asy + ca->ks[i]*bsy + ca->ls[i]*csy;
+		zl = ca->hs[i]*asz + ca->ks[i]*bsz + ca->ls[i]*csz;
+
+		tl = sqrt(xl*xl + yl*yl);
+		philow = angle_between_2d(tl-cetlow, zl-cezlow, 0.0, 1.0);
+		phihigh = angle_between_2d(tl-cethigh, zl-cezhigh, 0.0, 1.0);
+
+		/* Approximation: philow and phihigh are very similar */
+		phi = (philow + phihigh) / 2.0;
+		azi = atan2(yl, xl);
+
+		ex[i] = sin(phi) * cos(azi) * dg;
+		ey[i] = sin(phi) * sin(azi) * dg;
+		ez[i] = cos(phi) * dg;
+
+	}
+
+	/* Multiply by the gradient of excitation error wrt each parameter */
+	for ( i=0; i<n; i++ ) {
+		gradients[REF_ASX*n + i] = -ca->hs[i] * ex[i];
+		gradients[REF_BSX*n + i] = -ca->ks[i] * ex[i];
+		gradients[REF_CSX*n + i] = -ca->ls[i] * ex[i];
+	}
+	for ( i=0; i<n; i++ ) {
+		gradients[REF_ASY*n + i] = -ca->hs[i] * ey[i];
+		gradients[REF_BSY*n + i] = -ca->ks[i] * ey[i];
+		gradients[REF_CSY*n + i] = -ca->ls[i] * ey[i];
+	}
+	for ( i=0; i<n; i++ ) {
+		gradients[REF_ASZ*n + i] = -ca->hs[i] * ez[i];
+		gradients[REF_BSZ*n + i] = -ca->ks[i] * ez[i];
+		gradients[REF_CSZ*n + i] = -ca->ls[i] * ez[i];
+	}
+
+	free(ex);
+	return 0;
+}
+
+
 static void apply_cell_shift(UnitCell *cell, int k, double shift)
 {
 	double asx, asy, asz;
@@ -362,117 +467,230 @@ static void apply_shift(Crystal *cr, int k, double shift)
 }
 
 
+/* Solve M.x = v for the shifts, using the same rescaling as solve_svd() and a
+ * Cholesky decomposition.  Returns non-zero if the equations are not
+ * well-conditioned enough for this to be sure to give the same answer as
+ * solve_svd(), which should then be used instead. */
+static int solve_cholesky(double M[NUM_PARAMS][NUM_PARAMS],
+                          double v[NUM_PARAMS], double x[NUM_PARAMS])
+{
+	double S[NUM_PARAMS];
+	double L[NUM_PARAMS][NUM_PARAMS];
+	double Linv[NUM_PARAMS][NUM_PARAMS];
+	double y[NUM_PARAMS];
+	double lmax = 0.0;
+	double norm = 0.0;
+	int i, j, k;
+
+	/* Rescaling, which gives SAS a unit diagonal */
+	for ( i=0; i<NUM_PARAMS; i++ ) {
+		if ( !(M[i][i] > 0.0) || isinf(M[i][i]) ) return 1;
+		S[i] = pow(M[i][i], -0.5);
+	}
+
+	/* Decompose SAS = L.L^T, using only the lower triangle, and find an
+	 * upper bound on the largest eigenvalue (Gershgorin) */
+	for ( i=0; i<NUM_PARAMS; i++ ) {
+
+		double row = 0.0;
+
+		for ( j=0; j<NUM_PARAMS; j++ ) {
+			row += fabs(S[i]*M[i][j]*S[j]);
+		}
+		if ( row > lmax ) lmax = row;
+
+		for ( j=0; j<=i; j++ ) {
+
+			double sum = S[i]*M[i][j]*S[j];
+
+			for ( k=0; k<j; k++ ) sum -= L[i][k]*L[j][k];
+
+			if ( i == j ) {
+				if ( !(sum > 0.0) ) return 1;
+				L[i][i] = sqrt(sum);
+			} else {
+				L[i][j] = sum / L[j][j];
+			}
+
+		}
+	}
+
+	/* The smallest eigenvalue is at least 1/|L^-1|^2 (Frobenius norm).
+	 * If that isn't enough to be sure that solve_svd() would not filter
+	 * any eigenvalues, give up. */
+	for ( j=0; j<NUM_PARAMS; j++ ) {
+		for ( i=j; i<NUM_PARAMS; i++ ) {
+			double sum = (i == j) ? 1.0 : 0.0;
+			for ( k=j; k<i; k++ ) sum -= L[i][k]*Linv[k][j];
+			Linv[i][j] = sum / L[i][i];
+			norm += Linv[i][j]*Linv[i][j];
+		}
+	}
+	if ( 1.0/norm < lmax/PR_MAX_CONDITION ) return 1;
+
+	/* Solve L.y = Sv, then L^T.(S^-1 x) = y */
+	for ( i=0; i<NUM_PARAMS; i++ ) {
+		double sum = S[i]*v[i];
+		for ( k=0; k<i; k++ ) sum -= L[i][k]*y[k];
+		y[i] = sum / L[i][i];
+	}
+	for ( i=NUM_PARAMS-1; i>=0; i-- ) {
+		double sum = y[i];
+		for ( k=i+1; k<NUM_PARAMS; k++ ) sum -= L[k][i]*x[k];
+		x[i] = sum / L[i][i];
+	}
+	for ( i=0; i<NUM_PARAMS; i++ ) x[i] *= S[i];
+
+	return 0;
+}
+
+
+/* Solve the equations using solve_svd(), which filters the eigenvalues */
+static int solve_with_svd(double M[NUM_PARAMS][NUM_PARAMS],
+                          double v[NUM_PARAMS], double x[NUM_PARAMS],
+                          int *n_filtered, int verbose)
+{
+	gsl_matrix_view Mv;
+	gsl_vector_view vv;
+	gsl_vector *shifts;
+	int i;
+
+	Mv = gsl_matrix_view_array(&M[0][0], NUM_PARAMS, NUM_PARAMS);
+	vv = gsl_vector_view_array(v, NUM_PARAMS);
+
+	shifts = solve_svd(&vv.vector, &Mv.matrix, n_filtered, verbose);
+	if ( shifts == NULL ) return 1;
+
+	for ( i=0; i<NUM_PARAMS; i++ ) {
+		x[i] = gsl_vector_get(shifts, i);
+	}
+	gsl_vector_free(shifts);
+
+	return 0;
+}
+
+
 /* Perform one cycle of post refinement on 'image' against 'full' */
-static double pr_iterate(Crystal *cr, const RefList *full,
+static double pr_iterate(struct crystal_arrays *ca,
+                         const struct merged_arrays *full,
                          PartialityModel pmodel, int *n_filtered)
 {
-	gsl_matrix *M;
-	gsl_vector *v;
-	gsl_vector *shifts;
+	Crystal *cr = ca->crystal;
+	double M[NUM_PARAMS][NUM_PARAMS];
+	double v[NUM_PARAMS];
+	double shifts[NUM_PARAMS];
 	int param;
-	Reflection *refl;
-	RefListIterator *iter;
-	RefList *reflections;
 	double max_shift;
+	double G;
+	double *all_gradients;
 	int nref = 0;
+	int i, k, g;
 	const int verbose = 0;
 
 	*n_filtered = 0;
 
-	reflections = crystal_get_reflections(cr);
+	/* No reflections to refine against */
+	if ( ca->n == 0 ) {
+		crystal_set_user_flag(cr, 2);
+		return 0.0;
+	}
+
+	all_gradients = malloc(NUM_PARAMS*ca->n*sizeof(double));
+	if ( (all_gradients == NULL)
+	  || p_gradients(ca, pmodel, all_gradients) )
+	{
+		ERROR("Failed to calculate gradients.\n");
+		free(all_gradients);
+		crystal_set_user_flag(cr, 3);
+		return 0.0;
+	}
 
-	M = gsl_matrix_calloc(NUM_PARAMS, NUM_PARAMS);
-	v = gsl_vector_calloc(NUM_PARAMS);
+	for ( k=0; k<NUM_PARAMS; k++ ) {
+		for ( g=0; g<NUM_PARAMS; g++ ) M[k][g] = 0.0;
+		v[k] = 0.0;
+	}
+
+	G = crystal_get_osf(cr);
 
 	/* Construct the equations, one per reflection in this image */
-	for ( refl = first_refl(reflections, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		signed int ha, ka, la;
+	for ( i=0; i<ca->n; i++ ) {
+
 		double I_full, delta_I;
-		double w;
+		double w, wI2;
 		double I_partial;
-		int k;
 		double p, l;
-		Reflection *match;
+		int m;
 		double gradients[NUM_PARAMS];
 
 		/* Find the full version */
-		get_indices(refl, &ha, &ka, &la);
-		match = find_refl(full, ha, ka, la);
-		if ( match == NULL ) continue;
+		m = ca->merged[i];
+		if ( full->redundancy[m] == 0 ) continue;
 
-		if ( (get_intensity(refl) < 3.0*get_esd_intensity(refl))
-		  || (get_partiality(refl) < MIN_PART_REFINE)
-		  || (get_redundancy(match) < 2) ) continue;
+		if ( (ca->intensity[i] < 3.0*ca->esd[i])
+		  || (ca->partiality[i] < MIN_PART_REFINE)
+		  || (full->redundancy[m] < 2) ) continue;
 
-		I_full = get_intensity(match);
+		I_full = full->intensity[m];
 
 		/* Actual measurement of this reflection from this pattern? */
-		I_partial = get_intensity(refl) / crystal_get_osf(cr);
-		p = get_partiality(refl);
-		l = get_lorentz(refl);
+		I_partial = ca->intensity[i] / G;
+		p = ca->partiality[i];
+		l = ca->lorentz[i];
 
 		/* Calculate the weight for this reflection */
-		w =  pow(get_esd_intensity(refl), 2.0);
-		w += l * p * I_full * pow(get_esd_intensity(match), 2.0);
-		w = pow(w, -1.0);
+		w =  ca->esd[i]*ca->esd[i];
+		w += l * p * I_full * (full->esd[m]*full->esd[m]);
+		w = 1.0/w;
+		wI2 = w * (I_full*I_full);
 
 		/* Calculate all gradients for this reflection */
 		for ( k=0; k<NUM_PARAMS; k++ ) {
-			gradients[k] = p_gradient(cr, k, refl, pmodel) * l;
+			gradients[k] = all_gradients[k*ca->n + i] * l;
 		}
 
-		for ( k=0; k<NUM_PARAMS; k++ ) {
-
-			int g;
-			double v_c, v_curr;
-
-			for ( g=0; g<NUM_PARAMS; g++ ) {
-
-				double M_c, M_curr;
+		delta_I = I_partial - (l * p * I_full);
 
-				/* Matrix is symmetric */
-				if ( g > k ) continue;
-
-				M_c = gradients[g] * gradients[k];
-				M_c *= w * pow(I_full, 2.0);
-
-				M_curr = gsl_matrix_get(M, k, g);
-				gsl_matrix_set(M, k, g, M_curr + M_c);
-				gsl_matrix_set(M, g, k, M_curr + M_c);
+		for ( k=0; k<NUM_PARAMS; k++ ) {
 
+			/* Matrix is symmetric, so only do the lower triangle */
+			for ( g=0; g<=k; g++ ) {
+				M[k][g] += (gradients[g] * gradients[k]) * wI2;
 			}
 
-			delta_I = I_partial - (l * p * I_full);
-			v_c = w * delta_I * I_full * gradients[k];
-			v_curr = gsl_vector_get(v, k);
-			gsl_vector_set(v, k, v_curr + v_c);
+			v[k] += w * delta_I * I_full * gradients[k];
 
 		}
 
 		nref++;
 	}
+	free(all_gradients);
+
+	for ( k=0; k<NUM_PARAMS; k++ ) {
+		for ( g=k+1; g<NUM_PARAMS; g++ ) M[k][g] = M[g][k];
+	}
+
 	if ( verbose ) {
+		gsl_matrix_view Mv;
+		gsl_vector_view vv;
+		Mv = gsl_matrix_view_array(&M[0][0], NUM_PARAMS, NUM_PARAMS);
+		vv = gsl_vector_view_array(v, NUM_PARAMS);
 		STATUS("The original equation:\n");
-		show_matrix_eqn(M, v);
+		show_matrix_eqn(&Mv.matrix, &vv.vector);
 	}
 
 	//STATUS("%i reflections went into the equations.\n", nref);
 	if ( nref == 0 ) {
 		crystal_set_user_flag(cr, 2);
-		gsl_matrix_free(M);
-		gsl_vector_free(v);
 		return 0.0;
 	}
 
 	max_shift = 0.0;
-	shifts = solve_svd(v, M, n_filtered, verbose);
-	if ( shifts != NULL ) {
+	if ( solve_cholesky(M, v, shifts) == 0
+	  || solve_with_svd(M, v, shifts, n_filtered, verbose) == 0 )
+	{
 
 		for ( param=0; param<NUM_PARAMS; param++ ) {
-			double shift = gsl_vector_get(shifts, param);
+			double shift = shifts[param];
 			apply_shift(cr, param, shift);
 			//STATUS("Shift %i: %e\n", param, shift);
 			if ( fabs(shift) > max_shift ) max_shift = fabs(shift);
@@ -482,50 +700,36 @@ static double pr_iterate(Crystal *cr, const RefList *full,
 		crystal_set_user_flag(cr, 3);
 	}
 
-	gsl_matrix_free(M);
-	gsl_vector_free(v);
-	gsl_vector_free(shifts);
-
 	return max_shift;
 }
 
 
-static double guide_dev(Crystal *cr, const RefList *full)
+static double guide_dev(struct crystal_arrays *ca,
+                        const struct merged_arrays *full)
 {
 	double dev = 0.0;
+	double G = crystal_get_osf(ca->crystal);
+	int i;
 
 	/* For each reflection */
-	Reflection *refl;
-	RefListIterator *iter;
+	for ( i=0; i<ca->n; i++ ) {
 
-	for ( refl = first_refl(crystal_get_reflections(cr), &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) ) {
-
-		double G, p;
-		signed int h, k, l;
-		Reflection *full_version;
+		double p;
 		double I_full, I_partial;
+		int m;
 
-		if ( (get_intensity(refl) < 3.0*get_esd_intensity(refl))
-		  || (get_partiality(refl) < MIN_PART_REFINE) ) continue;
-
-		get_indices(refl, &h, &k, &l);
-		assert((h!=0) || (k!=0) || (l!=0));
+		if ( (ca->intensity[i] < 3.0*ca->esd[i])
+		  || (ca->partiality[i] < MIN_PART_REFINE) ) continue;
 
-		full_version = find_refl(full, h, k, l);
-		if ( full_version == NULL ) continue;
+		m = ca->merged[i];
+		if ( full->redundancy[m] == 0 ) continue;
 		/* Some reflections may have recently become scalable, but
 		 * scale_intensities() might not yet have been called, so the
 		 * full version may not have been calculated yet. */
 
-		G = crystal_get_osf(cr);
-		p = get_partiality(refl);
-		I_partial = get_intensity(refl);
-		I_full = get_intensity(full_version);
-		//STATUS("%3i %3i %3i  %5.2f  %5.2f  %5.2f  %5.2f  %5.2f\n",
-		//       h, k, l, G, p, I_partial, I_full,
-		//       I_partial - p*G*I_full);
+		p = ca->partiality[i];
+		I_partial = ca->intensity[i];
+		I_full = full->intensity[m];
 
 		dev += pow(I_partial - p*G*I_full, 2.0);
 
@@ -535,6 +739,62 @@ static double guide_dev(Crystal *cr, const RefList *full)
 }
 
 
+/* Returns an estimate of the largest change in partiality of any reflection of
+ * the crystal since the partialities were last calculated.  The change in
+ * excitation error of each reflection is bounded using the changes of the
+ * reciprocal axes and of the divergence, and partiality can't change faster
+ * than about one over the larger of the profile radius and the width of the
+ * range of excitation errors. */
+static double max_partiality_change(struct crystal_arrays *ca)
+{
+	Crystal *cr = ca->crystal;
+	struct image *image = crystal_get_image(cr);
+	const double *o = ca->last_cell;
+	double c[9];
+	double R = crystal_get_profile_radius(cr);
+	double da, db, dc, ddiv;
+	double max_change = 0.0;
+	int i;
+
+	cell_get_reciprocal(crystal_get_cell(cr), &c[0], &c[1], &c[2],
+	                    &c[3], &c[4], &c[5], &c[6], &c[7], &c[8]);
+
+	da = modulus(c[0]-o[0], c[1]-o[1], c[2]-o[2]);
+	db = modulus(c[3]-o[3], c[4]-o[4], c[5]-o[5]);
+	dc = modulus(c[6]-o[6], c[7]-o[7], c[8]-o[8]);
+
+	/* Largest movement of the Ewald sphere centres */
+	ddiv = fabs(image->div - ca->last_div)
+	       / (image->lambda - image->lambda*image->bw/2.0);
+
+	for ( i=0; i<ca->n; i++ ) {
+
+		double dr, change;
+
+		dr = abs(ca->hs[i])*da + abs(ca->ks[i])*db + abs(ca->ls[i])*dc
+		     + ddiv;
+		change = dr / fmax(R, ca->rlow[i]-ca->rhigh[i]);
+		if ( change > max_change ) max_change = change;
+	}
+
+	return max_change + fabs(R - ca->last_radius)/R;
+}
+
+
+/* Put back the parameters which the partialities were last calculated with,
+ * so that they match the partialities again */
+static void restore_last_params(struct crystal_arrays *ca)
+{
+	Crystal *cr = ca->crystal;
+	const double *c = ca->last_cell;
+
+	cell_set_reciprocal(crystal_get_cell(cr), c[0], c[1], c[2],
+	                    c[3], c[4], c[5], c[6], c[7], c[8]);
+	crystal_set_profile_radius(cr, ca->last_radius);
+	crystal_get_image(cr)->div = ca->last_div;
+}
+
+
 struct param_backup
 {
 	UnitCell *cell;
@@ -582,9 +842,11 @@ static void free_backup_crystal(struct param_backup b)
 }
 
 
-struct prdata pr_refine(Crystal *cr, const RefList *full,
+struct prdata pr_refine(struct crystal_arrays *ca,
+                        const struct merged_arrays *full,
                         PartialityModel pmodel)
 {
+	Crystal *cr = ca->crystal;
 	double dev;
 	int i;
 	struct param_backup backup;
@@ -594,12 +856,14 @@ struct prdata pr_refine(Crystal *cr, const RefList *full,
 
 	prdata.refined = 0;
 	prdata.n_filtered = 0;
+	prdata.n_updated = 0;
+	prdata.n_skipped = 0;
 
 	/* Don't refine crystal if scaling was bad */
 	if ( crystal_get_user_flag(cr) != 0 ) return prdata;
 
 	if ( verbose ) {
-		dev = guide_dev(cr, full);
+		dev = guide_dev(ca, full);
 		STATUS("\n");  /* Deal with progress bar */
 		STATUS("Before iteration:                       dev = %10.5e\n",
 		       dev);
@@ -622,13 +886,24 @@ struct prdata pr_refine(Crystal *cr, const RefList *full,
 		cell_get_reciprocal(crystal_get_cell(cr), &asx, &asy, &asz,
 			               &bsx, &bsy, &bsz, &csx, &csy, &csz);
 
-		pr_iterate(cr, full, pmodel, &prdata.n_filtered);
+		pr_iterate(ca, full, pmodel, &prdata.n_filtered);
+
+		/* If the partialities would hardly change, the refinement has
+		 * converged.  The last small step is undone instead of
+		 * calculating the partialities again. */
+		if ( max_partiality_change(ca) < PR_SKIP_TOLERANCE ) {
+			restore_last_params(ca);
+			prdata.n_skipped = 1;
+			break;
+		}
 
 		update_partialities_2(cr, pmodel, &n_gained, &n_lost,
 		                      &mean_p_change);
+		crystal_arrays_update_partialities(ca);
+		prdata.n_updated++;
 
 		if ( verbose ) {
-			dev = guide_dev(cr, full);
+			dev = guide_dev(ca, full);
 			STATUS("PR Iteration %2i: mean p change = %10.2f"
 			       " dev = %10.5e, %i gained, %i lost, %i total\n",
 			       i+1, mean_p_change, dev,
@@ -639,6 +914,7 @@ struct prdata pr_refine(Crystal *cr, const RefList *full,
 			revert_crystal(cr, backup);
 			update_partialities_2(cr, pmodel, &n_gained, &n_lost,
 			                      &mean_p_change);
+			crystal_arrays_update_partialities(ca);
 			crystal_set_user_flag(cr, 4);
 			break;
 		}
@@ -41,6 +41,7 @@
 #include "utils.h"
 #include "crystal.h"
 #include "geometry.h"
+#include "refl-arrays.h"
 
 
 /* Refineable parameters.
@@ -65,14 +66,21 @@ struct prdata
 {
 	int refined;
 	int n_filtered;
+	int n_updated;   /* Number of times the partialities were recalculated */
+	int n_skipped;   /* Non-zero if the last recalculation was skipped */
 };
 
 
-extern struct prdata pr_refine(Crystal *cr, const RefList *full,
+extern struct prdata pr_refine(struct crystal_arrays *ca,
+                               const struct merged_arrays *full,
                                PartialityModel pmodel);
 
 /* Exported so it can be poked by tests/pr_p_gradient_check */
 extern double p_gradient(Crystal *cr, int k, Reflection *refl,
                          PartialityModel pmodel);
 
+/* Exported so it can be checked by tests/pr_gradients_check */
+extern int p_gradients(const struct crystal_arrays *ca, PartialityModel pmodel,
+                       double *gradients);
+
 #endif	/* POST_REFINEMENT_H */
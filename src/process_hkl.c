@@ -69,6 +69,7 @@ static void show_help(const char *s)
 "                             Default: processed.hkl).\n"
 "      --stat=<filename>     Specify output filename for merging statistics.\n"
 "  -y, --symmetry=<sym>      Merge according to point group <sym>.\n"
+"  -j <n>                    Use <n> threads for reading the stream.\n"
 "\n"
 "      --start-after=<n>     Skip <n> crystals at the start of the stream.\n"
 "      --stop-after=<n>      Stop after merging <n> crystals.\n"
@@ -234,31 +235,13 @@ static double cc_intensities(RefList *reference, RefList *new,
 }
 
 
-static double *check_hist_size(int n, double *hist_vals)
-{
-	int ns;
-	double *tryMe;
-
-	if ( n % 1000 ) return hist_vals;
-
-	ns = n / 1000;
-	ns = (ns+1)*1000;
-
-	tryMe = realloc(hist_vals, ns*sizeof(double));
-	if ( tryMe == NULL ) {
-		ERROR("Failed to allocate space for histogram.\n");
-	}
-	return tryMe;
-}
-
-
 static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
                          RefList *reference, const SymOpList *sym,
                          double **hist_vals, signed int hist_h,
                          signed int hist_k, signed int hist_l, int *hist_n,
-                         int config_nopolar, double min_snr, double max_adu,
-                         double push_res, double min_cc, int do_scale,
-                         FILE *stat)
+                         int *hist_size, int config_nopolar, double min_snr,
+                         double max_adu, double push_res, double min_cc,
+                         int do_scale, FILE *stat)
 {
 	Reflection *refl;
 	RefListIterator *iter;
@@ -343,13 +326,17 @@ static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
 		if ( *hist_vals != NULL ) {
 
 			if ( (h==hist_h) && (k==hist_k) && (l==hist_l) ) {
-				*hist_vals = check_hist_size(*hist_n,
-							     *hist_vals);
 
-				/* Check again because realloc might have
-				 * failed */
-				if ( *hist_vals != NULL ) {
-					(*hist_vals)[*hist_n] = refl_intensity;
+				double *vals;
+
+				vals = grow_array(*hist_vals, hist_size,
+				                  *hist_n+1, sizeof(double));
+				if ( vals == NULL ) {
+					ERROR("Failed to allocate space for "
+					      "histogram.\n");
+				} else {
+					vals[*hist_n] = refl_intensity;
+					*hist_vals = vals;
 					*hist_n += 1;
 				}
 
@@ -377,82 +364,147 @@ static void display_progress(int n_images, int n_crystals, int n_crystals_used)
 }
 
 
+struct merge_args
+{
+	RefList *model;
+	RefList *reference;
+	const SymOpList *sym;
+	double **hist_vals;
+	signed int hist_h;
+	signed int hist_k;
+	signed int hist_l;
+	int *hist_i;
+	int *hist_size;
+	int config_nopolar;
+	double min_snr;
+	double max_adu;
+	int start_after;
+	int stop_after;
+	double min_res;
+	double push_res;
+	double min_cc;
+	int do_scale;
+	FILE *stat;
+
+	int n_images;
+	int n_crystals;
+	int n_crystals_used;
+	int n_crystals_seen;
+};
+
+
+/* Called for each chunk, in stream order, by read_stream_parallel() */
+static int merge_chunk(struct image *image, void *vp)
+{
+	struct merge_args *margs = vp;
+	int i;
+	int stop = 0;
+
+	margs->n_images++;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+
+		int r;
+		Crystal *cr = image->crystals[i];
+
+		margs->n_crystals_seen++;
+		if ( !stop && (margs->n_crystals_seen > margs->start_after)
+		  && (crystal_get_resolution_limit(cr) >= margs->min_res) )
+		{
+			margs->n_crystals++;
+			r = merge_crystal(margs->model, image, cr,
+			                  margs->reference, margs->sym,
+			                  margs->hist_vals, margs->hist_h,
+			                  margs->hist_k, margs->hist_l,
+			                  margs->hist_i, margs->hist_size,
+			                  margs->config_nopolar,
+			                  margs->min_snr, margs->max_adu,
+			                  margs->push_res, margs->min_cc,
+			                  margs->do_scale, margs->stat);
+			if ( r == 0 ) margs->n_crystals_used++;
+		}
+
+		reflist_free(crystal_get_reflections(cr));
+		cell_free(crystal_get_cell(cr));
+		crystal_free(cr);
+
+		if ( (margs->stop_after > 0)
+		  && (margs->n_crystals_used == margs->stop_after) ) stop = 1;
+
+	}
+
+	free(image->filename);
+	image_feature_list_free(image->features);
+	free(image->crystals);
+	if ( image->event != NULL ) free_event(image->event);
+	if ( image->stuff_from_stream != NULL ) {
+		for ( i=0; i<image->stuff_from_stream->n_fields; i++ ) {
+			free(image->stuff_from_stream->fields[i]);
+		}
+		free(image->stuff_from_stream->fields);
+		free(image->stuff_from_stream);
+	}
+
+	display_progress(margs->n_images, margs->n_crystals_seen,
+	                 margs->n_crystals_used);
+
+	return stop;
+}
+
+
 static int merge_all(Stream *st, RefList *model, RefList *reference,
                      const SymOpList *sym,
                      double **hist_vals, signed int hist_h,
                      signed int hist_k, signed int hist_l,
-                     int *hist_i, int config_nopolar, int min_measurements,
-                     double min_snr, double max_adu,
+                     int *hist_i, int *hist_size, int config_nopolar,
+                     int min_measurements, double min_snr, double max_adu,
                      int start_after, int stop_after, double min_res,
-                     double push_res, double min_cc, int do_scale, char *stat_output)
+                     double push_res, double min_cc, int do_scale,
+                     char *stat_output, int n_threads)
 {
-	int rval;
-	int n_images = 0;
-	int n_crystals = 0;
-	int n_crystals_used = 0;
+	int r;
 	Reflection *refl;
 	RefListIterator *iter;
-	int n_crystals_seen = 0;
-	FILE *stat = NULL;
+	struct merge_args margs;
 
+	margs.stat = NULL;
 	if ( stat_output != NULL ) {
-		stat = fopen(stat_output, "w");
-		if ( stat == NULL ) {
+		margs.stat = fopen(stat_output, "w");
+		if ( margs.stat == NULL ) {
 			ERROR("Failed to open statistics output file %s\n",
 			      stat_output);
 		}
 	}
 
-	do {
-
-		struct image image;
-		int i;
-
-		image.det = NULL;
-
-		/* Get data from next chunk */
-		rval = read_chunk_2(st, &image, STREAM_READ_REFLECTIONS |
-		                    STREAM_READ_UNITCELL);
-		if ( rval ) break;
-
-		n_images++;
-
-		for ( i=0; i<image.n_crystals; i++ ) {
-
-			int r;
-			Crystal *cr = image.crystals[i];
-
-			n_crystals_seen++;
-			if ( (n_crystals_seen > start_after)
-			  && (crystal_get_resolution_limit(cr) >= min_res) )
-			{
-				n_crystals++;
-				r = merge_crystal(model, &image, cr, reference,
-				                  sym, hist_vals,
-						  hist_h, hist_k, hist_l,
-				                  hist_i, config_nopolar,
-						  min_snr, max_adu, push_res,
-						  min_cc, do_scale, stat);
-				if ( r == 0 ) n_crystals_used++;
-			}
-
-			reflist_free(crystal_get_reflections(cr));
-			cell_free(crystal_get_cell(cr));
-			crystal_free(cr);
-
-			if ( n_crystals_used == stop_after ) break;
-
-		}
-
-		free(image.filename);
-		image_feature_list_free(image.features);
-		free(image.crystals);
-
-		display_progress(n_images, n_crystals_seen, n_crystals_used);
-
-		if ( (stop_after>0) && (n_crystals_used == stop_after) ) break;
-
-	} while ( rval == 0 );
+	margs.model = model;
+	margs.reference = reference;
+	margs.sym = sym;
+	margs.hist_vals = hist_vals;
+	margs.hist_h = hist_h;
+	margs.hist_k = hist_k;
+	margs.hist_l = hist_l;
+	margs.hist_i = hist_i;
+	margs.hist_size = hist_size;
+	margs.config_nopolar = config_nopolar;
+	margs.min_snr = min_snr;
+	margs.max_adu = max_adu;
+	margs.start_after = start_after;
+	margs.stop_after = stop_after;
+	margs.min_res = min_res;
+	margs.push_res = push_res;
+	margs.min_cc = min_cc;
+	margs.do_scale = do_scale;
+	margs.n_images = 0;
+	margs.n_crystals = 0;
+	margs.n_crystals_used = 0;
+	margs.n_crystals_seen = 0;
+
+	/* The crystals must be merged in stream order, for --start-after and
+	 * --stop-after and so that the result doesn't depend on the number of
+	 * threads */
+	r = read_stream_parallel(st, n_threads, STREAM_READ_REFLECTIONS
+	                                      | STREAM_READ_UNITCELL,
+	                         1, NULL, merge_chunk, &margs);
 
 	for ( refl = first_refl(model, &iter);
 	      refl != NULL;
@@ -471,11 +523,11 @@ static int merge_all(Stream *st, RefList *model, RefList *reference,
 		set_esd_intensity(refl, sqrt(var)/sqrt(red));
 	}
 
-	if ( stat != NULL ) {
-		fclose(stat);
+	if ( margs.stat != NULL ) {
+		fclose(margs.stat);
 	}
 
-	return 0;
+	return r;
 }
 
 
@@ -510,6 +562,7 @@ int main(int argc, char *argv[])
 	double push_res = +INFINITY;
 	double min_cc = -INFINITY;
 	int twopass = 0;
+	int n_threads = 1;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -537,7 +590,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hi:e:o:y:g:s:f:z:",
+	while ((c = getopt_long(argc, argv, "hi:e:o:y:g:s:f:z:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -578,6 +631,10 @@ int main(int argc, char *argv[])
 			sym_str = strdup(optarg);
 			break;
 
+			case 'j' :
+			n_threads = atoi(optarg);
+			break;
+
 			case 'g' :
 			histo = strdup(optarg);
 			break;
@@ -680,6 +737,11 @@ int main(int argc, char *argv[])
 		output = strdup("processed.hkl");
 	}
 
+	if ( n_threads < 1 ) {
+		ERROR("Invalid number of threads.\n");
+		return 1;
+	}
+
 	if ( sym_str == NULL ) sym_str = strdup("1");
 	sym = get_pointgroup(sym_str);
 	free(sym_str);
@@ -705,8 +767,9 @@ int main(int argc, char *argv[])
 		free(histo);
 
 		/* Allocate enough space that hist_vals isn't NULL.
-		 * check_hist_size will realloc it straight away */
+		 * merge_crystal() will grow it as needed */
 		hist_vals = malloc(1*sizeof(double));
+		space_for_hist = 1;
 		STATUS("Histogramming %i %i %i -> ", hist_h, hist_k, hist_l);
 
 		/* Put into the asymmetric cell for the target group */
@@ -740,9 +803,10 @@ int main(int argc, char *argv[])
 
 	hist_i = 0;
 	r = merge_all(st, model, NULL, sym, &hist_vals, hist_h, hist_k, hist_l,
-	              &hist_i, config_nopolar, min_measurements, min_snr,
-	              max_adu, start_after, stop_after, min_res, push_res,
-	              min_cc, config_scale, stat_output);
+	              &hist_i, &space_for_hist, config_nopolar,
+	              min_measurements, min_snr, max_adu, start_after,
+	              stop_after, min_res, push_res, min_cc, config_scale,
+	              stat_output, n_threads);
 	fprintf(stderr, "\n");
 	if ( r ) {
 		ERROR("Error while reading stream.\n");
@@ -770,15 +834,17 @@ int main(int argc, char *argv[])
 			if ( hist_vals != NULL ) {
 				free(hist_vals);
 				hist_vals = malloc(1*sizeof(double));
+				space_for_hist = 1;
 				hist_i = 0;
 			}
 
 			r = merge_all(st, model, reference, sym, &hist_vals,
 			              hist_h, hist_k, hist_l, &hist_i,
-				      config_nopolar, min_measurements, min_snr,
-				      max_adu, start_after, stop_after, min_res,
+				      &space_for_hist, config_nopolar,
+				      min_measurements, min_snr, max_adu,
+				      start_after, stop_after, min_res,
 				      push_res, min_cc, config_scale,
-				      stat_output);
+				      stat_output, n_threads);
 			fprintf(stderr, "\n");
 			if ( r ) {
 				ERROR("Error while reading stream.\n");
@@ -791,10 +857,6 @@ int main(int argc, char *argv[])
 
 	}
 
-	if ( space_for_hist && (hist_i >= space_for_hist) ) {
-		ERROR("Histogram array was too small!\n");
-	}
-
 	if ( hist_vals != NULL ) {
 		STATUS("%i %i %i was seen %i times.\n", hist_h, hist_k, hist_l,
 		                                        hist_i);
@@ -32,11 +32,13 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <hdf5.h>
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_statistics_double.h>
 #include <gsl/gsl_sort.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "hdf5-file.h"
@@ -164,50 +166,275 @@ static void refine_radius(Crystal *cr, ImageFeatureList *flist)
 }
 
 
-void process_image(const struct index_args *iargs, struct pattern_args *pargs,
-                   Stream *st, int cookie, const char *tmpdir, int results_pipe,
-                   int serial)
+/* The HDF5 library must not be called from more than one thread at once */
+pthread_mutex_t hdf5_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+struct hdfile_cache
+{
+	int max_files;
+	int n_files;
+
+	/* Most recently used first */
+	char **filenames;
+	struct hdfile **files;
+};
+
+
+struct hdfile_cache *hdfile_cache_new(int max_files)
+{
+	struct hdfile_cache *cache;
+
+	cache = malloc(sizeof(struct hdfile_cache));
+	if ( cache == NULL ) return NULL;
+
+	if ( max_files < 0 ) max_files = 0;
+	cache->max_files = max_files;
+	cache->n_files = 0;
+	cache->filenames = malloc((max_files+1)*sizeof(char *));
+	cache->files = malloc((max_files+1)*sizeof(struct hdfile *));
+	if ( (cache->filenames == NULL) || (cache->files == NULL) ) {
+		free(cache->filenames);
+		free(cache->files);
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+
+void hdfile_cache_free(struct hdfile_cache *cache)
 {
+	int i;
+
+	if ( cache == NULL ) return;
+
+	pthread_mutex_lock(&hdf5_lock);
+	for ( i=0; i<cache->n_files; i++ ) {
+		hdfile_close(cache->files[i]);
+		free(cache->filenames[i]);
+	}
+	pthread_mutex_unlock(&hdf5_lock);
+	free(cache->filenames);
+	free(cache->files);
+	free(cache);
+}
+
+
+/* Returns an open hdfile for "filename", re-using one from the cache if
+ * possible.  Give it back with hdfile_cache_release() when finished. */
+static struct hdfile *hdfile_cache_open(struct hdfile_cache *cache,
+                                        const char *filename)
+{
+	struct hdfile *hdfile;
+	int i;
+
+	if ( cache == NULL ) return hdfile_open(filename);
+
+	for ( i=0; i<cache->n_files; i++ ) {
+
+		char *fn;
+
+		if ( strcmp(cache->filenames[i], filename) != 0 ) continue;
+
+		/* Move to the front */
+		hdfile = cache->files[i];
+		fn = cache->filenames[i];
+		memmove(&cache->files[1], &cache->files[0],
+		        i*sizeof(struct hdfile *));
+		memmove(&cache->filenames[1], &cache->filenames[0],
+		        i*sizeof(char *));
+		cache->files[0] = hdfile;
+		cache->filenames[0] = fn;
+		return hdfile;
+
+	}
+
+	hdfile = hdfile_open(filename);
+	if ( (hdfile == NULL) || (cache->max_files == 0) ) return hdfile;
+
+	/* Evict the least recently used file */
+	if ( cache->n_files == cache->max_files ) {
+		cache->n_files--;
+		hdfile_close(cache->files[cache->n_files]);
+		free(cache->filenames[cache->n_files]);
+	}
+
+	memmove(&cache->files[1], &cache->files[0],
+	        cache->n_files*sizeof(struct hdfile *));
+	memmove(&cache->filenames[1], &cache->filenames[0],
+	        cache->n_files*sizeof(char *));
+	cache->files[0] = hdfile;
+	cache->filenames[0] = strdup(filename);
+	cache->n_files++;
+
+	return hdfile;
+}
+
+
+static void hdfile_cache_release(struct hdfile_cache *cache,
+                                 struct hdfile *hdfile)
+{
+	int i;
+
+	if ( cache != NULL ) {
+		for ( i=0; i<cache->n_files; i++ ) {
+			if ( cache->files[i] == hdfile ) return;
+		}
+	}
+
+	hdfile_close(hdfile);
+}
+
+
+struct image_arena
+{
+	struct detector *det;
+
+	/* From hdf5_alloc_image_buffers() */
+	int width;
+	int height;
+	float *data;
+	uint16_t *flags;
+	float **dp;
+	int **bad;
+
 	float *data_for_measurement;
+};
+
+
+struct image_arena *image_arena_new(const struct detector *det)
+{
+	struct image_arena *arena;
+	struct image image;
+	size_t data_size;
+
+	arena = malloc(sizeof(struct image_arena));
+	if ( arena == NULL ) return NULL;
+
+	arena->det = copy_geom(det);
+	if ( arena->det == NULL ) {
+		free(arena);
+		return NULL;
+	}
+
+	image.det = arena->det;
+	if ( hdf5_alloc_image_buffers(&image) ) {
+		free_detector_geometry(arena->det);
+		free(arena);
+		return NULL;
+	}
+	arena->width = image.width;
+	arena->height = image.height;
+	arena->data = image.data;
+	arena->flags = image.flags;
+	arena->dp = image.dp;
+	arena->bad = image.bad;
+
+	data_size = image.width * image.height * sizeof(float);
+	arena->data_for_measurement = malloc(data_size);
+	if ( arena->data_for_measurement == NULL ) {
+		hdf5_free_image_buffers(&image);
+		free_detector_geometry(arena->det);
+		free(arena);
+		return NULL;
+	}
+
+	return arena;
+}
+
+
+void image_arena_free(struct image_arena *arena)
+{
+	struct image image;
+
+	if ( arena == NULL ) return;
+
+	image.det = arena->det;
+	image.data = arena->data;
+	image.flags = arena->flags;
+	image.dp = arena->dp;
+	image.bad = arena->bad;
+	hdf5_free_image_buffers(&image);
+
+	free(arena->data_for_measurement);
+	free_detector_geometry(arena->det);
+	free(arena);
+}
+
+
+/* Gets the arena ready for the next frame, as if everything had just been
+ * freshly allocated */
+static void image_arena_reset(struct image_arena *arena,
+                              const struct detector *det, struct image *image)
+{
+	int i;
+
+	/* fill_in_values() is the only thing which changes the geometry */
+	for ( i=0; i<det->n_panels; i++ ) {
+		arena->det->panels[i].clen = det->panels[i].clen;
+	}
+
+	image->det = arena->det;
+	image->data = arena->data;
+	image->flags = arena->flags;
+	image->dp = arena->dp;
+	image->bad = arena->bad;
+	image->width = arena->width;
+	image->height = arena->height;
+}
+
+
+void process_image(const struct index_args *iargs, struct pattern_args *pargs,
+                   Stream *st, struct hdfile_cache *cache,
+                   struct image_arena *arena, int cookie,
+                   const char *tmpdir, int results_pipe, int serial)
+{
 	size_t data_size;
 	int check;
 	struct hdfile *hdfile;
 	struct image image;
 	int i;
-	int r;
 	int ret;
-	char *rn;
+
+	image_arena_reset(arena, iargs->det, &image);
 
 	image.features = NULL;
-	image.data = NULL;
-	image.flags = NULL;
 	image.copyme = iargs->copyme;
+	image.stuff_from_stream = NULL;
 	image.id = cookie;
+	image.tmpdir = tmpdir;
 	image.filename = pargs->filename_p_e->filename;
 	image.event = pargs->filename_p_e->ev;
 	image.beam = iargs->beam;
-	image.det = copy_geom(iargs->det);
 	image.crystals = NULL;
 	image.n_crystals = 0;
 	image.serial = serial;
 	image.indexed_by = INDEXING_NONE;
 
-	hdfile = hdfile_open(image.filename);
+	pthread_mutex_lock(&hdf5_lock);
+
+	hdfile = hdfile_cache_open(cache, image.filename);
 	if ( hdfile == NULL ) {
 		ERROR("Couldn't open file: %s\n", image.filename);
+		pthread_mutex_unlock(&hdf5_lock);
 		return;
 	}
 
-	check = hdf5_read2(hdfile, &image, image.event, 0);
+	check = hdf5_read_into_buffers(hdfile, &image, image.event, 0);
 	if ( check ) {
+		hdfile_cache_release(cache, hdfile);
+		pthread_mutex_unlock(&hdf5_lock);
 		return;
 	}
 
+	pthread_mutex_unlock(&hdf5_lock);
+
 	/* Take snapshot of image after CM subtraction but before applying
 	 * horrible noise filters to it */
 	data_size = image.width * image.height * sizeof(float);
-	data_for_measurement = malloc(data_size);
-	memcpy(data_for_measurement, image.data, data_size);
+	memcpy(arena->data_for_measurement, image.data, data_size);
 
 	if ( iargs->median_filter > 0 ) {
 		filter_median(&image, iargs->median_filter);
@@ -222,9 +449,11 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	switch ( iargs->peaks ) {
 
 		case PEAK_HDF5:
+		pthread_mutex_lock(&hdf5_lock);
 		if ( get_peaks(&image, hdfile, iargs->hdf5_peak_path) ) {
 			ERROR("Failed to get peaks from HDF5 file.\n");
 		}
+		pthread_mutex_unlock(&hdf5_lock);
 		if ( !iargs->no_revalidate ) {
 			validate_peaks(&image, iargs->min_snr,
 				       iargs->pk_inn, iargs->pk_mid,
@@ -234,10 +463,12 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		break;
 
 		case PEAK_CXI:
+		pthread_mutex_lock(&hdf5_lock);
 		if ( get_peaks_cxi(&image, hdfile, iargs->hdf5_peak_path,
 		                   pargs->filename_p_e) ) {
 			ERROR("Failed to get peaks from CXI file.\n");
 		}
+		pthread_mutex_unlock(&hdf5_lock);
 		if ( !iargs->no_revalidate ) {
 			validate_peaks(&image, iargs->min_snr,
 				       iargs->pk_inn, iargs->pk_mid,
@@ -257,30 +488,11 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 
 	/* Get rid of noise-filtered version at this point
 	 * - it was strictly for the purposes of peak detection. */
-	free(image.data);
-	image.data = data_for_measurement;
-
-	rn = getcwd(NULL, 0);
-
-	r = chdir(tmpdir);
-	if ( r ) {
-		ERROR("Failed to chdir to temporary folder: %s\n",
-		      strerror(errno));
-		hdfile_close(hdfile);
-		return;
-	}
+	image.data = arena->data_for_measurement;
 
 	/* Index the pattern */
 	index_pattern(&image, iargs->indm, iargs->ipriv);
 
-	r = chdir(rn);
-	if ( r ) {
-		ERROR("Failed to chdir: %s\n", strerror(errno));
-		hdfile_close(hdfile);
-		return;
-	}
-	free(rn);
-
 	pargs->n_crystals = image.n_crystals;
 	for ( i=0; i<image.n_crystals; i++ ) {
 		crystal_set_image(image.crystals[i], &image);
@@ -314,10 +526,10 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	 * overlaps can be detected. */
 	if ( iargs->fix_profile_r < 0.0 ) {
 
-		integrate_all_4(&image, iargs->int_meth, PMODEL_SCSPHERE,
-		                iargs->push_res,
-		                iargs->ir_inn, iargs->ir_mid, iargs->ir_out,
-		                INTDIAG_NONE, 0, 0, 0, results_pipe);
+		/* Only the reflections at the peaks are needed to refine the
+		 * radius, so there's no need to integrate anything yet */
+		predict_near_peaks(&image, iargs->int_meth, PMODEL_SCSPHERE,
+		                   iargs->push_res);
 
 		for ( i=0; i<image.n_crystals; i++ ) {
 			refine_radius(image.crystals[i], image.features);
@@ -341,9 +553,11 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 
 	}
 
+	pthread_mutex_lock(&hdf5_lock);
 	ret = write_chunk(st, &image, hdfile,
 	                  iargs->stream_peaks, iargs->stream_refls,
 	                  pargs->filename_p_e->ev);
+	pthread_mutex_unlock(&hdf5_lock);
 	if ( ret != 0 ) {
 		ERROR("Error writing stream file.\n");
 	}
@@ -365,16 +579,9 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	}
 	free(image.crystals);
 
-	for ( i=0; i<image.det->n_panels; i++ ) {
-		free(image.dp[i]);
-		free(image.bad[i]);
-	}
-	free(image.dp);
-	free(image.bad);
-
-	free(image.data);
-	if ( image.flags != NULL ) free(image.flags);
+	/* The image buffers and geometry belong to the arena */
 	image_feature_list_free(image.features);
-	free_detector_geometry(image.det);
-	hdfile_close(hdfile);
+	pthread_mutex_lock(&hdf5_lock);
+	hdfile_cache_release(cache, hdfile);
+	pthread_mutex_unlock(&hdf5_lock);
 }
@@ -35,6 +35,8 @@
 #endif
 
 
+#include <pthread.h>
+
 #include "integration.h"
 
 
@@ -86,6 +88,7 @@ struct index_args
 	float fix_profile_r;
 	float fix_bandwidth;
 	float fix_divergence;
+	int hdf5_cache_size;
 };
 
 
@@ -100,10 +103,26 @@ struct pattern_args
 };
 
 
+/* Open HDF5 files, kept between patterns */
+struct hdfile_cache;
+
+/* Geometry and image buffers, re-used for each pattern */
+struct image_arena;
+
+/* Held around all calls to the HDF5 library when running with threads */
+extern pthread_mutex_t hdf5_lock;
+
+extern struct hdfile_cache *hdfile_cache_new(int max_files);
+extern void hdfile_cache_free(struct hdfile_cache *cache);
+
+extern struct image_arena *image_arena_new(const struct detector *det);
+extern void image_arena_free(struct image_arena *arena);
+
 extern void process_image(const struct index_args *iargs,
                           struct pattern_args *pargs, Stream *st,
-                          int cookie, const char *tmpdir, int results_pipe,
-                          int serial);
+                          struct hdfile_cache *cache,
+                          struct image_arena *arena, int cookie,
+                          const char *tmpdir, int results_pipe, int serial);
 
 
 #endif	/* PROCESS_IMAGEs_H */
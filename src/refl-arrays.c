@@ -0,0 +1,331 @@
+/*
+ * refl-arrays.c
+ *
+ * Flat arrays of reflection data for scaling and post-refinement
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "crystal.h"
+#include "reflist.h"
+#include "cell.h"
+#include "image.h"
+#include "utils.h"
+#include "refl-arrays.h"
+
+
+/* Scaling and post-refinement both skip reflections weaker than this many
+ * sigmas, so there's no need to copy them.  The intensities and their
+ * uncertainties don't change after loading, so this doesn't go out of date. */
+static int usable(Reflection *refl)
+{
+	return !(get_intensity(refl) < 3.0*get_esd_intensity(refl));
+}
+
+
+static int alloc_arrays(struct refl_arrays *ra, int n)
+{
+	ra->n = n;
+	ra->h = malloc(n*sizeof(signed int));
+	ra->k = malloc(n*sizeof(signed int));
+	ra->l = malloc(n*sizeof(signed int));
+	ra->hs = malloc(n*sizeof(signed int));
+	ra->ks = malloc(n*sizeof(signed int));
+	ra->ls = malloc(n*sizeof(signed int));
+	ra->intensity = malloc(n*sizeof(double));
+	ra->esd = malloc(n*sizeof(double));
+	ra->partiality = malloc(n*sizeof(double));
+	ra->lorentz = malloc(n*sizeof(double));
+	ra->rlow = malloc(n*sizeof(double));
+	ra->rhigh = malloc(n*sizeof(double));
+	ra->merged_pos = malloc(n*sizeof(int));
+	ra->refls = malloc(n*sizeof(Reflection *));
+
+	if ( (ra->h == NULL) || (ra->k == NULL) || (ra->l == NULL)
+	  || (ra->hs == NULL) || (ra->ks == NULL) || (ra->ls == NULL)
+	  || (ra->intensity == NULL) || (ra->esd == NULL)
+	  || (ra->partiality == NULL) || (ra->lorentz == NULL)
+	  || (ra->rlow == NULL) || (ra->rhigh == NULL)
+	  || (ra->merged_pos == NULL) || (ra->refls == NULL) ) return 1;
+
+	return 0;
+}
+
+
+static int alloc_merged(struct merged_arrays *ma, int n)
+{
+	ma->n = n;
+	ma->h = malloc(n*sizeof(signed int));
+	ma->k = malloc(n*sizeof(signed int));
+	ma->l = malloc(n*sizeof(signed int));
+	ma->intensity = malloc(n*sizeof(double));
+	ma->esd = malloc(n*sizeof(double));
+	ma->redundancy = calloc(n, sizeof(int));
+
+	if ( (ma->h == NULL) || (ma->k == NULL) || (ma->l == NULL)
+	  || (ma->intensity == NULL) || (ma->esd == NULL)
+	  || (ma->redundancy == NULL) ) return 1;
+
+	return 0;
+}
+
+
+/* Point the crystal_arrays at their parts of the storage */
+static void set_crystal_pointers(struct refl_arrays *ra, int *counts)
+{
+	int i;
+	int pos = 0;
+
+	for ( i=0; i<ra->n_crystals; i++ ) {
+
+		struct crystal_arrays *ca = &ra->crystals[i];
+
+		ca->n = counts[i];
+		ca->h = &ra->h[pos];
+		ca->k = &ra->k[pos];
+		ca->l = &ra->l[pos];
+		ca->hs = &ra->hs[pos];
+		ca->ks = &ra->ks[pos];
+		ca->ls = &ra->ls[pos];
+		ca->intensity = &ra->intensity[pos];
+		ca->esd = &ra->esd[pos];
+		ca->partiality = &ra->partiality[pos];
+		ca->lorentz = &ra->lorentz[pos];
+		ca->rlow = &ra->rlow[pos];
+		ca->rhigh = &ra->rhigh[pos];
+		ca->merged = &ra->merged_pos[pos];
+		ca->refls = &ra->refls[pos];
+		pos += counts[i];
+
+	}
+}
+
+
+/* Copy the values from the reflections of each crystal, and work out where
+ * each one lives in the merged arrays.  "index" is used to number the unique
+ * indices, with the number stored in temp1. */
+static int fill_arrays(struct refl_arrays *ra, RefList *index)
+{
+	int i;
+	int n_unique = 0;
+
+	for ( i=0; i<ra->n_crystals; i++ ) {
+
+		struct crystal_arrays *ca = &ra->crystals[i];
+		Reflection *refl;
+		RefListIterator *iter;
+		int j = 0;
+
+		for ( refl = first_refl(crystal_get_reflections(ca->crystal),
+		                        &iter);
+		      refl != NULL;
+		      refl = next_refl(refl, iter) )
+		{
+			signed int h, k, l;
+			Reflection *u;
+
+			if ( !usable(refl) ) continue;
+
+			get_indices(refl, &h, &k, &l);
+			ca->h[j] = h;
+			ca->k[j] = k;
+			ca->l[j] = l;
+			get_symmetric_indices(refl, &ca->hs[j], &ca->ks[j],
+			                      &ca->ls[j]);
+			ca->intensity[j] = get_intensity(refl);
+			ca->esd[j] = get_esd_intensity(refl);
+			ca->refls[j] = refl;
+
+			u = find_refl(index, h, k, l);
+			if ( u == NULL ) {
+				u = add_refl(index, h, k, l);
+				set_temp1(u, n_unique++);
+			}
+			ca->merged[j] = get_temp1(u);
+
+			j++;
+		}
+		assert(j == ca->n);
+
+		crystal_arrays_update_partialities(ca);
+
+	}
+
+	return n_unique;
+}
+
+
+struct refl_arrays *refl_arrays_new(Crystal **crystals, int n)
+{
+	struct refl_arrays *ra;
+	RefList *index = NULL;
+	Reflection *refl;
+	RefListIterator *iter;
+	int *counts;
+	int n_total = 0;
+	int n_unique;
+	int i;
+
+	/* All the array pointers start off as NULL, so that refl_arrays_free()
+	 * can clean up after a failure at any point */
+	ra = calloc(1, sizeof(struct refl_arrays));
+	if ( ra == NULL ) return NULL;
+
+	ra->n_crystals = n;
+	ra->crystals = malloc(n*sizeof(struct crystal_arrays));
+	counts = malloc(n*sizeof(int));
+	if ( (ra->crystals == NULL) || (counts == NULL) ) goto fail;
+
+	for ( i=0; i<n; i++ ) {
+		ra->crystals[i].crystal = crystals[i];
+		counts[i] = 0;
+		for ( refl = first_refl(crystal_get_reflections(crystals[i]),
+		                        &iter);
+		      refl != NULL;
+		      refl = next_refl(refl, iter) )
+		{
+			if ( usable(refl) ) counts[i]++;
+		}
+		n_total += counts[i];
+	}
+
+	if ( alloc_arrays(ra, n_total) ) goto fail;
+	set_crystal_pointers(ra, counts);
+	free(counts);
+	counts = NULL;
+
+	index = reflist_new_2(REFLIST_HASH);
+	if ( index == NULL ) goto fail;
+	n_unique = fill_arrays(ra, index);
+
+	if ( alloc_merged(&ra->merged, n_unique) ) goto fail;
+
+	/* The hash table is iterated in order of insertion, which is the
+	 * order of the numbers */
+	i = 0;
+	for ( refl = first_refl(index, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		get_indices(refl, &ra->merged.h[i], &ra->merged.k[i],
+		            &ra->merged.l[i]);
+		i++;
+	}
+	reflist_free(index);
+
+	return ra;
+
+fail:
+	ERROR("Failed to allocate reflection arrays.\n");
+	free(counts);
+	if ( index != NULL ) reflist_free(index);
+	refl_arrays_free(ra);
+	return NULL;
+}
+
+
+void refl_arrays_free(struct refl_arrays *ra)
+{
+	if ( ra == NULL ) return;
+
+	free(ra->h);
+	free(ra->k);
+	free(ra->l);
+	free(ra->hs);
+	free(ra->ks);
+	free(ra->ls);
+	free(ra->intensity);
+	free(ra->esd);
+	free(ra->partiality);
+	free(ra->lorentz);
+	free(ra->rlow);
+	free(ra->rhigh);
+	free(ra->merged_pos);
+	free(ra->refls);
+
+	free(ra->merged.h);
+	free(ra->merged.k);
+	free(ra->merged.l);
+	free(ra->merged.intensity);
+	free(ra->merged.esd);
+	free(ra->merged.redundancy);
+
+	free(ra->crystals);
+	free(ra);
+}
+
+
+/* Take the merged values from "full", which has usually just been created by
+ * merging the crystals */
+void refl_arrays_set_merged(struct refl_arrays *ra, RefList *full)
+{
+	struct merged_arrays *ma = &ra->merged;
+	int i;
+
+	for ( i=0; i<ma->n; i++ ) {
+
+		Reflection *f;
+
+		f = find_refl(full, ma->h[i], ma->k[i], ma->l[i]);
+		if ( f == NULL ) {
+			ma->intensity[i] = 0.0;
+			ma->esd[i] = 0.0;
+			ma->redundancy[i] = 0;
+		} else {
+			ma->intensity[i] = get_intensity(f);
+			ma->esd[i] = get_esd_intensity(f);
+			ma->redundancy[i] = get_redundancy(f);
+		}
+
+	}
+}
+
+
+/* Copy the partialities and related values again, which must be done after
+ * calling update_partialities() for the crystal.  Also remembers the
+ * parameters which they were calculated with. */
+void crystal_arrays_update_partialities(struct crystal_arrays *ca)
+{
+	double *c = ca->last_cell;
+	int i;
+
+	cell_get_reciprocal(crystal_get_cell(ca->crystal), &c[0], &c[1], &c[2],
+	                    &c[3], &c[4], &c[5], &c[6], &c[7], &c[8]);
+	ca->last_radius = crystal_get_profile_radius(ca->crystal);
+	ca->last_div = crystal_get_image(ca->crystal)->div;
+
+	for ( i=0; i<ca->n; i++ ) {
+		double p;
+		get_partial(ca->refls[i], &ca->rlow[i], &ca->rhigh[i], &p);
+		ca->partiality[i] = get_partiality(ca->refls[i]);
+		ca->lorentz[i] = get_lorentz(ca->refls[i]);
+	}
+}
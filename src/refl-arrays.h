@@ -0,0 +1,114 @@
+/*
+ * refl-arrays.h
+ *
+ * Flat arrays of reflection data for scaling and post-refinement
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REFL_ARRAYS_H
+#define REFL_ARRAYS_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include "crystal.h"
+#include "reflist.h"
+
+
+/* Merged values for every reflection which appears in any crystal_arrays */
+struct merged_arrays
+{
+	int n;
+	signed int *h;
+	signed int *k;
+	signed int *l;
+	double *intensity;
+	double *esd;
+	int *redundancy;      /* Zero if not present in the merged list */
+};
+
+
+/* The reflections of one crystal which can be used for scaling or refinement.
+ * These point into the arrays of a struct refl_arrays. */
+struct crystal_arrays
+{
+	Crystal *crystal;
+	int n;
+	signed int *h;        /* Asymmetric indices */
+	signed int *k;
+	signed int *l;
+	signed int *hs;       /* Symmetric indices */
+	signed int *ks;
+	signed int *ls;
+	double *intensity;
+	double *esd;
+	double *partiality;
+	double *lorentz;
+	double *rlow;
+	double *rhigh;
+	int *merged;          /* Position in merged_arrays */
+	Reflection **refls;   /* The reflections which the values came from */
+
+	/* Parameters when the partialities were last calculated */
+	double last_cell[9];
+	double last_radius;
+	double last_div;
+};
+
+
+struct refl_arrays
+{
+	int n_crystals;
+	struct crystal_arrays *crystals;
+	struct merged_arrays merged;
+
+	/* Storage for all the crystals, one after the other */
+	int n;
+	signed int *h;
+	signed int *k;
+	signed int *l;
+	signed int *hs;
+	signed int *ks;
+	signed int *ls;
+	double *intensity;
+	double *esd;
+	double *partiality;
+	double *lorentz;
+	double *rlow;
+	double *rhigh;
+	int *merged_pos;
+	Reflection **refls;
+};
+
+
+extern struct refl_arrays *refl_arrays_new(Crystal **crystals, int n);
+extern void refl_arrays_free(struct refl_arrays *ra);
+
+extern void refl_arrays_set_merged(struct refl_arrays *ra, RefList *full);
+extern void crystal_arrays_update_partialities(struct crystal_arrays *ca);
+
+#endif	/* REFL_ARRAYS_H */
@@ -0,0 +1,455 @@
+/*
+ * refl-cache.c
+ *
+ * On-disk cache of reflection data, for datasets too large for memory
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "crystal.h"
+#include "reflist.h"
+#include "utils.h"
+#include "refl-cache.h"
+
+
+/* Approximate memory needed for each reflection of a block while it's loaded:
+ * the Reflection itself, plus its share of the refl_arrays and of the buffer
+ * used to read and write the cache. */
+#define REFL_MEMORY (320)
+
+
+/* Where each crystal's reflections are in the cache file */
+struct cached_crystal
+{
+	off_t offset;
+	int n;
+};
+
+
+/* The reflections of each crystal are stored as one segment of the file, with
+ * each quantity in its own column:
+ *
+ *   double intensity[n], esd[n], partiality[n], lorentz[n], rlow[n], rhigh[n]
+ *   int16_t h[n], k[n], l[n], hs[n], ks[n], ls[n], redundancy[n]
+ *
+ * padded to a multiple of eight bytes.  The crystals are stored in order, and
+ * divided into blocks of consecutive crystals which fit into the memory
+ * limit.  The number of reflections in each crystal never changes, so the
+ * segments can be written back in place. */
+struct refl_cache
+{
+	int fd;
+	off_t size;
+	int max_refls;        /* Maximum number of reflections per block */
+
+	struct cached_crystal *crystals;
+	int n_crystals;
+	int max_crystals;
+
+	int *block_start;     /* Number of the first crystal in each block */
+	int n_blocks;
+	int max_blocks;
+	int block_refls;      /* Number of reflections in the last block */
+
+	unsigned char *buf;
+	size_t buf_size;
+};
+
+
+size_t refl_cache_segment_size(int n)
+{
+	size_t ints = 7*n*sizeof(int16_t);
+	return 6*n*sizeof(double) + ((ints+7) & ~(size_t)7);
+}
+
+
+static int write_all(int fd, const unsigned char *buf, size_t len, off_t pos)
+{
+	while ( len > 0 ) {
+		ssize_t r = pwrite(fd, buf, len, pos);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		buf += r;
+		len -= r;
+		pos += r;
+	}
+	return 0;
+}
+
+
+static int read_all(int fd, unsigned char *buf, size_t len, off_t pos)
+{
+	while ( len > 0 ) {
+		ssize_t r = pread(fd, buf, len, pos);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		if ( r == 0 ) return 1;
+		buf += r;
+		len -= r;
+		pos += r;
+	}
+	return 0;
+}
+
+
+static int reserve_buffer(struct refl_cache *c, size_t size)
+{
+	unsigned char *buf_new;
+
+	if ( size <= c->buf_size ) return 0;
+
+	buf_new = realloc(c->buf, size);
+	if ( buf_new == NULL ) return 1;
+	c->buf = buf_new;
+	c->buf_size = size;
+	return 0;
+}
+
+
+/* Pack the reflections of "list", of which there are "n", into "seg", which
+ * must be refl_cache_segment_size(n) bytes long */
+void refl_cache_encode(unsigned char *seg, RefList *list, int n)
+{
+	double *intensity = (double *)seg;
+	double *esd = intensity + n;
+	double *partiality = esd + n;
+	double *lorentz = partiality + n;
+	double *rlow = lorentz + n;
+	double *rhigh = rlow + n;
+	int16_t *h = (int16_t *)(rhigh + n);
+	int16_t *k = h + n;
+	int16_t *l = k + n;
+	int16_t *hs = l + n;
+	int16_t *ks = hs + n;
+	int16_t *ls = ks + n;
+	int16_t *red = ls + n;
+	Reflection *refl;
+	RefListIterator *iter;
+	int i = 0;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int a, b, d;
+		double p;
+
+		get_indices(refl, &a, &b, &d);
+		h[i] = a;  k[i] = b;  l[i] = d;
+		get_symmetric_indices(refl, &a, &b, &d);
+		hs[i] = a;  ks[i] = b;  ls[i] = d;
+		red[i] = get_redundancy(refl);
+		intensity[i] = get_intensity(refl);
+		esd[i] = get_esd_intensity(refl);
+		get_partial(refl, &rlow[i], &rhigh[i], &p);
+		partiality[i] = get_partiality(refl);
+		lorentz[i] = get_lorentz(refl);
+		i++;
+	}
+}
+
+
+/* Unpack the "n" reflections in "seg" into a new list */
+RefList *refl_cache_decode(const unsigned char *seg, int n)
+{
+	const double *intensity = (const double *)seg;
+	const double *esd = intensity + n;
+	const double *partiality = esd + n;
+	const double *lorentz = partiality + n;
+	const double *rlow = lorentz + n;
+	const double *rhigh = rlow + n;
+	const int16_t *h = (const int16_t *)(rhigh + n);
+	const int16_t *k = h + n;
+	const int16_t *l = k + n;
+	const int16_t *hs = l + n;
+	const int16_t *ks = hs + n;
+	const int16_t *ls = ks + n;
+	const int16_t *red = ls + n;
+	RefList *list;
+	int i;
+
+	list = reflist_new();
+	if ( list == NULL ) return NULL;
+	reflist_reserve(list, n);
+
+	for ( i=0; i<n; i++ ) {
+		Reflection *refl = add_refl(list, h[i], k[i], l[i]);
+		if ( refl == NULL ) {
+			reflist_free(list);
+			return NULL;
+		}
+		set_symmetric_indices(refl, hs[i], ks[i], ls[i]);
+		set_redundancy(refl, red[i]);
+		set_intensity(refl, intensity[i]);
+		set_esd_intensity(refl, esd[i]);
+		set_partial(refl, rlow[i], rhigh[i], partiality[i]);
+		set_lorentz(refl, lorentz[i]);
+	}
+
+	return list;
+}
+
+
+/* "max_memory" is the approximate limit, in bytes, for the reflection data
+ * which is loaded at any one time */
+struct refl_cache *refl_cache_new(const char *dir, size_t max_memory)
+{
+	struct refl_cache *c;
+	char *filename;
+
+	c = malloc(sizeof(struct refl_cache));
+	if ( c == NULL ) return NULL;
+
+	filename = malloc(strlen(dir)+64);
+	if ( filename == NULL ) {
+		free(c);
+		return NULL;
+	}
+	sprintf(filename, "%s/partialator-cache-XXXXXX", dir);
+	c->fd = mkstemp(filename);
+	if ( c->fd == -1 ) {
+		ERROR("Failed to create reflection cache '%s': %s\n",
+		      filename, strerror(errno));
+		free(filename);
+		free(c);
+		return NULL;
+	}
+
+	/* The file will go away by itself when it's closed */
+	unlink(filename);
+	free(filename);
+
+	c->size = 0;
+	if ( max_memory/REFL_MEMORY > INT_MAX ) {
+		c->max_refls = INT_MAX;
+	} else {
+		c->max_refls = max_memory/REFL_MEMORY;
+	}
+	c->crystals = NULL;
+	c->n_crystals = 0;
+	c->max_crystals = 0;
+	c->block_start = NULL;
+	c->n_blocks = 0;
+	c->max_blocks = 0;
+	c->block_refls = 0;
+	c->buf = NULL;
+	c->buf_size = 0;
+
+	return c;
+}
+
+
+void refl_cache_free(struct refl_cache *c)
+{
+	if ( c == NULL ) return;
+	close(c->fd);
+	free(c->crystals);
+	free(c->block_start);
+	free(c->buf);
+	free(c);
+}
+
+
+/* Move the reflections of "cr" into the cache, and free them.  The crystals
+ * must be stored in the same order as in the array which will later be given
+ * to refl_cache_load_block().  The crystal's partialities must be up to
+ * date. */
+int refl_cache_store(struct refl_cache *c, Crystal *cr)
+{
+	RefList *list = crystal_get_reflections(cr);
+	struct cached_crystal *cc;
+	size_t size;
+	int n;
+
+	n = num_reflections(list);
+	size = refl_cache_segment_size(n);
+
+	if ( reserve_buffer(c, size) ) {
+		ERROR("Failed to allocate reflection cache buffer.\n");
+		return 1;
+	}
+	refl_cache_encode(c->buf, list, n);
+	if ( write_all(c->fd, c->buf, size, c->size) ) {
+		ERROR("Failed to write reflection cache: %s\n",
+		      strerror(errno));
+		return 1;
+	}
+
+	c->crystals = grow_array(c->crystals, &c->max_crystals,
+	                         c->n_crystals+1, sizeof(struct cached_crystal));
+	if ( c->crystals == NULL ) {
+		ERROR("Failed to allocate reflection cache index.\n");
+		return 1;
+	}
+
+	/* Start a new block if this crystal won't fit in the current one */
+	if ( (c->n_blocks == 0) || (c->block_refls + n > c->max_refls) ) {
+		c->block_start = grow_array(c->block_start, &c->max_blocks,
+		                            c->n_blocks+1, sizeof(int));
+		if ( c->block_start == NULL ) {
+			ERROR("Failed to allocate reflection cache index.\n");
+			return 1;
+		}
+		c->block_start[c->n_blocks++] = c->n_crystals;
+		c->block_refls = 0;
+	}
+	c->block_refls += n;
+
+	cc = &c->crystals[c->n_crystals++];
+	cc->offset = c->size;
+	cc->n = n;
+	c->size += size;
+
+	reflist_free(list);
+	crystal_set_reflections(cr, NULL);
+
+	return 0;
+}
+
+
+int refl_cache_num_blocks(struct refl_cache *c)
+{
+	return c->n_blocks;
+}
+
+
+static void block_range(struct refl_cache *c, int block, int *first, int *n,
+                        off_t *start, size_t *len)
+{
+	struct cached_crystal *last;
+	int end;
+
+	*first = c->block_start[block];
+	if ( block+1 < c->n_blocks ) {
+		end = c->block_start[block+1];
+	} else {
+		end = c->n_crystals;
+	}
+	*n = end - *first;
+
+	last = &c->crystals[end-1];
+	*start = c->crystals[*first].offset;
+	*len = last->offset + refl_cache_segment_size(last->n) - *start;
+}
+
+
+/* Read back the reflections for the crystals in "block", and give them to the
+ * crystals.  The crystals are numbers *first to *first+*n-1 in "crystals". */
+int refl_cache_load_block(struct refl_cache *c, Crystal **crystals, int block,
+                          int *first, int *n)
+{
+	off_t start;
+	size_t len;
+	int i;
+
+	block_range(c, block, first, n, &start, &len);
+
+	if ( reserve_buffer(c, len) ) {
+		ERROR("Failed to allocate reflection cache buffer.\n");
+		return 1;
+	}
+	if ( read_all(c->fd, c->buf, len, start) ) {
+		ERROR("Failed to read reflection cache: %s\n",
+		      strerror(errno));
+		return 1;
+	}
+
+	for ( i=*first; i<*first+*n; i++ ) {
+
+		struct cached_crystal *cc = &c->crystals[i];
+		RefList *list;
+
+		list = refl_cache_decode(c->buf + (cc->offset-start), cc->n);
+		if ( list == NULL ) {
+			ERROR("Failed to allocate reflections.\n");
+			/* Don't leave the block half loaded */
+			while ( i-- > *first ) {
+				reflist_free(crystal_get_reflections(crystals[i]));
+				crystal_set_reflections(crystals[i], NULL);
+			}
+			return 1;
+		}
+		crystal_set_reflections(crystals[i], list);
+
+	}
+
+	return 0;
+}
+
+
+/* Free the reflections for the crystals in "block", first saving any changes
+ * to them if "write_back" is non-zero */
+int refl_cache_release_block(struct refl_cache *c, Crystal **crystals,
+                             int block, int write_back)
+{
+	off_t start;
+	size_t len;
+	int first, n;
+	int i;
+	int r = 0;
+
+	block_range(c, block, &first, &n, &start, &len);
+
+	if ( write_back ) {
+
+		for ( i=first; i<first+n; i++ ) {
+			struct cached_crystal *cc = &c->crystals[i];
+			refl_cache_encode(c->buf + (cc->offset-start),
+			               crystal_get_reflections(crystals[i]),
+			               cc->n);
+		}
+
+		if ( write_all(c->fd, c->buf, len, start) ) {
+			ERROR("Failed to write reflection cache: %s\n",
+			      strerror(errno));
+			r = 1;
+		}
+
+	}
+
+	for ( i=first; i<first+n; i++ ) {
+		reflist_free(crystal_get_reflections(crystals[i]));
+		crystal_set_reflections(crystals[i], NULL);
+	}
+
+	return r;
+}
+
@@ -0,0 +1,61 @@
+/*
+ * refl-cache.h
+ *
+ * On-disk cache of reflection data, for datasets too large for memory
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REFL_CACHE_H
+#define REFL_CACHE_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stddef.h>
+
+#include "crystal.h"
+#include "reflist.h"
+
+
+struct refl_cache;
+
+extern struct refl_cache *refl_cache_new(const char *dir, size_t max_memory);
+extern void refl_cache_free(struct refl_cache *c);
+
+extern int refl_cache_store(struct refl_cache *c, Crystal *cr);
+
+extern int refl_cache_num_blocks(struct refl_cache *c);
+extern int refl_cache_load_block(struct refl_cache *c, Crystal **crystals,
+                                 int block, int *first, int *n);
+extern int refl_cache_release_block(struct refl_cache *c, Crystal **crystals,
+                                    int block, int write_back);
+
+extern size_t refl_cache_segment_size(int n);
+extern void refl_cache_encode(unsigned char *seg, RefList *list, int n);
+extern RefList *refl_cache_decode(const unsigned char *seg, int n);
+
+#endif	/* REFL_CACHE_H */
@@ -37,6 +37,7 @@
 #include "crystal.h"
 #include "reflist.h"
 #include "rejection.h"
+#include "collective.h"
 
 
 static double mean_intensity(RefList *list)
@@ -88,11 +89,13 @@ void early_rejection(Crystal **crystals, int n)
 
 	STATUS("Mean intensity/peak = %f ADU\n", m/n);
 	STATUS("%i crystals flagged\n", n_flag);
-	check_rejection(crystals, n);
+	check_rejection(crystals, n, NULL);
 }
 
 
-void check_rejection(Crystal **crystals, int n)
+/* If "coll" isn't NULL, the crystals of all the ranks are counted.  Returns
+ * non-zero if communication with the other ranks failed. */
+int check_rejection(Crystal **crystals, int n, struct collective *coll)
 {
 	int i;
 	int n_acc = 0;
@@ -103,10 +106,13 @@ void check_rejection(Crystal **crystals, int n)
 			if ( n_acc >= 2 ) break;
 		}
 	}
+	if ( collective_sum_int(coll, &n_acc, 1) ) return 1;
 
 	if ( n_acc < 2 ) {
 		ERROR("Not enough crystals left to proceed (%i).  Sorry.\n",
 		      n_acc);
 		exit(1);
 	}
+
+	return 0;
 }
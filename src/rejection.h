@@ -36,8 +36,10 @@
 
 
 #include "crystal.h"
+#include "collective.h"
 
 extern void early_rejection(Crystal **crystals, int n);
-extern void check_rejection(Crystal **crystals, int n);
+extern int check_rejection(Crystal **crystals, int n,
+                           struct collective *coll);
 
 #endif	/* REJECTION_H */
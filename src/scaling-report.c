@@ -3,11 +3,11 @@
  *
  * Write a nice PDF of scaling parameters
  *
- * Copyright © 2012-2013 Deutsches Elektronen-Synchrotron DESY,
+ * Copyright © 2012-2015 Deutsches Elektronen-Synchrotron DESY,
  *                       a research centre of the Helmholtz Association.
  *
  * Authors:
- *   2010-2013 Thomas White <taw@physics.org>
+ *   2010-2015 Thomas White <taw@physics.org>
  *
  * This file is part of CrystFEL.
  *
@@ -34,8 +34,11 @@
 #include <cairo-pdf.h>
 #include <pango/pangocairo.h>
 #include <math.h>
+#include <pthread.h>
+#include <gsl/gsl_rng.h>
 
 #include "image.h"
+#include "thread-pool.h"
 #include "scaling-report.h"
 
 
@@ -49,17 +52,75 @@ enum justification
 };
 
 
+/* Number of crystals looked at by each task when gathering statistics */
+#define SR_CHUNK (256)
+
+#define N_MOST_SAMPLED (9)
+#define PGRAPH_BINS (25)
+#define PHIST_BINS (100)
+
+
+/* Statistics from the reflections of some crystals */
+struct sr_stats
+{
+	/* Observed against calculated partiality */
+	double t_num[PGRAPH_BINS];
+	double t_den[PGRAPH_BINS];
+	double *points;       /* Pairs of pcalc, pobs */
+	int n_points;
+	int max_points;
+
+	/* Histograms of calculated and observed partiality */
+	int calc_counts[PHIST_BINS];
+	int obs_counts[PHIST_BINS];
+
+	/* Estimates of the full intensity of the most sampled reflections */
+	double *est[N_MOST_SAMPLED];
+	int n_est[N_MOST_SAMPLED];
+	int max_est[N_MOST_SAMPLED];
+
+	int err;
+};
+
+
+/* Everything which is shown on the page for one iteration */
+struct sr_page
+{
+	int iteration;
+
+	/* Scale factors of the crystals which haven't been rejected */
+	double *osf;
+	int n_osf;
+
+	struct sr_stats stats;
+
+	/* The most sampled reflections, and their merged intensities */
+	signed int h[N_MOST_SAMPLED];
+	signed int k[N_MOST_SAMPLED];
+	signed int l[N_MOST_SAMPLED];
+	double Ifull[N_MOST_SAMPLED];
+	double dsd_Ifull[N_MOST_SAMPLED];
+	int have_full[N_MOST_SAMPLED];
+};
+
+
 struct _srcontext
 {
 	cairo_surface_t *surf;
 	cairo_t *cr;
 	double w;
 	double h;
+	int n_threads;
 
 	/* Most sampled reflections */
-	signed int ms_h[9];
-	signed int ms_k[9];
-	signed int ms_l[9];
+	signed int ms_h[N_MOST_SAMPLED];
+	signed int ms_k[N_MOST_SAMPLED];
+	signed int ms_l[N_MOST_SAMPLED];
+
+	/* The page being drawn in the background */
+	pthread_t render_thread;
+	int rendering;
+	struct sr_page *page;
 
 };
 
@@ -183,20 +244,25 @@ static void plot_point(cairo_t *cr, double g_width, double g_height,
 }
 
 
-static void partiality_graph(cairo_t *cr, Crystal **crystals, int n,
-                             RefList *full)
+static void pcalc_bins(double *pcalcmin, double *pcalcmax)
+{
+	int i;
+
+	for ( i=0; i<PGRAPH_BINS; i++ ) {
+		pcalcmin[i] = (double)i/PGRAPH_BINS;
+		pcalcmax[i] = (double)(i+1)/PGRAPH_BINS;
+	}
+	pcalcmax[PGRAPH_BINS-1] += 0.001;  /* Make sure it include pcalc = 1 */
+}
+
+
+static void partiality_graph(cairo_t *cr, const struct sr_stats *s)
 {
 	const double g_width = 200.0;
 	const double g_height = 200.0;
 	int i;
-	const int nbins = 25;
-	double t_num[nbins];
-	double t_den[nbins];
-	double prob;
-	double pcalcmin[nbins];
-	double pcalcmax[nbins];
-	int num_nondud;
-	gsl_rng *rng;
+	double pcalcmin[PGRAPH_BINS];
+	double pcalcmax[PGRAPH_BINS];
 
 	show_text_simple(cr, "Observed partiality", -20.0, g_height/2.0,
 	                      NULL, -M_PI_2, J_CENTER);
@@ -210,100 +276,27 @@ static void partiality_graph(cairo_t *cr, Crystal **crystals, int n,
 	show_text_simple(cr, "1.0", g_width, g_height+10.0, NULL,
 	                     -M_PI/3.0, J_RIGHT);
 
-	for ( i=0; i<nbins; i++ ) {
-		t_num[i] = 0.0;
-		t_den[i] = 0.0;
-		pcalcmin[i] = (double)i/nbins;
-		pcalcmax[i] = (double)(i+1)/nbins;
-	}
-	pcalcmax[nbins-1] += 0.001;  /* Make sure it include pcalc = 1 */
-
-	num_nondud = 0;
-	for ( i=0; i<n; i++ ) {
-		if ( crystal_get_user_flag(crystals[i]) ) continue;
-		num_nondud++;
-	}
-
-	/* The reflections chosen for the graph will be the same every time
-	 * (given the same sequence of input reflections, scalabilities etc) */
-	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	pcalc_bins(pcalcmin, pcalcmax);
 
 	cairo_set_source_rgb(cr, 0.0, 0.7, 0.0);
-	prob = 1.0 / num_nondud;
-	for ( i=0; i<n; i++ ) {
-
-		Reflection *refl;
-		RefListIterator *iter;
-		Crystal *cryst;
-
-		cryst = crystals[i];
-
-		if ( crystal_get_user_flag(cryst) ) continue;
-
-		for ( refl = first_refl(crystal_get_reflections(cryst), &iter);
-		      refl != NULL;
-		      refl = next_refl(refl, iter) )
-		{
-			double Ipart, Ifull, pobs, pcalc;
-			signed int h, k, l;
-			Reflection *f;
-			int bin;
-
-			get_indices(refl, &h, &k, &l);
-			f = find_refl(full, h, k, l);
-			if ( f == NULL ) continue;
-			if ( get_redundancy(f) < 2 ) continue;
-
-			Ipart = crystal_get_osf(cryst) * get_intensity(refl);
-			Ifull = get_intensity(f);
-
-			pobs = Ipart/Ifull;
-			pcalc = get_lorentz(refl) * get_partiality(refl);
-
-			//STATUS("%4i %4i %4i : %9.6f %9.6f %e %e %e\n",
-			//       h, k, l, pobs, pcalc,
-			//       Ipart, Ifull, images[i].osf);
-
-			for ( bin=0; bin<nbins; bin++ ) {
-				if ( (pcalc >= pcalcmin[bin])
-				  && (pcalc < pcalcmax[bin]) )
-				{
-					double esd_pobs, esd_Ip, esd_If;
-					esd_Ip = get_esd_intensity(refl);
-					esd_If = get_esd_intensity(f);
-					esd_If *= crystal_get_osf(cryst);
-					esd_pobs  = pow(esd_Ip/Ipart, 2.0);
-					esd_pobs += pow(esd_If/Ifull, 2.0);
-					esd_pobs = sqrt(esd_pobs);
-					t_num[bin] += pobs / esd_pobs;
-					t_den[bin] += 1.0 / esd_pobs;
-				}
-			}
-
-			bin = nbins * pcalc;
-
-			if ( random_flat(rng, 1.0) < prob ) {
-				plot_point(cr, g_width, g_height, pcalc, pobs);
-			}
-		}
-
+	for ( i=0; i<s->n_points; i++ ) {
+		plot_point(cr, g_width, g_height, s->points[2*i],
+		           s->points[2*i+1]);
 	}
 
-	gsl_rng_free(rng);
-
 	cairo_new_path(cr);
 	cairo_rectangle(cr, 0.0, 0.0, g_width, g_height);
 	cairo_clip(cr);
 
 	cairo_new_path(cr);
 	cairo_move_to(cr, 0.0, g_height);
-	for ( i=0; i<nbins; i++ ) {
+	for ( i=0; i<PGRAPH_BINS; i++ ) {
 
 		double pos = pcalcmin[i] + (pcalcmax[i] - pcalcmin[i])/2.0;
 
-		if ( t_den[i] == 0.0 ) continue;
+		if ( s->t_den[i] == 0.0 ) continue;
 		cairo_line_to(cr, g_width*pos,
-		                  g_height - g_height*(t_num[i]/t_den[i]));
+		                  g_height - g_height*(s->t_num[i]/s->t_den[i]));
 
 	}
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
@@ -319,13 +312,12 @@ static void partiality_graph(cairo_t *cr, Crystal **crystals, int n,
 }
 
 
-static void partiality_histogram(cairo_t *cr, Crystal **crystals, int n,
-                                 RefList *full, int calc, int backwards)
+static void partiality_histogram(cairo_t *cr, const int *counts,
+                                 int backwards)
 {
 	int f_max;
-	int i, b;
-	const int nbins = 100;
-	int counts[nbins];
+	int b;
+	const int nbins = PHIST_BINS;
 	const double g_width = 200.0;
 	const double g_height = 120.0;
 	char tmp[32];
@@ -342,46 +334,6 @@ static void partiality_histogram(cairo_t *cr, Crystal **crystals, int n,
 	show_text_simple(cr, "Frequency", axis_pos, g_height/2.0,
 	                      NULL, text_rot, J_CENTER);
 
-	for ( b=0; b<nbins; b++ ) {
-		counts[b] = 0;
-	}
-
-	for ( i=0; i<n; i++ ) {
-
-		Reflection *refl;
-		RefListIterator *iter;
-		Crystal *cryst = crystals[i];
-
-		if ( crystal_get_user_flag(cryst) ) continue;
-
-		for ( refl = first_refl(crystal_get_reflections(cryst), &iter);
-		      refl != NULL;
-		      refl = next_refl(refl, iter) )
-		{
-			double Ipart, Ifull, pobs, pcalc;
-			signed int h, k, l;
-			Reflection *f;
-
-			get_indices(refl, &h, &k, &l);
-			f = find_refl(full, h, k, l);
-			if ( f == NULL ) continue;
-
-			Ipart = get_intensity(refl);
-			Ifull = get_intensity(f);
-
-			pobs = (Ipart * crystal_get_osf(cryst))
-			           / (Ifull * get_lorentz(refl));
-			pcalc = get_partiality(refl);
-
-			if ( calc ) {
-				b = pcalc*nbins;
-			} else {
-				b = pobs*nbins;
-			}
-			if ( (b>=0) && (b<nbins) ) counts[b]++;
-		}
-	}
-
 	f_max = 0;
 	for ( b=0; b<nbins; b++ ) {
 		if ( counts[b] > f_max ) f_max = counts[b];
@@ -432,7 +384,7 @@ static void partiality_histogram(cairo_t *cr, Crystal **crystals, int n,
 }
 
 
-static void scale_factor_histogram(cairo_t *cr, Crystal **crystals, int n,
+static void scale_factor_histogram(cairo_t *cr, const double *osfs, int n,
                                    const char *title)
 {
 	int f_max;
@@ -457,9 +409,7 @@ static void scale_factor_histogram(cairo_t *cr, Crystal **crystals, int n,
 
 	osf_max = 0.0;
 	for ( i=0; i<n; i++ ) {
-		double osf = crystal_get_osf(crystals[i]);
-		if ( crystal_get_user_flag(crystals[i]) ) continue;
-		if ( osf > osf_max ) osf_max = osf;
+		if ( osfs[i] > osf_max ) osf_max = osfs[i];
 	}
 	osf_max = ceil(osf_max+osf_max/10000.0);
 	if ( osf_max > 1000.0 ) {
@@ -478,14 +428,9 @@ static void scale_factor_histogram(cairo_t *cr, Crystal **crystals, int n,
 		}
 
 		for ( i=0; i<n; i++ ) {
-
-			double osf = crystal_get_osf(crystals[i]);
-
-			if ( crystal_get_user_flag(crystals[i]) ) continue;
-
 			for ( b=0; b<nbins; b++ ) {
-				if ( (osf >= osf_low[b])
-				  && (osf < osf_high[b]) )
+				if ( (osfs[i] >= osf_low[b])
+				  && (osfs[i] < osf_high[b]) )
 				{
 					counts[b]++;
 					break;
@@ -550,12 +495,12 @@ static void scale_factor_histogram(cairo_t *cr, Crystal **crystals, int n,
 }
 
 
-static void intensity_histogram(cairo_t *cr, Crystal **crystals, int n,
-                                RefList *full,
-                                signed int h, signed int k, signed int l)
+/* Histogram of the estimates of the full intensity of reflection number "i"
+ * of the most sampled ones */
+static void intensity_histogram(cairo_t *cr, const struct sr_page *page, int i)
 {
 	int f_max;
-	int i, b;
+	int j, b;
 	const int nbins = 30;
 	double int_max, int_inc;
 	double int_low[nbins];
@@ -564,50 +509,20 @@ static void intensity_histogram(cairo_t *cr, Crystal **crystals, int n,
 	const double g_width = 115.0;
 	const double g_height = 55.0;
 	char tmp[64];
-	Reflection *f;
 	double Ifull, dsd_Ifull, pos, mI, bit;
-	int have_full;
+	const double *est = page->stats.est[i];
+	int n_est = page->stats.n_est[i];
 
-	f = find_refl(full, h, k, l);
-	if ( f != NULL ) {
-		Ifull = get_intensity(f);
-		dsd_Ifull = get_esd_intensity(f) * sqrt(get_redundancy(f));
-		have_full = 1;
-	} else {
-		Ifull = 0.0;
-		dsd_Ifull = 0.0;
-		have_full = 0;
-	}
+	Ifull = page->Ifull[i];
+	dsd_Ifull = page->dsd_Ifull[i];
 
-	snprintf(tmp, 63, "%i  %i  %i", h, k, l);
+	snprintf(tmp, 63, "%i  %i  %i", page->h[i], page->k[i], page->l[i]);
 	show_text_simple(cr, tmp, g_width/2.0, -10.0,
 	                      "Sans Bold 10", 0.0, J_CENTER);
 
 	int_max = 0.0;
-	int nmeas = 0;
-	for ( i=0; i<n; i++ ) {
-
-		double osf;
-		Crystal *cryst = crystals[i];
-
-		if ( crystal_get_user_flag(cryst) ) continue;
-
-		osf = crystal_get_osf(cryst);
-
-		for ( f = find_refl(crystal_get_reflections(cryst), h, k, l);
-		      f != NULL;
-		      f = next_found_refl(f) )
-		{
-			double Iobs, pcalc, Ifull_est;
-
-			pcalc = get_partiality(f);
-			Iobs = get_intensity(f);
-			Ifull_est = Iobs / (pcalc * osf);
-
-			if ( Ifull_est > int_max ) int_max = Ifull_est;
-			nmeas++;
-		}
-
+	for ( j=0; j<n_est; j++ ) {
+		if ( est[j] > int_max ) int_max = est[j];
 	}
 	int_max *= 1.1;
 	int_inc = int_max / nbins;
@@ -618,34 +533,14 @@ static void intensity_histogram(cairo_t *cr, Crystal **crystals, int n,
 		counts[b] = 0;
 	}
 
-	for ( i=0; i<n; i++ ) {
-
-		double osf;
-		Crystal *cryst = crystals[i];
-
-		if ( crystal_get_user_flag(cryst) ) continue;
-
-		osf = crystal_get_osf(cryst);
-
-		for ( f = find_refl(crystal_get_reflections(cryst), h, k, l);
-		      f != NULL;
-		      f = next_found_refl(f) )
-		{
-			double Iobs, pcalc, Ifull_est;
-
-			pcalc = get_partiality(f);
-			Iobs = get_intensity(f);
-			Ifull_est = Iobs / (pcalc * osf);
-
-			for ( b=0; b<nbins; b++ ) {
-				if ( (Ifull_est >= int_low[b])
-				  && (Ifull_est < int_high[b]) ) {
-					counts[b]++;
-					break;
-				}
+	for ( j=0; j<n_est; j++ ) {
+		for ( b=0; b<nbins; b++ ) {
+			if ( (est[j] >= int_low[b])
+			  && (est[j] < int_high[b]) ) {
+				counts[b]++;
+				break;
 			}
 		}
-
 	}
 
 	f_max = 0;
@@ -682,14 +577,14 @@ static void intensity_histogram(cairo_t *cr, Crystal **crystals, int n,
 	pos = Ifull/mI;
 	bit = g_height / 15.0;
 	cairo_arc(cr, g_width*pos, g_height+bit, bit, 0.0, 2.0*M_PI);
-	if ( have_full ) {
+	if ( page->have_full[i] ) {
 		cairo_set_source_rgb(cr, 0.0, 0.67, 0.45);
 	} else {
 		cairo_set_source_rgb(cr, 0.86, 0.0, 0.0);
 	}
 	cairo_fill(cr);
 
-	if ( have_full ) {
+	if ( page->have_full[i] ) {
 
 		double eW = g_width*dsd_Ifull/mI;
 
@@ -781,58 +676,321 @@ static void find_most_sampled_reflections(RefList *list, int n, signed int *h,
 }
 
 
+static int add_value(double **vals, int *n, int *max, double v)
+{
+	double *vals_new;
 
-SRContext *sr_titlepage(Crystal **crystals, int n,
-                        const char *filename, const char *stream_filename,
-                        const char *cmdline)
+	vals_new = grow_array(*vals, max, *n+1, sizeof(double));
+	if ( vals_new == NULL ) return 1;
+	*vals = vals_new;
+	(*vals)[(*n)++] = v;
+	return 0;
+}
+
+
+static void free_stats(struct sr_stats *s)
 {
-	char tmp[1024];
-	struct _srcontext *sr;
+	int i;
 
-	sr = malloc(sizeof(*sr));
-	if ( sr == NULL ) return NULL;
+	free(s->points);
+	for ( i=0; i<N_MOST_SAMPLED; i++ ) {
+		free(s->est[i]);
+	}
+}
 
-	sr->w = PAGE_WIDTH;
-	sr->h = 595.0;
 
-	sr->surf = cairo_pdf_surface_create(filename, sr->w, sr->h);
+/* Add the statistics from "b" to "a" */
+static int add_stats(struct sr_stats *a, const struct sr_stats *b)
+{
+	int i;
 
-	if ( cairo_surface_status(sr->surf) != CAIRO_STATUS_SUCCESS ) {
-		fprintf(stderr, "Couldn't create Cairo surface\n");
-		cairo_surface_destroy(sr->surf);
-		free(sr);
+	for ( i=0; i<PGRAPH_BINS; i++ ) {
+		a->t_num[i] += b->t_num[i];
+		a->t_den[i] += b->t_den[i];
+	}
+	for ( i=0; i<PHIST_BINS; i++ ) {
+		a->calc_counts[i] += b->calc_counts[i];
+		a->obs_counts[i] += b->obs_counts[i];
+	}
+	for ( i=0; i<b->n_points; i++ ) {
+		if ( add_value(&a->points, &a->n_points, &a->max_points,
+		               b->points[i]) ) return 1;
+	}
+	for ( i=0; i<N_MOST_SAMPLED; i++ ) {
+		int j;
+		for ( j=0; j<b->n_est[i]; j++ ) {
+			if ( add_value(&a->est[i], &a->n_est[i], &a->max_est[i],
+			               b->est[i][j]) ) return 1;
+		}
+	}
+
+	return a->err || b->err;
+}
+
+
+/* The reflection statistics for one crystal, added to "s".  This is what
+ * partiality_graph(), partiality_histogram() and intensity_histogram() used
+ * to work out for themselves, in turn. */
+static void crystal_stats(struct sr_stats *s, Crystal *cryst, RefList *full,
+                          const struct sr_page *page, double prob,
+                          gsl_rng *rng)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	double pcalcmin[PGRAPH_BINS];
+	double pcalcmax[PGRAPH_BINS];
+	double osf = crystal_get_osf(cryst);
+	int i;
+
+	pcalc_bins(pcalcmin, pcalcmax);
+
+	for ( refl = first_refl(crystal_get_reflections(cryst), &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		double Ipart, Ifull, pobs, pcalc;
+		signed int h, k, l;
+		Reflection *f;
+		int bin;
+
+		get_indices(refl, &h, &k, &l);
+		f = find_refl(full, h, k, l);
+		if ( f == NULL ) continue;
+
+		Ipart = get_intensity(refl);
+		Ifull = get_intensity(f);
+
+		/* Histograms of calculated and observed partiality */
+		pobs = (Ipart * osf) / (Ifull * get_lorentz(refl));
+		pcalc = get_partiality(refl);
+		bin = pcalc*PHIST_BINS;
+		if ( (bin>=0) && (bin<PHIST_BINS) ) s->calc_counts[bin]++;
+		bin = pobs*PHIST_BINS;
+		if ( (bin>=0) && (bin<PHIST_BINS) ) s->obs_counts[bin]++;
+
+		/* Observed against calculated partiality */
+		if ( get_redundancy(f) < 2 ) continue;
+
+		Ipart = osf * get_intensity(refl);
+		pobs = Ipart/Ifull;
+		pcalc = get_lorentz(refl) * get_partiality(refl);
+
+		for ( bin=0; bin<PGRAPH_BINS; bin++ ) {
+			if ( (pcalc >= pcalcmin[bin])
+			  && (pcalc < pcalcmax[bin]) )
+			{
+				double esd_pobs, esd_Ip, esd_If;
+				esd_Ip = get_esd_intensity(refl);
+				esd_If = get_esd_intensity(f);
+				esd_If *= osf;
+				esd_pobs  = pow(esd_Ip/Ipart, 2.0);
+				esd_pobs += pow(esd_If/Ifull, 2.0);
+				esd_pobs = sqrt(esd_pobs);
+				s->t_num[bin] += pobs / esd_pobs;
+				s->t_den[bin] += 1.0 / esd_pobs;
+			}
+		}
+
+		if ( random_flat(rng, 1.0) < prob ) {
+			s->err |= add_value(&s->points, &s->n_points,
+			                    &s->max_points, pcalc);
+			s->err |= add_value(&s->points, &s->n_points,
+			                    &s->max_points, pobs);
+		}
+	}
+
+	/* Estimates of the full intensities of the most sampled reflections */
+	for ( i=0; i<N_MOST_SAMPLED; i++ ) {
+
+		Reflection *f;
+
+		for ( f = find_refl(crystal_get_reflections(cryst),
+		                    page->h[i], page->k[i], page->l[i]);
+		      f != NULL;
+		      f = next_found_refl(f) )
+		{
+			double Ifull_est;
+			Ifull_est = get_intensity(f) / (get_partiality(f) * osf);
+			s->err |= add_value(&s->est[i], &s->n_est[i],
+			                    &s->max_est[i], Ifull_est);
+		}
+
+	}
+}
+
+
+struct stats_queue_args
+{
+	struct srdata *d;
+	const struct sr_page *page;
+	double prob;
+	struct sr_stats *chunks;
+	int n_started;
+};
+
+
+struct stats_worker_args
+{
+	struct stats_queue_args *qargs;
+	int chunk;
+};
+
+
+static void *create_stats_job(void *vqargs)
+{
+	struct stats_worker_args *wargs;
+	struct stats_queue_args *qargs = vqargs;
+
+	wargs = malloc(sizeof(struct stats_worker_args));
+	wargs->qargs = qargs;
+	wargs->chunk = qargs->n_started++;
+
+	return wargs;
+}
+
+
+static void run_stats_job(void *vwargs, int cookie)
+{
+	struct stats_worker_args *wargs = vwargs;
+	struct stats_queue_args *qargs = wargs->qargs;
+	struct srdata *d = qargs->d;
+	struct sr_stats *s = &qargs->chunks[wargs->chunk];
+	int first = wargs->chunk * SR_CHUNK;
+	int last = first + SR_CHUNK;
+	gsl_rng *rng;
+	int i;
+
+	if ( last > d->n ) last = d->n;
+
+	/* The points chosen for the partiality graph will be the same every
+	 * time (given the same sequence of input reflections, scalabilities
+	 * etc), regardless of the number of threads */
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rng, wargs->chunk);
+
+	for ( i=first; i<last; i++ ) {
+		if ( crystal_get_user_flag(d->crystals[i]) ) continue;
+		crystal_stats(s, d->crystals[i], d->full, qargs->page,
+		              qargs->prob, rng);
+	}
+
+	gsl_rng_free(rng);
+}
+
+
+static void finalise_stats_job(void *vqargs, void *vwargs)
+{
+	free(vwargs);
+}
+
+
+static void free_page(struct sr_page *page)
+{
+	free(page->osf);
+	free_stats(&page->stats);
+	free(page);
+}
+
+
+/* Work out everything which will be shown on the page for this iteration.
+ * The crystals are looked at in chunks, in parallel, and the results are
+ * combined in order so that they don't depend on the number of threads. */
+static struct sr_page *gather_page(SRContext *sr, int iteration,
+                                   struct srdata *d)
+{
+	struct stats_queue_args qargs;
+	struct sr_page *page;
+	int n_chunks;
+	int i;
+	int err = 0;
+
+	page = calloc(1, sizeof(struct sr_page));
+	if ( page == NULL ) return NULL;
+	page->iteration = iteration;
+
+	page->osf = malloc(d->n*sizeof(double));
+	if ( (page->osf == NULL) && (d->n > 0) ) {
+		free(page);
 		return NULL;
 	}
+	for ( i=0; i<d->n; i++ ) {
+		if ( crystal_get_user_flag(d->crystals[i]) ) continue;
+		page->osf[page->n_osf++] = crystal_get_osf(d->crystals[i]);
+	}
 
-	sr->cr = cairo_create(sr->surf);
-	watermark(sr);
+	if ( iteration == 0 ) {
+		find_most_sampled_reflections(d->full, N_MOST_SAMPLED,
+		                              sr->ms_h, sr->ms_k, sr->ms_l);
+	}
+	for ( i=0; i<N_MOST_SAMPLED; i++ ) {
 
-	snprintf(tmp, 1023, "%s", stream_filename);
-	show_text(sr->cr, tmp, 10.0, J_CENTER, "Sans Bold 16");
-	snprintf(tmp, 1023, "partialator %s", cmdline);
-	show_text(sr->cr, tmp, 45.0, J_LEFT, "Mono 7");
+		Reflection *f;
 
-	return sr;
+		page->h[i] = sr->ms_h[i];
+		page->k[i] = sr->ms_k[i];
+		page->l[i] = sr->ms_l[i];
+
+		f = find_refl(d->full, page->h[i], page->k[i], page->l[i]);
+		if ( f != NULL ) {
+			page->Ifull[i] = get_intensity(f);
+			page->dsd_Ifull[i] = get_esd_intensity(f)
+			                     * sqrt(get_redundancy(f));
+			page->have_full[i] = 1;
+		}
+
+	}
+
+	n_chunks = (d->n + SR_CHUNK - 1) / SR_CHUNK;
+	qargs.chunks = calloc(n_chunks, sizeof(struct sr_stats));
+	if ( (qargs.chunks == NULL) && (n_chunks > 0) ) {
+		free_page(page);
+		return NULL;
+	}
+	qargs.d = d;
+	qargs.page = page;
+	qargs.prob = 1.0 / page->n_osf;
+	qargs.n_started = 0;
+
+	/* The merged list will be searched for every reflection of every
+	 * crystal, without being changed */
+	reflist_freeze(d->full);
+
+	/* Zero would mean "no limit" to run_threads() */
+	if ( n_chunks > 0 ) {
+		run_threads(sr->n_threads, run_stats_job, create_stats_job,
+		            finalise_stats_job, &qargs, n_chunks, 0, 0, 0);
+	}
+
+	for ( i=0; i<n_chunks; i++ ) {
+		err = err || add_stats(&page->stats, &qargs.chunks[i]);
+		free_stats(&qargs.chunks[i]);
+	}
+	free(qargs.chunks);
+
+	if ( err ) {
+		free_page(page);
+		return NULL;
+	}
+
+	return page;
 }
 
 
-void sr_iteration(SRContext *sr, int iteration, struct srdata *d)
+static void draw_page(SRContext *sr, const struct sr_page *page)
 {
 	int i;
 	char page_title[1024];
 	double dash[] = {2.0, 2.0};
 
-	if ( sr == NULL ) return;
-
 	snprintf(page_title, 1023, "After %i iteration%s",
-	         iteration, iteration==1?"":"s");
+	         page->iteration, page->iteration==1?"":"s");
 
 	new_page(sr);
 	show_text(sr->cr, page_title, 10.0, J_CENTER, "Sans Bold 16");
 
 	cairo_save(sr->cr);
 	cairo_translate(sr->cr, 480.0, 350.0);
-	scale_factor_histogram(sr->cr, d->crystals, d->n,
+	scale_factor_histogram(sr->cr, page->osf, page->n_osf,
 	                       "Distribution of overall scale factors");
 	cairo_restore(sr->cr);
 
@@ -840,7 +998,7 @@ void sr_iteration(SRContext *sr, int iteration, struct srdata *d)
 	cairo_save(sr->cr);
 
 	cairo_translate(sr->cr, 70.0, 330.0);
-	partiality_graph(sr->cr, d->crystals, d->n, d->full);
+	partiality_graph(sr->cr, &page->stats);
 
 	cairo_save(sr->cr);
 	cairo_move_to(sr->cr, 0.0, 0.0);
@@ -851,7 +1009,7 @@ void sr_iteration(SRContext *sr, int iteration, struct srdata *d)
 	cairo_stroke(sr->cr);
 	cairo_set_dash(sr->cr, NULL, 0, 0.0);
 	cairo_translate(sr->cr, 0.0, -150.0);
-	partiality_histogram(sr->cr, d->crystals, d->n, d->full, 1, 0);
+	partiality_histogram(sr->cr, page->stats.calc_counts, 0);
 	cairo_restore(sr->cr);
 
 	cairo_save(sr->cr);
@@ -864,17 +1022,12 @@ void sr_iteration(SRContext *sr, int iteration, struct srdata *d)
 	cairo_set_dash(sr->cr, NULL, 0, 0.0);
 	cairo_translate(sr->cr, 230.0, 200.0);
 	cairo_rotate(sr->cr, -M_PI_2);
-	partiality_histogram(sr->cr, d->crystals, d->n, d->full, 0, 1);
+	partiality_histogram(sr->cr, page->stats.obs_counts, 1);
 	cairo_restore(sr->cr);
 
 	cairo_restore(sr->cr);
 
-	if ( iteration == 0 ) {
-		find_most_sampled_reflections(d->full, 9,
-		                              sr->ms_h, sr->ms_k, sr->ms_l);
-	}
-
-	for ( i=0; i<9; i++ ) {
+	for ( i=0; i<N_MOST_SAMPLED; i++ ) {
 
 		int x, y;
 
@@ -883,16 +1036,102 @@ void sr_iteration(SRContext *sr, int iteration, struct srdata *d)
 
 		cairo_save(sr->cr);
 		cairo_translate(sr->cr, 400.0+140.0*x, 60.0+80.0*y);
-		intensity_histogram(sr->cr, d->crystals, d->n, d->full,
-		                    sr->ms_h[i], sr->ms_k[i], sr->ms_l[i]);
+		intensity_histogram(sr->cr, page, i);
 		cairo_restore(sr->cr);
 
 	}
 }
 
 
+static void *render_page(void *vp)
+{
+	SRContext *sr = vp;
+
+	draw_page(sr, sr->page);
+	free_page(sr->page);
+	sr->page = NULL;
+
+	return NULL;
+}
+
+
+static void wait_for_render(SRContext *sr)
+{
+	if ( !sr->rendering ) return;
+	pthread_join(sr->render_thread, NULL);
+	sr->rendering = 0;
+}
+
+
+SRContext *sr_titlepage(Crystal **crystals, int n,
+                        const char *filename, const char *stream_filename,
+                        const char *cmdline, int n_threads)
+{
+	char tmp[1024];
+	struct _srcontext *sr;
+
+	sr = malloc(sizeof(*sr));
+	if ( sr == NULL ) return NULL;
+
+	sr->w = PAGE_WIDTH;
+	sr->h = 595.0;
+	sr->n_threads = n_threads;
+	sr->rendering = 0;
+	sr->page = NULL;
+
+	sr->surf = cairo_pdf_surface_create(filename, sr->w, sr->h);
+
+	if ( cairo_surface_status(sr->surf) != CAIRO_STATUS_SUCCESS ) {
+		fprintf(stderr, "Couldn't create Cairo surface\n");
+		cairo_surface_destroy(sr->surf);
+		free(sr);
+		return NULL;
+	}
+
+	sr->cr = cairo_create(sr->surf);
+	watermark(sr);
+
+	snprintf(tmp, 1023, "%s", stream_filename);
+	show_text(sr->cr, tmp, 10.0, J_CENTER, "Sans Bold 16");
+	snprintf(tmp, 1023, "partialator %s", cmdline);
+	show_text(sr->cr, tmp, 45.0, J_LEFT, "Mono 7");
+
+	return sr;
+}
+
+
+/* The statistics are gathered straight away, but the page is drawn in the
+ * background while the next cycle runs */
+void sr_iteration(SRContext *sr, int iteration, struct srdata *d)
+{
+	struct sr_page *page;
+
+	if ( sr == NULL ) return;
+
+	page = gather_page(sr, iteration, d);
+	if ( page == NULL ) {
+		ERROR("Failed to gather statistics for the scaling report.\n");
+		return;
+	}
+
+	/* Only one page can be drawn at a time */
+	wait_for_render(sr);
+
+	sr->page = page;
+	if ( pthread_create(&sr->render_thread, NULL, render_page, sr) ) {
+		render_page(sr);
+	} else {
+		sr->rendering = 1;
+	}
+}
+
+
 void sr_finish(SRContext *sr)
 {
+	if ( sr == NULL ) return;
+	wait_for_render(sr);
 	cairo_surface_finish(sr->surf);
 	cairo_destroy(sr->cr);
+	cairo_surface_destroy(sr->surf);
+	free(sr);
 }
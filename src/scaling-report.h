@@ -54,7 +54,7 @@ struct srdata
 extern SRContext *sr_titlepage(Crystal **crystals, int n,
                                const char *filename,
                                const char *stream_filename,
-                               const char *cmdline);
+                               const char *cmdline, int n_threads);
 
 extern void sr_iteration(SRContext *sr, int iteration, struct srdata *d);
 
@@ -63,7 +63,8 @@ extern void sr_finish(SRContext *sr);
 #else /* defined(HAVE_CAIRO) && defined(HAVE_PANGO) && ... */
 
 SRContext *sr_titlepage(Crystal **crystals, int n, const char *filename,
-                        const char *stream_filename, const char *cmdline)
+                        const char *stream_filename, const char *cmdline,
+                        int n_threads)
 {
 	return NULL;
 }
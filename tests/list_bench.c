@@ -0,0 +1,186 @@
+/*
+ * list_bench.c
+ *
+ * Compare the speed of the different types of reflection list
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <reflist.h>
+
+
+/* Indices within a sphere of this radius, similar to a typical merged list */
+#define MAX_IND (40)
+
+/* Number of searches to time, as a multiple of the number of reflections */
+#define N_FIND_PASSES (20)
+
+
+struct bench_indices
+{
+	signed int *h;
+	signed int *k;
+	signed int *l;
+	int n;
+};
+
+
+static double get_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+static struct bench_indices *make_indices(void)
+{
+	struct bench_indices *ind;
+	signed int h, k, l;
+	int max = (2*MAX_IND+1)*(2*MAX_IND+1)*(2*MAX_IND+1);
+	int i;
+
+	ind = malloc(sizeof(struct bench_indices));
+	ind->h = malloc(max*sizeof(signed int));
+	ind->k = malloc(max*sizeof(signed int));
+	ind->l = malloc(max*sizeof(signed int));
+	ind->n = 0;
+
+	for ( h=-MAX_IND; h<=MAX_IND; h++ ) {
+	for ( k=-MAX_IND; k<=MAX_IND; k++ ) {
+	for ( l=-MAX_IND; l<=MAX_IND; l++ ) {
+		if ( h*h + k*k + l*l > MAX_IND*MAX_IND ) continue;
+		ind->h[ind->n] = h;
+		ind->k[ind->n] = k;
+		ind->l[ind->n] = l;
+		ind->n++;
+	}
+	}
+	}
+
+	/* Shuffle, so that the reflections are added in no particular order,
+	 * as happens when merging */
+	for ( i=ind->n-1; i>0; i-- ) {
+		int j = random() % (i+1);
+		signed int t;
+		t = ind->h[i];  ind->h[i] = ind->h[j];  ind->h[j] = t;
+		t = ind->k[i];  ind->k[i] = ind->k[j];  ind->k[j] = t;
+		t = ind->l[i];  ind->l[i] = ind->l[j];  ind->l[j] = t;
+	}
+
+	return ind;
+}
+
+
+static void bench_list(const char *name, struct bench_indices *ind,
+                       RefListType type, int freeze)
+{
+	RefList *list;
+	Reflection *refl;
+	RefListIterator *iter;
+	double t0, t_insert, t_freeze, t_find, t_iter, t_free;
+	double total = 0.0;
+	int n_found = 0;
+	int i, pass;
+
+	t0 = get_time();
+	list = reflist_new_2(type);
+	for ( i=0; i<ind->n; i++ ) {
+		refl = add_refl(list, ind->h[i], ind->k[i], ind->l[i]);
+		set_intensity(refl, i);
+	}
+	t_insert = get_time() - t0;
+
+	t0 = get_time();
+	if ( freeze ) reflist_freeze(list);
+	t_freeze = get_time() - t0;
+
+	t0 = get_time();
+	for ( pass=0; pass<N_FIND_PASSES; pass++ ) {
+		for ( i=0; i<ind->n; i++ ) {
+
+			/* Alternate between present and absent reflections */
+			signed int l = (i % 2) ? ind->l[i] : ind->l[i]+100;
+
+			refl = find_refl(list, ind->h[i], ind->k[i], l);
+			if ( refl != NULL ) n_found++;
+		}
+	}
+	t_find = get_time() - t0;
+
+	t0 = get_time();
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		total += get_intensity(refl);
+	}
+	t_iter = get_time() - t0;
+
+	t0 = get_time();
+	reflist_free(list);
+	t_free = get_time() - t0;
+
+	printf("%-12s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+	       1e9*t_insert/ind->n, 1e9*t_freeze/ind->n,
+	       1e9*t_find/(N_FIND_PASSES*ind->n), 1e9*t_iter/ind->n,
+	       1e9*t_free/ind->n);
+
+	if ( (n_found != N_FIND_PASSES*(ind->n/2))
+	  || (total != (double)ind->n*(ind->n-1)/2.0) )
+	{
+		fprintf(stderr, "%s gave wrong results!\n", name);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct bench_indices *ind;
+
+	ind = make_indices();
+
+	printf("%i reflections.  Times in ns per reflection.\n", ind->n);
+	printf("%-12s %10s %10s %10s %10s %10s\n", "List type", "Insert",
+	       "Freeze", "Find", "Iterate", "Free");
+	bench_list("tree", ind, REFLIST_TREE, 0);
+	bench_list("tree frozen", ind, REFLIST_TREE, 1);
+	bench_list("hash", ind, REFLIST_HASH, 0);
+	bench_list("hash frozen", ind, REFLIST_HASH, 1);
+
+	free(ind->h);
+	free(ind->k);
+	free(ind->l);
+	free(ind);
+
+	return 0;
+}
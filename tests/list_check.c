@@ -48,7 +48,7 @@ struct refltemp {
 #define RANDOM_INDEX (1022*random()/RAND_MAX - 511)
 
 
-static int test_lists(int num_items)
+static int test_lists(int num_items, RefListType type, int freeze)
 {
 	struct refltemp *check;
 	RefList *list;
@@ -56,9 +56,10 @@ static int test_lists(int num_items)
 	signed int h, k, l;
 	Reflection *refl;
 	RefListIterator *iter;
+	unsigned int last_serial = 0;
 
 	check = malloc(num_items * sizeof(struct refltemp));
-	list = reflist_new();
+	list = reflist_new_2(type);
 
 	h = RANDOM_INDEX;
 	k = RANDOM_INDEX;
@@ -103,6 +104,8 @@ static int test_lists(int num_items)
 
 	}
 
+	if ( freeze ) reflist_freeze(list);
+
 	printf("Created %i items, num_reflections is %i, tree depth is %i\n",
 	       num_items, num_reflections(list), tree_depth(list));
 
@@ -116,6 +119,16 @@ static int test_lists(int num_items)
 
 		get_indices(refl, &h, &k, &l);
 
+		/* Only hash lists may be iterated out of order */
+		if ( ((type != REFLIST_HASH) || freeze)
+		  && (SERIAL(h, k, l) < last_serial) )
+		{
+			fprintf(stderr, "Iteration out of order at"
+			        " %3i %3i %3i\n", h, k, l);
+			return 1;
+		}
+		last_serial = SERIAL(h, k, l);
+
 		for ( i=0; i<num_items; i++ ) {
 			if ( (check[i].h == h)
 			  && (check[i].k == k)
@@ -159,6 +172,7 @@ static int test_lists(int num_items)
 
 		signed int h, k, l;
 		Reflection *refl;
+		int n;
 
 		h = check[i].h;
 		k = check[i].k;
@@ -170,6 +184,43 @@ static int test_lists(int num_items)
 			return 1;
 		}
 
+		/* Check that all the duplicates are there */
+		n = 0;
+		do {
+			n++;
+			refl = next_found_refl(refl);
+		} while ( refl != NULL );
+		if ( n != check[i].num ) {
+			fprintf(stderr, "Found %i copies of %3i %3i %3i,"
+			        " not %i\n", n, h, k, l, check[i].num);
+			return 1;
+		}
+
+	}
+
+	/* Check that absent reflections are not found */
+	for ( i=0; i<1000; i++ ) {
+
+		int j;
+		int present = 0;
+
+		h = RANDOM_INDEX;
+		k = RANDOM_INDEX;
+		l = RANDOM_INDEX;
+
+		for ( j=0; j<num_items; j++ ) {
+			if ( (check[j].h == h)
+			  && (check[j].k == k)
+			  && (check[j].l == l) ) present = 1;
+		}
+		if ( present ) continue;
+
+		if ( find_refl(list, h, k, l) != NULL ) {
+			fprintf(stderr, "Found %3i %3i %3i, which isn't in"
+			        " the list\n", h, k, l);
+			return 1;
+		}
+
 	}
 
 	reflist_free(list);
@@ -185,7 +236,33 @@ int main(int argc, char *argv[])
 	printf("Running list test...\n");
 
 	for ( i=0; i<100; i++ ) {
-		if ( test_lists(4096*random()/RAND_MAX) ) return 1;
+		if ( test_lists(4096*random()/RAND_MAX, REFLIST_TREE, 0) ) {
+			return 1;
+		}
+	}
+
+	printf("Running list test with frozen lists...\n");
+
+	for ( i=0; i<30; i++ ) {
+		if ( test_lists(4096*random()/RAND_MAX, REFLIST_TREE, 1) ) {
+			return 1;
+		}
+	}
+
+	printf("Running list test with hash tables...\n");
+
+	for ( i=0; i<100; i++ ) {
+		if ( test_lists(4096*random()/RAND_MAX, REFLIST_HASH, 0) ) {
+			return 1;
+		}
+	}
+
+	printf("Running list test with frozen hash tables...\n");
+
+	for ( i=0; i<30; i++ ) {
+		if ( test_lists(4096*random()/RAND_MAX, REFLIST_HASH, 1) ) {
+			return 1;
+		}
 	}
 
 	return 0;
@@ -0,0 +1,306 @@
+/*
+ * load_bench.c
+ *
+ * Measure the cost of growing the image and crystal lists while loading
+ * a large stream
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <image.h>
+#include <stream.h>
+#include <cell.h>
+#include <crystal.h>
+#include <utils.h>
+
+
+/* Default number of simulated crystals.  Each image has between zero and
+ * three crystals, like in a real stream with multiple lattices. */
+#define N_CRYSTALS (1000000)
+
+
+static double get_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+static int write_test_stream(const char *filename, int n_crystals)
+{
+	Stream *st;
+	int i = 0;
+	int n = 0;
+
+	st = open_stream_for_write_3(filename, NULL, 0, NULL,
+	                             STREAM_FORMAT_BINARY);
+	if ( st == NULL ) return 1;
+
+	while ( n < n_crystals ) {
+
+		struct image image;
+		char tmp[64];
+		int j;
+
+		snprintf(tmp, 63, "image-%i.h5", i);
+		image.filename = strdup(tmp);
+		image.event = NULL;
+		image.serial = i+1;
+		image.indexed_by = INDEXING_NONE;
+		image.lambda = 1.0e-10;
+		image.div = 0.0;
+		image.bw = 0.0;
+		image.num_peaks = 0;
+		image.num_saturated_peaks = 0;
+		image.features = NULL;
+		image.det = NULL;
+		image.copyme = NULL;
+		image.stuff_from_stream = NULL;
+
+		image.n_crystals = i % 4;
+		if ( image.n_crystals > n_crystals - n ) {
+			image.n_crystals = n_crystals - n;
+		}
+		image.crystals = malloc(image.n_crystals * sizeof(Crystal *));
+		for ( j=0; j<image.n_crystals; j++ ) {
+			Crystal *cr = crystal_new();
+			crystal_set_cell(cr, cell_new_from_parameters(5e-9, 6e-9,
+			                                              7e-9,
+			                                              deg2rad(90.0),
+			                                              deg2rad(90.0),
+			                                              deg2rad(90.0)));
+			crystal_set_image(cr, &image);
+			image.crystals[j] = cr;
+		}
+
+		write_chunk(st, &image, NULL, 0, 0, NULL);
+
+		for ( j=0; j<image.n_crystals; j++ ) {
+			cell_free(crystal_get_cell(image.crystals[j]));
+			crystal_free(image.crystals[j]);
+		}
+		free(image.crystals);
+		free(image.filename);
+
+		n += image.n_crystals;
+		i++;
+
+	}
+
+	close_stream(st);
+	return 0;
+}
+
+
+struct load_context
+{
+	int amortised;
+	struct image *images;
+	int n_images;
+	int max_images;
+	Crystal **crystals;
+	int n_crystals;
+	int max_crystals;
+	double t_grow;       /* Time spent growing the lists */
+	int err;
+};
+
+
+/* The same as load_chunk() in partialator, minus the processing of the
+ * reflections */
+static int load_chunk(struct image *image, void *vp)
+{
+	struct load_context *lc = vp;
+	struct image *images_new;
+	Crystal **crystals_new;
+	double t0;
+	int i;
+
+	t0 = get_time();
+	if ( lc->amortised ) {
+		images_new = grow_array(lc->images, &lc->max_images,
+		                        lc->n_images+1, sizeof(struct image));
+		crystals_new = grow_array(lc->crystals, &lc->max_crystals,
+		                          lc->n_crystals+image->n_crystals,
+		                          sizeof(Crystal *));
+	} else {
+		images_new = realloc(lc->images,
+		                     (lc->n_images+1)*sizeof(struct image));
+		crystals_new = realloc(lc->crystals,
+		                       (lc->n_crystals+image->n_crystals)
+		                       *sizeof(Crystal *));
+	}
+	lc->t_grow += get_time() - t0;
+
+	if ( (images_new == NULL) || (crystals_new == NULL) ) {
+		ERROR("Failed to allocate memory.\n");
+		lc->err = 1;
+		return 1;
+	}
+	lc->images = images_new;
+	lc->crystals = crystals_new;
+
+	lc->images[lc->n_images++] = *image;
+	for ( i=0; i<image->n_crystals; i++ ) {
+		lc->crystals[lc->n_crystals++] = image->crystals[i];
+	}
+
+	return 0;
+}
+
+
+static void free_lists(struct load_context *lc)
+{
+	int i;
+
+	for ( i=0; i<lc->n_crystals; i++ ) {
+		cell_free(crystal_get_cell(lc->crystals[i]));
+		crystal_free(lc->crystals[i]);
+	}
+	for ( i=0; i<lc->n_images; i++ ) {
+		free(lc->images[i].crystals);
+		free(lc->images[i].filename);
+	}
+	free(lc->crystals);
+	free(lc->images);
+}
+
+
+static int run(const char *filename, const char *name, int amortised,
+               int presize, int n_threads, int n_crystals)
+{
+	Stream *st;
+	struct load_context lc;
+	double t0, t;
+	int fail = 0;
+
+	st = open_stream_for_read(filename);
+	if ( st == NULL ) {
+		ERROR("Failed to open stream.\n");
+		return 1;
+	}
+
+	lc.amortised = amortised;
+	lc.images = NULL;
+	lc.n_images = 0;
+	lc.max_images = 0;
+	lc.crystals = NULL;
+	lc.n_crystals = 0;
+	lc.max_crystals = 0;
+	lc.t_grow = 0.0;
+	lc.err = 0;
+
+	t0 = get_time();
+	if ( presize ) {
+
+		int n_chunks;
+		int n_index = 0;
+		int i;
+
+		/* Find the sizes from the index, as partialator does */
+		n_chunks = stream_num_chunks(st);
+		for ( i=0; i<n_chunks; i++ ) {
+			int n;
+			stream_chunk_info(st, i, NULL, NULL, &n);
+			n_index += n;
+		}
+
+		lc.images = grow_array(NULL, &lc.max_images, n_chunks,
+		                       sizeof(struct image));
+		lc.crystals = grow_array(NULL, &lc.max_crystals, n_index,
+		                         sizeof(Crystal *));
+
+	}
+	if ( read_stream_parallel(st, n_threads, STREAM_READ_UNITCELL, 1,
+	                          NULL, load_chunk, &lc) || lc.err )
+	{
+		ERROR("Failed to read stream.\n");
+		fail = 1;
+	}
+	t = get_time() - t0;
+	close_stream(st);
+
+	if ( lc.n_crystals != n_crystals ) {
+		ERROR("Loaded %i crystals instead of %i\n", lc.n_crystals,
+		      n_crystals);
+		fail = 1;
+	}
+
+	printf("%-20s %10.3f %14.3f\n", name, t, lc.t_grow);
+
+	free_lists(&lc);
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	char filename[64];
+	char index_filename[64];
+	int n_crystals = N_CRYSTALS;
+	int n_threads = 4;
+	int fd;
+	int fail = 0;
+
+	if ( argc > 1 ) n_crystals = atoi(argv[1]);
+	if ( argc > 2 ) n_threads = atoi(argv[2]);
+
+	strcpy(filename, "/tmp/load_bench-XXXXXX");
+	fd = mkstemp(filename);
+	if ( fd == -1 ) {
+		ERROR("Failed to create temporary file.\n");
+		return 1;
+	}
+	close(fd);
+	snprintf(index_filename, 63, "%s.idx", filename);
+
+	printf("Writing a stream with %i crystals...\n", n_crystals);
+	if ( write_test_stream(filename, n_crystals) ) {
+		ERROR("Failed to write stream.\n");
+		unlink(filename);
+		return 1;
+	}
+
+	printf("Loading with %i threads.\n", n_threads);
+	printf("%-20s %10s %14s\n", "Lists", "Total/s", "Growing/s");
+	fail += run(filename, "realloc(n+1)", 0, 0, n_threads, n_crystals);
+	fail += run(filename, "grow_array()", 1, 0, n_threads, n_crystals);
+	fail += run(filename, "Pre-sized", 1, 1, n_threads, n_crystals);
+
+	unlink(filename);
+	unlink(index_filename);
+
+	return fail;
+}
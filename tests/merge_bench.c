@@ -0,0 +1,208 @@
+/*
+ * merge_bench.c
+ *
+ * Measure how the merging of intensities scales with the number of threads
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <gsl/gsl_rng.h>
+
+#include <crystal.h>
+#include <cell.h>
+#include <utils.h>
+#include <reflist.h>
+#include "../src/hrs-scaling.h"
+
+
+/* Number of simulated crystals, and reflections in each one */
+#define N_CRYSTALS (20000)
+#define N_REFLS (200)
+
+/* Reflections are taken from a sphere of this radius in index space */
+#define MAX_IND (25)
+
+#define MAX_THREADS (64)
+
+
+static double get_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+static Crystal *make_crystal(gsl_rng *rng)
+{
+	Crystal *cr;
+	RefList *list;
+	int i;
+
+	cr = crystal_new();
+	crystal_set_cell(cr, cell_new_from_parameters(50e-9, 50e-9, 50e-9,
+	                                              deg2rad(90.0),
+	                                              deg2rad(90.0),
+	                                              deg2rad(90.0)));
+	crystal_set_osf(cr, 0.5 + gsl_rng_uniform(rng));
+	crystal_set_Bfac(cr, 0.0);
+	crystal_set_user_flag(cr, 0);
+
+	list = reflist_new();
+	reflist_reserve(list, N_REFLS);
+	for ( i=0; i<N_REFLS; i++ ) {
+
+		Reflection *refl;
+		signed int h, k, l;
+
+		do {
+			h = gsl_rng_uniform_int(rng, 2*MAX_IND+1) - MAX_IND;
+			k = gsl_rng_uniform_int(rng, 2*MAX_IND+1) - MAX_IND;
+			l = gsl_rng_uniform_int(rng, 2*MAX_IND+1) - MAX_IND;
+		} while ( h*h + k*k + l*l > MAX_IND*MAX_IND );
+
+		refl = add_refl(list, h, k, l);
+		set_intensity(refl, 1000.0*gsl_rng_uniform(rng));
+		set_esd_intensity(refl, 10.0 + 10.0*gsl_rng_uniform(rng));
+		set_partiality(refl, 0.1 + 0.9*gsl_rng_uniform(rng));
+		set_lorentz(refl, 1.0);
+		set_redundancy(refl, 1);
+
+	}
+	crystal_set_reflections(cr, list);
+
+	return cr;
+}
+
+
+/* Returns the largest relative difference between the merged intensities and
+ * their uncertainties in "a" and "b" */
+static double compare_lists(RefList *a, RefList *b)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	double max_diff = 0.0;
+
+	if ( num_reflections(a) != num_reflections(b) ) return INFINITY;
+
+	for ( refl = first_refl(a, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		Reflection *f;
+		signed int h, k, l;
+		double d;
+
+		get_indices(refl, &h, &k, &l);
+		f = find_refl(b, h, k, l);
+		if ( f == NULL ) return INFINITY;
+		if ( get_redundancy(f) != get_redundancy(refl) ) {
+			return INFINITY;
+		}
+
+		d = fabs(get_intensity(f) - get_intensity(refl))
+		    / fabs(get_intensity(refl));
+		if ( d > max_diff ) max_diff = d;
+
+		d = fabs(get_esd_intensity(f) - get_esd_intensity(refl))
+		    / get_esd_intensity(refl);
+		if ( d > max_diff ) max_diff = d;
+	}
+
+	return max_diff;
+}
+
+
+int main(int argc, char *argv[])
+{
+	Crystal **crystals;
+	RefList *single = NULL;
+	gsl_rng *rng;
+	double t1 = 0.0;
+	int n_threads;
+	int fail = 0;
+	int i;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	crystals = malloc(N_CRYSTALS*sizeof(Crystal *));
+	for ( i=0; i<N_CRYSTALS; i++ ) {
+		crystals[i] = make_crystal(rng);
+	}
+	gsl_rng_free(rng);
+
+	printf("%i crystals, %i reflections each.\n", N_CRYSTALS, N_REFLS);
+	printf("%8s %10s %10s %12s\n", "Threads", "Time/s", "Speedup",
+	       "Difference");
+
+	for ( n_threads=1; n_threads<=MAX_THREADS; n_threads*=2 ) {
+
+		RefList *full;
+		double t0, t;
+		double diff = 0.0;
+
+		t0 = get_time();
+		full = lsq_intensities(crystals, N_CRYSTALS, NULL, NULL,
+		                       n_threads, PMODEL_UNITY);
+		t = get_time() - t0;
+		if ( full == NULL ) {
+			ERROR("Merging failed.\n");
+			return 1;
+		}
+
+		if ( n_threads == 1 ) {
+			single = full;
+			t1 = t;
+		} else {
+			diff = compare_lists(single, full);
+			reflist_free(full);
+		}
+
+		printf("%8i %10.3f %10.2f %12.2e\n", n_threads, t, t1/t, diff);
+
+		if ( diff > 1e-10 ) {
+			fprintf(stderr, "Results with %i threads are wrong!\n",
+			        n_threads);
+			fail = 1;
+		}
+
+	}
+
+	reflist_free(single);
+	for ( i=0; i<N_CRYSTALS; i++ ) {
+		cell_free(crystal_get_cell(crystals[i]));
+		reflist_free(crystal_get_reflections(crystals[i]));
+		crystal_free(crystals[i]);
+	}
+	free(crystals);
+
+	return fail;
+}
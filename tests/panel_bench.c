@@ -0,0 +1,275 @@
+/*
+ * panel_bench.c
+ *
+ * Measure the cost of finding the panel for detector coordinates
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <gsl/gsl_rng.h>
+
+#include <detector.h>
+#include <utils.h>
+
+#include "../libcrystfel/src/geometry.c"
+
+
+#define N_LOOKUPS (1000000)
+
+
+static double get_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+/* Writes a geometry file for an n_x by n_y arrangement of w by h panels,
+ * separated by gaps of "gap" pixels */
+static int write_geometry(const char *filename, int n_x, int n_y, int w, int h,
+                          int gap, double res)
+{
+	FILE *fh;
+	int x, y;
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) return 1;
+
+	fprintf(fh, "clen = 0.1\n");
+	fprintf(fh, "res = %f\n", res);
+	fprintf(fh, "adu_per_eV = 1.0\n");
+
+	for ( y=0; y<n_y; y++ ) {
+	for ( x=0; x<n_x; x++ ) {
+
+		int i = x + n_x*y;
+
+		fprintf(fh, "\np%i/min_fs = 0\n", i);
+		fprintf(fh, "p%i/max_fs = %i\n", i, w-1);
+		fprintf(fh, "p%i/min_ss = %i\n", i, i*h);
+		fprintf(fh, "p%i/max_ss = %i\n", i, (i+1)*h-1);
+		fprintf(fh, "p%i/corner_x = %i\n", i,
+		        (x-n_x/2)*(w+gap) + gap/2);
+		fprintf(fh, "p%i/corner_y = %i\n", i,
+		        (y-n_y/2)*(h+gap) + gap/2);
+		fprintf(fh, "p%i/fs = x\n", i);
+		fprintf(fh, "p%i/ss = y\n", i);
+
+	}
+	}
+
+	fclose(fh);
+	return 0;
+}
+
+
+static int bench_find_panel(struct detector *det, gsl_rng *rng)
+{
+	double *fs, *ss;
+	int *pn1, *pn2;
+	struct panel_lookup *lookup;
+	double t1, t2, t3;
+	int i;
+
+	fs = malloc(N_LOOKUPS*sizeof(double));
+	ss = malloc(N_LOOKUPS*sizeof(double));
+	pn1 = malloc(N_LOOKUPS*sizeof(int));
+	pn2 = malloc(N_LOOKUPS*sizeof(int));
+	if ( (fs == NULL) || (ss == NULL) || (pn1 == NULL) || (pn2 == NULL) ) {
+		ERROR("Failed to allocate lookups\n");
+		return 1;
+	}
+
+	/* Slightly beyond the data block, to include some misses */
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+		fs[i] = gsl_rng_uniform(rng) * (det->max_fs+2) - 0.5;
+		ss[i] = gsl_rng_uniform(rng) * (det->max_ss+2) - 0.5;
+	}
+
+	t1 = get_time();
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+		pn1[i] = find_panel_number(det, fs[i], ss[i]);
+	}
+	t2 = get_time();
+
+	/* Without the lookup, find_panel_number() checks every panel */
+	lookup = det->lookup;
+	det->lookup = NULL;
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+		pn2[i] = find_panel_number(det, fs[i], ss[i]);
+	}
+	t3 = get_time();
+	det->lookup = lookup;
+
+	STATUS("  find_panel_number(): %.1f ns with lookup,"
+	       " %.1f ns without\n", (t2-t1)*1e9/N_LOOKUPS,
+	       (t3-t2)*1e9/N_LOOKUPS);
+
+	free(fs);
+	free(ss);
+	free(pn1);
+	free(pn2);
+
+	return 0;
+}
+
+
+static int bench_locate_peak(struct detector *det, gsl_rng *rng)
+{
+	double *x, *y, *z;
+	int *pn1, *pn2;
+	double *pos1, *pos2;
+	struct ray_lookup *rl;
+	double t1, t2, t3, t4;
+	double max_t = 0.0;
+	const double k = 1.0/ph_eV_to_lambda(9000.0);
+	int i;
+
+	x = malloc(N_LOOKUPS*sizeof(double));
+	y = malloc(N_LOOKUPS*sizeof(double));
+	z = malloc(N_LOOKUPS*sizeof(double));
+	pn1 = malloc(N_LOOKUPS*sizeof(int));
+	pn2 = malloc(N_LOOKUPS*sizeof(int));
+	pos1 = malloc(2*N_LOOKUPS*sizeof(double));
+	pos2 = malloc(2*N_LOOKUPS*sizeof(double));
+	if ( (x == NULL) || (y == NULL) || (z == NULL) || (pn1 == NULL)
+	  || (pn2 == NULL) || (pos1 == NULL) || (pos2 == NULL) )
+	{
+		ERROR("Failed to allocate lookups\n");
+		return 1;
+	}
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		struct panel *p = &det->panels[i];
+		double t = (fabs(p->cnx) + p->w) / (p->res*p->clen);
+		if ( t > max_t ) max_t = t;
+		t = (fabs(p->cny) + p->h) / (p->res*p->clen);
+		if ( t > max_t ) max_t = t;
+	}
+
+	/* Scattering vectors for rays pointing anywhere across the detector,
+	 * and a little beyond */
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+
+		double tx, ty, n;
+
+		tx = (2.0*gsl_rng_uniform(rng) - 1.0) * max_t * 1.1;
+		ty = (2.0*gsl_rng_uniform(rng) - 1.0) * max_t * 1.1;
+		n = sqrt(tx*tx + ty*ty + 1.0);
+
+		x[i] = k * tx / n;
+		y[i] = k * ty / n;
+		z[i] = k / n - k;
+
+	}
+
+	t1 = get_time();
+	rl = make_ray_lookup(det);
+	t2 = get_time();
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+		pn1[i] = locate_peak(x[i], y[i], z[i], k, det, rl,
+		                     &pos1[2*i], &pos1[2*i+1]);
+	}
+	t3 = get_time();
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+		pn2[i] = locate_peak(x[i], y[i], z[i], k, det, NULL,
+		                     &pos2[2*i], &pos2[2*i+1]);
+	}
+	t4 = get_time();
+	free_ray_lookup(rl);
+
+	STATUS("  locate_peak(): %.1f ns with lookup (plus %.1f us to make"
+	       " it), %.1f ns without\n", (t3-t2)*1e9/N_LOOKUPS,
+	       (t2-t1)*1e6, (t4-t3)*1e9/N_LOOKUPS);
+
+	free(x);
+	free(y);
+	free(z);
+	free(pn1);
+	free(pn2);
+	free(pos1);
+	free(pos2);
+
+	return 0;
+}
+
+
+static int bench_geometry(const char *name, int n_x, int n_y, int w, int h,
+                          int gap, double res, gsl_rng *rng)
+{
+	char filename[64];
+	struct detector *det;
+	double t1, t2;
+	int r;
+
+	snprintf(filename, 63, "panel_bench-%i.geom", getpid());
+	if ( write_geometry(filename, n_x, n_y, w, h, gap, res) ) {
+		ERROR("Failed to write geometry file\n");
+		return 1;
+	}
+
+	STATUS("%s: %i panels of %i x %i pixels\n", name, n_x*n_y, w, h);
+
+	t1 = get_time();
+	det = get_detector_geometry(filename, NULL);
+	t2 = get_time();
+	unlink(filename);
+	if ( det == NULL ) {
+		ERROR("Failed to read geometry\n");
+		return 1;
+	}
+	STATUS("  Loading geometry: %.2f s\n", t2-t1);
+
+	r = bench_find_panel(det, rng);
+	r += bench_locate_peak(det, rng);
+
+	free_detector_geometry(det);
+	return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+	gsl_rng *rng;
+	int r;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+	r = bench_geometry("CSPAD", 8, 8, 194, 185, 10, 9097.525, rng);
+	r += bench_geometry("Jungfrau-like", 64, 32, 256, 256, 2, 13333.3, rng);
+
+	gsl_rng_free(rng);
+
+	return r;
+}
@@ -0,0 +1,241 @@
+/*
+ * panel_lookup_check.c
+ *
+ * Check that the panel lookups give the same results as checking every panel
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <gsl/gsl_rng.h>
+
+#include <detector.h>
+#include <utils.h>
+
+#include "../libcrystfel/src/geometry.c"
+
+
+#define N_LOOKUPS (50000)
+
+
+/* Writes a geometry file for an n_x by n_y arrangement of w by h panels,
+ * separated by gaps of "gap" pixels */
+static int write_geometry(const char *filename, int n_x, int n_y, int w, int h,
+                          int gap, double res)
+{
+	FILE *fh;
+	int x, y;
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) return 1;
+
+	fprintf(fh, "clen = 0.1\n");
+	fprintf(fh, "res = %f\n", res);
+	fprintf(fh, "adu_per_eV = 1.0\n");
+
+	for ( y=0; y<n_y; y++ ) {
+	for ( x=0; x<n_x; x++ ) {
+
+		int i = x + n_x*y;
+
+		fprintf(fh, "\np%i/min_fs = 0\n", i);
+		fprintf(fh, "p%i/max_fs = %i\n", i, w-1);
+		fprintf(fh, "p%i/min_ss = %i\n", i, i*h);
+		fprintf(fh, "p%i/max_ss = %i\n", i, (i+1)*h-1);
+		fprintf(fh, "p%i/corner_x = %i\n", i,
+		        (x-n_x/2)*(w+gap) + gap/2);
+		fprintf(fh, "p%i/corner_y = %i\n", i,
+		        (y-n_y/2)*(h+gap) + gap/2);
+		fprintf(fh, "p%i/fs = x\n", i);
+		fprintf(fh, "p%i/ss = y\n", i);
+
+	}
+	}
+
+	fclose(fh);
+	return 0;
+}
+
+
+static int check_find_panel(struct detector *det, gsl_rng *rng)
+{
+	struct panel_lookup *lookup;
+	int i;
+	int n_diff = 0;
+
+	lookup = det->lookup;
+
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+
+		double fs, ss;
+		int pn1, pn2;
+
+		/* Slightly beyond the data block, to include some misses */
+		fs = gsl_rng_uniform(rng) * (det->max_fs+2) - 0.5;
+		ss = gsl_rng_uniform(rng) * (det->max_ss+2) - 0.5;
+
+		pn1 = find_panel_number(det, fs, ss);
+
+		/* Without the lookup, find_panel_number() checks every panel */
+		det->lookup = NULL;
+		pn2 = find_panel_number(det, fs, ss);
+		det->lookup = lookup;
+
+		if ( pn1 != pn2 ) n_diff++;
+
+	}
+
+	if ( n_diff ) {
+		ERROR("  find_panel_number(): %i different results!\n", n_diff);
+		return 1;
+	}
+	return 0;
+}
+
+
+static int check_locate_peak(struct detector *det, gsl_rng *rng)
+{
+	struct ray_lookup *rl;
+	double max_t = 0.0;
+	const double k = 1.0/ph_eV_to_lambda(9000.0);
+	int i;
+	int n_diff = 0;
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		struct panel *p = &det->panels[i];
+		double t = (fabs(p->cnx) + p->w) / (p->res*p->clen);
+		if ( t > max_t ) max_t = t;
+		t = (fabs(p->cny) + p->h) / (p->res*p->clen);
+		if ( t > max_t ) max_t = t;
+	}
+
+	rl = get_ray_lookup(det);
+	if ( rl == NULL ) {
+		ERROR("  Failed to make ray lookup\n");
+		return 1;
+	}
+
+	/* Rays pointing anywhere across the detector, and a little beyond */
+	for ( i=0; i<N_LOOKUPS; i++ ) {
+
+		double tx, ty, n, x, y, z;
+		double fs1, ss1, fs2, ss2;
+		int pn1, pn2;
+
+		tx = (2.0*gsl_rng_uniform(rng) - 1.0) * max_t * 1.1;
+		ty = (2.0*gsl_rng_uniform(rng) - 1.0) * max_t * 1.1;
+		n = sqrt(tx*tx + ty*ty + 1.0);
+
+		x = k * tx / n;
+		y = k * ty / n;
+		z = k / n - k;
+
+		pn1 = locate_peak(x, y, z, k, det, rl, &fs1, &ss1);
+		pn2 = locate_peak(x, y, z, k, det, NULL, &fs2, &ss2);
+
+		if ( pn1 != pn2 ) {
+			n_diff++;
+		} else if ( (pn1 != -1) && ((fs1 != fs2) || (ss1 != ss2)) ) {
+			n_diff++;
+		}
+
+	}
+
+	put_ray_lookup(det, rl);
+
+	if ( n_diff ) {
+		ERROR("  locate_peak(): %i different results!\n", n_diff);
+		return 1;
+	}
+	return 0;
+}
+
+
+static int check_geometry(const char *name, int n_x, int n_y, int w, int h,
+                          int gap, double res, gsl_rng *rng)
+{
+	char filename[64];
+	struct detector *det;
+	int i;
+	int r;
+
+	snprintf(filename, 63, "panel_lookup_check-%i.geom", getpid());
+	if ( write_geometry(filename, n_x, n_y, w, h, gap, res) ) {
+		ERROR("Failed to write geometry file\n");
+		return 1;
+	}
+
+	STATUS("%s: %i panels of %i x %i pixels\n", name, n_x*n_y, w, h);
+
+	det = get_detector_geometry(filename, NULL);
+	unlink(filename);
+	if ( det == NULL ) {
+		ERROR("Failed to read geometry\n");
+		return 1;
+	}
+
+	r = check_find_panel(det, rng);
+	r += check_locate_peak(det, rng);
+
+	/* The detector keeps its ray lookup, which must be made again when
+	 * the camera length changes */
+	for ( i=0; i<det->n_panels; i++ ) {
+		det->panels[i].clen *= 1.5;
+	}
+	if ( (det->rays == NULL) || ray_lookup_current(det->rays, det) ) {
+		ERROR("  Ray lookup did not notice the new camera length.\n");
+		r++;
+	}
+	r += check_locate_peak(det, rng);
+	if ( (det->rays == NULL) || !ray_lookup_current(det->rays, det) ) {
+		ERROR("  Ray lookup was not made again.\n");
+		r++;
+	}
+
+	free_detector_geometry(det);
+	return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+	gsl_rng *rng;
+	int r;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+	r = check_geometry("CSPAD", 8, 8, 194, 185, 10, 9097.525, rng);
+	r += check_geometry("Jungfrau-like", 32, 16, 256, 256, 2, 13333.3, rng);
+
+	gsl_rng_free(rng);
+
+	if ( r ) return 1;
+	return 0;
+}
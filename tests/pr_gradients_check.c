@@ -0,0 +1,172 @@
+/*
+ * pr_gradients_check.c
+ *
+ * Check that the batched partiality gradients agree with p_gradient()
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <gsl/gsl_rng.h>
+
+#include <image.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <geometry.h>
+#include <reflist.h>
+#include "../src/post-refinement.h"
+#include "../src/refl-arrays.h"
+
+
+/* The two calculations group the multiplications differently, so they can
+ * differ in the last few bits */
+#define TOLERANCE (1e-12)
+
+
+static int check_crystal(Crystal *cr, PartialityModel pmodel)
+{
+	struct refl_arrays *ra;
+	struct crystal_arrays *ca;
+	RefList *reflections;
+	double *gradients;
+	int n_bad = 0;
+	int k, i;
+
+	reflections = find_intersections(crystal_get_image(cr), cr, pmodel);
+	crystal_set_reflections(cr, reflections);
+
+	ra = refl_arrays_new(&cr, 1);
+	if ( ra == NULL ) return 1;
+	ca = &ra->crystals[0];
+
+	if ( ca->n < 10 ) {
+		ERROR("Too few reflections found.  Failing test by default.\n");
+		return 1;
+	}
+
+	gradients = malloc(NUM_PARAMS*ca->n*sizeof(double));
+	if ( (gradients == NULL) || p_gradients(ca, pmodel, gradients) ) {
+		ERROR("Failed to calculate gradients.\n");
+		return 1;
+	}
+
+	for ( k=0; k<NUM_PARAMS; k++ ) {
+	for ( i=0; i<ca->n; i++ ) {
+
+		double batch = gradients[k*ca->n + i];
+		double scalar = p_gradient(cr, k, ca->refls[i], pmodel);
+
+		if ( isnan(batch) && isnan(scalar) ) continue;
+
+		if ( fabs(batch - scalar)
+		     > TOLERANCE * fmax(fabs(batch), fabs(scalar)) )
+		{
+			if ( n_bad < 10 ) {
+				ERROR("Parameter %i, reflection %3i %3i %3i: "
+				      "%e vs %e\n", k, ca->hs[i], ca->ks[i],
+				      ca->ls[i], batch, scalar);
+			}
+			n_bad++;
+		}
+
+	}
+	}
+
+	STATUS("%i reflections, %i gradients disagree.\n", ca->n, n_bad);
+
+	free(gradients);
+	refl_arrays_free(ra);
+	reflist_free(reflections);
+
+	return n_bad != 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct image image;
+	UnitCell *cell;
+	Crystal *cr;
+	gsl_rng *rng;
+	int fail = 0;
+	int i;
+
+	image.width = 1024;
+	image.height = 1024;
+	image.det = simple_geometry(&image);
+	image.det->panels[0].res = 13333.3;
+	image.det->panels[0].clen = 80e-3;
+	image.det->panels[0].coffset = 0.0;
+
+	image.lambda = ph_en_to_lambda(eV_to_J(8000.0));
+	image.div = 1e-3;
+	image.bw = 0.01;
+	image.filename = NULL;
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		ERROR("Failed to allocate crystal.\n");
+		return 1;
+	}
+	crystal_set_mosaicity(cr, 0.0);
+	crystal_set_profile_radius(cr, 0.005e9);
+	crystal_set_image(cr, &image);
+
+	cell = cell_new_from_parameters(10.0e-9, 11.0e-9, 12.0e-9,
+	                                deg2rad(90.0),
+	                                deg2rad(95.0),
+	                                deg2rad(90.0));
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+	for ( i=0; i<10; i++ ) {
+
+		UnitCell *rot;
+
+		rot = cell_rotate(cell, random_quaternion(rng));
+		crystal_set_cell(cr, rot);
+
+		STATUS("Orientation %i, SCSphere model: ", i);
+		fail += check_crystal(cr, PMODEL_SCSPHERE);
+		STATUS("Orientation %i, SCGaussian model: ", i);
+		fail += check_crystal(cr, PMODEL_SCGAUSSIAN);
+
+		cell_free(rot);
+
+	}
+
+	gsl_rng_free(rng);
+	cell_free(cell);
+	crystal_free(cr);
+	free_detector_geometry(image.det);
+
+	if ( fail ) return 1;
+	return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * prediction_check.c
+ *
+ * Check that the fast reflection prediction matches the full search
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <image.h>
+#include <utils.h>
+
+#include "../libcrystfel/src/geometry.c"
+
+
+/* Predict reflections for "cr" with the full search */
+static RefList *predict_all(struct image *image, Crystal *cr, double max_res)
+{
+	struct prediction pr;
+	UnitCell *cell;
+	double ax, ay, az;
+	double bx, by, bz;
+	double cx, cy, cz;
+	double mres;
+
+	cell = crystal_get_cell(cr);
+	cell_get_cartesian(cell, &ax, &ay, &az, &bx, &by, &bz, &cx, &cy, &cz);
+
+	mres = largest_q(image);
+	if ( mres > max_res ) mres = max_res;
+
+	pr.hmax = mres * modulus(ax, ay, az);
+	pr.kmax = mres * modulus(bx, by, bz);
+	pr.lmax = mres * modulus(cx, cy, cz);
+	if ( pr.hmax >= 512 ) pr.hmax = 511;
+	if ( pr.kmax >= 512 ) pr.kmax = 511;
+	if ( pr.lmax >= 512 ) pr.lmax = 511;
+
+	cell_get_reciprocal(cell, &pr.asx, &pr.asy, &pr.asz,
+	                          &pr.bsx, &pr.bsy, &pr.bsz,
+	                          &pr.csx, &pr.csy, &pr.csz);
+
+	pr.image = image;
+	pr.cryst = cr;
+	pr.pmodel = PMODEL_SCSPHERE;
+	pr.cell = cell;
+	pr.max_res = max_res;
+	pr.rays = NULL;  /* Check every panel */
+	pr.reflections = reflist_new();
+	pr.vals = reflection_new(0, 0, 0);
+
+	predict_cube(&pr);
+
+	reflection_free(pr.vals);
+	return pr.reflections;
+}
+
+
+/* Returns non-zero if the lists are not identical */
+static int compare_lists(RefList *full, RefList *fast)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	int n_full = 0;
+	int n_fast = 0;
+	int n_diff = 0;
+
+	for ( refl = first_refl(full, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *f;
+		double fs1, ss1, fs2, ss2;
+
+		n_full++;
+		get_indices(refl, &h, &k, &l);
+		f = find_refl(fast, h, k, l);
+		if ( f == NULL ) {
+			if ( n_diff++ < 10 ) {
+				ERROR("%4i %4i %4i missing\n", h, k, l);
+			}
+			continue;
+		}
+
+		get_detector_pos(refl, &fs1, &ss1);
+		get_detector_pos(f, &fs2, &ss2);
+
+		if ( (get_partiality(refl) != get_partiality(f))
+		  || (get_lorentz(refl) != get_lorentz(f))
+		  || (fs1 != fs2) || (ss1 != ss2) )
+		{
+			if ( n_diff++ < 10 ) {
+				ERROR("%4i %4i %4i different\n", h, k, l);
+			}
+		}
+	}
+
+	for ( refl = first_refl(fast, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+
+		n_fast++;
+		get_indices(refl, &h, &k, &l);
+		if ( find_refl(full, h, k, l) == NULL ) {
+			if ( n_diff++ < 10 ) {
+				ERROR("%4i %4i %4i extra\n", h, k, l);
+			}
+		}
+	}
+
+	if ( n_diff ) {
+		ERROR("%i differences (%i reflections, %i predicted)\n",
+		      n_diff, n_full, n_fast);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct image image;
+	gsl_rng *rng;
+	int i;
+	int fail = 0;
+	const int w = 1024;
+	const int h = 1024;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+	image.flags = NULL;
+	image.beam = NULL;
+
+	image.det = calloc(1, sizeof(struct detector));
+	image.det->n_panels = 1;
+	image.det->panels = calloc(1, sizeof(struct panel));
+
+	image.width = w;
+	image.height = h;
+	image.det->panels[0].min_fs = 0;
+	image.det->panels[0].max_fs = w;
+	image.det->panels[0].min_ss = 0;
+	image.det->panels[0].max_ss = h;
+	image.det->panels[0].w = w;
+	image.det->panels[0].h = h;
+	image.det->panels[0].fsx = 1.0;
+	image.det->panels[0].fsy = 0.0;
+	image.det->panels[0].ssx = 0.0;
+	image.det->panels[0].ssy = 1.0;
+	image.det->panels[0].xfs = 1.0;
+	image.det->panels[0].yfs = 0.0;
+	image.det->panels[0].xss = 0.0;
+	image.det->panels[0].yss = 1.0;
+	image.det->panels[0].cnx = -w/2;
+	image.det->panels[0].cny = -h/2;
+	image.det->panels[0].clen = 60.0e-3;
+	image.det->panels[0].res = 10000;  /* 10 px per mm */
+	image.det->panels[0].adu_per_eV = 10.0/9000.0;
+	image.det->panels[0].max_adu = +INFINITY;
+
+	image.det->furthest_out_panel = &image.det->panels[0];
+	image.det->furthest_out_fs = 0;
+	image.det->furthest_out_ss = 0;
+
+	for ( i=0; i<20; i++ ) {
+
+		UnitCell *cell;
+		Crystal *cr;
+		RefList *full;
+		RefList *fast;
+		double a, b, c, max_res;
+
+		/* Cells from small molecule to virus size, one of them
+		 * bigger than the 511th-order limit */
+		a = (3.0 + gsl_rng_uniform(rng)*(i%10 ? 300.0 : 1500.0))*1e-10;
+		b = (3.0 + gsl_rng_uniform(rng)*300.0)*1e-10;
+		c = (3.0 + gsl_rng_uniform(rng)*300.0)*1e-10;
+
+		cell = cell_new();
+		cell_set_parameters(cell, a, b, c,
+		                    deg2rad(80.0+gsl_rng_uniform(rng)*30.0),
+		                    deg2rad(80.0+gsl_rng_uniform(rng)*30.0),
+		                    deg2rad(80.0+gsl_rng_uniform(rng)*30.0));
+		cell = cell_rotate(cell, random_quaternion(rng));
+
+		image.lambda = ph_eV_to_lambda(5000.0
+		                               + gsl_rng_uniform(rng)*10000.0);
+		image.bw = (i%3) ? gsl_rng_uniform(rng)*0.05 : 0.0;
+		image.div = (i%5) ? gsl_rng_uniform(rng)*0.005 : 0.0;
+
+		cr = crystal_new();
+		crystal_set_profile_radius(cr, gsl_rng_uniform(rng)*0.01e9);
+		crystal_set_mosaicity(cr, gsl_rng_uniform(rng)*0.001);
+		crystal_set_image(cr, &image);
+		crystal_set_cell(cr, cell);
+
+		max_res = (i%2) ? INFINITY : 1.0/(2.0e-10
+		                              + gsl_rng_uniform(rng)*5e-10);
+
+		full = predict_all(&image, cr, max_res);
+		fast = find_intersections_to_res(&image, cr, PMODEL_SCSPHERE,
+		                                 max_res);
+
+		if ( compare_lists(full, fast) ) {
+			ERROR("Prediction %i does not match\n", i);
+			cell_print(cell);
+			fail = 1;
+		}
+
+		reflist_free(full);
+		reflist_free(fast);
+		cell_free(cell);
+		crystal_free(cr);
+
+	}
+
+	gsl_rng_free(rng);
+
+	return fail;
+}
@@ -0,0 +1,412 @@
+/*
+ * stream_index_check.c
+ *
+ * Check random access to chunks in streams, and parallel reading
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <image.h>
+#include <stream.h>
+#include <cell.h>
+#include <crystal.h>
+#include <utils.h>
+
+
+#define N_CHUNKS (57)
+
+
+/* If 'via_fd' is set, the chunks are prepared separately and written straight
+ * into the file descriptor, like indexamajig does */
+static int write_test_stream(const char *filename, StreamFormat format,
+                             int via_fd)
+{
+	Stream *st;
+	int i;
+
+	st = open_stream_for_write_3(filename, NULL, 0, NULL, format);
+	if ( st == NULL ) return 1;
+
+	for ( i=0; i<N_CHUNKS; i++ ) {
+
+		struct image image;
+		char tmp[64];
+		int j;
+
+		snprintf(tmp, 63, "image-%i.h5", i);
+		image.filename = strdup(tmp);
+		image.event = NULL;
+		image.serial = i+1;
+		image.indexed_by = INDEXING_NONE;
+		image.lambda = 1.0e-10;
+		image.div = 0.0;
+		image.bw = 0.0;
+		image.num_peaks = 0;
+		image.num_saturated_peaks = 0;
+		image.features = NULL;
+		image.det = NULL;
+		image.copyme = NULL;
+		image.stuff_from_stream = NULL;
+
+		/* Vary the number of crystals, so that the chunks are of
+		 * different sizes */
+		image.n_crystals = i % 4;
+		image.crystals = malloc(image.n_crystals * sizeof(Crystal *));
+		for ( j=0; j<image.n_crystals; j++ ) {
+			Crystal *cr = crystal_new();
+			crystal_set_cell(cr, cell_new_from_parameters(5e-9+j*1e-9,
+			                                              6e-9, 7e-9,
+			                                              deg2rad(90.0),
+			                                              deg2rad(90.0),
+			                                              deg2rad(90.0)));
+			crystal_set_image(cr, &image);
+			image.crystals[j] = cr;
+		}
+
+		if ( via_fd ) {
+
+			Stream *buf;
+			char *data;
+			size_t len;
+
+			buf = open_stream_for_write_buffer(format);
+			if ( buf == NULL ) return 1;
+			write_chunk(buf, &image, NULL, 0, 0, NULL);
+			data = close_stream_buffer(buf, &len);
+			if ( data == NULL ) return 1;
+			if ( write(get_stream_fd(st), data, len) != len ) {
+				return 1;
+			}
+			free(data);
+
+		} else {
+			write_chunk(st, &image, NULL, 0, 0, NULL);
+		}
+
+		for ( j=0; j<image.n_crystals; j++ ) {
+			cell_free(crystal_get_cell(image.crystals[j]));
+			crystal_free(image.crystals[j]);
+		}
+		free(image.crystals);
+		free(image.filename);
+
+	}
+
+	close_stream(st);
+	return 0;
+}
+
+
+/* Returns non-zero if the index file ends with the end marker */
+static int index_complete(const char *idx)
+{
+	FILE *fh;
+	char line[1024];
+	int done = 0;
+
+	fh = fopen(idx, "r");
+	if ( fh == NULL ) return 0;
+	while ( fgets(line, 1023, fh) != NULL ) {
+		done = (strncmp(line, "End of index ", 13) == 0);
+	}
+	fclose(fh);
+
+	return done;
+}
+
+
+static int check_chunk(Stream *st, int n)
+{
+	struct image image;
+	const char *filename;
+	int n_crystals;
+	char tmp[64];
+	int fail = 0;
+	int i;
+
+	snprintf(tmp, 63, "image-%i.h5", n);
+
+	if ( stream_chunk_info(st, n, &filename, NULL, &n_crystals) ) {
+		ERROR("Failed to get info for chunk %i\n", n);
+		return 1;
+	}
+	if ( (strcmp(filename, tmp) != 0) || (n_crystals != n % 4) ) {
+		ERROR("Wrong index entry for chunk %i: %s %i\n", n,
+		      filename, n_crystals);
+		fail = 1;
+	}
+
+	if ( stream_seek_chunk(st, n) ) {
+		ERROR("Failed to seek to chunk %i\n", n);
+		return 1;
+	}
+
+	image.det = NULL;
+	if ( read_chunk_2(st, &image, STREAM_READ_UNITCELL) ) {
+		ERROR("Failed to read chunk %i\n", n);
+		return 1;
+	}
+
+	if ( (strcmp(image.filename, tmp) != 0) || (image.serial != n+1)
+	  || (image.n_crystals != n % 4) )
+	{
+		ERROR("Wrong chunk after seeking to %i: %s %i %i\n", n,
+		      image.filename, image.serial, image.n_crystals);
+		fail = 1;
+	}
+
+	for ( i=0; i<image.n_crystals; i++ ) {
+		cell_free(crystal_get_cell(image.crystals[i]));
+		crystal_free(image.crystals[i]);
+	}
+	free(image.crystals);
+	free(image.filename);
+
+	return fail;
+}
+
+
+struct parallel_check
+{
+	int n;
+	int ordered;
+	int seen[N_CHUNKS];
+	int fail;
+};
+
+
+static int check_parallel_chunk(struct image *image, void *vp)
+{
+	struct parallel_check *pc = vp;
+	int i;
+
+	if ( (image->serial < 1) || (image->serial > N_CHUNKS) ) {
+		ERROR("Bad serial number %i\n", image->serial);
+		pc->fail = 1;
+	} else {
+		if ( pc->ordered && (image->serial != pc->n+1) ) {
+			ERROR("Chunk %i delivered out of order\n",
+			      image->serial);
+			pc->fail = 1;
+		}
+		if ( image->n_crystals != (image->serial-1) % 4 ) {
+			ERROR("Wrong number of crystals in chunk %i\n",
+			      image->serial);
+			pc->fail = 1;
+		}
+		pc->seen[image->serial-1]++;
+	}
+	pc->n++;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+		cell_free(crystal_get_cell(image->crystals[i]));
+		crystal_free(image->crystals[i]);
+	}
+	free(image->crystals);
+	free(image->filename);
+
+	return 0;
+}
+
+
+static int check_parallel(const char *filename, int ordered)
+{
+	Stream *st;
+	struct parallel_check pc;
+	int i;
+
+	st = open_stream_for_read(filename);
+	if ( st == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return 1;
+	}
+
+	pc.n = 0;
+	pc.ordered = ordered;
+	pc.fail = 0;
+	for ( i=0; i<N_CHUNKS; i++ ) pc.seen[i] = 0;
+
+	if ( read_stream_parallel(st, 4, STREAM_READ_UNITCELL, ordered, NULL,
+	                          check_parallel_chunk, &pc) )
+	{
+		ERROR("Parallel read failed.\n");
+		pc.fail = 1;
+	}
+
+	for ( i=0; i<N_CHUNKS; i++ ) {
+		if ( pc.seen[i] != 1 ) {
+			ERROR("Chunk %i delivered %i times\n", i+1,
+			      pc.seen[i]);
+			pc.fail = 1;
+		}
+	}
+
+	close_stream(st);
+
+	return pc.fail;
+}
+
+
+/* Reading the stream from the start should give all the chunks without error.
+ * If the last chunk has been cut off, it should be skipped, both when reading
+ * serially and in parallel. */
+static int check_read_all(const char *filename, int n_threads, int truncated)
+{
+	Stream *st;
+	struct parallel_check pc;
+	int n_expected = truncated ? N_CHUNKS-1 : N_CHUNKS;
+	int i;
+
+	st = open_stream_for_read(filename);
+	if ( st == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return 1;
+	}
+
+	pc.n = 0;
+	pc.ordered = 1;
+	pc.fail = 0;
+	for ( i=0; i<N_CHUNKS; i++ ) pc.seen[i] = 0;
+
+	if ( read_stream_parallel(st, n_threads, STREAM_READ_UNITCELL, 1, NULL,
+	                          check_parallel_chunk, &pc) )
+	{
+		ERROR("Reading with %i threads failed.\n", n_threads);
+		pc.fail = 1;
+	}
+	close_stream(st);
+
+	if ( pc.n != n_expected ) {
+		ERROR("Reading with %i threads gave %i chunks, not %i\n",
+		      n_threads, pc.n, n_expected);
+		return 1;
+	}
+
+	return pc.fail;
+}
+
+
+static int check_stream(const char *filename, StreamFormat format, int via_fd)
+{
+	Stream *st;
+	char idx[256];
+	int i;
+	int fail = 0;
+	struct stat statbuf;
+
+	if ( write_test_stream(filename, format, via_fd) ) {
+		ERROR("Failed to write '%s'\n", filename);
+		return 1;
+	}
+
+	snprintf(idx, 255, "%s.idx", filename);
+
+	/* First time using the index written alongside the stream, second
+	 * time after building it from scratch.  Only the program writing the
+	 * stream should write the index file. */
+	for ( i=0; i<2; i++ ) {
+
+		int j;
+
+		if ( i == 1 ) unlink(idx);
+
+		st = open_stream_for_read(filename);
+		if ( st == NULL ) {
+			ERROR("Failed to open '%s'\n", filename);
+			return 1;
+		}
+
+		if ( stream_num_chunks(st) != N_CHUNKS ) {
+			ERROR("Wrong number of chunks: %i\n",
+			      stream_num_chunks(st));
+			fail = 1;
+		}
+
+		/* Jump around, in both directions */
+		for ( j=0; j<N_CHUNKS; j++ ) {
+			fail += check_chunk(st, (j*17) % N_CHUNKS);
+		}
+		fail += check_chunk(st, N_CHUNKS-1);
+		fail += check_chunk(st, 0);
+
+		if ( stream_seek_chunk(st, N_CHUNKS) == 0 ) {
+			ERROR("Seeking beyond the end should fail.\n");
+			fail = 1;
+		}
+
+		close_stream(st);
+
+		if ( (i == 0) && !index_complete(idx) ) {
+			ERROR("Index file was not written.\n");
+			fail = 1;
+		}
+		if ( (i == 1) && (access(idx, F_OK) == 0) ) {
+			ERROR("Index file was written by a reader.\n");
+			fail = 1;
+		}
+
+	}
+
+	fail += check_parallel(filename, 1);
+	fail += check_parallel(filename, 0);
+
+	fail += check_read_all(filename, 1, 0);
+	if ( stat(filename, &statbuf) || truncate(filename, statbuf.st_size-5) ) {
+		ERROR("Failed to truncate '%s'\n", filename);
+		fail = 1;
+	} else {
+		fail += check_read_all(filename, 1, 1);
+		fail += check_read_all(filename, 4, 1);
+	}
+
+	unlink(filename);
+	unlink(idx);
+
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fail = 0;
+
+	fail += check_stream("stream_index_check.stream", STREAM_FORMAT_TEXT, 0);
+	fail += check_stream("stream_index_check.bin", STREAM_FORMAT_BINARY, 0);
+	fail += check_stream("stream_index_check.stream", STREAM_FORMAT_TEXT, 1);
+	fail += check_stream("stream_index_check.bin", STREAM_FORMAT_BINARY, 1);
+
+	if ( fail ) return 1;
+	return 0;
+}
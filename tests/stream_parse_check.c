@@ -0,0 +1,160 @@
+/*
+ * stream_parse_check.c
+ *
+ * Check the number parsing used for reading streams
+ *
+ * Copyright © 2015 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2015 Thomas White <taw@physics.org>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <gsl/gsl_rng.h>
+
+#include "../libcrystfel/src/stream.c"
+
+
+/* The result must be exactly the same as strtod() */
+static int check_double(const char *str)
+{
+	const char *p = str;
+	double v;
+
+	if ( parse_double(&p, str+strlen(str), &v) ) {
+		ERROR("Failed to parse '%s'\n", str);
+		return 1;
+	}
+
+	if ( *p != '\0' ) {
+		ERROR("Didn't parse all of '%s'\n", str);
+		return 1;
+	}
+
+	if ( isnan(v) && isnan(strtod(str, NULL)) ) return 0;
+
+	if ( v != strtod(str, NULL) ) {
+		ERROR("Wrong value for '%s': %.20e\n", str, v);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int check_int(const char *str, signed int ans)
+{
+	const char *p = str;
+	signed int v;
+
+	if ( parse_int(&p, str+strlen(str), &v) || (v != ans) ) {
+		ERROR("Wrong value for '%s'\n", str);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int check_line(void)
+{
+	const char *line = "  -22   -2  -22      53.21      20.00      12.00"
+	                   "       3.00  555.6    5.8 q0a1 and some junk";
+	const char *p = line;
+	const char *end = strstr(line, "a1 and");  /* Not NUL-terminated */
+	signed int h, k, l;
+	float i, s, pk, bg, fs, ss;
+	char pn[32];
+
+	if ( parse_int(&p, end, &h) || parse_int(&p, end, &k)
+	  || parse_int(&p, end, &l) || parse_float(&p, end, &i)
+	  || parse_float(&p, end, &s) || parse_float(&p, end, &pk)
+	  || parse_float(&p, end, &bg) || parse_float(&p, end, &fs)
+	  || parse_float(&p, end, &ss) || parse_word(&p, end, pn, 32) )
+	{
+		ERROR("Failed to parse reflection line.\n");
+		return 1;
+	}
+
+	if ( (h != -22) || (k != -2) || (l != -22) || (i != 53.21f)
+	  || (s != 20.0f) || (pk != 12.0f) || (bg != 3.0f) || (fs != 555.6f)
+	  || (ss != 5.8f) || (strcmp(pn, "q0") != 0) )
+	{
+		ERROR("Reflection line parsed incorrectly.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fail = 0;
+	int i;
+	gsl_rng *rng;
+	char tmp[128];
+	const char *specials[] = { "0", "-0", "0.0", "-0.00", "1e10", "1.5E-3",
+	                           "123456789012345678901234", "nan", "-nan",
+	                           "inf", "-inf", "+3.25", ".5", "5.",
+	                           "0.000000000000000000000000001",
+	                           "12345678.901234567", "1e-300", NULL };
+
+	for ( i=0; specials[i]!=NULL; i++ ) {
+		fail += check_double(specials[i]);
+	}
+
+	fail += check_int("0", 0);
+	fail += check_int("-17", -17);
+	fail += check_int("   +4", 4);
+	fail += check_int("2147483647", 2147483647);
+
+	fail += check_line();
+
+	/* Numbers as they are written into streams */
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	for ( i=0; i<100000; i++ ) {
+
+		double v = (gsl_rng_uniform(rng) - 0.5)
+		           * pow(10.0, gsl_rng_uniform_int(rng, 16) - 4.0);
+
+		snprintf(tmp, 127, "%10.2f", v);
+		fail += check_double(tmp);
+		snprintf(tmp, 127, "%+9.7f", v);
+		fail += check_double(tmp);
+		snprintf(tmp, 127, "%.5e", v);
+		fail += check_double(tmp);
+		snprintf(tmp, 127, "%f", v);
+		fail += check_double(tmp);
+
+		if ( fail > 10 ) break;
+
+	}
+	gsl_rng_free(rng);
+
+	if ( fail ) return 1;
+	return 0;
+}